@@ -0,0 +1,173 @@
+// Synchronization.h on pthreads, for host programs built with SYNCHRONIZATION_POSIX. Timed
+// sleeps measure against the monotonic clock. Every wait queue is on a list, so that
+// InterruptSleepers() can reach threads that sleep on any of them.
+
+#include "Synchronization.h"
+#include "KernelShim.h"
+#include <time.h>
+
+namespace
+{
+
+pthread_mutex_t sQueuesMutex = PTHREAD_MUTEX_INITIALIZER;
+Synchronization::WaitQueue* spQueues = 0;
+
+thread_local const volatile bool* tpInterrupted = 0;
+
+bool
+interrupted()
+{
+  return tpInterrupted && __atomic_load_n( tpInterrupted, __ATOMIC_SEQ_CST );
+}
+
+} // namespace
+
+namespace Synchronization
+{
+
+// Mutex
+Mutex::Mutex()
+{
+  ::pthread_mutex_init( &mMutex, 0 );
+}
+
+Mutex::~Mutex()
+{
+  ::pthread_mutex_destroy( &mMutex );
+}
+
+void
+Mutex::Acquire()
+{
+  ::pthread_mutex_lock( &mMutex );
+}
+
+void
+Mutex::Release()
+{
+  ::pthread_mutex_unlock( &mMutex );
+}
+
+// WaitQueue
+WaitQueue::WaitQueue()
+: mGeneration( 0 ),
+  mSleepers( 0 ),
+  mValid( true ),
+  mpPrev( 0 ),
+  mpNext( 0 )
+{
+  ::pthread_mutex_init( &mMutex, 0 );
+  pthread_condattr_t attr;
+  ::pthread_condattr_init( &attr );
+  ::pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+  ::pthread_cond_init( &mCond, &attr );
+  ::pthread_condattr_destroy( &attr );
+
+  ::pthread_mutex_lock( &sQueuesMutex );
+  mpNext = spQueues;
+  if( mpNext )
+    mpNext->mpPrev = this;
+  spQueues = this;
+  ::pthread_mutex_unlock( &sQueuesMutex );
+}
+
+// Sleepers are woken, and have left before the queue goes away.
+WaitQueue::~WaitQueue()
+{
+  ::pthread_mutex_lock( &sQueuesMutex );
+  if( mpPrev )
+    mpPrev->mpNext = mpNext;
+  else
+    spQueues = mpNext;
+  if( mpNext )
+    mpNext->mpPrev = mpPrev;
+  ::pthread_mutex_unlock( &sQueuesMutex );
+
+  ::pthread_mutex_lock( &mMutex );
+  mValid = false;
+  while( mSleepers > 0 )
+  {
+    ::pthread_cond_broadcast( &mCond );
+    ::pthread_cond_wait( &mCond, &mMutex );
+  }
+  ::pthread_mutex_unlock( &mMutex );
+  ::pthread_cond_destroy( &mCond );
+  ::pthread_mutex_destroy( &mMutex );
+}
+
+unsigned
+WaitQueue::Ticket() const
+{
+  return __atomic_load_n( &mGeneration, __ATOMIC_SEQ_CST );
+}
+
+// The sleeper counts itself before it compares its ticket, and Wakeup() advances the
+// generation before it looks at the count, so one of them sees the other.
+int
+WaitQueue::Sleep( unsigned ticket, int timeoutMs )
+{
+  struct timespec deadline = { 0, 0 };
+  if( timeoutMs > 0 )
+  {
+    ::clock_gettime( CLOCK_MONOTONIC, &deadline );
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += ( timeoutMs % 1000 ) * 1000 * 1000;
+    if( deadline.tv_nsec >= 1000 * 1000 * 1000 )
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+  }
+  ::pthread_mutex_lock( &mMutex );
+  __sync_add_and_fetch( &mSleepers, 1 );
+  int err = 0;
+  while( !err && mValid && Ticket() == ticket )
+  {
+    if( interrupted() )
+      err = EINTR;
+    else if( timeoutMs < 1 )
+      ::pthread_cond_wait( &mCond, &mMutex );
+    else if( ::pthread_cond_timedwait( &mCond, &mMutex, &deadline ) == ETIMEDOUT && Ticket() == ticket )
+      err = EWOULDBLOCK;
+  }
+  if( !mValid )
+  {
+    err = EDEVERR;
+    ::pthread_cond_broadcast( &mCond ); // for the destructor
+  }
+  __sync_sub_and_fetch( &mSleepers, 1 );
+  ::pthread_mutex_unlock( &mMutex );
+  return err;
+}
+
+void
+WaitQueue::Wakeup()
+{
+  __sync_add_and_fetch( &mGeneration, 1 );
+  if( __atomic_load_n( &mSleepers, __ATOMIC_SEQ_CST ) < 1 )
+    return;
+  ::pthread_mutex_lock( &mMutex );
+  ::pthread_cond_broadcast( &mCond );
+  ::pthread_mutex_unlock( &mMutex );
+}
+
+void
+SetInterruptFlag( const volatile bool* pInterrupted )
+{
+  tpInterrupted = pInterrupted;
+}
+
+void
+InterruptSleepers()
+{
+  ::pthread_mutex_lock( &sQueuesMutex );
+  for( WaitQueue* p = spQueues; p; p = p->mpNext )
+  {
+    ::pthread_mutex_lock( &p->mMutex );
+    ::pthread_cond_broadcast( &p->mCond );
+    ::pthread_mutex_unlock( &p->mMutex );
+  }
+  ::pthread_mutex_unlock( &sQueuesMutex );
+}
+
+} // namespace
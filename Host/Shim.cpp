@@ -0,0 +1,257 @@
+// Implementation of the kernel and IOAudioFamily stand-ins declared in include/ that do not
+// depend on the program's runtime.
+
+#include "KernelShim.h"
+#include "AudioShim.h"
+#include <stdarg.h>
+#include <mutex>
+
+namespace
+{
+
+const size_t cGuardBytes = 64;
+const unsigned char cGuard = 0xa5;
+
+std::mutex sBuffersMutex;
+std::vector<IOBufferMemoryDescriptor*> sBuffers;
+
+} // namespace
+
+namespace KernelShim
+{
+
+bool
+buffersIntact()
+{
+  std::lock_guard<std::mutex> lock( sBuffersMutex );
+  for( size_t i = 0; i < sBuffers.size(); ++i )
+    if( !sBuffers[i]->guardIntact() )
+      return false;
+  return true;
+}
+
+} // namespace KernelShim
+
+void
+panic( const char* format, ... )
+{
+  va_list args;
+  va_start( args, format );
+  ::vfprintf( stderr, format, args );
+  va_end( args );
+  ::fputc( '\n', stderr );
+  ::abort();
+}
+
+// Memory
+IOBufferMemoryDescriptor*
+IOBufferMemoryDescriptor::withOptions( IOOptionBits, size_t capacity, size_t alignment )
+{
+  void* p = 0;
+  if( ::posix_memalign( &p, max( alignment, sizeof(void*) ), capacity + cGuardBytes ) )
+    return 0;
+  IOBufferMemoryDescriptor* pDesc = new IOBufferMemoryDescriptor;
+  pDesc->mpBytes = static_cast<char*>( p );
+  pDesc->mLength = capacity;
+  ::memset( pDesc->mpBytes, 0xcd, capacity ); // not cleared, as in the kernel
+  ::memset( pDesc->mpBytes + capacity, cGuard, cGuardBytes );
+  std::lock_guard<std::mutex> lock( sBuffersMutex );
+  sBuffers.push_back( pDesc );
+  return pDesc;
+}
+
+bool
+IOBufferMemoryDescriptor::guardIntact() const
+{
+  for( size_t i = 0; i < cGuardBytes; ++i )
+    if( (unsigned char)mpBytes[mLength + i] != cGuard )
+      return false;
+  return true;
+}
+
+void
+IOBufferMemoryDescriptor::free()
+{
+  if( !guardIntact() )
+    panic( "buffer overrun detected when freeing a buffer" );
+  {
+    std::lock_guard<std::mutex> lock( sBuffersMutex );
+    for( size_t i = 0; i < sBuffers.size(); ++i )
+      if( sBuffers[i] == this )
+      {
+        sBuffers.erase( sBuffers.begin() + i );
+        break;
+      }
+  }
+  ::free( mpBytes );
+  OSObject::free();
+}
+
+int
+uiomove( const char* cp, int n, struct uio* uio )
+{
+  if( n < 0 )
+    panic( "uiomove with a negative count" );
+  int count = int( min( (user_ssize_t)n, uio->resid ) );
+  if( uio->rw == UIO_READ )
+    ::memcpy( uio->base, cp, count );
+  else
+    ::memcpy( const_cast<char*>( cp ), uio->base, count );
+  uio->base += count;
+  uio->resid -= count;
+  return 0;
+}
+
+// IOAudioEngine
+bool
+IOAudioEngine::init( OSDictionary* )
+{
+  numSampleFramesPerBuffer = 0;
+  numActiveUserClients = 1;
+  sampleOffset = 0;
+  workLoop = new IOWorkLoop;
+  outputStreams = new OSSet;
+  inputStreams = new OSSet;
+  defaultAudioControls = new OSSet;
+  state = kIOAudioEngineStopped;
+  sampleRate.whole = 0;
+  sampleRate.fraction = 0;
+  configurationChanges = 0;
+  currentLoopCount = 0;
+  lastLoopTime = 0;
+  return true;
+}
+
+void
+IOAudioEngine::free()
+{
+  defaultAudioControls->release();
+  inputStreams->release();
+  outputStreams->release();
+  workLoop->release();
+  IOService::free();
+}
+
+// As in IOKit, an engine shares its device's work loop.
+bool
+IOAudioEngine::start( IOService* pProvider )
+{
+  IOAudioDevice* pDevice = OSDynamicCast( IOAudioDevice, pProvider );
+  if( pDevice )
+  {
+    pDevice->getWorkLoop()->retain();
+    workLoop->release();
+    workLoop = pDevice->getWorkLoop();
+  }
+  return initHardware( pProvider );
+}
+
+IOReturn
+IOAudioEngine::startAudioEngine()
+{
+  currentLoopCount = 0;
+  IOReturn result = performAudioEngineStart();
+  state = kIOAudioEngineRunning;
+  return result;
+}
+
+IOReturn
+IOAudioEngine::stopAudioEngine()
+{
+  IOReturn result = performAudioEngineStop();
+  state = kIOAudioEngineStopped;
+  return result;
+}
+
+IOReturn
+IOAudioEngine::pauseAudioEngine()
+{
+  if( state != kIOAudioEngineRunning )
+    return kIOReturnSuccess;
+  performAudioEngineStop();
+  state = kIOAudioEnginePaused;
+  return kIOReturnSuccess;
+}
+
+IOReturn
+IOAudioEngine::resumeAudioEngine()
+{
+  if( state != kIOAudioEnginePaused )
+    return kIOReturnSuccess;
+  performAudioEngineStart();
+  state = kIOAudioEngineRunning;
+  return kIOReturnSuccess;
+}
+
+IOReturn
+IOAudioEngine::eraseOutputSamples( const void* mixBuf, void* sampleBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames,
+  const IOAudioStreamFormat* pFormat, IOAudioStream* )
+{
+  if( !pFormat )
+    return kIOReturnError;
+  size_t channels = pFormat->fNumChannels;
+  if( mixBuf )
+    ::bzero( (float*)mixBuf + firstSampleFrame * channels, numSampleFrames * channels * sizeof(float) );
+  if( sampleBuf )
+    ::bzero( (char*)sampleBuf + firstSampleFrame * channels * ( pFormat->fBitWidth / 8 ),
+      numSampleFrames * channels * ( pFormat->fBitWidth / 8 ) );
+  return kIOReturnSuccess;
+}
+
+void
+IOAudioEngine::takeTimeStamp( bool incrementLoopCount, AbsoluteTime* pTime )
+{
+  if( incrementLoopCount )
+    ++currentLoopCount;
+  lastLoopTime = pTime ? *pTime : KernelShim::now();
+}
+
+IOReturn
+IOAudioEngine::addAudioStream( IOAudioStream* pStream )
+{
+  OSSet* streams = pStream->getDirection() == kIOAudioStreamDirectionOutput ? outputStreams : inputStreams;
+  return streams->setObject( pStream ) ? kIOReturnSuccess : kIOReturnError;
+}
+
+// IOAudioDevice
+bool
+IOAudioDevice::init( OSDictionary* )
+{
+  workLoop = new IOWorkLoop;
+  audioEngines = new OSArray;
+  return true;
+}
+
+void
+IOAudioDevice::free()
+{
+  deactivateAllAudioEngines();
+  audioEngines->release();
+  workLoop->release();
+  IOService::free();
+}
+
+IOReturn
+IOAudioDevice::activateAudioEngine( IOAudioEngine* pEngine )
+{
+  if( !pEngine->attach( this ) || !pEngine->start( this ) )
+    return kIOReturnError;
+  audioEngines->setObject( pEngine );
+  return kIOReturnSuccess;
+}
+
+void
+IOAudioDevice::deactivateAllAudioEngines()
+{
+  while( audioEngines->getCount() > 0 )
+  {
+    IOAudioEngine* pEngine = OSDynamicCast( IOAudioEngine, audioEngines->getObject( 0 ) );
+    if( pEngine )
+    {
+      pEngine->stopAudioEngine();
+      pEngine->terminate( kIOServiceRequired );
+      pEngine->detach( this );
+    }
+    audioEngines->removeObject( 0 );
+  }
+}
@@ -0,0 +1,191 @@
+#ifndef AUDIO_SHIM_H
+#define AUDIO_SHIM_H
+
+// Host stand-ins for the IOAudioFamily classes used by the driver. The family itself does not
+// exist on the host: the program plays its part and that of the HAL, starting engines and
+// calling clipOutputSamples() and convertInputSamples() with positions within their buffers.
+
+#include "KernelShim.h"
+
+typedef UInt32 IOAudioStreamDirection;
+enum { kIOAudioStreamDirectionOutput = 0, kIOAudioStreamDirectionInput = 1 };
+enum { kIOAudioStreamSampleFormatLinearPCM = 0x6c70636d /* 'lpcm' */ };
+enum
+{
+  kIOAudioStreamNumericRepresentationSignedInt = 0x73696e74 /* 'sint' */,
+  kIOAudioStreamNumericRepresentationIEEE754Float = 0x666c6f74 /* 'flot' */
+};
+enum { kIOAudioStreamAlignmentLowByte = 0, kIOAudioStreamAlignmentHighByte = 1 };
+enum { kIOAudioStreamByteOrderBigEndian = 0, kIOAudioStreamByteOrderLittleEndian = 1 };
+struct IOAudioStreamFormat
+{
+  UInt32 fNumChannels;
+  UInt32 fSampleFormat;
+  UInt32 fNumericRepresentation;
+  UInt8 fBitDepth;
+  UInt8 fBitWidth;
+  UInt8 fAlignment;
+  UInt8 fByteOrder;
+  UInt8 fIsMixable;
+  UInt32 fDriverTag;
+};
+struct IOAudioSampleRate { UInt32 whole; UInt32 fraction; };
+struct IOAudioEnginePosition { UInt32 fSampleFrame; UInt32 fLoopCount; };
+typedef UInt32 IOAudioEngineState;
+enum { kIOAudioEngineStopped = 0, kIOAudioEngineRunning = 1, kIOAudioEnginePaused = 2 };
+enum { kIOAudioControlChannelIDAll = 0 };
+#define kIOAudioControlChannelNameAll "All Channels"
+enum { kIOAudioControlUsageOutput = 0x6f757470 /* 'outp' */, kIOAudioControlUsageInput = 0x696e7074 /* 'inpt' */ };
+
+class IOAudioEngine;
+
+class IOAudioStream : public IOService
+{
+public:
+  IOAudioStream() : numClients( 0 ), mpEngine( 0 ), mDirection( 0 ), mStartingChannel( 0 ), mpSampleBuffer( 0 ), mSampleBufferSize( 0 ) {}
+  bool initWithAudioEngine( IOAudioEngine* pEngine, IOAudioStreamDirection direction, UInt32 startingChannel )
+  { mpEngine = pEngine; mDirection = direction; mStartingChannel = startingChannel; return true; }
+  void clearAvailableFormats() {}
+  void addAvailableFormat( const IOAudioStreamFormat*, const IOAudioSampleRate*, const IOAudioSampleRate* ) {}
+  IOReturn setFormat( const IOAudioStreamFormat* pFormat, bool ) { mFormat = *pFormat; return kIOReturnSuccess; }
+  const IOAudioStreamFormat* getFormat() const { return &mFormat; }
+  void setSampleBuffer( void* p, UInt32 size ) { mpSampleBuffer = p; mSampleBufferSize = size; }
+  void* getSampleBuffer() const { return mpSampleBuffer; }
+  UInt32 getSampleBufferSize() const { return mSampleBufferSize; }
+  IOAudioStreamDirection getDirection() const { return mDirection; }
+  UInt32 getStartingChannelID() const { return mStartingChannel; }
+  UInt32 numClients;
+private:
+  IOAudioEngine* mpEngine;
+  IOAudioStreamDirection mDirection;
+  UInt32 mStartingChannel;
+  IOAudioStreamFormat mFormat;
+  void* mpSampleBuffer;
+  UInt32 mSampleBufferSize;
+};
+
+class IOAudioControl : public IOService
+{
+public:
+  typedef IOReturn (*IntValueChangeHandler)( OSObject*, IOAudioControl*, SInt32, SInt32 );
+  IOAudioControl( int value, int minValue, int maxValue, UInt32 channel, UInt32 id, UInt32 usage )
+  : mValue( value ), mMin( minValue ), mMax( maxValue ), mChannel( channel ), mId( id ), mUsage( usage ),
+    mHandler( 0 ), mpTarget( 0 ) {}
+  IOReturn setValueChangeHandler( IntValueChangeHandler handler, OSObject* pTarget )
+  { mHandler = handler; mpTarget = pTarget; return kIOReturnSuccess; }
+  UInt32 getControlID() const { return mId; }
+  UInt32 getChannelID() const { return mChannel; }
+  UInt32 getUsage() const { return mUsage; }
+  SInt32 getIntValue() const { return mValue; }
+  SInt32 getMinValue() const { return mMin; }
+  SInt32 getMaxValue() const { return mMax; }
+  // Changes the value as a CoreAudio client would.
+  IOReturn setValue( SInt32 value )
+  {
+    SInt32 old = mValue;
+    mValue = value;
+    return mHandler ? mHandler( mpTarget, this, old, value ) : kIOReturnSuccess;
+  }
+private:
+  SInt32 mValue, mMin, mMax;
+  UInt32 mChannel, mId, mUsage;
+  IntValueChangeHandler mHandler;
+  OSObject* mpTarget;
+};
+
+class IOAudioLevelControl : public IOAudioControl
+{
+public:
+  IOAudioLevelControl( SInt32 value, SInt32 minValue, SInt32 maxValue, UInt32 channel, UInt32 id, UInt32 usage )
+  : IOAudioControl( value, minValue, maxValue, channel, id, usage ) {}
+  static IOAudioLevelControl* createVolumeControl( SInt32 value, SInt32 minValue, SInt32 maxValue,
+    IOFixed, IOFixed, UInt32 channel, const char*, UInt32 id, UInt32 usage )
+  { return new IOAudioLevelControl( value, minValue, maxValue, channel, id, usage ); }
+};
+
+class IOAudioToggleControl : public IOAudioControl
+{
+public:
+  IOAudioToggleControl( bool value, UInt32 channel, UInt32 id, UInt32 usage )
+  : IOAudioControl( value, 0, 1, channel, id, usage ) {}
+  static IOAudioToggleControl* createMuteControl( bool value, UInt32 channel, const char*, UInt32 id, UInt32 usage )
+  { return new IOAudioToggleControl( value, channel, id, usage ); }
+};
+
+class IOAudioEngine : public IOService
+{
+public:
+  virtual bool init( OSDictionary* );
+  virtual void free();
+  virtual bool start( IOService* );
+  virtual bool initHardware( IOService* ) { return true; }
+  virtual bool terminate( IOOptionBits ) { return true; }
+
+  virtual IOReturn performAudioEngineStart() = 0;
+  virtual IOReturn performAudioEngineStop() = 0;
+  virtual UInt32 getCurrentSampleFrame() = 0;
+  virtual IOReturn startAudioEngine();
+  virtual IOReturn stopAudioEngine();
+  virtual IOReturn pauseAudioEngine();
+  virtual IOReturn resumeAudioEngine();
+  virtual void stopEngineAtPosition( IOAudioEnginePosition* ) {}
+  virtual void resetClipPosition( IOAudioStream*, UInt32 ) {}
+  virtual IOReturn eraseOutputSamples( const void*, void*, UInt32, UInt32, const IOAudioStreamFormat*, IOAudioStream* );
+  virtual IOReturn clipOutputSamples( const void*, void*, UInt32, UInt32, const IOAudioStreamFormat*, IOAudioStream* )
+  { return kIOReturnUnsupported; }
+  virtual IOReturn convertInputSamples( const void*, void*, UInt32, UInt32, const IOAudioStreamFormat*, IOAudioStream* )
+  { return kIOReturnUnsupported; }
+  virtual void takeTimeStamp( bool incrementLoopCount = true, AbsoluteTime* pTime = 0 );
+
+  void setSampleRate( const IOAudioSampleRate* pRate ) { sampleRate = *pRate; }
+  void setNumSampleFramesPerBuffer( UInt32 frames ) { numSampleFramesPerBuffer = frames; }
+  void setSampleLatency( UInt32 ) {}
+  void setSampleOffset( UInt32 frames ) { sampleOffset = frames; }
+  void setMixClipOverhead( UInt32 ) {}
+  void setDescription( const char* ) {}
+  IOReturn addAudioStream( IOAudioStream* );
+  IOReturn addDefaultAudioControl( IOAudioControl* pControl ) { return defaultAudioControls->setObject( pControl ) ? kIOReturnSuccess : kIOReturnError; }
+  IOAudioEngineState getState() const { return state; }
+  IOReturn beginConfigurationChange() { return kIOReturnSuccess; }
+  IOReturn completeConfigurationChange() { ++configurationChanges; return kIOReturnSuccess; }
+
+  UInt32 numSampleFramesPerBuffer, numActiveUserClients;
+  // Frames that CoreAudio mixes ahead of the engine's position
+  UInt32 sampleOffset;
+  IOWorkLoop* workLoop;
+  OSSet* outputStreams, *inputStreams, *defaultAudioControls;
+  IOAudioEngineState state;
+  IOAudioSampleRate sampleRate;
+  // Counts completed configuration changes, after which the HAL starts over at the beginning
+  // of the buffer.
+  UInt32 configurationChanges;
+  // As published to CoreAudio
+  UInt32 currentLoopCount;
+  AbsoluteTime lastLoopTime;
+};
+
+enum { kIOAudioDeviceTransportTypeVirtual = 0x76697274 /* 'virt' */ };
+enum { kIOAudioDeviceCanBeDefaultInput = 1, kIOAudioDeviceCanBeDefaultOutput = 2 };
+
+class IOAudioDevice : public IOService
+{
+public:
+  virtual bool init( OSDictionary* );
+  virtual void free();
+  virtual bool initHardware( IOService* ) { return true; }
+  void setDeviceName( const char* ) {}
+  void setDeviceShortName( const char* ) {}
+  void setManufacturerName( const char* ) {}
+  void setDeviceTransportType( UInt32 ) {}
+  void setDeviceCanBeDefault( UInt32 ) {}
+  IOWorkLoop* getWorkLoop() const { return workLoop; }
+  // Starts the engine on the device's work loop and adds it to audioEngines.
+  IOReturn activateAudioEngine( IOAudioEngine* );
+  // Stops, terminates, and removes all engines.
+  void deactivateAllAudioEngines();
+
+  IOWorkLoop* workLoop;
+  OSArray* audioEngines;
+};
+
+#endif // AUDIO_SHIM_H
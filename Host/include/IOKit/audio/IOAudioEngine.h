@@ -0,0 +1 @@
+#include "../../AudioShim.h"
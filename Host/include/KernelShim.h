@@ -0,0 +1,253 @@
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+// Host stand-ins for the parts of IOKit and the BSD kernel interface that the driver uses, so
+// its sources build as part of a userspace program. Host/Shim.cpp implements what all programs
+// share. Time, timers, locks, sleeping, and device nodes are up to each program's runtime:
+// vpcmsim simulates them in a single thread (Tools/vpcmsim/SimRuntime.cpp), and vpcmd maps
+// them onto threads and CUSE devices on Linux (Linux/Runtime.cpp, Linux/CuseDeviceNode.cpp).
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#ifndef EDEVERR
+# define EDEVERR EIO
+#endif
+#ifndef PAGE_SIZE
+# define PAGE_SIZE 4096
+#endif
+
+typedef uint8_t UInt8;
+typedef int8_t SInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+typedef int IOReturn;
+typedef unsigned int IOOptionBits;
+typedef uint64_t AbsoluteTime;
+typedef int64_t user_ssize_t;
+typedef SInt32 IOFixed;
+#ifndef TRUE
+# define TRUE 1
+# define FALSE 0
+#endif
+
+#define kIOReturnSuccess 0
+#define kIOReturnError ( (IOReturn)0xe00002bc )
+#define kIOReturnUnsupported ( (IOReturn)0xe00002c7 )
+#define kIOServiceRequired 0x00000001
+
+// The kernel's min and max accept mixed argument types.
+template<class A, class B> inline typename std::common_type<A, B>::type min( A a, B b ) { return a < b ? a : b; }
+template<class A, class B> inline typename std::common_type<A, B>::type max( A a, B b ) { return a > b ? a : b; }
+
+namespace KernelShim
+{
+  // Returns the uptime in nanoseconds, which absolute time also uses as its unit.
+  uint64_t now();
+  // Returns whether the guard bytes of all buffers are intact.
+  bool buffersIntact();
+}
+// Templates, since 64-bit integer types differ between the kernel and the host.
+template<class T> inline void clock_get_uptime( T* t ) { *t = KernelShim::now(); }
+template<class T> inline void nanoseconds_to_absolutetime( uint64_t ns, T* t ) { *t = ns; }
+template<class T> inline void absolutetime_to_nanoseconds( uint64_t t, T* ns ) { *ns = t; }
+void IOSleep( unsigned ms );
+#define IOLog printf
+// Prints a message and aborts.
+void panic( const char* format, ... ) __attribute__(( noreturn, format( printf, 1, 2 ) ));
+
+// Objects
+class OSObject
+{
+public:
+  OSObject() : mRefs( 1 ) {}
+  virtual ~OSObject() {}
+  // As in the kernel, objects are zeroed when allocated.
+  static void* operator new( size_t size ) { void* p = ::calloc( 1, size ); if( !p ) throw std::bad_alloc(); return p; }
+  static void operator delete( void* p ) { ::free( p ); }
+  virtual bool init() { return true; }
+  virtual void free() { delete this; }
+  void retain() const { __sync_add_and_fetch( &mRefs, 1 ); }
+  void release() const { if( __sync_sub_and_fetch( &mRefs, 1 ) == 0 ) const_cast<OSObject*>( this )->free(); }
+private:
+  mutable int mRefs;
+};
+typedef OSObject OSMetaClassBase;
+
+#define OSDeclareDefaultStructors( c ) public: c(); virtual ~c();
+#define OSDefineMetaClassAndStructors( c, b ) c::c() {} c::~c() {}
+#define OSDynamicCast( T, p ) ( dynamic_cast<T*>( p ) )
+
+// Converts a pointer to a non-virtual member function into a function pointer that takes the
+// object as its first argument, as the kernel does. Relies on the Itanium C++ ABI.
+template<class T, class F>
+T OSMemberFunctionCastImpl( F f )
+{
+  union { F pmf; struct { uintptr_t ptr; ptrdiff_t adj; } raw; } u;
+  u.pmf = f;
+  return reinterpret_cast<T>( u.raw.ptr );
+}
+#define OSMemberFunctionCast( T, obj, func ) OSMemberFunctionCastImpl<T>( func )
+
+class OSDictionary : public OSObject {};
+
+// Collections retain their members. Neither is thread safe; the driver only changes them on
+// the work loop.
+class OSSet : public OSObject
+{
+public:
+  OSObject* getObject( unsigned int i ) const { return i < mObjects.size() ? mObjects[i] : 0; }
+  unsigned int getCount() const { return (unsigned int)mObjects.size(); }
+  bool setObject( OSObject* p ) { p->retain(); mObjects.push_back( p ); return true; }
+  void removeObject( unsigned int i ) { if( i < mObjects.size() ) { OSObject* p = mObjects[i]; mObjects.erase( mObjects.begin() + i ); p->release(); } }
+  void flushCollection() { while( !mObjects.empty() ) removeObject( getCount() - 1 ); }
+  virtual void free() { flushCollection(); OSObject::free(); }
+private:
+  std::vector<OSObject*> mObjects;
+};
+typedef OSSet OSArray;
+
+class IOWorkLoop;
+
+class IOService : public OSObject
+{
+public:
+  virtual bool init( OSDictionary* = 0 ) { return true; }
+  virtual bool terminate( IOOptionBits = 0 ) { return true; }
+  virtual bool attach( IOService* ) { return true; }
+  virtual void detach( IOService* ) {}
+};
+
+class IOEventSource : public OSObject
+{
+public:
+  IOEventSource() : mpWorkLoop( 0 ) {}
+  IOWorkLoop* getWorkLoop() const { return mpWorkLoop; }
+private:
+  IOWorkLoop* mpWorkLoop;
+  friend class IOWorkLoop;
+};
+
+// Actions and event sources run with the work loop's gate closed. The gate is recursive, as in
+// IOKit, and the runtime decides what closing it means.
+class IOWorkLoop : public OSObject
+{
+public:
+  typedef IOReturn (*Action)( OSObject*, void*, void*, void*, void* );
+  IOWorkLoop();
+  virtual void free();
+  IOReturn addEventSource( IOEventSource* p ) { p->mpWorkLoop = this; return kIOReturnSuccess; }
+  IOReturn removeEventSource( IOEventSource* p ) { p->mpWorkLoop = 0; return kIOReturnSuccess; }
+  IOReturn runAction( Action action, OSObject* target, void* a0 = 0, void* a1 = 0, void* a2 = 0, void* a3 = 0 )
+  {
+    closeGate();
+    IOReturn result = action( target, a0, a1, a2, a3 );
+    openGate();
+    return result;
+  }
+  void closeGate();
+  void openGate();
+private:
+  void* mpGate;
+};
+
+class IOCommandGate : public OSObject {};
+
+// The runtime fires a timer at or after its deadline, with its work loop's gate closed.
+class IOTimerEventSource : public IOEventSource
+{
+public:
+  typedef void (*Action)( OSObject*, IOTimerEventSource* );
+  static IOTimerEventSource* timerEventSource( OSObject* owner, Action action );
+  IOReturn wakeAtTime( AbsoluteTime );
+  IOReturn setTimeoutUS( UInt32 us ) { return wakeAtTime( KernelShim::now() + us * 1000ULL ); }
+  void cancelTimeout();
+  virtual void free();
+  AbsoluteTime deadline() const { return mDeadline; }
+  bool armed() const { return mArmed; }
+  // Disarms the timer if its deadline has passed, and returns whether it had.
+  bool takeIfDue( AbsoluteTime now ) { if( !mArmed || mDeadline > now ) return false; mArmed = false; return true; }
+  void fire() { mAction( mpOwner, this ); }
+private:
+  OSObject* mpOwner;
+  Action mAction;
+  AbsoluteTime mDeadline;
+  bool mArmed;
+};
+
+enum { kIODirectionNone = 0, kIODirectionIn = 1, kIODirectionOut = 2, kIODirectionInOut = 3 };
+enum { kIOMemoryPhysicallyContiguous = 0x10, kIOMemoryThreadSafe = 0x100000 };
+
+// Buffers are followed by guard bytes, which are checked for overruns.
+class IOBufferMemoryDescriptor : public OSObject
+{
+public:
+  static IOBufferMemoryDescriptor* withOptions( IOOptionBits, size_t capacity, size_t alignment = 1 );
+  void* getBytesNoCopy() { return mpBytes; }
+  size_t getLength() const { return mLength; }
+  bool guardIntact() const;
+  virtual void free();
+private:
+  char* mpBytes;
+  size_t mLength;
+};
+
+// Locks
+typedef struct lck_grp_attr lck_grp_attr_t;
+typedef struct lck_grp lck_grp_t;
+typedef struct lck_attr lck_attr_t;
+typedef struct lck_mtx lck_mtx_t;
+lck_grp_attr_t* lck_grp_attr_alloc_init();
+void lck_grp_attr_setstat( lck_grp_attr_t* );
+lck_grp_t* lck_grp_alloc_init( const char*, lck_grp_attr_t* );
+lck_attr_t* lck_attr_alloc_init();
+lck_mtx_t* lck_mtx_alloc_init( lck_grp_t*, lck_attr_t* );
+void lck_mtx_free( lck_mtx_t*, lck_grp_t* );
+void lck_attr_free( lck_attr_t* );
+void lck_grp_free( lck_grp_t* );
+void lck_grp_attr_free( lck_grp_attr_t* );
+void lck_mtx_lock( lck_mtx_t* );
+void lck_mtx_unlock( lck_mtx_t* );
+
+#define PCATCH 0x100
+#define PDROP 0x400
+int msleep( void*, lck_mtx_t*, int, const char*, struct timespec* );
+void wakeup( void* );
+// Select is implemented by the device node backend.
+void selwakeup( void* );
+void selrecord( struct proc*, void*, void* );
+void selthreadclear( void* );
+
+// Device I/O
+#define FREAD 0x0001
+#define FWRITE 0x0002
+#define FNONBLOCK 0x0004
+#define FMASK ( FREAD | FWRITE | FNONBLOCK )
+
+#define UIO_READ 0
+#define UIO_WRITE 1
+struct uio
+{
+  char* base;
+  user_ssize_t resid;
+  int rw;
+};
+inline user_ssize_t uio_resid( struct uio* uio ) { return uio->resid; }
+inline int uio_rw( struct uio* uio ) { return uio->rw; }
+int uiomove( const char* cp, int n, struct uio* uio );
+
+#endif // KERNEL_SHIM_H
@@ -0,0 +1 @@
+#include "../KernelShim.h"
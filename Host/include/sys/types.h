@@ -0,0 +1,13 @@
+#ifndef SYS_TYPES_SHIM_H
+#define SYS_TYPES_SHIM_H
+
+#include_next <sys/types.h>
+#include <stdint.h>
+
+// The kernel declares these as functions, which the engine calls as ::major() and ::minor().
+#undef major
+#undef minor
+inline int major( dev_t dev ) { return int( ( dev >> 24 ) & 0xff ); }
+inline int minor( dev_t dev ) { return int( dev & 0xffffff ); }
+
+#endif // SYS_TYPES_SHIM_H
@@ -0,0 +1,2 @@
+#include_next <sys/uio.h>
+#include "../KernelShim.h"
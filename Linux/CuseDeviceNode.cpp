@@ -0,0 +1,854 @@
+// DevfsDeviceNode over CUSE, see CuseDeviceNode.h.
+
+#define FUSE_USE_VERSION 31
+#include <cuse_lowlevel.h>
+
+#include "CuseDeviceNode.h"
+#include "DevfsDeviceNode.h"
+#include "Runtime.h"
+#include "Synchronization.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+// The device switch, which the kext registers with the kernel.
+struct cdevsw
+{
+  int (*d_open)( dev_t, int, int, struct proc* );
+  int (*d_close)( dev_t, int, int, struct proc* );
+  int (*d_read)( dev_t, struct uio*, int );
+  int (*d_write)( dev_t, struct uio*, int );
+  int (*d_ioctl)( dev_t, u_long, caddr_t, int, struct proc* );
+  int (*d_select)( dev_t, int, void*, struct proc* );
+};
+
+namespace
+{
+
+const int cMaxWorkers = 256;
+const int cInitTimeoutMs = 5000;
+const int cStopTimeoutMs = 1000;
+const int cMaxGroups = 1024;
+
+struct File;
+
+// A node's CUSE session. Once the node is destroyed, the session stays open until no worker
+// uses it any more, and the dispatcher then closes it, which removes the device.
+struct Node
+{
+  dev_t dev;
+  struct fuse_session* pSession;
+  int fd;
+  bool initialized; // CUSE_INIT has been answered, and the device exists
+  bool failed;      // the connection is gone
+  bool destroyed;   // the DevfsDeviceNode is gone
+  bool receiving;   // a worker is about to receive a request
+  int busy;         // workers that receive or process a request
+  std::set<File*> files;
+};
+
+struct File
+{
+  Node* pNode;
+  int flags;
+  bool nonblocking;
+  struct fuse_pollhandle* pPollHandle;
+};
+
+const struct cdevsw* spCdevsw = 0;
+
+std::mutex sMutex;
+std::condition_variable sWorkCond, sInitCond;
+std::vector<Node*> sNodes;
+std::deque<Node*> sReady;
+std::thread sDispatcher;
+int sEventFd = -1;
+int sWorkers = 0, sIdleWorkers = 0;
+bool sRunning = false, sDebug = false;
+gid_t sStaffGid = 0;
+
+// Files that wait on each selinfo, and the files of each node, are protected by sSelMutex.
+std::mutex sSelMutex;
+std::multimap<void*, File*> sSelections;
+
+// The request that the calling thread serves, for the caller's credentials.
+thread_local fuse_req_t tRequest = 0;
+
+void
+wakeDispatcher()
+{
+  uint64_t one = 1;
+  ssize_t r = ::write( sEventFd, &one, sizeof(one) );
+  (void)r;
+}
+
+// While a handler calls into the node, the thread serves the request, and sleeping on a wait
+// queue ends when the request is interrupted. The interrupt function is reset before the
+// request is answered, since libfuse may still be calling it.
+class RequestScope
+{
+public:
+  explicit RequestScope( fuse_req_t req )
+  : mReq( req ),
+    mInterrupted( false )
+  {
+    tRequest = req;
+    Synchronization::SetInterruptFlag( &mInterrupted );
+    ::fuse_req_interrupt_func( req, onInterrupt, this );
+  }
+  ~RequestScope()
+  {
+    ::fuse_req_interrupt_func( mReq, 0, 0 );
+    Synchronization::SetInterruptFlag( 0 );
+    tRequest = 0;
+  }
+private:
+  static void onInterrupt( fuse_req_t, void* p )
+  {
+    __atomic_store_n( &static_cast<RequestScope*>( p )->mInterrupted, true, __ATOMIC_SEQ_CST );
+    Synchronization::InterruptSleepers();
+  }
+  fuse_req_t mReq;
+  volatile bool mInterrupted;
+};
+
+bool
+isLive( const Node* pNode )
+{
+  std::lock_guard<std::mutex> lock( sMutex );
+  return !pNode->destroyed && spCdevsw;
+}
+
+File*
+fileOf( struct fuse_file_info* fi )
+{
+  return reinterpret_cast<File*>( fi->fh );
+}
+
+void
+forgetFile( File* pFile )
+{
+  std::lock_guard<std::mutex> lock( sSelMutex );
+  for( std::multimap<void*, File*>::iterator i = sSelections.begin(); i != sSelections.end(); )
+    if( i->second == pFile )
+      sSelections.erase( i++ );
+    else
+      ++i;
+  pFile->pNode->files.erase( pFile );
+  if( pFile->pPollHandle )
+    ::fuse_pollhandle_destroy( pFile->pPollHandle );
+  pFile->pPollHandle = 0;
+}
+
+// fcntl( F_SETFL ) does not reach the device, so the node learns about O_NONBLOCK from the
+// flags that come with each read and write.
+void
+syncNonblocking( File* pFile, const struct fuse_file_info* fi )
+{
+  bool nonblocking = ( fi->flags & O_NONBLOCK );
+  if( nonblocking == pFile->nonblocking )
+    return;
+  int arg = nonblocking;
+  spCdevsw->d_ioctl( pFile->pNode->dev, FIONBIO, reinterpret_cast<caddr_t>( &arg ), 0, 0 );
+  pFile->nonblocking = nonblocking;
+}
+
+void
+cuseInitDone( void* pUserData )
+{
+  std::lock_guard<std::mutex> lock( sMutex );
+  static_cast<Node*>( pUserData )->initialized = true;
+  sInitCond.notify_all();
+}
+
+void
+cuseOpen( fuse_req_t req, struct fuse_file_info* fi )
+{
+  Node* pNode = static_cast<Node*>( ::fuse_req_userdata( req ) );
+  int flags = FREAD | FWRITE;
+  if( ( fi->flags & O_ACCMODE ) == O_RDONLY )
+    flags = FREAD;
+  else if( ( fi->flags & O_ACCMODE ) == O_WRONLY )
+    flags = FWRITE;
+  bool nonblocking = ( fi->flags & O_NONBLOCK );
+  if( nonblocking )
+    flags |= FNONBLOCK;
+  int err = ENXIO;
+  if( isLive( pNode ) )
+  {
+    RequestScope scope( req );
+    err = spCdevsw->d_open( pNode->dev, flags, S_IFCHR, 0 );
+  }
+  if( err )
+  {
+    ::fuse_reply_err( req, err );
+    return;
+  }
+  File* pFile = new File;
+  pFile->pNode = pNode;
+  pFile->flags = flags;
+  pFile->nonblocking = nonblocking;
+  pFile->pPollHandle = 0;
+  {
+    std::lock_guard<std::mutex> lock( sSelMutex );
+    pNode->files.insert( pFile );
+  }
+  fi->fh = reinterpret_cast<uintptr_t>( pFile );
+  fi->direct_io = 1;
+  fi->nonseekable = 1;
+  if( ::fuse_reply_open( req, fi ) != 0 )
+  { // the caller has gone away
+    forgetFile( pFile );
+    if( isLive( pNode ) )
+      spCdevsw->d_close( pNode->dev, flags, S_IFCHR, 0 );
+    delete pFile;
+  }
+}
+
+void
+cuseRelease( fuse_req_t req, struct fuse_file_info* fi )
+{
+  File* pFile = fileOf( fi );
+  forgetFile( pFile );
+  if( isLive( pFile->pNode ) )
+  {
+    RequestScope scope( req );
+    spCdevsw->d_close( pFile->pNode->dev, pFile->flags, S_IFCHR, 0 );
+  }
+  delete pFile;
+  ::fuse_reply_err( req, 0 );
+}
+
+// As in the kernel, a transfer that is interrupted or would block after some data has been
+// moved reports that data rather than the error.
+int
+transferResult( int err, size_t count )
+{
+  if( count > 0 && ( err == EINTR || err == EWOULDBLOCK ) )
+    return 0;
+  return err;
+}
+
+void
+cuseRead( fuse_req_t req, size_t size, off_t, struct fuse_file_info* fi )
+{
+  File* pFile = fileOf( fi );
+  std::vector<char> buf( size );
+  struct uio uio = { buf.data(), user_ssize_t( size ), UIO_READ };
+  int err = ENXIO;
+  if( isLive( pFile->pNode ) )
+  {
+    RequestScope scope( req );
+    syncNonblocking( pFile, fi );
+    err = spCdevsw->d_read( pFile->pNode->dev, &uio, 0 );
+  }
+  size_t count = size - uio.resid;
+  err = transferResult( err, count );
+  if( err )
+    ::fuse_reply_err( req, err );
+  else
+    ::fuse_reply_buf( req, buf.data(), count );
+}
+
+void
+cuseWrite( fuse_req_t req, const char* pData, size_t size, off_t, struct fuse_file_info* fi )
+{
+  File* pFile = fileOf( fi );
+  struct uio uio = { const_cast<char*>( pData ), user_ssize_t( size ), UIO_WRITE };
+  int err = ENXIO;
+  if( isLive( pFile->pNode ) )
+  {
+    RequestScope scope( req );
+    syncNonblocking( pFile, fi );
+    err = spCdevsw->d_write( pFile->pNode->dev, &uio, 0 );
+  }
+  size_t count = size - uio.resid;
+  err = transferResult( err, count );
+  if( err )
+    ::fuse_reply_err( req, err );
+  else
+    ::fuse_reply_write( req, count );
+}
+
+// Linux does not encode the argument size of FIONREAD.
+size_t
+ioctlSize( unsigned int cmd )
+{
+  return cmd == FIONREAD ? sizeof(int) : _IOC_SIZE( cmd );
+}
+
+// The argument is fetched and returned by asking the kernel to retry the request with the
+// buffers that the command's encoding describes.
+void
+cuseIoctl( fuse_req_t req, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags,
+  const void* pIn, size_t inBytes, size_t outBytes )
+{
+  if( flags & FUSE_IOCTL_COMPAT )
+  {
+    ::fuse_reply_err( req, ENOSYS );
+    return;
+  }
+  unsigned int request = cmd;
+  size_t size = ioctlSize( request );
+  bool in = ( _IOC_DIR( request ) & _IOC_WRITE ),
+       out = ( _IOC_DIR( request ) & _IOC_READ ) || request == FIONREAD;
+  if( size > 0 && ( ( in && inBytes < size ) || ( out && outBytes < size ) ) )
+  {
+    struct iovec iov = { arg, size };
+    ::fuse_reply_ioctl_retry( req, &iov, in ? 1 : 0, &iov, out ? 1 : 0 );
+    return;
+  }
+  std::vector<char> data( max( size, sizeof(int) ) );
+  if( in )
+    ::memcpy( data.data(), pIn, size );
+  File* pFile = fileOf( fi );
+  int err = ENXIO;
+  if( isLive( pFile->pNode ) )
+  {
+    RequestScope scope( req );
+    err = spCdevsw->d_ioctl( pFile->pNode->dev, request, data.data(), pFile->flags, 0 );
+  }
+  if( err )
+    ::fuse_reply_err( req, err );
+  else
+    ::fuse_reply_ioctl( req, 0, out ? data.data() : 0, out ? size : 0 );
+}
+
+// The poll handle is kept before the node is asked, so a selwakeup() in between is not lost.
+void
+cusePoll( fuse_req_t req, struct fuse_file_info* fi, struct fuse_pollhandle* ph )
+{
+  File* pFile = fileOf( fi );
+  if( ph )
+  {
+    std::lock_guard<std::mutex> lock( sSelMutex );
+    if( pFile->pPollHandle )
+      ::fuse_pollhandle_destroy( pFile->pPollHandle );
+    pFile->pPollHandle = ph;
+  }
+  unsigned int events = fi->poll_events ? fi->poll_events : POLLIN | POLLOUT;
+  unsigned int revents = 0;
+  if( isLive( pFile->pNode ) )
+  {
+    RequestScope scope( req );
+    dev_t dev = pFile->pNode->dev;
+    if( ( events & POLLIN ) && ( pFile->flags & FREAD ) && spCdevsw->d_select( dev, FREAD, pFile, 0 ) )
+      revents |= POLLIN | POLLRDNORM;
+    if( ( events & POLLOUT ) && ( pFile->flags & FWRITE ) && spCdevsw->d_select( dev, FWRITE, pFile, 0 ) )
+      revents |= POLLOUT | POLLWRNORM;
+  }
+  else
+    revents = POLLERR;
+  ::fuse_reply_poll( req, revents );
+}
+
+struct cuse_lowlevel_ops
+cuseOps()
+{
+  struct cuse_lowlevel_ops ops;
+  ::memset( &ops, 0, sizeof(ops) );
+  ops.init_done = cuseInitDone;
+  ops.open = cuseOpen;
+  ops.read = cuseRead;
+  ops.write = cuseWrite;
+  ops.release = cuseRelease;
+  ops.ioctl = cuseIoctl;
+  ops.poll = cusePoll;
+  return ops;
+}
+
+const struct cuse_lowlevel_ops sOps = cuseOps();
+
+// Opens a CUSE session for a device with the given name, and waits until the device exists.
+Node*
+createNode( dev_t dev, const char* pName )
+{
+  int fd = ::open( "/dev/cuse", O_RDWR | O_NONBLOCK | O_CLOEXEC );
+  if( fd < 0 )
+  {
+    IOLog( "vpcmd: cannot open /dev/cuse: %s\n", ::strerror( errno ) );
+    return 0;
+  }
+  std::string devName = std::string( "DEVNAME=" ) + pName;
+  const char* devInfo[] = { devName.c_str() };
+  struct cuse_info ci;
+  ::memset( &ci, 0, sizeof(ci) );
+  ci.dev_info_argc = 1;
+  ci.dev_info_argv = devInfo;
+  ci.flags = CUSE_UNRESTRICTED_IOCTL;
+  const char* argv[] = { "vpcmd", "-d" };
+  struct fuse_args args = FUSE_ARGS_INIT( sDebug ? 2 : 1, const_cast<char**>( argv ) );
+
+  Node* pNode = new Node;
+  pNode->dev = dev;
+  pNode->fd = fd;
+  pNode->initialized = false;
+  pNode->failed = false;
+  pNode->destroyed = false;
+  pNode->receiving = false;
+  pNode->busy = 0;
+  pNode->pSession = ::cuse_lowlevel_new( &args, &ci, &sOps, pNode );
+  ::fuse_opt_free_args( &args );
+  char mountpoint[32];
+  ::snprintf( mountpoint, sizeof(mountpoint), "/dev/fd/%d", fd );
+  if( !pNode->pSession || ::fuse_session_mount( pNode->pSession, mountpoint ) != 0 )
+  {
+    if( pNode->pSession )
+      ::fuse_session_destroy( pNode->pSession );
+    ::close( fd );
+    delete pNode;
+    return 0;
+  }
+
+  std::unique_lock<std::mutex> lock( sMutex );
+  sNodes.push_back( pNode );
+  wakeDispatcher();
+  sInitCond.wait_for( lock, std::chrono::milliseconds( cInitTimeoutMs ),
+    [pNode] { return pNode->initialized || pNode->failed; } );
+  if( !pNode->initialized )
+  {
+    IOLog( "vpcmd: cannot create /dev/%s\n", pName );
+    pNode->destroyed = true;
+    wakeDispatcher();
+    return 0;
+  }
+  return pNode;
+}
+
+// The device node itself appears asynchronously when there is no devtmpfs.
+void
+setOwnership( const char* pName, uid_t uid, gid_t gid, mode_t mode )
+{
+  std::string path = std::string( "/dev/" ) + pName;
+  for( int i = 0; i < 100; ++i )
+  {
+    if( ::chown( path.c_str(), uid, gid ) == 0 )
+    {
+      ::chmod( path.c_str(), mode & ALLPERMS );
+      return;
+    }
+    if( errno != ENOENT )
+      break;
+    std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+  }
+  IOLog( "vpcmd: cannot set the owner of %s: %s\n", path.c_str(), ::strerror( errno ) );
+}
+
+// Closes the sessions of destroyed nodes that no worker uses any more. Open files of such
+// nodes never see a release request, so they are freed here.
+void
+closeDestroyedNodes( std::unique_lock<std::mutex>& lock )
+{
+  std::vector<Node*> closed;
+  for( size_t i = 0; i < sNodes.size(); )
+    if( sNodes[i]->destroyed && sNodes[i]->busy == 0 )
+    {
+      closed.push_back( sNodes[i] );
+      sNodes.erase( sNodes.begin() + i );
+    }
+    else
+      ++i;
+  lock.unlock();
+  for( size_t i = 0; i < closed.size(); ++i )
+  {
+    Node* pNode = closed[i];
+    while( !pNode->files.empty() )
+    {
+      File* pFile = *pNode->files.begin();
+      forgetFile( pFile );
+      delete pFile;
+    }
+    ::fuse_session_destroy( pNode->pSession );
+    delete pNode;
+  }
+  lock.lock();
+}
+
+void
+work()
+{
+  struct fuse_buf buf;
+  ::memset( &buf, 0, sizeof(buf) );
+  std::unique_lock<std::mutex> lock( sMutex );
+  for( ;; )
+  {
+    ++sIdleWorkers;
+    sWorkCond.wait( lock, [] { return !sReady.empty() || !sRunning; } );
+    --sIdleWorkers;
+    if( sReady.empty() )
+      break;
+    Node* pNode = sReady.front();
+    sReady.pop_front();
+    lock.unlock();
+    int res = ::fuse_session_receive_buf( pNode->pSession, &buf );
+    lock.lock();
+    pNode->receiving = false;
+    if( res == 0 || ( res < 0 && res != -EINTR && res != -EAGAIN ) )
+    {
+      pNode->failed = true;
+      sInitCond.notify_all();
+    }
+    wakeDispatcher();
+    if( res > 0 )
+    {
+      lock.unlock();
+      ::fuse_session_process_buf( pNode->pSession, &buf );
+      lock.lock();
+    }
+    if( --pNode->busy == 0 && pNode->destroyed )
+      wakeDispatcher();
+  }
+  --sWorkers;
+  sWorkCond.notify_all();
+  lock.unlock();
+  ::free( buf.mem );
+}
+
+// Waits for requests on all nodes, and hands each node that has one to a worker. A node is not
+// waited on again until its worker has received the request.
+void
+dispatch()
+{
+  std::vector<struct pollfd> fds;
+  std::vector<Node*> polled;
+  std::unique_lock<std::mutex> lock( sMutex );
+  while( sRunning )
+  {
+    closeDestroyedNodes( lock );
+    fds.clear();
+    polled.clear();
+    struct pollfd event = { sEventFd, POLLIN, 0 };
+    fds.push_back( event );
+    polled.push_back( 0 );
+    for( size_t i = 0; i < sNodes.size(); ++i )
+    {
+      Node* pNode = sNodes[i];
+      if( pNode->receiving || pNode->failed || pNode->destroyed )
+        continue;
+      struct pollfd request = { pNode->fd, POLLIN, 0 };
+      fds.push_back( request );
+      polled.push_back( pNode );
+    }
+    lock.unlock();
+    int n = ::poll( fds.data(), fds.size(), -1 );
+    if( n < 0 && errno != EINTR )
+      panic( "vpcmd: poll: %s", ::strerror( errno ) );
+    uint64_t count;
+    if( fds[0].revents && ::read( sEventFd, &count, sizeof(count) ) < 0 && errno != EAGAIN )
+      panic( "vpcmd: eventfd: %s", ::strerror( errno ) );
+    lock.lock();
+    for( size_t i = 1; i < fds.size() && n > 0; ++i )
+    {
+      Node* pNode = polled[i];
+      if( !fds[i].revents || pNode->destroyed )
+        continue;
+      pNode->receiving = true;
+      ++pNode->busy;
+      sReady.push_back( pNode );
+      if( int( sReady.size() ) > sIdleWorkers && sWorkers < cMaxWorkers )
+      {
+        ++sWorkers;
+        std::thread( work ).detach();
+      }
+      sWorkCond.notify_one();
+    }
+  }
+}
+
+bool
+isGroupMember( gid_t gid )
+{
+  gid_t groups[cMaxGroups];
+  int count = 0;
+  if( tRequest )
+  {
+    if( ::fuse_req_ctx( tRequest )->gid == gid )
+      return true;
+    count = ::fuse_req_getgroups( tRequest, cMaxGroups, groups );
+  }
+  else
+  {
+    if( ::getegid() == gid )
+      return true;
+    count = ::getgroups( cMaxGroups, groups );
+  }
+  for( int i = 0; i < min( count, cMaxGroups ); ++i )
+    if( groups[i] == gid )
+      return true;
+  return false;
+}
+
+} // namespace
+
+int
+CuseDispatcher::start( gid_t staffGid, bool debug )
+{
+  std::lock_guard<std::mutex> lock( sMutex );
+  if( sRunning )
+    return EBUSY;
+  sStaffGid = staffGid;
+  sDebug = debug;
+  sEventFd = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if( sEventFd < 0 )
+    return errno;
+  sRunning = true;
+  sDispatcher = std::thread( dispatch );
+  return 0;
+}
+
+void
+CuseDispatcher::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock( sMutex );
+    if( !sRunning )
+      return;
+    sRunning = false;
+    sWorkCond.notify_all();
+  }
+  wakeDispatcher();
+  sDispatcher.join();
+  std::unique_lock<std::mutex> lock( sMutex );
+  sWorkCond.wait_for( lock, std::chrono::milliseconds( cStopTimeoutMs ), [] { return sWorkers == 0; } );
+  closeDestroyedNodes( lock );
+}
+
+// DevfsDeviceNode
+struct cdevsw DevfsDeviceNode::sCdevsw;
+int DevfsDeviceNode::sMajor = 0;
+int DevfsDeviceNode::sInstanceCount = 0;
+DevfsDeviceNode* DevfsDeviceNode::sInstances[] = { 0 };
+
+void
+DevfsDeviceNode::classInit()
+{
+  sCdevsw.d_open = open;
+  sCdevsw.d_close = close;
+  sCdevsw.d_read = read;
+  sCdevsw.d_write = write;
+  sCdevsw.d_ioctl = ioctl;
+  sCdevsw.d_select = select;
+  std::lock_guard<std::mutex> lock( sMutex );
+  spCdevsw = &sCdevsw;
+}
+
+void
+DevfsDeviceNode::classFree()
+{
+  std::lock_guard<std::mutex> lock( sMutex );
+  spCdevsw = 0;
+}
+
+DevfsDeviceNode::DevfsDeviceNode()
+: mpName( 0 ),
+  mNode( 0 ),
+  mDev( 0 ),
+  mUid( 0 ),
+  mGid( 0 ),
+  mMode( 0 )
+{
+  if( sInstanceCount++ == 0 )
+    classInit();
+}
+
+DevfsDeviceNode::~DevfsDeviceNode()
+{
+  devDestroy();
+  if( --sInstanceCount == 0 )
+    classFree();
+}
+
+// Owners default to the credentials of the request being served, as they default to those of
+// the calling process in the kext.
+int
+DevfsDeviceNode::devCreate( const char* pNamePattern, int mode, int uid, int gid )
+{
+  if( !pNamePattern )
+    return EINVAL;
+  const struct fuse_ctx* pCaller = tRequest ? ::fuse_req_ctx( tRequest ) : 0;
+  if( uid < 0 )
+    mUid = pCaller ? pCaller->uid : ::geteuid();
+  else
+    mUid = uid;
+  if( gid < 0 )
+    mGid = pCaller ? pCaller->gid : ::getegid();
+  else
+    mGid = gid == GID_STAFF ? sStaffGid : gid;
+  mMode = mode;
+
+  int minor = 0;
+  {
+    std::lock_guard<std::mutex> lock( sMutex );
+    while( minor < sMaxInstances && sInstances[minor] )
+      ++minor;
+    if( minor >= sMaxInstances )
+      return ENOMEM;
+    sInstances[minor] = this;
+  }
+  mDev = dev_t( ( sMajor << 24 ) | minor );
+
+  size_t size = ::strlen( pNamePattern ) + 4;
+  mpName = new char[size];
+  int r = ::snprintf( mpName, size, pNamePattern, minor );
+  if( r < 0 || size_t( r ) >= size )
+    return EINVAL;
+  Node* pNode = createNode( mDev, mpName );
+  if( !pNode )
+    return EDEVERR;
+  mNode = pNode;
+  setOwnership( mpName, mUid, mGid, mMode );
+  return 0;
+}
+
+int
+DevfsDeviceNode::devDestroy()
+{
+  std::lock_guard<std::mutex> lock( sMutex );
+  if( mNode )
+  {
+    static_cast<Node*>( mNode )->destroyed = true;
+    wakeDispatcher();
+  }
+  mNode = 0;
+  int minor = ::minor( mDev );
+  if( mpName && minor < sMaxInstances && sInstances[minor] == this )
+    sInstances[minor] = 0;
+  delete[] mpName;
+  mpName = 0;
+  return 0;
+}
+
+int
+DevfsDeviceNode::devAccess( mode_t reqMode ) const
+{
+  uid_t uid = tRequest ? ::fuse_req_ctx( tRequest )->uid : ::geteuid();
+  if( uid == 0 )
+    return 0;
+  mode_t mode = (mMode & S_IRWXO) << 6;
+  if( isGroupMember( mGid ) )
+    mode |= (mMode & S_IRWXG) << 3;
+  if( uid == mUid )
+    mode |= (mMode & S_IRWXU);
+  if( (reqMode & mode) == reqMode )
+    return 0;
+  return EACCES;
+}
+
+DevfsDeviceNode*
+DevfsDeviceNode::getInstance( dev_t dev )
+{
+  if( ::major( dev ) != sMajor )
+    return 0;
+  if( ::minor( dev ) < sMaxInstances )
+    return sInstances[::minor( dev )];
+  return 0;
+}
+
+int
+DevfsDeviceNode::open( dev_t dev, int flags, int, struct proc* )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devOpen( flags ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::close( dev_t dev, int, int, struct proc* )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devClose() : ENXIO;
+}
+
+int
+DevfsDeviceNode::read( dev_t dev, struct uio *uio, int )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devRead( uio ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::write( dev_t dev, struct uio *uio, int )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devWrite( uio ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::ioctl( dev_t dev, u_long cmd, caddr_t pData, int, struct proc* )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devIoctl( cmd, pData ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::select( dev_t dev, int rw, void* wql, struct proc* proc )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devSelect( rw, wql, proc ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::devRead( struct uio* )
+{
+  return ENOTSUP;
+}
+
+int
+DevfsDeviceNode::devWrite( struct uio* )
+{
+  return ENOTSUP;
+}
+
+int
+DevfsDeviceNode::devIoctl( u_long, caddr_t )
+{
+  return ENOTTY;
+}
+
+int
+DevfsDeviceNode::devSelect( int, void*, struct proc* )
+{
+  return 1;
+}
+
+// Select
+void
+selrecord( struct proc*, void* sel, void* wql )
+{
+  File* pFile = static_cast<File*>( wql );
+  std::lock_guard<std::mutex> lock( sSelMutex );
+  std::pair<std::multimap<void*, File*>::iterator, std::multimap<void*, File*>::iterator>
+    range = sSelections.equal_range( sel );
+  for( std::multimap<void*, File*>::iterator i = range.first; i != range.second; ++i )
+    if( i->second == pFile )
+      return;
+  sSelections.insert( std::make_pair( sel, pFile ) );
+}
+
+void
+selwakeup( void* sel )
+{
+  std::lock_guard<std::mutex> lock( sSelMutex );
+  std::pair<std::multimap<void*, File*>::iterator, std::multimap<void*, File*>::iterator>
+    range = sSelections.equal_range( sel );
+  for( std::multimap<void*, File*>::iterator i = range.first; i != range.second; ++i )
+    if( i->second->pPollHandle )
+      ::fuse_lowlevel_notify_poll( i->second->pPollHandle );
+  sSelections.erase( range.first, range.second );
+}
+
+void
+selthreadclear( void* sel )
+{
+  std::lock_guard<std::mutex> lock( sSelMutex );
+  sSelections.erase( sel );
+}
@@ -0,0 +1,21 @@
+#ifndef CUSE_DEVICE_NODE_H
+#define CUSE_DEVICE_NODE_H
+
+// DevfsDeviceNode on Linux, with each node a CUSE device (character device in userspace).
+// A dispatcher thread waits for requests on all nodes and hands them to worker threads, so
+// that a blocking read only holds up its own caller. Workers are started as needed.
+
+#include <sys/types.h>
+
+class CuseDispatcher
+{
+public:
+  // Nodes that the driver creates for Darwin's staff group are given staffGid instead.
+  // With debug set, libfuse prints each request.
+  static int start( gid_t staffGid, bool debug );
+  // Nodes must have been destroyed before. Requests that are still in progress are abandoned
+  // after a second.
+  static void stop();
+};
+
+#endif // CUSE_DEVICE_NODE_H
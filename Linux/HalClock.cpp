@@ -0,0 +1,219 @@
+#include "HalClock.h"
+#include <chrono>
+
+namespace
+{
+
+const uint64_t cIdlePeriodNs = 10000000;
+
+} // namespace
+
+HalClock::HalClock( IOAudioDevice* pDevice, int cycleFrames, bool loopback )
+: mpDevice( pDevice ),
+  mCycleFrames( cycleFrames ),
+  mLoopback( loopback ),
+  mRunning( false )
+{
+  mpDevice->retain();
+}
+
+HalClock::~HalClock()
+{
+  stop();
+  mpDevice->release();
+}
+
+void
+HalClock::start()
+{
+  std::lock_guard<std::mutex> lock( mMutex );
+  if( mRunning )
+    return;
+  mRunning = true;
+  mThread = std::thread( &HalClock::run, this );
+}
+
+void
+HalClock::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock( mMutex );
+    if( !mRunning )
+      return;
+    mRunning = false;
+    mCond.notify_all();
+  }
+  mThread.join();
+  IOWorkLoop* pWorkLoop = mpDevice->getWorkLoop();
+  pWorkLoop->closeGate();
+  for( size_t i = 0; i < mEngines.size(); ++i )
+    mEngines[i].pEngine->release();
+  mEngines.clear();
+  pWorkLoop->openGate();
+}
+
+// Each round runs with the device's gate closed, so engines are neither created, deleted, nor
+// reconfigured meanwhile. Rounds are a cycle of the fastest engine apart.
+void
+HalClock::run()
+{
+  std::unique_lock<std::mutex> lock( mMutex );
+  while( mRunning )
+  {
+    lock.unlock();
+    IOWorkLoop* pWorkLoop = mpDevice->getWorkLoop();
+    uint64_t period = cIdlePeriodNs;
+    pWorkLoop->closeGate();
+    track();
+    uint64_t now = KernelShim::now();
+    for( size_t i = 0; i < mEngines.size(); ++i )
+    {
+      Engine& e = mEngines[i];
+      cycle( e, now );
+      if( e.running && e.pEngine->sampleRate.whole > 0 )
+        period = min( period, mCycleFrames * 1000000000ULL / e.pEngine->sampleRate.whole );
+    }
+    pWorkLoop->openGate();
+    lock.lock();
+    mCond.wait_for( lock, std::chrono::nanoseconds( period ) );
+  }
+}
+
+// Follows the device's list of engines. Engines that appear are started, as CoreAudio starts
+// an engine for its first client, and engines that have been removed are let go.
+void
+HalClock::track()
+{
+  OSArray* pEngines = mpDevice->audioEngines;
+  for( size_t i = 0; i < mEngines.size(); )
+  {
+    bool found = false;
+    for( unsigned int j = 0; j < pEngines->getCount() && !found; ++j )
+      found = ( pEngines->getObject( j ) == mEngines[i].pEngine );
+    if( found )
+      ++i;
+    else
+    {
+      mEngines[i].pEngine->release();
+      mEngines.erase( mEngines.begin() + i );
+    }
+  }
+  for( unsigned int j = 0; j < pEngines->getCount(); ++j )
+  {
+    IOAudioEngine* pEngine = OSDynamicCast( IOAudioEngine, pEngines->getObject( j ) );
+    bool found = !pEngine;
+    for( size_t i = 0; i < mEngines.size() && !found; ++i )
+      found = ( mEngines[i].pEngine == pEngine );
+    if( found )
+      continue;
+    pEngine->retain();
+    Engine e;
+    e.pEngine = pEngine;
+    std::vector<IOAudioStream*> inputs;
+    for( unsigned int k = 0; k < pEngine->inputStreams->getCount(); ++k )
+      inputs.push_back( OSDynamicCast( IOAudioStream, pEngine->inputStreams->getObject( k ) ) );
+    for( unsigned int k = 0; k < pEngine->outputStreams->getCount(); ++k )
+    {
+      StreamPair pair = { OSDynamicCast( IOAudioStream, pEngine->outputStreams->getObject( k ) ), 0, 0, std::vector<float>() };
+      for( size_t l = 0; l < inputs.size() && !pair.pInput; ++l )
+        if( inputs[l]->getStartingChannelID() == pair.pOutput->getStartingChannelID()
+            && inputs[l]->getFormat()->fNumChannels == pair.pOutput->getFormat()->fNumChannels )
+        {
+          pair.pInput = inputs[l];
+          inputs.erase( inputs.begin() + l );
+        }
+      e.streams.push_back( pair );
+    }
+    for( size_t l = 0; l < inputs.size(); ++l )
+    {
+      StreamPair pair = { 0, inputs[l], 0, std::vector<float>() };
+      e.streams.push_back( pair );
+    }
+    for( size_t k = 0; k < e.streams.size(); ++k )
+    {
+      if( e.streams[k].pOutput )
+        e.streams[k].pOutput->numClients = 1;
+      if( e.streams[k].pInput )
+        e.streams[k].pInput->numClients = 1;
+    }
+    if( pEngine->getState() == kIOAudioEngineStopped )
+      pEngine->startAudioEngine();
+    e.running = false;
+    mEngines.push_back( e );
+  }
+}
+
+// Starts over at the beginning of the buffer, from the engine's current loop, as the HAL
+// does after the engine has been started or reconfigured.
+void
+HalClock::reset( Engine& e )
+{
+  IOAudioEngine* pEngine = e.pEngine;
+  e.running = true;
+  e.configurationChanges = pEngine->configurationChanges;
+  e.loopBase = pEngine->currentLoopCount;
+  e.framesSinceBase = 0;
+  e.position = 0;
+  for( size_t i = 0; i < e.streams.size(); ++i )
+  {
+    StreamPair& pair = e.streams[i];
+    pair.channels = ( pair.pOutput ? pair.pOutput : pair.pInput )->getFormat()->fNumChannels;
+    pair.mix.assign( size_t( pEngine->numSampleFramesPerBuffer ) * pair.channels, 0.0f );
+  }
+}
+
+// Transfers the frames up to the engine's position, as extrapolated from its last time stamp
+// at the nominal rate. Blocks never cross the end of the buffer. A HAL that has fallen more
+// than a buffer behind skips whole buffers.
+void
+HalClock::cycle( Engine& e, uint64_t now )
+{
+  IOAudioEngine* pEngine = e.pEngine;
+  if( pEngine->getState() != kIOAudioEngineRunning )
+  {
+    e.running = false;
+    return;
+  }
+  if( !e.running || e.configurationChanges != pEngine->configurationChanges )
+    reset( e );
+  const uint64_t bufferFrames = pEngine->numSampleFramesPerBuffer, rate = pEngine->sampleRate.whole;
+  if( bufferFrames == 0 || rate == 0 )
+    return;
+  uint64_t sinceStamp = now > pEngine->lastLoopTime ? ( now - pEngine->lastLoopTime ) * rate / 1000000000ULL : 0;
+  uint64_t target = UInt32( pEngine->currentLoopCount - e.loopBase ) * bufferFrames + min( sinceStamp, bufferFrames );
+  if( target <= e.framesSinceBase )
+    return;
+  uint64_t frames = target - e.framesSinceBase;
+  if( frames > bufferFrames )
+  {
+    uint64_t skipped = frames - frames % bufferFrames;
+    e.framesSinceBase += skipped;
+    frames -= skipped;
+  }
+  while( frames > 0 )
+  {
+    UInt32 n = UInt32( min( frames, bufferFrames - e.position ) );
+    for( size_t i = 0; i < e.streams.size(); ++i )
+      transfer( e, e.streams[i], n );
+    e.position = UInt32( ( e.position + n ) % bufferFrames );
+    e.framesSinceBase += n;
+    frames -= n;
+  }
+}
+
+// Input is converted into the mix buffer at the block's position, where the output is then
+// clipped from.
+void
+HalClock::transfer( Engine& e, StreamPair& pair, UInt32 frames )
+{
+  float* pMix = &pair.mix[size_t( e.position ) * pair.channels];
+  if( pair.pInput )
+    e.pEngine->convertInputSamples( pair.pInput->getSampleBuffer(), pMix, e.position, frames,
+      pair.pInput->getFormat(), pair.pInput );
+  if( !pair.pOutput )
+    return;
+  if( !mLoopback || !pair.pInput )
+    ::memset( pMix, 0, size_t( frames ) * pair.channels * sizeof(float) );
+  e.pEngine->clipOutputSamples( &pair.mix[0], pair.pOutput->getSampleBuffer(), e.position, frames,
+    pair.pOutput->getFormat(), pair.pOutput );
+}
@@ -0,0 +1,61 @@
+#ifndef HAL_CLOCK_H
+#define HAL_CLOCK_H
+
+// Plays the part of the CoreAudio HAL with a single client: starts each engine of the device
+// as it appears, and runs its I/O cycles in real time, following the engine's time stamps as
+// the HAL does. With loopback, each engine's playback streams play what its record streams
+// have recorded, so a duplex device node works as a clocked pipe. Otherwise, playback streams
+// play silence.
+
+#include "AudioShim.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class HalClock
+{
+public:
+  HalClock( IOAudioDevice* pDevice, int cycleFrames, bool loopback );
+  ~HalClock();
+  void start();
+  // Lets go of all engines, which keep running.
+  void stop();
+
+private:
+  // An output and an input stream with the same starting channel and width, either of which
+  // may be missing, and the HAL's mix buffer between them.
+  struct StreamPair
+  {
+    IOAudioStream* pOutput, * pInput;
+    int channels;
+    std::vector<float> mix;
+  };
+  struct Engine
+  {
+    IOAudioEngine* pEngine;
+    std::vector<StreamPair> streams;
+    bool running;
+    UInt32 configurationChanges;
+    UInt32 loopBase;
+    uint64_t framesSinceBase;
+    UInt32 position;
+  };
+
+  void run();
+  void track();
+  void reset( Engine& );
+  void cycle( Engine&, uint64_t now );
+  void transfer( Engine&, StreamPair&, UInt32 frames );
+
+  IOAudioDevice* mpDevice;
+  int mCycleFrames;
+  bool mLoopback;
+  std::vector<Engine> mEngines;
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  bool mRunning;
+};
+
+#endif // HAL_CLOCK_H
@@ -0,0 +1,171 @@
+// vpcmd's runtime, see Runtime.h.
+
+#include "Runtime.h"
+#include <time.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+
+std::mutex sTimersMutex;
+std::condition_variable sTimersCond;
+std::vector<IOTimerEventSource*> sTimers;
+std::thread sTimerThread;
+bool sTimersRunning = false;
+
+// Fires each timer with its work loop's gate closed. The gate is taken before the timer, so
+// a timer that is cancelled or rearmed while the thread waits for the gate does not fire.
+void
+runTimers()
+{
+  std::unique_lock<std::mutex> lock( sTimersMutex );
+  while( sTimersRunning )
+  {
+    IOTimerEventSource* pNext = 0;
+    for( size_t i = 0; i < sTimers.size(); ++i )
+      if( sTimers[i]->armed() && ( !pNext || sTimers[i]->deadline() < pNext->deadline() ) )
+        pNext = sTimers[i];
+    uint64_t now = KernelShim::now();
+    if( !pNext )
+    {
+      sTimersCond.wait( lock );
+      continue;
+    }
+    if( pNext->deadline() > now )
+    {
+      sTimersCond.wait_for( lock, std::chrono::nanoseconds( pNext->deadline() - now ) );
+      continue;
+    }
+    IOWorkLoop* pWorkLoop = pNext->getWorkLoop();
+    if( !pWorkLoop )
+    {
+      pNext->takeIfDue( now ); // a timer without a work loop cannot fire
+      continue;
+    }
+    pNext->retain();
+    pWorkLoop->retain();
+    lock.unlock();
+    pWorkLoop->closeGate();
+    bool due;
+    {
+      std::lock_guard<std::mutex> timersLock( sTimersMutex );
+      due = pNext->takeIfDue( KernelShim::now() );
+    }
+    if( due )
+      pNext->fire();
+    pWorkLoop->openGate();
+    pNext->release();
+    pWorkLoop->release();
+    lock.lock();
+  }
+}
+
+} // namespace
+
+namespace Runtime
+{
+
+void
+startTimers()
+{
+  std::lock_guard<std::mutex> lock( sTimersMutex );
+  if( sTimersRunning )
+    return;
+  sTimersRunning = true;
+  sTimerThread = std::thread( runTimers );
+}
+
+void
+stopTimers()
+{
+  {
+    std::lock_guard<std::mutex> lock( sTimersMutex );
+    if( !sTimersRunning )
+      return;
+    sTimersRunning = false;
+    sTimersCond.notify_all();
+  }
+  sTimerThread.join();
+}
+
+} // namespace Runtime
+
+namespace KernelShim
+{
+
+uint64_t
+now()
+{
+  struct timespec t;
+  ::clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+} // namespace KernelShim
+
+void
+IOSleep( unsigned ms )
+{
+  std::this_thread::sleep_for( std::chrono::milliseconds( ms ) );
+}
+
+IOWorkLoop::IOWorkLoop() : mpGate( new std::recursive_mutex ) {}
+
+void
+IOWorkLoop::free()
+{
+  delete static_cast<std::recursive_mutex*>( mpGate );
+  OSObject::free();
+}
+
+void IOWorkLoop::closeGate() { static_cast<std::recursive_mutex*>( mpGate )->lock(); }
+void IOWorkLoop::openGate() { static_cast<std::recursive_mutex*>( mpGate )->unlock(); }
+
+// Timers
+IOTimerEventSource*
+IOTimerEventSource::timerEventSource( OSObject* pOwner, Action action )
+{
+  IOTimerEventSource* p = new IOTimerEventSource;
+  p->mpOwner = pOwner;
+  p->mAction = action;
+  p->mDeadline = 0;
+  p->mArmed = false;
+  std::lock_guard<std::mutex> lock( sTimersMutex );
+  sTimers.push_back( p );
+  return p;
+}
+
+IOReturn
+IOTimerEventSource::wakeAtTime( AbsoluteTime t )
+{
+  std::lock_guard<std::mutex> lock( sTimersMutex );
+  mDeadline = t;
+  mArmed = true;
+  sTimersCond.notify_all();
+  return kIOReturnSuccess;
+}
+
+void
+IOTimerEventSource::cancelTimeout()
+{
+  std::lock_guard<std::mutex> lock( sTimersMutex );
+  mArmed = false;
+}
+
+void
+IOTimerEventSource::free()
+{
+  {
+    std::lock_guard<std::mutex> lock( sTimersMutex );
+    for( size_t i = 0; i < sTimers.size(); ++i )
+      if( sTimers[i] == this )
+      {
+        sTimers.erase( sTimers.begin() + i );
+        break;
+      }
+  }
+  IOEventSource::free();
+}
@@ -0,0 +1,16 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+// vpcmd's runtime for the stand-ins in Host/include. Time is the monotonic clock, work loop
+// gates are recursive mutexes, and timers fire on a thread of their own. The driver's own
+// locks and wait queues are in Host/PosixSynchronization.cpp.
+
+#include "KernelShim.h"
+
+namespace Runtime
+{
+  void startTimers();
+  void stopTimers();
+}
+
+#endif // RUNTIME_H
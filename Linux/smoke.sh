@@ -0,0 +1,83 @@
+#!/bin/sh
+# Smoke test of vpcmd: starts the daemon, creates a duplex device through /dev/vpcmctl, writes
+# a pattern into the device's node and reads it back through the loopback, and deletes the
+# device again. Needs root privileges and the cuse module, and exits with status 77 (skipped)
+# without them, or while another daemon is running.
+#
+# usage: smoke.sh [path to vpcmd]
+
+VPCMD=${1:-./vpcmd}
+NAME=smoke$$
+TMP=${TMPDIR:-/tmp}/vpcmd-smoke.$$
+PID=
+
+skip() { echo "smoke.sh: SKIP: $*" >&2; exit 77; }
+fail() { echo "smoke.sh: FAILED: $*" >&2; exit 1; }
+
+cleanup()
+{
+  exec 3>&- 2>/dev/null
+  [ -n "$PID" ] && kill "$PID" 2>/dev/null && wait "$PID" 2>/dev/null
+  rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Waits up to five seconds for a condition.
+waitfor()
+{
+  n=0
+  until eval "$1"; do
+    n=$((n + 1))
+    [ $n -gt 50 ] && return 1
+    sleep 0.1
+  done
+}
+
+[ -x "$VPCMD" ] || fail "$VPCMD not found, build it with make first"
+[ "$(id -u)" -eq 0 ] || skip "needs root privileges"
+[ -e /dev/cuse ] || modprobe cuse 2>/dev/null
+[ -e /dev/cuse ] || skip "no /dev/cuse, the cuse module is not available"
+[ -e /dev/vpcmctl ] && skip "/dev/vpcmctl exists, another vpcmd is running"
+mkdir -p "$TMP" || fail "cannot create $TMP"
+
+"$VPCMD" --group=root &
+PID=$!
+waitfor '[ -c /dev/vpcmctl ]' || fail "/dev/vpcmctl did not appear"
+
+# create
+echo create --duplex --format=s16 --channels=2 --rate=48000 "$NAME" >/dev/vpcmctl || fail "create"
+grep -q "\"$NAME\"" /dev/vpcmctl || fail "$NAME is not listed"
+echo name "$NAME" >/dev/vpcmctl || fail "name"
+NODE=$(cat /dev/vpcmctl)
+waitfor '[ -c "$NODE" ]' || fail "device node '$NODE' did not appear"
+
+# write and read back: a second of frames that hold 0x1234 in each channel
+i=0
+while [ $i -lt 12 ]; do
+  printf '\064\022\064\022\064\022\064\022\064\022\064\022\064\022\064\022' >>"$TMP/frames"
+  i=$((i + 1))
+done
+i=0
+while [ $i -lt 1000 ]; do
+  cat "$TMP/frames" >>"$TMP/pattern"
+  i=$((i + 1))
+done
+exec 3<>"$NODE" || fail "open $NODE"
+cat "$TMP/pattern" >&3 &
+WRITER=$!
+head -c 192000 <&3 >"$TMP/read" &
+READER=$!
+waitfor '! kill -0 $READER 2>/dev/null' || { kill $READER $WRITER; fail "reading $NODE timed out"; }
+[ "$(wc -c <"$TMP/read")" -eq 192000 ] || fail "short read from $NODE"
+od -An -tx1 -v "$TMP/read" | grep -q '34 12 34 12 34 12 34 12' || fail "pattern not read back from $NODE"
+kill $WRITER 2>/dev/null
+wait $WRITER 2>/dev/null
+exec 3>&-
+
+# delete
+echo delete "$NAME" >/dev/vpcmctl || fail "delete"
+grep -q "\"$NAME\"" /dev/vpcmctl && fail "$NAME is still listed"
+waitfor '[ ! -e "$NODE" ]' || fail "$NODE still exists"
+
+echo "smoke.sh: passed"
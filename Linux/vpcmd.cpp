@@ -0,0 +1,120 @@
+// vpcmd: the vpcm driver as a Linux daemon, with the same /dev/vpcmctl and /dev/vpcmN device
+// nodes as on macOS.
+//
+// The driver sources are compiled against the stand-ins in Host/include, with the threaded
+// runtime in Runtime.cpp. Device nodes are CUSE devices (CuseDeviceNode.cpp), and HalClock
+// plays the part of CoreAudio, which starts each device as it is created and runs its I/O
+// cycles in real time. vpcmd runs in the foreground until it receives SIGINT or SIGTERM. It
+// needs the cuse kernel module and permission to open /dev/cuse, i.e. usually root.
+//
+// Build, from the repository root: make -C Linux
+
+#include "CuseDeviceNode.h"
+#include "HalClock.h"
+#include "Runtime.h"
+#include "VpcmAudioDevice.h"
+#include <grp.h>
+#include <signal.h>
+
+namespace
+{
+
+const char* cUsage =
+  "usage: vpcmd [options]\n"
+  "  --group=<name>         group that may create devices through /dev/vpcmctl (audio)\n"
+  "  --cycle-frames=<n>     frames per I/O cycle (512)\n"
+  "  --no-loopback          play silence rather than each device's record data\n"
+  "  --debug                print each request to a device node\n";
+
+struct Options
+{
+  const char* group;
+  int cycleFrames;
+  bool loopback, debug;
+};
+
+bool
+parseOptions( int argc, char** argv, Options& o )
+{
+  o.group = "audio";
+  o.cycleFrames = 512;
+  o.loopback = true;
+  o.debug = false;
+  for( int i = 1; i < argc; ++i )
+  {
+    const char* arg = argv[i];
+    const char* value = ::strchr( arg, '=' );
+    value = value ? value + 1 : "";
+    if( !::strncmp( arg, "--group=", 8 ) )
+      o.group = value;
+    else if( !::strncmp( arg, "--cycle-frames=", 15 ) )
+      o.cycleFrames = ::atoi( value );
+    else if( !::strcmp( arg, "--no-loopback" ) )
+      o.loopback = false;
+    else if( !::strcmp( arg, "--debug" ) )
+      o.debug = true;
+    else
+      return false;
+  }
+  return o.cycleFrames > 0;
+}
+
+} // namespace
+
+int
+main( int argc, char** argv )
+{
+  Options options;
+  if( !parseOptions( argc, argv, options ) )
+  {
+    ::fprintf( stderr, "%s", cUsage );
+    return 2;
+  }
+  struct group* pGroup = ::getgrnam( options.group );
+  if( !pGroup )
+  {
+    ::fprintf( stderr, "vpcmd: no group named %s\n", options.group );
+    return 2;
+  }
+  // Signals are blocked before any thread starts, so that only sigwait() sees them.
+  sigset_t signals;
+  ::sigemptyset( &signals );
+  ::sigaddset( &signals, SIGINT );
+  ::sigaddset( &signals, SIGTERM );
+  ::pthread_sigmask( SIG_BLOCK, &signals, 0 );
+
+  int err = CuseDispatcher::start( pGroup->gr_gid, options.debug );
+  if( err )
+  {
+    ::fprintf( stderr, "vpcmd: %s\n", ::strerror( err ) );
+    return 1;
+  }
+  Runtime::startTimers();
+  IOAudioDevice* pDevice = new VpcmAudioDevice;
+  if( !pDevice->init( 0 ) || !pDevice->initHardware( 0 ) )
+  {
+    ::fprintf( stderr, "vpcmd: could not create the control node\n" );
+    pDevice->release();
+    Runtime::stopTimers();
+    CuseDispatcher::stop();
+    return 1;
+  }
+  IOWorkLoop* pWorkLoop = pDevice->getWorkLoop();
+  pWorkLoop->retain();
+  {
+    HalClock clock( pDevice, options.cycleFrames, options.loopback );
+    clock.start();
+    int signal = 0;
+    ::sigwait( &signals, &signal );
+    clock.stop();
+  }
+  // Engines are terminated as when the kext is unloaded, which waits for open device nodes
+  // to be closed. The gate keeps timers from firing meanwhile.
+  pWorkLoop->closeGate();
+  pDevice->release();
+  pWorkLoop->openGate();
+  pWorkLoop->release();
+  Runtime::stopTimers();
+  CuseDispatcher::stop();
+  return 0;
+}
@@ -0,0 +1,261 @@
+#include "Codecs.h"
+
+namespace Codecs
+{
+
+namespace {
+
+const short sULawToInt16[256] =
+{
+  -32124, -31100, -30076, -29052, -28028, -27004, -25980, -24956,
+  -23932, -22908, -21884, -20860, -19836, -18812, -17788, -16764,
+  -15996, -15484, -14972, -14460, -13948, -13436, -12924, -12412,
+  -11900, -11388, -10876, -10364,  -9852,  -9340,  -8828,  -8316,
+   -7932,  -7676,  -7420,  -7164,  -6908,  -6652,  -6396,  -6140,
+   -5884,  -5628,  -5372,  -5116,  -4860,  -4604,  -4348,  -4092,
+   -3900,  -3772,  -3644,  -3516,  -3388,  -3260,  -3132,  -3004,
+   -2876,  -2748,  -2620,  -2492,  -2364,  -2236,  -2108,  -1980,
+   -1884,  -1820,  -1756,  -1692,  -1628,  -1564,  -1500,  -1436,
+   -1372,  -1308,  -1244,  -1180,  -1116,  -1052,   -988,   -924,
+    -876,   -844,   -812,   -780,   -748,   -716,   -684,   -652,
+    -620,   -588,   -556,   -524,   -492,   -460,   -428,   -396,
+    -372,   -356,   -340,   -324,   -308,   -292,   -276,   -260,
+    -244,   -228,   -212,   -196,   -180,   -164,   -148,   -132,
+    -120,   -112,   -104,    -96,    -88,    -80,    -72,    -64,
+     -56,    -48,    -40,    -32,    -24,    -16,     -8,      0,
+   32124,  31100,  30076,  29052,  28028,  27004,  25980,  24956,
+   23932,  22908,  21884,  20860,  19836,  18812,  17788,  16764,
+   15996,  15484,  14972,  14460,  13948,  13436,  12924,  12412,
+   11900,  11388,  10876,  10364,   9852,   9340,   8828,   8316,
+    7932,   7676,   7420,   7164,   6908,   6652,   6396,   6140,
+    5884,   5628,   5372,   5116,   4860,   4604,   4348,   4092,
+    3900,   3772,   3644,   3516,   3388,   3260,   3132,   3004,
+    2876,   2748,   2620,   2492,   2364,   2236,   2108,   1980,
+    1884,   1820,   1756,   1692,   1628,   1564,   1500,   1436,
+    1372,   1308,   1244,   1180,   1116,   1052,    988,    924,
+     876,    844,    812,    780,    748,    716,    684,    652,
+     620,    588,    556,    524,    492,    460,    428,    396,
+     372,    356,    340,    324,    308,    292,    276,    260,
+     244,    228,    212,    196,    180,    164,    148,    132,
+     120,    112,    104,     96,     88,     80,     72,     64,
+      56,     48,     40,     32,     24,     16,      8,      0,
+};
+
+const short sALawToInt16[256] =
+{
+   -5504,  -5248,  -6016,  -5760,  -4480,  -4224,  -4992,  -4736,
+   -7552,  -7296,  -8064,  -7808,  -6528,  -6272,  -7040,  -6784,
+   -2752,  -2624,  -3008,  -2880,  -2240,  -2112,  -2496,  -2368,
+   -3776,  -3648,  -4032,  -3904,  -3264,  -3136,  -3520,  -3392,
+  -22016, -20992, -24064, -23040, -17920, -16896, -19968, -18944,
+  -30208, -29184, -32256, -31232, -26112, -25088, -28160, -27136,
+  -11008, -10496, -12032, -11520,  -8960,  -8448,  -9984,  -9472,
+  -15104, -14592, -16128, -15616, -13056, -12544, -14080, -13568,
+    -344,   -328,   -376,   -360,   -280,   -264,   -312,   -296,
+    -472,   -456,   -504,   -488,   -408,   -392,   -440,   -424,
+     -88,    -72,   -120,   -104,    -24,     -8,    -56,    -40,
+    -216,   -200,   -248,   -232,   -152,   -136,   -184,   -168,
+   -1376,  -1312,  -1504,  -1440,  -1120,  -1056,  -1248,  -1184,
+   -1888,  -1824,  -2016,  -1952,  -1632,  -1568,  -1760,  -1696,
+    -688,   -656,   -752,   -720,   -560,   -528,   -624,   -592,
+    -944,   -912,  -1008,   -976,   -816,   -784,   -880,   -848,
+    5504,   5248,   6016,   5760,   4480,   4224,   4992,   4736,
+    7552,   7296,   8064,   7808,   6528,   6272,   7040,   6784,
+    2752,   2624,   3008,   2880,   2240,   2112,   2496,   2368,
+    3776,   3648,   4032,   3904,   3264,   3136,   3520,   3392,
+   22016,  20992,  24064,  23040,  17920,  16896,  19968,  18944,
+   30208,  29184,  32256,  31232,  26112,  25088,  28160,  27136,
+   11008,  10496,  12032,  11520,   8960,   8448,   9984,   9472,
+   15104,  14592,  16128,  15616,  13056,  12544,  14080,  13568,
+     344,    328,    376,    360,    280,    264,    312,    296,
+     472,    456,    504,    488,    408,    392,    440,    424,
+      88,     72,    120,    104,     24,      8,     56,     40,
+     216,    200,    248,    232,    152,    136,    184,    168,
+    1376,   1312,   1504,   1440,   1120,   1056,   1248,   1184,
+    1888,   1824,   2016,   1952,   1632,   1568,   1760,   1696,
+     688,    656,    752,    720,    560,    528,    624,    592,
+     944,    912,   1008,    976,    816,    784,    880,    848,
+};
+
+// Segment number of a 15-bit magnitude, indexed by its upper 8 bits.
+const unsigned char sSegment[256] =
+{
+  0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+  6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+  6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+  6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+};
+
+const int cULawBias = 0x84, cG711Clip = 32635;
+
+const signed char sAdpcmIndex[16] =
+{
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+const short sAdpcmStep[89] =
+{
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+  19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+  5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+template<class T> T min( T a, T b ) { return a < b ? a : b; }
+template<class T> T max( T a, T b ) { return a > b ? a : b; }
+
+inline void
+adpcmUpdate( AdpcmState& s, int nibble, int diff )
+{
+  s.predictor = max( -32768, min( 32767, s.predictor + ( ( nibble & 8 ) ? -diff : diff ) ) );
+  s.index = max( 0, min( 88, s.index + sAdpcmIndex[nibble] ) );
+}
+
+inline int
+adpcmEncode( AdpcmState& s, int sample )
+{
+  int step = sAdpcmStep[s.index],
+      diff = sample - s.predictor,
+      nibble = 0;
+  if( diff < 0 )
+  {
+    nibble = 8;
+    diff = -diff;
+  }
+  int vpdiff = step >> 3;
+  for( int bit = 4; bit; bit >>= 1, step >>= 1 )
+  {
+    if( diff >= step )
+    {
+      nibble |= bit;
+      diff -= step;
+      vpdiff += step;
+    }
+  }
+  adpcmUpdate( s, nibble, vpdiff );
+  return nibble;
+}
+
+inline short
+adpcmDecode( AdpcmState& s, int nibble )
+{
+  int step = sAdpcmStep[s.index],
+      vpdiff = step >> 3;
+  if( nibble & 4 )
+    vpdiff += step;
+  if( nibble & 2 )
+    vpdiff += step >> 1;
+  if( nibble & 1 )
+    vpdiff += step >> 2;
+  adpcmUpdate( s, nibble, vpdiff );
+  return s.predictor;
+}
+
+} // namespace
+
+void
+Int16ToULawCopy( unsigned char* outData, const short* inData, unsigned int inCount )
+{
+  for( const short* p = inData; p < inData + inCount; ++p )
+  {
+    int s = *p, sign = 0;
+    if( s < 0 )
+    {
+      s = -s;
+      sign = 0x80;
+    }
+    s = min( s, cG711Clip ) + cULawBias;
+    int seg = sSegment[( s >> 7 ) & 0xff];
+    *outData++ = ~( sign | ( seg << 4 ) | ( ( s >> ( seg + 3 ) ) & 0x0f ) );
+  }
+}
+
+void
+ULawToInt16Copy( short* outData, const unsigned char* inData, unsigned int inCount )
+{
+  for( const unsigned char* p = inData; p < inData + inCount; ++p )
+    *outData++ = sULawToInt16[*p];
+}
+
+void
+Int16ToALawCopy( unsigned char* outData, const short* inData, unsigned int inCount )
+{
+  for( const short* p = inData; p < inData + inCount; ++p )
+  {
+    int s = *p, sign = 0x80;
+    if( s < 0 )
+    {
+      s = -s;
+      sign = 0;
+    }
+    s = min( s, cG711Clip );
+    int a = 0;
+    if( s >= 256 )
+    {
+      int seg = sSegment[( s >> 8 ) & 0x7f] + 1;
+      a = ( seg << 4 ) | ( ( s >> ( seg + 3 ) ) & 0x0f );
+    }
+    else
+      a = s >> 4;
+    *outData++ = a ^ ( sign ^ 0x55 );
+  }
+}
+
+void
+ALawToInt16Copy( short* outData, const unsigned char* inData, unsigned int inCount )
+{
+  for( const unsigned char* p = inData; p < inData + inCount; ++p )
+    *outData++ = sALawToInt16[*p];
+}
+
+void
+Int16ToImaAdpcmCopy( unsigned char* outData, const short* inData, unsigned int inCount, AdpcmState* ioState, int inChannels, int inChannel )
+{
+  AdpcmState* s = ioState + inChannel, *end = ioState + inChannels;
+  for( const short* p = inData; p + 1 < inData + inCount; p += 2 )
+  {
+    int lo = adpcmEncode( *s, p[0] );
+    if( ++s == end )
+      s = ioState;
+    int hi = adpcmEncode( *s, p[1] );
+    if( ++s == end )
+      s = ioState;
+    *outData++ = lo | ( hi << 4 );
+  }
+}
+
+void
+ImaAdpcmToInt16Copy( short* outData, const unsigned char* inData, unsigned int inCount, AdpcmState* ioState, int inChannels, int inChannel )
+{
+  AdpcmState* s = ioState + inChannel, *end = ioState + inChannels;
+  for( short* q = outData; q + 1 < outData + inCount; q += 2 )
+  {
+    unsigned char b = *inData++;
+    q[0] = adpcmDecode( *s, b & 0x0f );
+    if( ++s == end )
+      s = ioState;
+    q[1] = adpcmDecode( *s, b >> 4 );
+    if( ++s == end )
+      s = ioState;
+  }
+}
+
+} // namespace
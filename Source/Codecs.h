@@ -0,0 +1,26 @@
+#ifndef CODECS_H
+#define CODECS_H
+
+namespace Codecs
+{
+// G.711 mu-law and A-law, one byte per sample.
+void Int16ToULawCopy( unsigned char*, const short*, unsigned int count );
+void ULawToInt16Copy( short*, const unsigned char*, unsigned int count );
+void Int16ToALawCopy( unsigned char*, const short*, unsigned int count );
+void ALawToInt16Copy( short*, const unsigned char*, unsigned int count );
+
+// IMA ADPCM, two samples per byte, first sample in the low nibble. The count must be even.
+// Samples are interleaved over the given number of channels, each of which has its own state,
+// and the first sample belongs to the given channel.
+// A state must be reset whenever encoder and decoder may have lost sync.
+struct AdpcmState
+{
+  int predictor, index;
+  void reset() { predictor = 0; index = 0; }
+};
+void Int16ToImaAdpcmCopy( unsigned char*, const short*, unsigned int count, AdpcmState*, int channels, int channel );
+void ImaAdpcmToInt16Copy( short*, const unsigned char*, unsigned int count, AdpcmState*, int channels, int channel );
+
+} // namespace
+
+#endif // CODECS_H
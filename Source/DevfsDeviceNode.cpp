@@ -66,7 +66,7 @@ DevfsDeviceNode::devCreate( const char* pNamePattern, int mode, int uid, int gid
   mMode = mode;
 
   int minor = 0;
-  while( sInstances[minor] && minor < sMaxInstances )
+  while( minor < sMaxInstances && sInstances[minor] )
     ++minor;
   if( minor >= sMaxInstances )
     return ENOMEM;
@@ -10,6 +10,8 @@
 # define GID_STAFF 20
 #endif
 
+// Device nodes of all kinds share this many minor numbers: each stream of a device, up to
+// MAX_STREAMS per device, takes one, and so does each aggregate.
 #define MAX_INSTANCES 32
 
 class DevfsDeviceNode
@@ -13,45 +13,6 @@ const unsigned int expShift = 23,
 template<class T> T min( T a, T b ) { return a < b ? a : b; }
 template<class T> T max( T a, T b ) { return a > b ? a : b; }
 
-// This function uses fast integer operations in order to scale unit-range floating-point values
-// by factors of 2^(k/2) for negative integer k.
-// This corresponds to 16 steps between -96 and 0 dB, and is sufficient for a simple volume control.
-void
-Scale( float* ioData, unsigned int inCount, signed char k )
-{
-  const int kHalf = -k >> 1, kOdd = k & 1;
-  union { float* f; unsigned int* i; } p = { ioData };
-  while( p.f < ioData + inCount )
-  {
-    int exp = ( *p.i & ~signMask ) >> expShift;
-    if( exp ) // if( fabs(*p.f) > 1.1754942e-38 )
-    {
-      int expAdd = -kHalf;
-      if( kOdd )
-      {
-        unsigned int mant = *p.i & mantMask;
-        mant |= implicitBit;
-                                             // assert( fabs(256/181-sqrt(2)) < 2e-4 );
-        mant = ( mant * 181 + (1<<7) ) >> 8; // mant = round( mant / sqrt(2) );
-        if( !( mant & implicitBit ) )
-        {
-          mant <<= 1;
-          --expAdd;
-        }
-        mant &= mantMask;
-        *p.i = ( *p.i & ~mantMask ) | mant;
-      }
-      if( expAdd )
-      {
-        exp += expAdd;
-        *p.i &= ~expMask;
-        *p.i |= exp << expShift;
-      }
-    }
-    ++p.f;
-  }
-}
-
 void
 Clip( float* ioData, unsigned int inCount )
 {
@@ -79,7 +40,7 @@ FloatToInt16Copy( short* outData, const float* inData, unsigned int inCount )
       unsigned int mant = 0;
       if( exp >= expBias )
         mant = implicitBit;
-      else
+      else if( expBias - exp < 32 )
       {
         mant = ( *p.i & mantMask ) | implicitBit;
         mant >>= expBias - exp;
@@ -127,5 +88,483 @@ Int16ToFloatCopy( float* outData, const short* inData, unsigned int inCount )
   }
 }
 
+namespace {
+
+typedef unsigned long long uint64;
+
+// Rounds to nearest when dropping the s lowest bits.
+inline unsigned int
+roundShift( unsigned int v, int s )
+{
+  return s ? ( ( v >> ( s - 1 ) ) + 1 ) >> 1 : v;
+}
+
+// Converts a float bit pattern into a signed integer of the given number of bits,
+// saturating at full scale.
+template<int Bits>
+inline int
+floatBitsToInt( unsigned int i )
+{
+  const unsigned int maxPos = ( 1u << ( Bits - 1 ) ) - 1;
+  unsigned int exp = ( i >> expShift ) & 0xff, mag = 0;
+  if( exp >= expBias )
+    mag = maxPos + 1;
+  else if( exp && expBias - exp < 32 )
+  {
+    mag = ( ( i & mantMask ) | implicitBit ) << 7; // 1.0 -> 1 << 30
+    mag >>= expBias - exp - 1;                     // 1.0 -> 1 << 31
+    mag = roundShift( mag, 32 - Bits );
+  }
+  if( i & signMask )
+    return int( 0u - min( mag, maxPos + 1 ) );
+  return int( min( mag, maxPos ) );
+}
+
+// Converts a left-justified 32-bit integer into a float bit pattern.
+inline unsigned int
+intToFloatBits( int v )
+{
+  if( !v )
+    return 0;
+  unsigned int sign = v < 0 ? signMask : 0,
+               u = sign ? 0u - (unsigned int)v : (unsigned int)v;
+  int msb = 31 - __builtin_clz( u );
+  unsigned int exp = expBias + msb - 31, mant = 0;
+  if( msb > int( expShift ) )
+  {
+    mant = roundShift( u, msb - expShift );
+    if( mant & ( implicitBit << 1 ) )
+    {
+      mant >>= 1;
+      ++exp;
+    }
+  }
+  else
+    mant = u << ( expShift - msb );
+  return sign | ( exp << expShift ) | ( mant & mantMask );
+}
+
+template<int Bytes, bool BigEndian>
+inline void
+store( unsigned char* p, uint64 v )
+{
+  for( int i = 0; i < Bytes; ++i )
+    p[BigEndian ? Bytes - 1 - i : i] = (unsigned char)( v >> ( 8 * i ) );
+}
+
+template<int Bytes, bool BigEndian>
+inline uint64
+load( const unsigned char* p )
+{
+  uint64 v = 0;
+  for( int i = 0; i < Bytes; ++i )
+    v |= uint64( p[BigEndian ? Bytes - 1 - i : i] ) << ( 8 * i );
+  return v;
+}
+
+template<int Bytes, bool BigEndian>
+void
+floatToIntCopy( unsigned char* q, const unsigned int* p, unsigned int count )
+{
+  for( const unsigned int* end = p + count; p < end; ++p, q += Bytes )
+    store<Bytes, BigEndian>( q, (unsigned int)floatBitsToInt<8 * Bytes>( *p ) );
+}
+
+template<int Bytes, bool BigEndian>
+void
+intToFloatCopy( unsigned int* q, const unsigned char* p, unsigned int count )
+{
+  for( unsigned int* end = q + count; q < end; ++q, p += Bytes )
+    *q = intToFloatBits( int( (unsigned int)load<Bytes, BigEndian>( p ) << ( 32 - 8 * Bytes ) ) );
+}
+
+// Converts a float bit pattern into Q27 like floatBitsToInt<28>, without branches.
+inline int
+floatBitsToQ27( unsigned int i )
+{
+  const int maxPos = ( 1 << 27 ) - 1;
+  int exp = ( i >> expShift ) & 0xff;
+  unsigned int mant = ( ( i & mantMask ) | ( exp ? implicitBit : 0 ) ) << 7; // 1.0 -> 1 << 30
+  int s = min( max( int( expBias ) - exp - 1, 0 ), 31 );
+  int mag = int( ( ( mant >> s >> 3 ) + 1 ) >> 1 );
+  mag = exp >= int( expBias ) ? maxPos + 1 : mag;
+  return ( i & signMask ) ? -min( mag, maxPos + 1 ) : min( mag, maxPos );
+}
+
+// Returns triangular noise of -1 .. 1 LSB in Q12, plus half an LSB for rounding. The noise is a
+// hash of the sample's position, so that there is no recurrence between samples.
+inline int
+ditherNoise( unsigned int i )
+{
+  i = ( i ^ ( i >> 16 ) ) * 0x85ebca6bu; // murmur3 finalizer
+  i = ( i ^ ( i >> 13 ) ) * 0xc2b2ae35u;
+  i ^= i >> 16;
+  return int( i & 0xfff ) + int( ( i >> 12 ) & 0xfff ) - ( 1 << 12 ) + ( 1 << 11 );
+}
+
+template<bool BigEndian>
+inline void
+storeInt16( unsigned char* q, int y )
+{ // bytewise like store<2>, but on 32 bits, which vectorizes
+  q[BigEndian] = (unsigned char)y;
+  q[!BigEndian] = (unsigned char)( y >> 8 );
+}
+
+template<bool BigEndian, bool Shaped>
+void
+floatToInt16DitherCopy( unsigned char* q, const unsigned int* p, unsigned int count, DitherState& ioState )
+{
+  const int shift = 12, // Q27 -> Q15
+            maxError = 2 << shift;
+  const unsigned int seed = ioState.seed;
+  const int channels = ioState.channels;
+  if( Shaped )
+    for( int c = 0; c < channels; ++c )
+    { // the error feedback is serial, so each channel keeps its error in a register
+      int e = ioState.pError[c];
+      unsigned int i = seed + c;
+      unsigned char* out = q + 2 * c;
+      for( const unsigned int* in = p + c, *end = p + count; in < end; in += channels, out += 2 * channels, i += channels )
+      {
+        int w = floatBitsToQ27( *in ) - e,
+            y = max( -0x8000, min( 0x7fff, ( w + ditherNoise( i ) ) >> shift ) );
+        e = max( -maxError, min( maxError, y * ( 1 << shift ) - w ) );
+        storeInt16<BigEndian>( out, y );
+      }
+      ioState.pError[c] = e;
+    }
+  else
+  {
+    unsigned int i = seed;
+    for( const unsigned int* end = p + count; p < end; ++p, q += 2, ++i )
+      storeInt16<BigEndian>( q, max( -0x8000, min( 0x7fff, ( floatBitsToQ27( *p ) + ditherNoise( i ) ) >> shift ) ) );
+  }
+  ioState.seed = seed + count;
+}
+
+template<bool BigEndian>
+void
+floatToDoubleCopy( unsigned char* q, const unsigned int* p, unsigned int count )
+{
+  const int mantShift = 52 - expShift;
+  for( const unsigned int* end = p + count; p < end; ++p, q += 8 )
+  {
+    unsigned int exp = ( *p & expMask ) >> expShift;
+    uint64 d = uint64( *p & signMask ) << 32;
+    if( exp == 0xff )
+      d |= uint64( 0x7ff ) << 52 | uint64( *p & mantMask ) << mantShift;
+    else if( exp )
+      d |= uint64( exp - expBias + 1023 ) << 52 | uint64( *p & mantMask ) << mantShift;
+    store<8, BigEndian>( q, d );
+  }
+}
+
+template<bool BigEndian>
+void
+doubleToFloatCopy( unsigned int* q, const unsigned char* p, unsigned int count )
+{
+  const int mantShift = 52 - expShift;
+  for( unsigned int* end = q + count; q < end; ++q, p += 8 )
+  {
+    uint64 d = load<8, BigEndian>( p ),
+           mant = d & ( ( uint64( 1 ) << 52 ) - 1 );
+    unsigned int sign = (unsigned int)( d >> 32 ) & signMask;
+    int exp = int( d >> 52 ) & 0x7ff;
+    if( exp == 0x7ff )
+      *q = sign | expMask | ( mant ? implicitBit >> 1 : 0 );
+    else
+    {
+      exp += int( expBias ) - 1023;
+      unsigned int m = (unsigned int)( ( mant + ( uint64( 1 ) << ( mantShift - 1 ) ) ) >> mantShift );
+      if( m & implicitBit )
+      {
+        m = 0;
+        ++exp;
+      }
+      if( exp >= 0xff )
+        *q = sign | expMask;
+      else if( exp <= 0 )
+        *q = sign;
+      else
+        *q = sign | ( exp << expShift ) | m;
+    }
+  }
+}
+
+// A gain of at most 4 in Q30 fixed point, as a mantissa with its top bit set and an exponent,
+// such that gain = mant * 2^exp / 2^31. A zero gain has a mask of zero, which clears any result.
+struct NormalGain
+{
+  unsigned int mant;
+  int exp;
+  unsigned int mask;
+};
+
+// Constant gains are applied in blocks of up to this many samples.
+const unsigned int cGainBlock = 64;
+
+inline NormalGain
+normalizeGain( unsigned int gain )
+{
+  const int shift = __builtin_clz( gain | 1 ); // 1 for unity gain
+  const NormalGain g = { gain << shift, 1 - shift, gain ? ~0u : 0 };
+  return g;
+}
+
+// Advances a gain by one frame of its ramp, and returns its value.
+inline unsigned int
+rampGain( Gain& g )
+{
+  if( g.value < g.target )
+    g.value += min( g.step, g.target - g.value );
+  else if( g.value > g.target )
+    g.value -= min( g.step, g.value - g.target );
+  return g.value;
+}
+
+// Multiplies a float bit pattern by a normalized gain, rounding to nearest. There are no
+// branches, so that loops over it vectorize. The 24-bit mantissa times the gain's 32 bits is
+// below 2^56, and shifted right by 30 leaves enough bits to round either way with 32-bit
+// operations. A rounded mantissa of 2^24 carries into the exponent, as the float format needs.
+inline unsigned int
+multiplyGain( unsigned int i, NormalGain g )
+{
+  const unsigned int sign = i & signMask, exp = ( i >> expShift ) & 0xff,
+                     r = (unsigned int)( ( uint64( ( i & mantMask ) | implicitBit ) * g.mant ) >> 30 ),
+                     high = r >> 25,
+                     m = high ? ( r + 2 ) >> 2 : ( r + 1 ) >> 1;
+  const int e = int( exp + high ) + g.exp;
+  unsigned int result = sign | ( ( (unsigned int)e << expShift ) + m - implicitBit );
+  result = e > 0 ? result : sign;                  // flush to zero below the normal range
+  result = e < 0xff ? result : ( sign | expMask ); // infinite above it
+  result = exp ? result : 0;                       // zeros and denormals
+  return ( exp == 0xff ? i : result ) & g.mask;    // infinities and NaNs, unless muted
+}
+
+// Gains of 10^(-2^b/40) for attenuations of 2^b half decibels, in Q30.
+const unsigned int sAttenuations[] =
+{
+  1013677647, 956973408, 852903448, 677485290, 427464319, 170176611, 26971175, 677485,
+};
+
+} // namespace
+
+unsigned int
+AttenuationToGain( unsigned int inHalfDecibels )
+{
+  uint64 g = UnityGain;
+  for( unsigned int b = 0; b < sizeof(sAttenuations)/sizeof(*sAttenuations); ++b )
+    if( inHalfDecibels & ( 1 << b ) )
+      g = ( g * sAttenuations[b] + ( 1 << 29 ) ) >> 30;
+  return inHalfDecibels >> sizeof(sAttenuations)/sizeof(*sAttenuations) ? 0 : (unsigned int)g;
+}
+
+void
+SetGainTarget( Gain& ioGain, unsigned int inTarget, unsigned int inFrames )
+{
+  unsigned int diff = inTarget > ioGain.value ? inTarget - ioGain.value : ioGain.value - inTarget;
+  ioGain.target = inTarget;
+  ioGain.step = inFrames ? max<unsigned int>( diff / inFrames, 1 ) : diff;
+}
+
+void
+ApplyGain( float* ioData, unsigned int inCount, unsigned int inChannels, Gain* ioGains )
+{
+  bool unity = true;
+  for( unsigned int c = 0; c < inChannels; ++c )
+    unity = unity && ioGains[c].value == UnityGain && ioGains[c].target == UnityGain;
+  if( unity )
+    return;
+  unsigned int* p = reinterpret_cast<unsigned int*>( ioData ), *end = p + inCount;
+  if( inChannels > cGainBlock )
+  { // frame by frame
+    while( p < end )
+      for( Gain* g = ioGains; g < ioGains + inChannels; ++g, ++p )
+        *p = multiplyGain( *p, normalizeGain( rampGain( *g ) ) );
+    return;
+  }
+  // In blocks of whole frames. The gain of each sample of a block is laid out first, only once
+  // if no channel ramps, so that the multiplication vectorizes for any channel count.
+  bool constant = true;
+  for( unsigned int c = 0; c < inChannels; ++c )
+    constant = constant && ioGains[c].value == ioGains[c].target;
+  const unsigned int block = cGainBlock - cGainBlock % inChannels;
+  NormalGain gains[cGainBlock];
+  if( constant )
+    for( unsigned int i = 0; i < block; ++i )
+      gains[i] = normalizeGain( ioGains[i % inChannels].value );
+  for( ; p < end; p += block )
+  {
+    const unsigned int n = min<unsigned int>( block, (unsigned int)( end - p ) );
+    if( !constant )
+      for( unsigned int i = 0; i < n; )
+        for( Gain* g = ioGains; g < ioGains + inChannels; ++g, ++i )
+          gains[i] = normalizeGain( rampGain( *g ) );
+    for( unsigned int i = 0; i < n; ++i )
+      p[i] = multiplyGain( p[i], gains[i] );
+  }
+}
+
+void
+MeasureLevels( const float* inData, unsigned int inCount, unsigned int inChannels, Levels* ioLevels, int inSets )
+{
+  const unsigned int* p = reinterpret_cast<const unsigned int*>( inData );
+  unsigned int frames = inCount / inChannels;
+  for( unsigned int c = 0; c < inChannels; ++c )
+  {
+    unsigned int peak = 0;
+    uint64 sum = 0;
+    for( const unsigned int* q = p + c, *end = p + inCount; q < end; q += inChannels )
+    {
+      unsigned int mag = *q & ~signMask;
+      peak = max( peak, mag );
+      uint64 v = floatBitsToInt<17>( mag ); // Q16
+      sum += v * v;
+    }
+    for( Levels* l = ioLevels + c; l < ioLevels + inSets * inChannels; l += inChannels )
+    {
+      unsigned int prev = l->peak;
+      while( peak > prev && !__sync_bool_compare_and_swap( &l->peak, prev, peak ) )
+        prev = l->peak;
+      if( l->frames >= Levels::cMaxFrames ) // sum < ( cMaxFrames + frames ) << 32 cannot overflow
+        continue;
+      __sync_fetch_and_add( &l->sumSquares, sum );
+      __sync_fetch_and_add( &l->frames, frames );
+    }
+  }
+}
+
+unsigned int
+Peak( const float* inData, unsigned int inCount )
+{
+  const unsigned int* p = reinterpret_cast<const unsigned int*>( inData );
+  unsigned int peak = 0;
+  for( unsigned int i = 0; i < inCount; ++i )
+    peak = max( peak, p[i] & ~signMask );
+  return floatBitsToInt<25>( peak );
+}
+
+void
+TakeLevels( Levels& ioLevels, unsigned int* outPeak, unsigned int* outRms )
+{
+  unsigned int peak = __sync_fetch_and_and( &ioLevels.peak, 0 ),
+               frames = __sync_fetch_and_and( &ioLevels.frames, 0 );
+  uint64 sum = __sync_fetch_and_and( &ioLevels.sumSquares, 0 );
+  *outPeak = floatBitsToInt<25>( peak );
+  uint64 meanSquare = frames ? ( sum / frames ) << 16 : 0, // Q48
+         root = 0;
+  for( uint64 bit = 1ull << 62; bit; bit >>= 2 )
+  { // integer square root, Q48 -> Q24
+    if( meanSquare >= root + bit )
+    {
+      meanSquare -= root + bit;
+      root = ( root >> 1 ) + bit;
+    }
+    else
+      root >>= 1;
+  }
+  *outRms = (unsigned int)root;
+}
+
+int
+LevelToDecibels( unsigned int inLevel )
+{
+  if( !inLevel )
+    return -0x7fffffff - 1;
+  // log2 with 16 fractional bits, by repeated squaring of the normalized mantissa
+  int msb = 31 - __builtin_clz( inLevel ), log2 = ( msb - 24 ) * 65536; // negative below 1.0
+  uint64 m = uint64( inLevel ) << ( 31 - msb ); // 1.0 -> 1 << 31
+  for( int bit = 1 << 15; bit; bit >>= 1 )
+  {
+    m = ( m * m ) >> 31;
+    if( m >> 32 )
+    {
+      m >>= 1;
+      log2 += bit;
+    }
+  }
+  // 20 * log10(2) = 6.0206 dB per octave
+  int tenths1000 = int( ( (long long)log2 * 60206 ) >> 16 ) + 500,
+      tenths = tenths1000 / 1000;
+  return tenths1000 % 1000 < 0 ? tenths - 1 : tenths; // round to nearest
+}
+
+void
+FloatToIntCopy( void* outData, const float* inData, unsigned int inCount, int inBytes, bool inBigEndian )
+{
+  unsigned char* q = static_cast<unsigned char*>( outData );
+  const unsigned int* p = reinterpret_cast<const unsigned int*>( inData );
+  switch( inBytes * 2 + inBigEndian )
+  {
+    case 4: floatToIntCopy<2, false>( q, p, inCount ); break;
+    case 5: floatToIntCopy<2, true>( q, p, inCount ); break;
+    case 6: floatToIntCopy<3, false>( q, p, inCount ); break;
+    case 7: floatToIntCopy<3, true>( q, p, inCount ); break;
+    case 8: floatToIntCopy<4, false>( q, p, inCount ); break;
+    case 9: floatToIntCopy<4, true>( q, p, inCount ); break;
+  }
+}
+
+void
+IntToFloatCopy( float* outData, const void* inData, unsigned int inCount, int inBytes, bool inBigEndian )
+{
+  unsigned int* q = reinterpret_cast<unsigned int*>( outData );
+  const unsigned char* p = static_cast<const unsigned char*>( inData );
+  switch( inBytes * 2 + inBigEndian )
+  {
+    case 4: intToFloatCopy<2, false>( q, p, inCount ); break;
+    case 5: intToFloatCopy<2, true>( q, p, inCount ); break;
+    case 6: intToFloatCopy<3, false>( q, p, inCount ); break;
+    case 7: intToFloatCopy<3, true>( q, p, inCount ); break;
+    case 8: intToFloatCopy<4, false>( q, p, inCount ); break;
+    case 9: intToFloatCopy<4, true>( q, p, inCount ); break;
+  }
+}
+
+void
+FloatToInt16DitherCopy( void* outData, const float* inData, unsigned int inCount, bool inBigEndian, bool inShaped, DitherState& ioState )
+{
+  unsigned char* q = static_cast<unsigned char*>( outData );
+  const unsigned int* p = reinterpret_cast<const unsigned int*>( inData );
+  switch( inBigEndian * 2 + inShaped )
+  {
+    case 0: floatToInt16DitherCopy<false, false>( q, p, inCount, ioState ); break;
+    case 1: floatToInt16DitherCopy<false, true>( q, p, inCount, ioState ); break;
+    case 2: floatToInt16DitherCopy<true, false>( q, p, inCount, ioState ); break;
+    case 3: floatToInt16DitherCopy<true, true>( q, p, inCount, ioState ); break;
+  }
+}
+
+void
+FloatToDoubleCopy( void* outData, const float* inData, unsigned int inCount, bool inBigEndian )
+{
+  unsigned char* q = static_cast<unsigned char*>( outData );
+  const unsigned int* p = reinterpret_cast<const unsigned int*>( inData );
+  if( inBigEndian )
+    floatToDoubleCopy<true>( q, p, inCount );
+  else
+    floatToDoubleCopy<false>( q, p, inCount );
+}
+
+void
+DoubleToFloatCopy( float* outData, const void* inData, unsigned int inCount, bool inBigEndian )
+{
+  unsigned int* q = reinterpret_cast<unsigned int*>( outData );
+  const unsigned char* p = static_cast<const unsigned char*>( inData );
+  if( inBigEndian )
+    doubleToFloatCopy<true>( q, p, inCount );
+  else
+    doubleToFloatCopy<false>( q, p, inCount );
+}
+
+void
+SwapCopy32( void* outData, const void* inData, unsigned int inCount )
+{
+  unsigned char* q = static_cast<unsigned char*>( outData );
+  const unsigned char* p = static_cast<const unsigned char*>( inData );
+  for( const unsigned char* end = p + 4 * inCount; p < end; p += 4, q += 4 )
+    store<4, true>( q, load<4, false>( p ) );
+}
+
 } // namespace
 
@@ -3,16 +3,76 @@
 
 namespace FloatEmu
 {
-// This function uses integer operations in order to scale unit-range floating-point values
-// by factors of 2^(k/2) for negative integer k.
-// This corresponds to 16 steps between -96 and 0 dB, and is sufficient for a simple volume control.
-void Scale( float*, unsigned int count, signed char k );
+// Gain in Q30 fixed point, such that 1<<30 is unity. A gain ramps linearly towards its target
+// by step per frame, which avoids zipper noise when a volume control is moved.
+struct Gain
+{
+  unsigned int value, target, step;
+};
+const unsigned int UnityGain = 1 << 30;
+// Converts an attenuation in 0.5 dB steps into a gain, for attenuations up to 127.5 dB.
+unsigned int AttenuationToGain( unsigned int halfDecibels );
+// Sets a new target, to be reached after the given number of frames.
+void SetGainTarget( Gain&, unsigned int target, unsigned int frames );
+// This function uses integer operations in order to multiply unit-range floating-point values
+// by one gain per channel, with a relative error below 2^-23 plus the gain's resolution of 2^-30.
+// The count must cover whole frames. Denormal results are flushed to zero.
+void ApplyGain( float*, unsigned int count, unsigned int channels, Gain* );
+// Peak and RMS level accumulators of a single channel. The sums stop growing at cMaxFrames,
+// before the sum of squares can overflow, so the RMS then covers only the first frames.
+struct Levels
+{
+  static const unsigned int cMaxFrames = 1u << 31; // 12 hours at 48 kHz
+  unsigned int peak;             // largest magnitude, as float bits
+  unsigned long long sumSquares; // sum of squared magnitudes in Q16
+  unsigned int frames;
+};
+// Accumulates the levels of unit-range floats, per channel, into each of the given number of
+// sets of accumulators, which follow each other, so that several readers may take levels
+// independently. The count must cover whole frames. Accumulators are updated atomically once
+// per call, so levels may be taken concurrently.
+void MeasureLevels( const float*, unsigned int count, unsigned int channels, Levels*, int sets );
+// Returns the levels accumulated since the last call in Q24, such that 1<<24 is full scale,
+// and resets the accumulators.
+void TakeLevels( Levels&, unsigned int* peak, unsigned int* rms );
+// Converts a level in Q24 into tenths of a decibel relative to full scale, rounded to nearest.
+// Zero maps to INT_MIN.
+int LevelToDecibels( unsigned int );
+// Returns the largest magnitude of unit-range floats in Q24, such that 1<<24 is full scale.
+unsigned int Peak( const float*, unsigned int count );
 // This function uses integer operations for clipping float values to the -1 .. 1 range.
+// Results are exact; NaNs become -1 or 1, depending on their sign bit.
 void Clip( float*, unsigned int count );
 
+// Converts unit-range floats to round(x*32768), clamped to the 16-bit range, with ties rounded
+// away from zero. Results are exact; denormals and values below 2^-32 become zero.
 void FloatToInt16Copy( short*, const float*, unsigned int count );
+// Converts to x/32768. Results are exact.
 void Int16ToFloatCopy( float*, const short*, unsigned int count );
 
+// Conversion between unit-range floats and packed integer samples of 2, 3, or 4 bytes
+// in either byte order, without unaligned accesses.
+void FloatToIntCopy( void*, const float*, unsigned int count, int bytes, bool bigEndian );
+void IntToFloatCopy( float*, const void*, unsigned int count, int bytes, bool bigEndian );
+// Dithered conversion to 16-bit samples in either byte order. Triangular dither adds noise
+// of up to +-1 LSB before rounding. Noise shaping additionally feeds back each channel's
+// quantization error, which moves the noise towards high frequencies.
+// The noise of each sample is a hash of its position in the stream, so that it vectorizes.
+// The count must cover whole frames.
+struct DitherState
+{
+  unsigned int seed; // position in the noise stream
+  int* pError;       // one per channel
+  int channels;
+};
+void FloatToInt16DitherCopy( void*, const float*, unsigned int count, bool bigEndian, bool shaped, DitherState& );
+// Conversion between single and double precision, operating on bit patterns.
+// Denormals are flushed to zero, and out-of-range values become infinite.
+void FloatToDoubleCopy( void*, const float*, unsigned int count, bool bigEndian );
+void DoubleToFloatCopy( float*, const void*, unsigned int count, bool bigEndian );
+// Copies 32-bit values, reversing their byte order.
+void SwapCopy32( void*, const void*, unsigned int count );
+
 } // namespace
 
 #endif // FLOAT_EMU_H
@@ -10,9 +10,9 @@ lck_grp_t* Mutex::sLockGrp = 0;
 int Mutex::sInstances = 0;
 
 Mutex::Mutex()
-: mMtxAttr( 0 ),
-  mMtx( 0 ),
-  mValid( false )
+: mValid( false ),
+  mMtxAttr( 0 ),
+  mMtx( 0 )
 {
   if( sInstances++ == 0 )
   {
@@ -31,7 +31,6 @@ Mutex::Mutex()
 Mutex::~Mutex()
 {
   mValid = false;
-  ::wakeup( this );
   if( mMtx )
     ::lck_mtx_free( mMtx, sLockGrp );
   if( mMtxAttr )
@@ -45,59 +44,80 @@ Mutex::~Mutex()
   }
 }
 
-int
-Mutex::Sleep( int timeoutMs )
+void
+Mutex::Acquire()
 {
-  if( !mValid )
-    return EDEVERR;
-  struct timespec t = { 0, 0 };
-  if( timeoutMs > 0 )
-  {
-    t.tv_sec = timeoutMs / 1000;
-    t.tv_nsec = ( timeoutMs % 1000 ) * 1000 * 1000 + 1;
-  }
-  ::lck_mtx_lock( mMtx );
-  return ::msleep( this, mMtx, PCATCH | PDROP, __FUNCTION__, &t );
+  if( mValid )
+    ::lck_mtx_lock( mMtx );
 }
 
 void
-Mutex::Wakeup()
+Mutex::Release()
 {
   if( mValid )
-    ::wakeup( this );
+    ::lck_mtx_unlock( mMtx );
 }
 
-// Lock
-Lock::Lock()
-: mpMutex( 0 )
+// WaitQueue
+WaitQueue::WaitQueue()
+: mGeneration( 0 ),
+  mSleepers( 0 ),
+  mValid( true )
 {
 }
 
-Lock::Lock( Mutex& m )
-: mpMutex( &m )
+// Wakes the sleepers and polls until they have left, as terminate() polls for closing nodes.
+WaitQueue::~WaitQueue()
 {
-  if( m.mValid )
-    ::lck_mtx_lock( mpMutex->mMtx );
+  mValid = false;
+  while( __atomic_load_n( &mSleepers, __ATOMIC_SEQ_CST ) > 0 )
+  {
+    Wakeup();
+    ::IOSleep( 1 );
+  }
 }
 
-Lock::Lock( const Lock& other )
-: mpMutex( other.mpMutex )
+unsigned
+WaitQueue::Ticket() const
 {
-  other.mpMutex = 0;
+  return __atomic_load_n( &mGeneration, __ATOMIC_SEQ_CST );
 }
 
-Lock&
-Lock::operator=( const Lock& other )
+// The sleeper counts itself before it compares its ticket, and Wakeup() advances the
+// generation before it looks at the count, so one of them sees the other. msleep() drops
+// the mutex atomically, so a wakeup under the mutex is not lost either.
+int
+WaitQueue::Sleep( unsigned ticket, int timeoutMs )
 {
-  mpMutex = other.mpMutex;
-  other.mpMutex = 0;
-  return *this;
+  if( !mValid || !mMutex.mValid )
+    return EDEVERR;
+  struct timespec t = { 0, 0 };
+  if( timeoutMs > 0 )
+  {
+    t.tv_sec = timeoutMs / 1000;
+    t.tv_nsec = ( timeoutMs % 1000 ) * 1000 * 1000 + 1;
+  }
+  ::lck_mtx_lock( mMutex.mMtx );
+  __sync_add_and_fetch( &mSleepers, 1 );
+  int err = 0;
+  if( Ticket() == ticket && mValid )
+    err = ::msleep( this, mMutex.mMtx, PCATCH | PDROP, __FUNCTION__, &t );
+  else
+    ::lck_mtx_unlock( mMutex.mMtx );
+  if( !mValid )
+    err = EDEVERR;
+  __sync_sub_and_fetch( &mSleepers, 1 ); // the last access, after which the queue may go away
+  return err;
 }
 
-Lock::~Lock()
+void
+WaitQueue::Wakeup()
 {
-  if( mpMutex && mpMutex->mValid )
-    ::lck_mtx_unlock( mpMutex->mMtx );
+  __sync_add_and_fetch( &mGeneration, 1 );
+  if( __atomic_load_n( &mSleepers, __ATOMIC_SEQ_CST ) < 1 )
+    return;
+  Lock lock( mMutex );
+  ::wakeup( this );
 }
 
 } // namespace
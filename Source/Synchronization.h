@@ -1,43 +1,113 @@
 #ifndef SYNCHRONIZATION_H
 #define SYNCHRONIZATION_H
 
-#include <IOKit/IOLib.h>
+// Mutexes, locks, and wait queues. The kext implements them with lck_mtx and msleep(), in
+// Synchronization.cpp. Host programs that define SYNCHRONIZATION_POSIX link
+// Host/PosixSynchronization.cpp instead, which uses pthreads, so the engine's blocking I/O
+// runs in userspace threads.
 
-namespace Synchronization
-{
-
-class Mutex;
+#ifdef SYNCHRONIZATION_POSIX
+# include <pthread.h>
+#else
+# include <IOKit/IOLib.h>
+#endif
 
-class Lock
+namespace Synchronization
 {
-public:
-  Lock();
-  Lock( Mutex& );
-  Lock( const Lock& );
-  Lock& operator=( const Lock& );
-  ~Lock();
-private:
-  mutable Mutex* mpMutex;
-};
-
 
 class Mutex
 {
 public:
   Mutex();
   ~Mutex();
-  int Sleep( int timeoutMs = -1 );
-  void Wakeup();
+  Mutex( const Mutex& ) = delete;
+  Mutex& operator=( const Mutex& ) = delete;
 private:
+  void Acquire();
+  void Release();
+#ifdef SYNCHRONIZATION_POSIX
+  pthread_mutex_t mMutex;
+#else
   int mValid;
   lck_attr_t* mMtxAttr;
   lck_mtx_t* mMtx;
   static lck_grp_attr_t* sLockGrpAttr;
   static lck_grp_t* sLockGrp;
   static int sInstances;
+  friend class WaitQueue;
+#endif
   friend class Lock;
 };
 
+// Holds a mutex until it is destroyed. Locks can be moved, but not copied.
+class Lock
+{
+public:
+  Lock() : mpMutex( 0 ) {}
+  explicit Lock( Mutex& m ) : mpMutex( &m ) { m.Acquire(); }
+  Lock( Lock&& other ) : mpMutex( other.mpMutex ) { other.mpMutex = 0; }
+  Lock& operator=( Lock&& other )
+  {
+    if( this != &other )
+    {
+      Unlock();
+      mpMutex = other.mpMutex;
+      other.mpMutex = 0;
+    }
+    return *this;
+  }
+  ~Lock() { Unlock(); }
+  Lock( const Lock& ) = delete;
+  Lock& operator=( const Lock& ) = delete;
+  // Releases the mutex early.
+  void Unlock()
+  {
+    if( mpMutex )
+      mpMutex->Release();
+    mpMutex = 0;
+  }
+private:
+  Mutex* mpMutex;
+};
+
+// Threads sleep on a wait queue until another thread wakes them. So as not to miss a wakeup,
+// a thread takes a ticket before it checks the condition it waits for, and passes it to
+// Sleep(), which returns at once if Wakeup() has been called since. While nobody sleeps,
+// Wakeup() costs an atomic increment.
+class WaitQueue
+{
+public:
+  WaitQueue();
+  ~WaitQueue(); // wakes the sleepers, and returns once they have left
+  WaitQueue( const WaitQueue& ) = delete;
+  WaitQueue& operator=( const WaitQueue& ) = delete;
+  unsigned Ticket() const;
+  // Returns 0 when woken, EWOULDBLOCK when a positive timeout has expired, EINTR when the
+  // sleep has been interrupted, and EDEVERR when the queue is being destroyed.
+  int Sleep( unsigned ticket, int timeoutMs = -1 );
+  void Wakeup();
+private:
+  volatile unsigned mGeneration;
+  volatile int mSleepers;
+  volatile bool mValid;
+#ifdef SYNCHRONIZATION_POSIX
+  pthread_mutex_t mMutex;
+  pthread_cond_t mCond;
+  WaitQueue* mpPrev, * mpNext;
+  friend void InterruptSleepers();
+#else
+  Mutex mMutex;
+#endif
+};
+
+#ifdef SYNCHRONIZATION_POSIX
+// While set, the calling thread's sleeps return EINTR once *pInterrupted is true. Pass 0 to
+// clear it.
+void SetInterruptFlag( const volatile bool* pInterrupted );
+// Wakes all sleeping threads, so they notice an interrupt.
+void InterruptSleepers();
+#endif
+
 } // namespace
 
 #endif // SYNCHRONIZATION_H
@@ -0,0 +1,329 @@
+#include "VpcmAggregateNode.h"
+#include "VpcmAudioEngine.h"
+#include "VpcmAudioDevice.h"
+
+#include <sys/fcntl.h>
+#include <sys/uio.h>
+#include <sys/systm.h>
+
+namespace {
+
+const int cBounceBufferSize = 16384;
+
+template<int frameBytes>
+void
+copyFrames( char* pDest, int destStride, const char* pSrc, int frames )
+{
+  for( int i = 0; i < frames; ++i, pDest += destStride, pSrc += frameBytes )
+    __builtin_memcpy( pDest, pSrc, frameBytes ); // a builtin, as kexts are built without builtins
+}
+
+// Copies a contiguous run of frames into every destStride bytes of pDest. Common frame sizes
+// are copied with fixed sizes, which compile to plain loads and stores rather than calls.
+void
+copyFrames( char* pDest, int destStride, const char* pSrc, int frameBytes, int frames )
+{
+  switch( frameBytes )
+  {
+    case 4:
+      copyFrames<4>( pDest, destStride, pSrc, frames );
+      break;
+    case 6:
+      copyFrames<6>( pDest, destStride, pSrc, frames );
+      break;
+    case 8:
+      copyFrames<8>( pDest, destStride, pSrc, frames );
+      break;
+    case 16:
+      copyFrames<16>( pDest, destStride, pSrc, frames );
+      break;
+    default:
+      for( int i = 0; i < frames; ++i, pDest += destStride, pSrc += frameBytes )
+        ::memcpy( pDest, pSrc, frameBytes );
+  }
+}
+
+} // namespace
+
+VpcmAggregateNode::VpcmAggregateNode()
+: mpName( 0 ),
+  mNumEngines( 0 ),
+  mFrameBytes( 0 ),
+  mIOState( 0 ),
+  mpBounce( 0 )
+{
+}
+
+VpcmAggregateNode::~VpcmAggregateNode()
+{
+  devDestroy();
+  for( int i = 0; i < mNumEngines; ++i )
+    mEngines[i]->release();
+  delete[] mpBounce;
+  delete[] mpName;
+}
+
+int
+VpcmAggregateNode::init( const char* pName, VpcmAudioEngine** engines, int count )
+{
+  if( !pName || count < 1 || count > MAX_INSTANCES )
+    return EINVAL;
+  const VpcmProperties* p0 = engines[0]->getProperties();
+  if( p0->clockGroup < 1 )
+    return EINVAL;
+  int frameBytes = 0;
+  for( int i = 0; i < count; ++i )
+  {
+    const VpcmProperties* p = engines[i]->getProperties();
+    if( !( p->mode & VpcmProperties::Playback ) || p->streams != 1 || p->squelchLevel || p->framing )
+      return EINVAL;
+    if( p->clockGroup != p0->clockGroup || p->format != p0->format )
+      return EINVAL;
+    for( int j = 0; j < i; ++j )
+      if( engines[j] == engines[i] )
+        return EINVAL;
+    frameBytes += p->frameBytes;
+  }
+  if( frameBytes > cBounceBufferSize )
+    return EINVAL;
+  mpBounce = new char[cBounceBufferSize];
+  size_t size = ::strlen( pName ) + 1;
+  mpName = new char[size];
+  if( !mpBounce || !mpName )
+    return ENOMEM;
+  ::memcpy( mpName, pName, size );
+  int err = devCreate( ENGINE_NODE_NAME );
+  if( err )
+    return err;
+  for( int i = 0; i < count; ++i )
+  {
+    mEngines[i] = engines[i];
+    mEngines[i]->retain();
+  }
+  mNumEngines = count;
+  mFrameBytes = frameBytes;
+  return 0;
+}
+
+bool
+VpcmAggregateNode::contains( const VpcmAudioEngine* pEngine ) const
+{
+  for( int i = 0; i < mNumEngines; ++i )
+    if( mEngines[i] == pEngine )
+      return true;
+  return false;
+}
+
+int
+VpcmAggregateNode::printStatus( char* buf, int len ) const
+{
+  int pos = 0;
+  pos += ::snprintf( buf + pos, len - pos, "\"%s\" -> /dev/%s\n", mpName, devName() );
+  pos += ::snprintf( buf + pos, len - pos, "  Device node state: %s\n", mIOState ? "open for reading" : "closed" );
+  pos += ::snprintf( buf + pos, len - pos, "  Aggregate of:" );
+  for( int i = 0; i < mNumEngines; ++i )
+    pos += ::snprintf( buf + pos, len - pos, " \"%s\"", mEngines[i]->getProperties()->name );
+  pos += ::snprintf( buf + pos, len - pos, "\n" );
+  return pos;
+}
+
+int
+VpcmAggregateNode::devOpen( int flags )
+{
+  if( flags & FWRITE )
+    return ENOTSUP;
+  if( !__sync_bool_compare_and_swap( &mIOState, 0, flags ) )
+    return EACCES;
+  int err = 0, i = 0;
+  while( i < mNumEngines && !err )
+    err = mEngines[i++]->devOpen( FREAD );
+  if( err )
+  {
+    for( --i; i > 0; --i )
+      mEngines[i-1]->devClose();
+    mIOState = 0;
+  }
+  return err;
+}
+
+int
+VpcmAggregateNode::devClose()
+{
+  for( int i = 0; i < mNumEngines; ++i )
+    mEngines[i]->devClose();
+  mIOState = 0;
+  return 0;
+}
+
+// Members of a clock group wrap at the same time and have the same buffer size, so a frame's
+// offset within the engine buffer is common to all of them, and so are the frames of a ring.
+// Moves all read pointers to the same group frame, by skipping the data of members that started
+// earlier than others, and data that has been overwritten. Whole buffer periods are told apart
+// by the members' write positions, which are taken to lie within half a buffer of each other.
+// Aligned read pointers stay aligned, since reads take the same number of frames from each
+// member, so this only skips data after a member has started, restarted, or overflowed.
+void
+VpcmAggregateNode::align()
+{
+  const int bufferFrames = mEngines[0]->getProperties()->bufferFrames;
+  int skip[MAX_INSTANCES], avail[MAX_INSTANCES], start[MAX_INSTANCES], restarts[MAX_INSTANCES],
+      end0 = 0, latest = 0;
+  for( int i = 0; i < mNumEngines; ++i )
+  {
+    VpcmAudioEngine::DevIO& io = mEngines[i]->mStreams[0].io[VpcmAudioEngine::Output];
+    const int frameBytes = mEngines[i]->getProperties()->frameBytes;
+    restarts[i] = io.restarts;
+    int bytesAvail = io.bytesAvail;
+    if( bytesAvail < 0 )
+      return; // aligned once started
+    skip[i] = max( 0, bytesAvail - io.buffer.bytes() ) / frameBytes; // overwritten
+    avail[i] = bytesAvail / frameBytes - skip[i];
+    int end = ( int( io.ptr.c - io.buffer.begin.c ) / frameBytes + skip[i] + avail[i] ) % bufferFrames;
+    if( i == 0 )
+      end0 = end;
+    int delta = ( end - end0 + bufferFrames ) % bufferFrames; // relative to the first member
+    if( delta > bufferFrames / 2 )
+      delta -= bufferFrames;
+    start[i] = end0 + delta - avail[i];
+    if( i == 0 || start[i] > latest )
+      latest = start[i];
+  }
+  for( int i = 0; i < mNumEngines; ++i )
+  {
+    skip[i] += min( latest - start[i], avail[i] );
+    if( !skip[i] )
+      continue;
+    VpcmAudioEngine::DevIO& io = mEngines[i]->mStreams[0].io[VpcmAudioEngine::Output];
+    int bytes = skip[i] * mEngines[i]->getProperties()->frameBytes;
+    Synchronization::Lock lock( io.mutex );
+    if( io.restarts != restarts[i] || io.bytesAvail < bytes )
+      continue; // restarted meanwhile, aligned by the next read
+    io.ptr.c = io.buffer.begin.c + ( io.ptr.c - io.buffer.begin.c + bytes ) % io.buffer.bytes();
+    __sync_sub_and_fetch( &io.bytesAvail, bytes );
+  }
+}
+
+// Returns the number of frames that are available from all engines.
+int
+VpcmAggregateNode::framesAvail( VpcmAudioEngine** pStarving )
+{
+  int frames = -1;
+  for( int i = 0; i < mNumEngines; ++i )
+  {
+    VpcmAudioEngine* pEngine = mEngines[i];
+    const VpcmProperties* p = pEngine->getProperties();
+    VpcmAudioEngine::DevIO& io = pEngine->mStreams[0].io[VpcmAudioEngine::Output];
+    int engineFrames = max( 0, min( io.bytesAvail, io.buffer.bytes() ) ) / p->frameBytes;
+    if( frames < 0 || engineFrames < frames )
+    {
+      frames = engineFrames;
+      if( pStarving )
+        *pStarving = pEngine;
+    }
+  }
+  return max( 0, frames );
+}
+
+int
+VpcmAggregateNode::devRead( struct uio* uio )
+{
+  Synchronization::Lock lock( mMutex );
+  user_ssize_t resid = ::uio_resid( uio );
+  if( resid < mFrameBytes )
+    return resid < 1 ? 0 : EINVAL;
+
+  VpcmAudioEngine* pStarving = 0;
+  int frames = 0;
+  for( ;; )
+  {
+    // Each engine's ticket is taken before the check, as any of them may turn out to starve.
+    unsigned tickets[MAX_INSTANCES];
+    for( int i = 0; i < mNumEngines; ++i )
+      tickets[i] = mEngines[i]->mStreams[0].io[VpcmAudioEngine::Output].wait.Ticket();
+    align();
+    if( ( frames = framesAvail( &pStarving ) ) > 0 )
+      break;
+    // Without data from all members, the stream ends with the first member that ends.
+    for( int i = 0; i < mNumEngines; ++i )
+    {
+      int err = 0;
+      if( mEngines[i]->devWaitEnds( mEngines[i]->mStreams[0], UIO_READ, &err ) )
+        return err;
+    }
+    if( mIOState & FNONBLOCK )
+      return EWOULDBLOCK;
+    int i = 0;
+    while( mEngines[i] != pStarving )
+      ++i;
+    int err = pStarving->mStreams[0].io[VpcmAudioEngine::Output].wait.Sleep( tickets[i] );
+    if( err )
+      return err;
+  }
+  frames = min( frames, int( resid / mFrameBytes ) );
+
+  int err = 0;
+  while( frames > 0 && !err )
+  {
+    int count = min( frames, cBounceBufferSize / mFrameBytes );
+    char* pDest = mpBounce;
+    for( int i = 0; i < mNumEngines; ++i )
+    {
+      VpcmAudioEngine* pEngine = mEngines[i];
+      const VpcmProperties* p = pEngine->getProperties();
+      VpcmAudioEngine::DevIO& io = pEngine->mStreams[0].io[VpcmAudioEngine::Output];
+      int frameBytes = p->frameBytes;
+      Synchronization::Lock lock( io.mutex );
+      char* q = pDest;
+      for( int left = count; left > 0; )
+      { // up to the end of the ring, then from its start
+        int run = min( left, int( io.buffer.end.c - io.ptr.c ) / frameBytes );
+        copyFrames( q, mFrameBytes, io.ptr.c, frameBytes, run );
+        q += run * mFrameBytes;
+        io.ptr.c += run * frameBytes;
+        if( io.ptr.c >= io.buffer.end.c )
+          io.ptr = io.buffer.begin;
+        left -= run;
+      }
+      __sync_sub_and_fetch( &io.bytesAvail, count * frameBytes );
+      pDest += frameBytes;
+    }
+    err = ::uiomove( mpBounce, count * mFrameBytes, uio );
+    frames -= count;
+  }
+  return err;
+}
+
+int
+VpcmAggregateNode::devIoctl( u_long cmd, caddr_t data )
+{
+  int err = 0, arg = *(int*)data;
+  int result = 0;
+  switch( cmd )
+  {
+    case FIONBIO:
+      if( arg )
+        __sync_or_and_fetch( &mIOState, FNONBLOCK );
+      else
+        __sync_and_and_fetch( &mIOState, ~FNONBLOCK );
+      result = arg;
+      break;
+    case FIONREAD:
+      result = framesAvail() * mFrameBytes;
+      break;
+    default:
+      err = ENOTTY;
+  }
+  if( !err )
+    *(int*)data = result;
+  return err;
+}
+
+int
+VpcmAggregateNode::devSelect( int, void* wql, struct proc* p )
+{
+  VpcmAudioEngine* pStarving = 0;
+  if( framesAvail( &pStarving ) > 0 )
+    return 1;
+  ::selrecord( p, &pStarving->mStreams[0].io[VpcmAudioEngine::Output].sel, wql );
+  return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef VPCM_AGGREGATE_NODE_H
+#define VPCM_AGGREGATE_NODE_H
+
+#include "DevfsDeviceNode.h"
+#include "Synchronization.h"
+
+class VpcmAudioEngine;
+
+// A read-only device node that interleaves the playback data of several engines
+// into a single stream, so a single reader may capture all of them with one read.
+// Each frame of the stream consists of one frame from each engine, in the order given.
+// All engines must be single-stream playback engines in the same clock group, and use the same format.
+class VpcmAggregateNode : public DevfsDeviceNode
+{
+public:
+  VpcmAggregateNode();
+  ~VpcmAggregateNode();
+
+  int init( const char* name, VpcmAudioEngine** engines, int count );
+  const char* getName() const { return mpName; }
+  bool contains( const VpcmAudioEngine* ) const;
+  bool isOpen() const { return mIOState != 0; }
+  int printStatus( char*, int ) const;
+
+protected:
+  virtual int devOpen( int );
+  virtual int devClose();
+  virtual int devRead( struct uio* );
+  virtual int devIoctl( u_long, caddr_t );
+  virtual int devSelect( int, void*, struct proc* );
+
+private:
+  void align();
+  int framesAvail( VpcmAudioEngine** pStarving = 0 );
+
+  char* mpName;
+  VpcmAudioEngine* mEngines[MAX_INSTANCES];
+  int mNumEngines, mFrameBytes;
+  int mIOState;
+  char* mpBounce;
+  Synchronization::Mutex mMutex;
+};
+
+#endif // VPCM_AGGREGATE_NODE_H
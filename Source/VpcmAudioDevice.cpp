@@ -1,5 +1,8 @@
 #include "VpcmAudioDevice.h"
 #include "VpcmAudioEngine.h"
+#include "VpcmAggregateNode.h"
+#include "VpcmIoctl.h"
+#include "FloatEmu.h"
 
 #include <IOKit/audio/IOAudioControl.h>
 #include <IOKit/audio/IOAudioLevelControl.h>
@@ -21,6 +24,29 @@ namespace {
 
 const int cCommandBufferSize = 2048;
 
+const char*
+ioStateName( int flags )
+{
+  if( ( flags & FREAD ) && ( flags & FWRITE ) )
+    return "open for reading and writing";
+  if( flags & FREAD )
+    return "open for reading";
+  if( flags & FWRITE )
+    return "open for writing";
+  return "closed";
+}
+
+// Prints a level in Q24 as decibels relative to full scale.
+int
+printLevel( char* buf, int len, unsigned int level )
+{
+  int tenths = FloatEmu::LevelToDecibels( level );
+  if( tenths < -999 )
+    return ::snprintf( buf, len, " -inf" );
+  int mag = tenths < 0 ? -tenths : tenths;
+  return ::snprintf( buf, len, " %s%d.%d", tenths < 0 ? "-" : "", mag / 10, mag % 10 );
+}
+
 bool isws( char c )
 {
   for( const char* p = " \t\n"; *p; ++p )
@@ -109,6 +135,8 @@ VpcmAudioDevice::init( OSDictionary *properties )
   if( DevfsDeviceNode::devCreate( CONTROL_NODE_NAME, CONTROL_NODE_PERMISSIONS, UID_ROOT, GID_STAFF ) )
     return false;
   mpOutputBuffer = 0;
+  for( int i = 0; i < MAX_INSTANCES; ++i )
+    mAggregates[i] = 0;
   return true;
 }
 
@@ -116,6 +144,8 @@ void
 VpcmAudioDevice::free()
 {
   delete[] mpOutputBuffer;
+  for( int i = 0; i < MAX_INSTANCES; ++i )
+    delete mAggregates[i];
   IOAudioDevice::free();
 }
 
@@ -217,10 +247,20 @@ VpcmAudioDevice::executeCommand( int* pArgc, char** argv )
     result = createEngine( *pArgc, argv );
   else if( !strcmp( *argv, "delete" ) )
     result = deleteEngine( *pArgc, argv );
+  else if( !strcmp( *argv, "reconfigure" ) )
+    result = reconfigureEngine( *pArgc, argv );
+  else if( !strcmp( *argv, "route" ) )
+    result = routeEngine( *pArgc, argv );
+  else if( !strcmp( *argv, "unroute" ) )
+    result = unrouteEngine( *pArgc, argv );
+  else if( !strcmp( *argv, "aggregate" ) )
+    result = createAggregate( *pArgc, argv );
   else if( !strcmp( *argv, "name" ) )
     result = nameEngine( *pArgc, argv );
   else if( !strcmp( *argv, "describe" ) )
     result = describeEngine( *pArgc, argv );
+  else if( !strcmp( *argv, "meter" ) )
+    result = meterEngine( *pArgc, argv );
   return result;
 }
 
@@ -250,6 +290,16 @@ VpcmAudioDevice::printInfo( int, char** )
         ++hidden;
     }
   }
+  for( i = 0; i < MAX_INSTANCES; ++i )
+  {
+    if( mAggregates[i] )
+    {
+      if( mAggregates[i]->devAccess( S_IREAD ) == 0 )
+        pos += mAggregates[i]->printStatus( buf + pos, len - pos );
+      else
+        ++hidden;
+    }
+  }
   if( hidden > 0 )
     pos += ::snprintf( buf + pos, len - pos, "Some device pairs hidden due to insufficient permissions.\n" );
   return 0;
@@ -260,7 +310,7 @@ VpcmAudioDevice::createEngine( int argc, char** argv )
 {
   if( argc < 2 )
     return EINVAL;
-  VpcmProperties prop = { 0 };
+  VpcmProperties prop = VpcmProperties();
   int err = prop.parse( argc, argv );
   if( err )
     return err;
@@ -282,15 +332,38 @@ VpcmAudioDevice::deleteEngine( int argc, char** argv )
 {
   if( argc < 2 )
     return EINVAL;
-  int idx = findEngine( argv[1] );
+  int idx = findAggregate( argv[1] );
+  if( idx >= 0 )
+  {
+    int err = mAggregates[idx]->devAccess( S_IWRITE );
+    if( !err && mAggregates[idx]->isOpen() )
+      err = EBUSY;
+    if( !err )
+    {
+      delete mAggregates[idx];
+      mAggregates[idx] = 0;
+    }
+    return err;
+  }
+  idx = findEngine( argv[1] );
   if( idx < 0 )
     return ENOENT;
   VpcmAudioEngine* pEngine = OSDynamicCast( VpcmAudioEngine, audioEngines->getObject( idx ) );
   if( !pEngine )
     return ENOENT;
+  if( isAggregated( pEngine ) )
+    return EBUSY;
   int err = pEngine->devAccess( S_IWRITE );
   if( !err )
   {
+    pEngine->route( 0 );
+    OSObject* pObject = 0;
+    for( int i = 0; ( pObject = audioEngines->getObject( i ) ); ++i )
+    {
+      VpcmAudioEngine* pSource = OSDynamicCast( VpcmAudioEngine, pObject );
+      if( pSource && pSource->getRouteTarget() == pEngine )
+        pSource->route( 0 );
+    }
     pEngine->stopAudioEngine();
     pEngine->terminate( kIOServiceRequired );
     pEngine->detach( this );
@@ -300,7 +373,7 @@ VpcmAudioDevice::deleteEngine( int argc, char** argv )
 }
 
 int
-VpcmAudioDevice::nameEngine( int argc, char** argv )
+VpcmAudioDevice::reconfigureEngine( int argc, char** argv )
 {
   if( argc < 2 )
     return EINVAL;
@@ -308,13 +381,133 @@ VpcmAudioDevice::nameEngine( int argc, char** argv )
   if( idx < 0 )
     return ENOENT;
   VpcmAudioEngine* pEngine = OSDynamicCast( VpcmAudioEngine, audioEngines->getObject( idx ) );
+  if( !pEngine )
+    return ENOENT;
+  int err = pEngine->devAccess( S_IWRITE );
+  if( err )
+    return err;
+  if( isAggregated( pEngine ) )
+    return EBUSY;
+  VpcmProperties prop = *pEngine->getProperties();
+  err = prop.update( argc, argv );
+  if( err )
+    return err;
+  return pEngine->reconfigure( &prop );
+}
+
+int
+VpcmAudioDevice::routeEngine( int argc, char** argv )
+{
+  if( argc < 3 )
+    return EINVAL;
+  VpcmAudioEngine* pSource = getEngine( argv[1] ),
+                 * pTarget = getEngine( argv[2] );
+  if( !pSource || !pTarget )
+    return ENOENT;
+  int err = pSource->devAccess( S_IREAD );
+  if( !err )
+    err = pTarget->devAccess( S_IWRITE );
+  if( !err )
+    err = pSource->route( pTarget );
+  return err;
+}
+
+int
+VpcmAudioDevice::unrouteEngine( int argc, char** argv )
+{
+  if( argc < 2 )
+    return EINVAL;
+  VpcmAudioEngine* pSource = getEngine( argv[1] );
+  if( !pSource )
+    return ENOENT;
+  int err = pSource->devAccess( S_IREAD );
+  if( !err )
+    err = pSource->route( 0 );
+  return err;
+}
+
+int
+VpcmAudioDevice::createAggregate( int argc, char** argv )
+{
+  if( argc < 3 )
+    return EINVAL;
+  if( findEngine( argv[1] ) >= 0 || findAggregate( argv[1] ) >= 0 )
+    return EEXIST;
+  int idx = 0;
+  while( idx < MAX_INSTANCES && mAggregates[idx] )
+    ++idx;
+  if( idx >= MAX_INSTANCES )
+    return ENOMEM;
+  VpcmAudioEngine* engines[MAX_INSTANCES];
+  int count = argc - 2;
+  if( count > MAX_INSTANCES )
+    return EINVAL;
+  for( int i = 0; i < count; ++i )
+  {
+    engines[i] = getEngine( argv[i+2] );
+    if( !engines[i] )
+      return ENOENT;
+    if( isAggregated( engines[i] ) || engines[i]->getIOFlags() )
+      return EBUSY;
+    int err = engines[i]->devAccess( S_IREAD );
+    if( err )
+      return err;
+  }
+  VpcmAggregateNode* pAggregate = new VpcmAggregateNode;
+  if( !pAggregate )
+    return ENOMEM;
+  int err = pAggregate->init( argv[1], engines, count );
+  if( err )
+    delete pAggregate;
+  else
+    mAggregates[idx] = pAggregate;
+  return err;
+}
+
+int
+VpcmAudioDevice::findAggregate( const char* inName ) const
+{
+  for( int i = 0; i < MAX_INSTANCES; ++i )
+    if( mAggregates[i] && ( !::strcmp( mAggregates[i]->getName(), inName )
+                         || !::strcmp( mAggregates[i]->devName(), inName ) ) )
+      return i;
+  return -1;
+}
+
+bool
+VpcmAudioDevice::isAggregated( const VpcmAudioEngine* pEngine ) const
+{
+  for( int i = 0; i < MAX_INSTANCES; ++i )
+    if( mAggregates[i] && mAggregates[i]->contains( pEngine ) )
+      return true;
+  return false;
+}
+
+int
+VpcmAudioDevice::nameEngine( int argc, char** argv )
+{
+  if( argc < 2 )
+    return EINVAL;
+  int idx = findAggregate( argv[1] );
+  if( idx >= 0 )
+  {
+    int err = mAggregates[idx]->devAccess( S_IREAD );
+    if( !err )
+      ::snprintf( mpOutputBuffer, cCommandBufferSize, "/dev/%s\n", mAggregates[idx]->devName() );
+    return err;
+  }
+  idx = findEngine( argv[1] );
+  if( idx < 0 )
+    return ENOENT;
+  VpcmAudioEngine* pEngine = OSDynamicCast( VpcmAudioEngine, audioEngines->getObject( idx ) );
   if( !pEngine )
     return ENOENT;
   int err = pEngine->devAccess( S_IREAD );
   if( err )
     return err;
   int pos = 0;
-  pos += ::snprintf( mpOutputBuffer + pos, cCommandBufferSize - pos, "/dev/%s\n", pEngine->devName() );
+  for( int i = 0; i < pEngine->getProperties()->streams; ++i )
+    pos += ::snprintf( mpOutputBuffer + pos, cCommandBufferSize - pos, "/dev/%s\n", pEngine->getStreamNodeName( i ) );
   return 0;
 }
 
@@ -339,6 +532,48 @@ VpcmAudioDevice::describeEngine( int argc, char** argv )
   return 0;
 }
 
+// Lists peak and RMS levels per channel since the previous meter request, in dBFS.
+int
+VpcmAudioDevice::meterEngine( int argc, char** argv )
+{
+  if( argc < 2 )
+    return EINVAL;
+  VpcmAudioEngine* pEngine = getEngine( argv[1] );
+  if( !pEngine )
+    return ENOENT;
+  int err = pEngine->devAccess( S_IREAD );
+  if( err )
+    return err;
+  char* buf = mpOutputBuffer;
+  int len = cCommandBufferSize, pos = 0;
+  const VpcmProperties* p = pEngine->getProperties();
+  const struct { int mode, direction; const char* name; } directions[] =
+  {
+    { VpcmProperties::Playback, VPCM_METER_PLAYBACK, "playback" },
+    { VpcmProperties::Record, VPCM_METER_RECORD, "record" },
+  };
+  for( size_t i = 0; i < sizeof(directions)/sizeof(*directions); ++i )
+  {
+    if( !( p->mode & directions[i].mode ) )
+      continue;
+    for( int j = 0; j < p->streams; ++j )
+    {
+      vpcm_levels levels = vpcm_levels();
+      levels.direction = directions[i].direction;
+      if( pEngine->takeLevels( j, VpcmAudioEngine::LevelsMeter, &levels ) )
+        continue;
+      for( int c = 0; c < levels.channels && pos < len; ++c )
+      {
+        pos += ::snprintf( buf + pos, len - pos, "%s %d:", directions[i].name, j * p->channels + c + 1 );
+        pos += printLevel( buf + pos, max( 0, len - pos ), levels.peak[c] );
+        pos += printLevel( buf + pos, max( 0, len - pos ), levels.rms[c] );
+        pos += ::snprintf( buf + pos, max( 0, len - pos ), "\n" );
+      }
+    }
+  }
+  return 0;
+}
+
 int
 VpcmAudioDevice::findEngine( const char* inName ) const
 {
@@ -355,6 +590,15 @@ VpcmAudioDevice::findEngine( const char* inName ) const
   return pEngine ? i : -1;
 }
 
+VpcmAudioEngine*
+VpcmAudioDevice::getEngine( const char* inName ) const
+{
+  int idx = findEngine( inName );
+  if( idx < 0 )
+    return 0;
+  return OSDynamicCast( VpcmAudioEngine, audioEngines->getObject( idx ) );
+}
+
 int
 VpcmAudioDevice::printEngineStatus( VpcmAudioEngine* pEngine, char* buf, int len )
 {
@@ -376,20 +620,23 @@ VpcmAudioDevice::printEngineStatus( VpcmAudioEngine* pEngine, char* buf, int len
     case VpcmProperties::Record:
       dir = "<-";
       break;
+    case VpcmProperties::Duplex:
+      dir = "<->";
+      break;
   }
   pos += ::snprintf( buf + pos, len - pos, "\"%s\" %s /dev/%s\n", pEngine->getProperties()->name, dir, pEngine->devName() );
   uint32_t numClients = pStream->numClients;
-  const char* state = "closed";
-  if( pEngine->getIOFlags() & FREAD )
-    state = "open for reading";
-  else if( pEngine->getIOFlags() & FWRITE )
-    state = "open for writing";
   pos += ::snprintf( buf + pos, len - pos,
     "  CoreAudio clients: %d\n"
     "  Device node state: %s\n",
     numClients,
-    state
+    ioStateName( pEngine->getIOFlags() )
   );
+  for( int i = 1; i < pEngine->getProperties()->streams; ++i )
+    pos += ::snprintf( buf + pos, len - pos, "  Stream %d: /dev/%s, %s\n",
+      i, pEngine->getStreamNodeName( i ), ioStateName( pEngine->getIOFlags( i ) ) );
+  if( pEngine->getRouteTarget() )
+    pos += ::snprintf( buf + pos, len - pos, "  Routed to: \"%s\"\n", pEngine->getRouteTarget()->getProperties()->name );
   pos += ::snprintf( buf + pos, len - pos, "  Configuration:" );
   pos += pEngine->getProperties()->print( buf + pos, len - pos, "\n\t--" );
   pos += ::snprintf( buf + pos, len - pos, "\n" );
@@ -6,6 +6,8 @@
 #include "Synchronization.h"
 #include "VpcmAudioEngine.h"
 
+class VpcmAggregateNode;
+
 #define DEVICE_GUI_NAME "vpcm Virtual Audio Device"
 #define DEVICE_SHORT_GUI_NAME "vpcm"
 #define MANUFACTURER_NAME "vpcm"
@@ -37,15 +39,24 @@ private:
   int printInfo( int, char** );
   int createEngine( int, char** );
   int deleteEngine( int, char** );
+  int reconfigureEngine( int, char** );
+  int routeEngine( int, char** );
+  int unrouteEngine( int, char** );
+  int createAggregate( int, char** );
+  int findAggregate( const char* ) const;
+  bool isAggregated( const VpcmAudioEngine* ) const;
   int nameEngine( int, char** );
   int describeEngine( int, char** );
+  int meterEngine( int, char** );
   int findEngine( const char* ) const;
+  VpcmAudioEngine* getEngine( const char* ) const;
   static int printEngineStatus( VpcmAudioEngine*, char*, int );
 
 private:
   int mIOFlags;
   Synchronization::Mutex mMutex;
   char* mpOutputBuffer;
+  VpcmAggregateNode* mAggregates[MAX_INSTANCES];
 };
 
 #endif // VPCM_AUDIO_DEVICE_H
@@ -1,6 +1,9 @@
 #include "VpcmAudioEngine.h"
 #include "VpcmAudioDevice.h"
+#include "VpcmClockGroup.h"
 #include "FloatEmu.h"
+#include "Codecs.h"
+#include "VpcmIoctl.h"
 #include <IOKit/audio/IOAudioLevelControl.h>
 #include <IOKit/audio/IOAudioToggleControl.h>
 #include <IOKit/audio/IOAudioDefines.h>
@@ -13,22 +16,38 @@
 
 #define INT64_1E9  1000000000LL
 
-#ifndef FIONWRITE
-# define FIONWRITE	_IOR('f', 119, int)
-#endif
-#ifndef FIONSPACE
-# define FIONSPACE	_IOR('f', 118, int)
-#endif
+#define IO_EOF 0x00010000
+#define IO_CLOSING 0x00020000
+#define IO_TERMINATING 0x00040000
+
+namespace {
 
-#define EOF 0x00010000
-#define CLOSING 0x00020000
-#define TERMINATING 0x00040000
+// Rings are accessed by the CPU only, and never by DMA, so they need not be physically contiguous.
+// Contiguous allocations of more than a few pages fail once physical memory is fragmented, and
+// deplete the contiguous memory that drivers of real hardware depend on. Rings must be wired,
+// though: they are accessed from the engine's work loop and with device node mutexes held, where
+// page faults are not allowed. Rings of up to a page are allocated from the kernel's zones,
+// larger rings as whole pages of virtually contiguous memory.
+IOBufferMemoryDescriptor*
+allocateRing( int bytes )
+{
+  int flags = kIODirectionInOut | kIOMemoryThreadSafe;
+  if( bytes <= int( PAGE_SIZE ) )
+    return IOBufferMemoryDescriptor::withOptions( flags, bytes, 4 );
+  return IOBufferMemoryDescriptor::withOptions( flags, bytes, PAGE_SIZE );
+}
+
+// IMA ADPCM packets carry the decoder state at their first frame. After an overflow, reading
+// resumes at the start of a block of this many frames, where the engine recorded the state.
+const int cAdpcmBlockFrames = 256;
+
+} // namespace
 
 bool
-VpcmAudioEngine::Buffer::init( int bufferBytes )
+VpcmAudioEngine::Buffer::init( int bufferFrames, const VpcmProperties& p )
 {
-  int flags = kIOMemoryPhysicallyContiguous | kIOMemoryThreadSafe;
-  pDesc = IOBufferMemoryDescriptor::withOptions( flags, bufferBytes, 4 );
+  int bufferBytes = bufferFrames * p.frameBytes;
+  pDesc = allocateRing( bufferBytes );
   if( !pDesc )
     return false;
   begin.v = pDesc->getBytesNoCopy();
@@ -36,6 +55,25 @@ VpcmAudioEngine::Buffer::init( int bufferBytes )
     return false;
   end.c = begin.c + bufferBytes;
   ::bzero( begin.c, bufferBytes );
+  channels = p.channels;
+  if( p.format == VpcmProperties::ImaAdpcm )
+  { // the engine's state, the state at the read pointer, and the state at each block's start
+    int blocks = ( bufferFrames + cAdpcmBlockFrames - 1 ) / cAdpcmBlockFrames;
+    pAdpcm = new Codecs::AdpcmState[( blocks + 2 ) * p.channels]();
+    if( !pAdpcm )
+      return false;
+    pReadAdpcm = pAdpcm + p.channels;
+    pBlockAdpcm = pReadAdpcm + p.channels;
+  }
+  if( p.format == VpcmProperties::Int16 || p.format == VpcmProperties::Int16BE )
+  { // allocated regardless of --dither, so dither may be reconfigured in place
+    dither.pError = new int[p.channels];
+    if( !dither.pError )
+      return false;
+    ::bzero( dither.pError, p.channels * sizeof(int) );
+    dither.channels = p.channels;
+    dither.seed = ( 0x9e3779b9u ^ (unsigned int)(uintptr_t)begin.v ) | 1;
+  }
   return true;
 }
 
@@ -47,6 +85,12 @@ VpcmAudioEngine::Buffer::free()
     pDesc->release();
     pDesc = 0;
   }
+  delete[] pAdpcm;
+  pAdpcm = 0;
+  pReadAdpcm = 0;
+  pBlockAdpcm = 0;
+  delete[] dither.pError;
+  dither.pError = 0;
   begin.c = 0;
   end.c = 0;
 }
@@ -54,21 +98,21 @@ VpcmAudioEngine::Buffer::free()
 namespace {
 
 IOAudioControl*
-createVolumeControl( int idx, int usage, int initialValue )
+createVolumeControl( int idx, int usage, int initialValue, int channel )
 {
   return IOAudioLevelControl::createVolumeControl(
-    initialValue, -15, 0, -((15*6)<<16), 0,
-    kIOAudioControlChannelIDAll, kIOAudioControlChannelNameAll,
+    initialValue, -2*96, 0, -(96<<16), 0, // 0.5 dB steps
+    channel, channel == kIOAudioControlChannelIDAll ? kIOAudioControlChannelNameAll : 0,
     idx, usage
   );
 }
 
 IOAudioControl*
-createMuteControl( int idx, int usage, int initialValue )
+createMuteControl( int idx, int usage, int initialValue, int channel )
 {
   return IOAudioToggleControl::createMuteControl(
     initialValue,
-    kIOAudioControlChannelIDAll, kIOAudioControlChannelNameAll,
+    channel, channel == kIOAudioControlChannelIDAll ? kIOAudioControlChannelNameAll : 0,
     idx, usage
   );
 }
@@ -78,16 +122,27 @@ createMuteControl( int idx, int usage, int initialValue )
 const VpcmAudioEngine::ControlDef
 VpcmAudioEngine::sAudioControls[] =
 {
-  { &createVolumeControl, kIOAudioControlUsageInput,  0, &VpcmAudioEngine::mGain },
-  { &createVolumeControl, kIOAudioControlUsageOutput, 0, &VpcmAudioEngine::mVolume },
-  { &createMuteControl,   kIOAudioControlUsageInput,  0, &VpcmAudioEngine::mMuteInput },
-  { &createMuteControl,   kIOAudioControlUsageOutput, 0, &VpcmAudioEngine::mMuteOutput },
+  { &createVolumeControl, kIOAudioControlUsageInput,  0, &VpcmAudioEngine::mGain, &VpcmAudioEngine::mpChannelGain },
+  { &createVolumeControl, kIOAudioControlUsageOutput, 0, &VpcmAudioEngine::mVolume, &VpcmAudioEngine::mpChannelVolume },
+  { &createMuteControl,   kIOAudioControlUsageInput,  0, &VpcmAudioEngine::mMuteInput, &VpcmAudioEngine::mpChannelMuteInput },
+  { &createMuteControl,   kIOAudioControlUsageOutput, 0, &VpcmAudioEngine::mMuteOutput, &VpcmAudioEngine::mpChannelMuteOutput },
 };
 
+// Control IDs of engine-wide controls are indices into sAudioControls. They are followed
+// by the per-channel controls of each entry, for all channels of the engine.
 IOReturn
 VpcmAudioEngine::onControlChanged( IOAudioControl* pControl, SInt32, SInt32 newValue )
 {
-  this->*sAudioControls[pControl->getControlID()].pValue = newValue;
+  int id = pControl->getControlID(),
+      numControls = sizeof(sAudioControls)/sizeof(*sAudioControls),
+      numChannels = mProperties.channels * mProperties.streams;
+  if( id < numControls )
+    this->*sAudioControls[id].pValue = newValue;
+  else
+  {
+    id -= numControls;
+    ( this->*sAudioControls[id / numChannels].pChannelValues )[id % numChannels] = newValue;
+  }
   return kIOReturnSuccess;
 }
 
@@ -110,23 +165,388 @@ IOAudioStreamFormat sFormats[] =
     32, 32, 0, kIOAudioStreamByteOrderLittleEndian,
     TRUE, VpcmProperties::Float32
   },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    16, 16, 0, kIOAudioStreamByteOrderBigEndian,
+    TRUE, VpcmProperties::Int16BE
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    24, 24, 0, kIOAudioStreamByteOrderLittleEndian,
+    TRUE, VpcmProperties::Int24
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    24, 24, 0, kIOAudioStreamByteOrderBigEndian,
+    TRUE, VpcmProperties::Int24BE
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    32, 32, 0, kIOAudioStreamByteOrderLittleEndian,
+    TRUE, VpcmProperties::Int32
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    32, 32, 0, kIOAudioStreamByteOrderBigEndian,
+    TRUE, VpcmProperties::Int32BE
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationIEEE754Float,
+    32, 32, 0, kIOAudioStreamByteOrderBigEndian,
+    TRUE, VpcmProperties::Float32BE
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationIEEE754Float,
+    64, 64, 0, kIOAudioStreamByteOrderLittleEndian,
+    TRUE, VpcmProperties::Float64
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationIEEE754Float,
+    64, 64, 0, kIOAudioStreamByteOrderBigEndian,
+    TRUE, VpcmProperties::Float64BE
+  },
+  // Wire codecs are presented to CoreAudio as the 16-bit linear data they encode.
+  // Only the device node sees encoded data.
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    16, 16, 0, kIOAudioStreamByteOrderLittleEndian,
+    TRUE, VpcmProperties::ULaw
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    16, 16, 0, kIOAudioStreamByteOrderLittleEndian,
+    TRUE, VpcmProperties::ALaw
+  },
+  {
+    0,
+    kIOAudioStreamSampleFormatLinearPCM,
+    kIOAudioStreamNumericRepresentationSignedInt,
+    16, 16, 0, kIOAudioStreamByteOrderLittleEndian,
+    TRUE, VpcmProperties::ImaAdpcm
+  },
 };
 
+const int cCodecChunk = 256;
+// Packet headers use format numbers as defined by the enum
+typedef char cFormatNumbersMatch[ VPCM_FORMAT_IMA_ADPCM == VpcmProperties::ImaAdpcm
+                                  && VPCM_FORMAT_FLOAT32LE == VpcmProperties::Float32 ? 1 : -1 ];
+const int cGainRampMsec = 10;
+
+IOAudioStreamFormat*
+findFormat( UInt32 tag )
+{
+  IOAudioStreamFormat* pFormat = sFormats, *formatsEnd = sFormats + sizeof(sFormats)/sizeof(*sFormats);
+  while( pFormat < formatsEnd && pFormat->fDriverTag != tag )
+    ++pFormat;
+  return pFormat == formatsEnd ? 0 : pFormat;
+}
+
+// The byte value that represents silence in the given format.
+int
+silenceByte( int format )
+{
+  switch( format )
+  {
+    case VpcmProperties::ULaw:
+      return 0xff;
+    case VpcmProperties::ALaw:
+      return 0xd5;
+  }
+  return 0;
+}
+
+// Converts unit-range floats into samples of a format given at compile time, so the format
+// switch folds away. Codecs go through 16-bit linear samples in chunks. IMA ADPCM takes a state
+// per channel, and dithered 16-bit samples take a dither state; count must then cover whole frames.
+template<int Format, int Dither>
+void
+encodeSamples( void* dest, const float* src, int count, Codecs::AdpcmState* pAdpcm, FloatEmu::DitherState* pDither, int channels )
+{
+  switch( Format )
+  {
+    case VpcmProperties::ULaw:
+    case VpcmProperties::ALaw:
+    case VpcmProperties::ImaAdpcm:
+    {
+      unsigned char* q = static_cast<unsigned char*>( dest );
+      short buf[cCodecChunk];
+      for( int i = 0; i < count; i += cCodecChunk )
+      {
+        int n = min( count - i, cCodecChunk );
+        FloatEmu::FloatToInt16Copy( buf, src + i, n );
+        if( Format == VpcmProperties::ULaw )
+          Codecs::Int16ToULawCopy( q + i, buf, n );
+        else if( Format == VpcmProperties::ALaw )
+          Codecs::Int16ToALawCopy( q + i, buf, n );
+        else
+          Codecs::Int16ToImaAdpcmCopy( q + i / 2, buf, n, pAdpcm, channels, i % channels );
+      }
+      break;
+    }
+    case VpcmProperties::Int16:
+    case VpcmProperties::Int16BE:
+      if( Dither != VpcmProperties::None )
+        FloatEmu::FloatToInt16DitherCopy( dest, src, count, Format == VpcmProperties::Int16BE,
+                                          Dither == VpcmProperties::ShapedDither, *pDither );
+      else if( Format == VpcmProperties::Int16 )
+        FloatEmu::FloatToInt16Copy( static_cast<short*>( dest ), src, count );
+      else
+        FloatEmu::FloatToIntCopy( dest, src, count, 2, true );
+      break;
+    case VpcmProperties::Int24:
+    case VpcmProperties::Int24BE:
+      FloatEmu::FloatToIntCopy( dest, src, count, 3, Format == VpcmProperties::Int24BE );
+      break;
+    case VpcmProperties::Int32:
+    case VpcmProperties::Int32BE:
+      FloatEmu::FloatToIntCopy( dest, src, count, 4, Format == VpcmProperties::Int32BE );
+      break;
+    case VpcmProperties::Float32:
+      ::memcpy( dest, src, count * sizeof(float) );
+      break;
+    case VpcmProperties::Float32BE:
+      FloatEmu::SwapCopy32( dest, src, count );
+      break;
+    case VpcmProperties::Float64:
+    case VpcmProperties::Float64BE:
+      FloatEmu::FloatToDoubleCopy( dest, src, count, Format == VpcmProperties::Float64BE );
+      break;
+  }
+}
+
+// Converts samples of a format given at compile time into floats.
+template<int Format>
+void
+decodeSamples( float* dest, const void* src, int count, Codecs::AdpcmState* pAdpcm, int channels )
+{
+  switch( Format )
+  {
+    case VpcmProperties::ULaw:
+    case VpcmProperties::ALaw:
+    case VpcmProperties::ImaAdpcm:
+    {
+      const unsigned char* p = static_cast<const unsigned char*>( src );
+      short buf[cCodecChunk];
+      for( int i = 0; i < count; i += cCodecChunk )
+      {
+        int n = min( count - i, cCodecChunk );
+        if( Format == VpcmProperties::ULaw )
+          Codecs::ULawToInt16Copy( buf, p + i, n );
+        else if( Format == VpcmProperties::ALaw )
+          Codecs::ALawToInt16Copy( buf, p + i, n );
+        else
+          Codecs::ImaAdpcmToInt16Copy( buf, p + i / 2, n, pAdpcm, channels, i % channels );
+        FloatEmu::Int16ToFloatCopy( dest + i, buf, n );
+      }
+      break;
+    }
+    case VpcmProperties::Int16:
+      FloatEmu::Int16ToFloatCopy( dest, static_cast<const short*>( src ), count );
+      break;
+    case VpcmProperties::Int16BE:
+      FloatEmu::IntToFloatCopy( dest, src, count, 2, true );
+      break;
+    case VpcmProperties::Int24:
+    case VpcmProperties::Int24BE:
+      FloatEmu::IntToFloatCopy( dest, src, count, 3, Format == VpcmProperties::Int24BE );
+      break;
+    case VpcmProperties::Int32:
+    case VpcmProperties::Int32BE:
+      FloatEmu::IntToFloatCopy( dest, src, count, 4, Format == VpcmProperties::Int32BE );
+      break;
+    case VpcmProperties::Float32:
+      ::memcpy( dest, src, count * sizeof(float) );
+      break;
+    case VpcmProperties::Float32BE:
+      FloatEmu::SwapCopy32( dest, src, count );
+      break;
+    case VpcmProperties::Float64:
+    case VpcmProperties::Float64BE:
+      FloatEmu::DoubleToFloatCopy( dest, src, count, Format == VpcmProperties::Float64BE );
+      break;
+  }
+}
+
+// Advances a decoder state over IMA ADPCM data of whole frames, as a reader decodes it.
+void
+advanceAdpcm( Codecs::AdpcmState* pAdpcm, const void* src, int bytes, int channels )
+{
+  const unsigned char* p = static_cast<const unsigned char*>( src );
+  short buf[cCodecChunk];
+  for( int i = 0; i < 2 * bytes; i += cCodecChunk )
+    Codecs::ImaAdpcmToInt16Copy( buf, p + i / 2, min( 2 * bytes - i, cCodecChunk ), pAdpcm, channels, i % channels );
+}
+
 } // namespace
 
+template<int Format, int Dither, bool Raw>
+void
+VpcmAudioEngine::fill( Buffer& buffer, void* dest, float* mix, int count, FloatEmu::Gain* pGains, FloatEmu::Levels* pLevels )
+{
+  if( !Raw )
+  {
+    FloatEmu::ApplyGain( mix, count, buffer.channels, pGains );
+    FloatEmu::Clip( mix, count );
+  }
+  if( pLevels )
+    FloatEmu::MeasureLevels( mix, count, buffer.channels, pLevels, LevelReaders );
+  encodeSamples<Format, Dither>( dest, mix, count, buffer.pAdpcm, &buffer.dither, buffer.channels );
+}
+
+template<int Format, bool Raw>
+void
+VpcmAudioEngine::drain( Buffer& buffer, float* dest, const void* src, int count, FloatEmu::Gain* pGains, FloatEmu::Levels* pLevels )
+{
+  decodeSamples<Format>( dest, src, count, buffer.pAdpcm, buffer.channels );
+  if( !Raw )
+  {
+    FloatEmu::ApplyGain( dest, count, buffer.channels, pGains );
+    FloatEmu::Clip( dest, count );
+  }
+  if( pLevels )
+    FloatEmu::MeasureLevels( dest, count, buffer.channels, pLevels, LevelReaders );
+}
+
+#define KERNELS( format ) \
+  { { { &fill<format, VpcmProperties::None, false>, \
+        &fill<format, VpcmProperties::None, false>, \
+        &fill<format, VpcmProperties::None, false> }, \
+      { &fill<format, VpcmProperties::None, true>, \
+        &fill<format, VpcmProperties::None, true>, \
+        &fill<format, VpcmProperties::None, true> } }, \
+    { &drain<format, false>, &drain<format, true> } }
+#define DITHERED_KERNELS( format ) \
+  { { { &fill<format, VpcmProperties::None, false>, \
+        &fill<format, VpcmProperties::TriangularDither, false>, \
+        &fill<format, VpcmProperties::ShapedDither, false> }, \
+      { &fill<format, VpcmProperties::None, true>, \
+        &fill<format, VpcmProperties::TriangularDither, true>, \
+        &fill<format, VpcmProperties::ShapedDither, true> } }, \
+    { &drain<format, false>, &drain<format, true> } }
+
+const VpcmAudioEngine::KernelDef
+VpcmAudioEngine::sKernels[] =
+{
+  DITHERED_KERNELS( VpcmProperties::Int16 ),
+  KERNELS( VpcmProperties::Float32 ),
+  DITHERED_KERNELS( VpcmProperties::Int16BE ),
+  KERNELS( VpcmProperties::Int24 ),
+  KERNELS( VpcmProperties::Int24BE ),
+  KERNELS( VpcmProperties::Int32 ),
+  KERNELS( VpcmProperties::Int32BE ),
+  KERNELS( VpcmProperties::Float32BE ),
+  KERNELS( VpcmProperties::Float64 ),
+  KERNELS( VpcmProperties::Float64BE ),
+  KERNELS( VpcmProperties::ULaw ),
+  KERNELS( VpcmProperties::ALaw ),
+  KERNELS( VpcmProperties::ImaAdpcm ),
+};
+
+#undef KERNELS
+#undef DITHERED_KERNELS
+
+void
+VpcmAudioEngine::selectKernels()
+{
+  static_assert( sizeof(sKernels)/sizeof(*sKernels) == VpcmProperties::NumFormats, "one kernel set per format" );
+  const KernelDef& k = sKernels[mProperties.format];
+  int dither = mProperties.dither;
+  mpFillRaw = k.fill[true][dither];
+  mpFill = k.fill[mProperties.raw][dither];
+  mpDrainRaw = k.drain[true];
+  mpDrain = k.drain[mProperties.raw];
+}
+
+// Device node of a stream other than the first one.
+class VpcmAudioEngine::StreamNode : public DevfsDeviceNode
+{
+public:
+  StreamNode( VpcmAudioEngine* pEngine, Stream& stream ) : mpEngine( pEngine ), mStream( stream ) {}
+
+protected:
+  virtual int devOpen( int flags ) { return mpEngine->devOpen( mStream, flags ); }
+  virtual int devClose() { return mpEngine->devClose( mStream ); }
+  virtual int devRead( struct uio* uio ) { return mpEngine->devReadWrite( mStream, uio ); }
+  virtual int devWrite( struct uio* uio ) { return mpEngine->devReadWrite( mStream, uio ); }
+  virtual int devIoctl( u_long cmd, caddr_t data ) { return mpEngine->devIoctl( mStream, cmd, data ); }
+  virtual int devSelect( int which, void* wql, struct proc* p ) { return mpEngine->devSelect( mStream, which, wql, p ); }
+
+private:
+  VpcmAudioEngine* mpEngine;
+  Stream& mStream;
+};
+
 OSDefineMetaClassAndStructors( VpcmAudioEngine, IOAudioEngine )
 
 bool
 VpcmAudioEngine::init( const VpcmProperties* pProperties )
 {
-  ::bzero( &mDevIOSel, sizeof(mDevIOSel) );
-  mDevIOPtr.c = 0;
-  mDevIOBytesAvail = -1;
-  mIOState = 0;
+  for( int i = 0; i < MAX_STREAMS; ++i )
+  {
+    Stream& s = mStreams[i];
+    for( size_t j = 0; j < sizeof(s.io)/sizeof(*s.io); ++j )
+    {
+      ::bzero( &s.io[j].sel, sizeof(s.io[j].sel) );
+      s.io[j].ptr.c = 0;
+      s.io[j].bytesAvail = -1;
+      s.io[j].segment = 0;
+      s.io[j].pGains = 0;
+      s.io[j].pLevels = 0;
+      s.io[j].silentFrames = 0;
+      s.io[j].squelchedFrames = 0;
+      s.io[j].writeFrame = 0;
+      s.io[j].startFrame = 0;
+      s.io[j].readFrame = 0;
+      s.io[j].anchorFrame = 0;
+      s.io[j].anchorTime = 0;
+      s.io[j].restarts = 0;
+      s.io[j].readRestarts = 0;
+      s.io[j].anchorSeq = 0;
+      s.io[j].discontinuity = false;
+      s.io[j].adpcmResync = false;
+    }
+    s.ioState = 0;
+    s.pNode = 0;
+  }
   mWritePosition = 0;
+  mReaderWraps = 0;
+  mpRouteTarget = 0;
+  mpRouteSource = 0;
   mNextTime.t = 0;
   mBufferDuration.t = 0;
+  mWrapTime.t = 0;
+  mClockFrame = 0;
   mpTimer = 0;
+  mpClockGroup = 0;
+  mpFill = 0;
+  mpFillRaw = 0;
+  mpDrain = 0;
+  mpDrainRaw = 0;
+  for( size_t i = 0; i < sizeof(sAudioControls)/sizeof(*sAudioControls); ++i )
+  {
+    this->*sAudioControls[i].pValue = sAudioControls[i].initialValue;
+    this->*sAudioControls[i].pChannelValues = 0;
+  }
   
   mProperties = *pProperties;
   const char* p = mProperties.name;
@@ -142,7 +562,38 @@ VpcmAudioEngine::init( const VpcmProperties* pProperties )
 void
 VpcmAudioEngine::free()
 {
-  mBuffer.free();
+  route( 0 );
+  if( mpClockGroup )
+  {
+    mpClockGroup->leave( this );
+    mpClockGroup = 0;
+  }
+  if( mpTimer )
+  {
+    mpTimer->cancelTimeout();
+    if( workLoop )
+      workLoop->removeEventSource( mpTimer );
+    mpTimer->release();
+    mpTimer = 0;
+  }
+  for( int i = 0; i < MAX_STREAMS; ++i )
+  {
+    delete mStreams[i].pNode;
+    mStreams[i].pNode = 0;
+    for( size_t j = 0; j < sizeof(mStreams[i].io)/sizeof(*mStreams[i].io); ++j )
+    {
+      mStreams[i].io[j].buffer.free();
+      delete[] mStreams[i].io[j].pGains;
+      mStreams[i].io[j].pGains = 0;
+      delete[] mStreams[i].io[j].pLevels;
+      mStreams[i].io[j].pLevels = 0;
+    }
+  }
+  for( size_t i = 0; i < sizeof(sAudioControls)/sizeof(*sAudioControls); ++i )
+  {
+    delete[] ( this->*sAudioControls[i].pChannelValues );
+    this->*sAudioControls[i].pChannelValues = 0;
+  }
   delete[] mProperties.name;
   mProperties.name = 0;
   IOAudioEngine::free();
@@ -157,39 +608,46 @@ VpcmAudioEngine::initHardware( IOService* pProvider )
   int err = DevfsDeviceNode::devCreate( ENGINE_NODE_NAME );
   if( err )
     return false;
+  for( int i = 1; i < mProperties.streams; ++i )
+  {
+    mStreams[i].pNode = new StreamNode( this, mStreams[i] );
+    if( !mStreams[i].pNode || mStreams[i].pNode->devCreate( ENGINE_NODE_NAME ) )
+      return false;
+  }
 
   if( mProperties.name )
     IOAudioEngine::setDescription( mProperties.name );
 
   if( mProperties.rate < 1 )
     return false;
-  ::nanoseconds_to_absolutetime(
-    ( mProperties.bufferFrames * INT64_1E9 ) / mProperties.rate,
-    &mBufferDuration.t
-  );
-  int bufferBytes = mProperties.bufferFrames * mProperties.channels * mProperties.byteWidth;
-  if( !mBuffer.init( bufferBytes ) )
+  if( mProperties.format < 0 || mProperties.format >= VpcmProperties::NumFormats )
     return false;
+  selectKernels();
+  setBufferDuration();
 
-  IOTimerEventSource::Action action = OSMemberFunctionCast(
-    IOTimerEventSource::Action, this,
-    &VpcmAudioEngine::onBufferTimer
-  );
-  mpTimer = IOTimerEventSource::timerEventSource( this, action );
-  if (!mpTimer)
-    return false;
   if( !workLoop )
     return false;
-  workLoop->addEventSource( mpTimer );
+  if( mProperties.clockGroup > 0 )
+  {
+    mpClockGroup = VpcmClockGroup::join( mProperties.clockGroup, this, workLoop );
+    if( !mpClockGroup )
+      return false;
+  }
+  else
+  {
+    IOTimerEventSource::Action action = OSMemberFunctionCast(
+      IOTimerEventSource::Action, this,
+      &VpcmAudioEngine::onBufferTimer
+    );
+    mpTimer = IOTimerEventSource::timerEventSource( this, action );
+    if (!mpTimer)
+      return false;
+    workLoop->addEventSource( mpTimer );
+  }
   
-  IOAudioStreamFormat* pFormat = sFormats, *formatsEnd = sFormats + sizeof(sFormats)/sizeof(*sFormats);
-  while( pFormat->fDriverTag != mProperties.format && pFormat < formatsEnd )
-    ++pFormat;
-  if( pFormat == formatsEnd )
-    return false;
-  IOAudioSampleRate rate = { mProperties.rate, 0 };
+  IOAudioSampleRate rate = { UInt32( mProperties.rate ), 0 };
   IOAudioStreamDirection d[] = { kIOAudioStreamDirectionOutput, kIOAudioStreamDirectionInput };
-  for( int i = 0; i < sizeof(d)/sizeof(*d); ++i )
+  for( size_t i = 0; i < sizeof(d)/sizeof(*d); ++i )
   {
     bool create = false;
     switch( d[i] )
@@ -201,15 +659,32 @@ VpcmAudioEngine::initHardware( IOService* pProvider )
         create = ( mProperties.mode & VpcmProperties::Playback );
         break;
     }
-    if( create )
+    // Streams occupy consecutive channel ranges of the engine.
+    for( int j = 0; create && j < mProperties.streams; ++j )
     {
       IOAudioStream* pStream = new IOAudioStream;
-      if( !pStream || !pStream->initWithAudioEngine( this, d[i], 1 ) )
+      if( !pStream || !pStream->initWithAudioEngine( this, d[i], 1 + j * mProperties.channels ) )
+        return false;
+      if( !setFormat( pStream ) )
+        return false;
+      DevIO& io = mStreams[j].io[d[i]];
+      Buffer& buffer = io.buffer;
+      if( !buffer.init( mProperties.ringFrames(), mProperties ) )
         return false;
-      pFormat->fNumChannels = mProperties.channels;
-      pStream->addAvailableFormat( pFormat, &rate, &rate );
-      pStream->setFormat( pFormat );
-      pStream->setSampleBuffer( mBuffer.begin.c, mBuffer.bytes() );
+      io.pGains = new FloatEmu::Gain[mProperties.channels];
+      io.pLevels = new FloatEmu::Levels[LevelReaders * mProperties.channels];
+      if( !io.pGains || !io.pLevels )
+        return false;
+      ::bzero( io.pLevels, LevelReaders * mProperties.channels * sizeof(*io.pLevels) );
+      for( int c = 0; c < mProperties.channels; ++c )
+      {
+        io.pGains[c].value = FloatEmu::UnityGain;
+        io.pGains[c].target = FloatEmu::UnityGain;
+        io.pGains[c].step = 0;
+      }
+      // The engine sees the first bufferFrames of the ring only; clipOutputSamples() and
+      // convertInputSamples() map engine positions into the ring themselves.
+      pStream->setSampleBuffer( buffer.begin.c, mProperties.bufferFrames * mProperties.frameBytes );
       addAudioStream( pStream );
       pStream->release();
     }
@@ -217,12 +692,26 @@ VpcmAudioEngine::initHardware( IOService* pProvider )
   setSampleRate( &rate );
   setNumSampleFramesPerBuffer( mProperties.bufferFrames );
   setSampleLatency( mProperties.latencyFrames );
+  setReaderClockOffset();
   setMixClipOverhead( 20 );
   
-  for( int i = 0; i < sizeof(sAudioControls)/sizeof(*sAudioControls); ++i )
+  int numControls = sizeof(sAudioControls)/sizeof(*sAudioControls),
+      numChannels = mProperties.channels * mProperties.streams;
+  for( int i = 0; i < numControls; ++i )
+  {
+    int*& pValues = this->*sAudioControls[i].pChannelValues;
+    pValues = new int[numChannels];
+    if( !pValues )
+      return false;
+    for( int c = 0; c < numChannels; ++c )
+      pValues[c] = sAudioControls[i].initialValue;
+  }
+  for( int i = 0; i < numControls * ( 1 + numChannels ); ++i )
   {
-    const ControlDef* pDef = sAudioControls + i;
-    IOAudioControl* pControl = pDef->create( i, pDef->usage, pDef->initialValue );
+    bool global = ( i < numControls );
+    const ControlDef* pDef = sAudioControls + ( global ? i : ( i - numControls ) / numChannels );
+    int channel = global ? kIOAudioControlChannelIDAll : 1 + ( i - numControls ) % numChannels;
+    IOAudioControl* pControl = pDef->create( i, pDef->usage, pDef->initialValue, channel );
     if( !pControl )
       return false;
     IOAudioControl::IntValueChangeHandler onChange =
@@ -238,37 +727,267 @@ VpcmAudioEngine::initHardware( IOService* pProvider )
   return true;
 }
 
+bool
+VpcmAudioEngine::setFormat( IOAudioStream* pStream )
+{
+  IOAudioStreamFormat* pFormat = findFormat( mProperties.format );
+  if( !pFormat )
+    return false;
+  IOAudioSampleRate rate = { UInt32( mProperties.rate ), 0 };
+  pFormat->fNumChannels = mProperties.channels;
+  pStream->clearAvailableFormats();
+  pStream->addAvailableFormat( pFormat, &rate, &rate );
+  pStream->setFormat( pFormat, false );
+  return true;
+}
+
+int
+VpcmAudioEngine::streamIndex( IOAudioStream* pStream ) const
+{
+  int idx = int( pStream->getStartingChannelID() - 1 ) / mProperties.channels;
+  return max( 0, min( idx, mProperties.streams - 1 ) );
+}
+
+void
+VpcmAudioEngine::setBufferDuration()
+{
+  ::nanoseconds_to_absolutetime(
+    ( mProperties.bufferFrames * INT64_1E9 ) / mProperties.rate,
+    &mBufferDuration.t
+  );
+}
+
+// Called on the work loop. Options that only affect the device node are applied in place.
+// A change in buffer size or format requires a new sample buffer, which is swapped
+// while the engine is paused, so it takes effect at a buffer boundary when the engine resumes.
+int
+VpcmAudioEngine::reconfigure( const VpcmProperties* pProperties )
+{
+  const VpcmProperties& p = *pProperties;
+  if( p.mode != mProperties.mode || p.rate != mProperties.rate || p.channels != mProperties.channels
+      || p.streams != mProperties.streams || p.clock != mProperties.clock || p.clockGroup != mProperties.clockGroup
+      || p.framing != mProperties.framing || p.timestampIntervalFrames != mProperties.timestampIntervalFrames )
+    return ENOTSUP;
+  if( mpClockGroup && !mpClockGroup->isCompatible( p.rate, p.bufferFrames ) )
+    return ENOTSUP;
+  if( !findFormat( p.format ) )
+    return EINVAL;
+
+  bool resize = ( p.bufferFrames != mProperties.bufferFrames || p.fifoFrames != mProperties.fifoFrames
+                  || p.format != mProperties.format );
+  if( resize && ( mpRouteTarget || mpRouteSource ) )
+    return EBUSY;
+  bool running = ( getState() == kIOAudioEngineRunning );
+  if( resize && running )
+    pauseAudioEngine();
+
+  const int numRings = sizeof(mStreams->io)/sizeof(*mStreams->io);
+  Synchronization::Lock locks[MAX_STREAMS][numRings];
+  for( int i = 0; i < mProperties.streams; ++i )
+    for( int j = 0; j < numRings; ++j )
+      locks[i][j] = Synchronization::Lock( mStreams[i].io[j].mutex );
+  int err = 0;
+  if( resize )
+  {
+    Buffer buffers[MAX_STREAMS][numRings];
+    for( int i = 0; i < mProperties.streams; ++i )
+      for( int j = 0; j < numRings && !err; ++j )
+        if( mStreams[i].io[j].buffer.pDesc && !buffers[i][j].init( p.ringFrames(), p ) )
+          err = ENOMEM;
+    for( int i = 0; i < mProperties.streams; ++i )
+      for( int j = 0; j < numRings; ++j )
+      {
+        if( err )
+          buffers[i][j].free();
+        else if( buffers[i][j].pDesc )
+        {
+          mStreams[i].io[j].buffer.free();
+          mStreams[i].io[j].buffer = buffers[i][j];
+        }
+      }
+  }
+  if( !err )
+  {
+    char* name = mProperties.name;
+    mProperties = p;
+    mProperties.name = name;
+    selectKernels();
+    setSampleLatency( mProperties.latencyFrames );
+    setReaderClockOffset();
+  }
+  if( resize && !err )
+  {
+    beginConfigurationChange();
+    OSSet* streams[] = { outputStreams, inputStreams };
+    for( size_t i = 0; i < sizeof(streams)/sizeof(*streams); ++i )
+    {
+      IOAudioStream* pStream = 0;
+      for( int j = 0; ( pStream = OSDynamicCast( IOAudioStream, streams[i]->getObject( j ) ) ); ++j )
+      {
+        DevIO& io = mStreams[streamIndex( pStream )].io[pStream->getDirection()];
+        setFormat( pStream );
+        pStream->setSampleBuffer( io.buffer.begin.c, mProperties.bufferFrames * mProperties.frameBytes );
+        io.ptr = io.buffer.begin;
+        io.segment = 0;
+        io.bytesAvail = -1;
+      }
+    }
+    setNumSampleFramesPerBuffer( mProperties.bufferFrames );
+    setBufferDuration();
+    completeConfigurationChange();
+  }
+  if( resize && running )
+    resumeAudioEngine();
+  return err;
+}
+
+// Called on the work loop. The target is claimed before its nodes are checked for writers, while
+// devOpen() marks a node open before onDevOpen() checks for a source, so that a route and a writer
+// never both succeed.
+int
+VpcmAudioEngine::route( VpcmAudioEngine* pTarget )
+{
+  if( pTarget == this )
+    return EINVAL;
+  if( pTarget )
+  {
+    const VpcmProperties& p = pTarget->mProperties;
+    if( !( mProperties.mode & VpcmProperties::Playback ) || !( p.mode & VpcmProperties::Record ) )
+      return EINVAL;
+    if( p.rate != mProperties.rate || p.channels != mProperties.channels || p.streams != mProperties.streams )
+      return EINVAL;
+    // ADPCM state cannot be shared between the engines
+    if( p.format == VpcmProperties::ImaAdpcm || mProperties.format == VpcmProperties::ImaAdpcm )
+      return EINVAL;
+  }
+  Synchronization::Lock lock( mRouteMutex );
+  if( pTarget == mpRouteTarget )
+    return 0;
+  if( pTarget )
+  {
+    if( !__sync_bool_compare_and_swap( &pTarget->mpRouteSource, (VpcmAudioEngine*)0, this ) )
+      return EBUSY;
+    for( int i = 0; i < pTarget->mProperties.streams; ++i )
+      if( pTarget->mStreams[i].ioState & FWRITE )
+      {
+        pTarget->mpRouteSource = 0;
+        return EBUSY;
+      }
+    pTarget->retain();
+  }
+  if( mpRouteTarget )
+  {
+    mpRouteTarget->mpRouteSource = 0;
+    mpRouteTarget->release();
+  }
+  mpRouteTarget = pTarget;
+  return 0;
+}
+
+// Called from clipOutputSamples() with the route mutex held. Data that has just been written into
+// the playback ring is appended to the record ring of the target's corresponding stream, as if it
+// had been written to that stream's device node, and under that ring's mutex, as the target's
+// reconfigure() may swap the ring. If formats match, this is a single copy from ring to ring.
+// Otherwise, the target's format is produced from the mix data. Routes never involve ADPCM data,
+// so all formats have whole bytes per sample.
+void
+VpcmAudioEngine::routeOutputSamples( int stream, DataPtr src, const float* mix, int valueCount )
+{
+  DevIO& io = mpRouteTarget->mStreams[stream].io[Input];
+  Synchronization::Lock lock( io.mutex );
+  int avail = io.bytesAvail;
+  if( avail < 0 )
+    return;
+  int bufferBytes = io.buffer.bytes(),
+      bytesPerValue = mpRouteTarget->mProperties.byteWidth;
+  if( avail > bufferBytes )
+  { // skip data that the target engine has already consumed
+    int skip = avail - bufferBytes;
+    io.ptr.c = io.buffer.begin.c + ( io.ptr.c - io.buffer.begin.c + skip ) % bufferBytes;
+    avail = __sync_sub_and_fetch( &io.bytesAvail, skip );
+  }
+  valueCount = min( valueCount, avail / bytesPerValue );
+  while( valueCount > 0 )
+  {
+    int count = min( valueCount, int( io.buffer.end.c - io.ptr.c ) / bytesPerValue );
+    if( mProperties.format == mpRouteTarget->mProperties.format )
+      ::memcpy( io.ptr.c, src.c, count * bytesPerValue );
+    else
+    {
+      sKernels[mpRouteTarget->mProperties.format].fill[true][VpcmProperties::None]( io.buffer, io.ptr.v, const_cast<float*>( mix ), count, io.pGains, 0 );
+      mix += count;
+    }
+    src.c += count * mProperties.byteWidth;
+    io.ptr.c += count * bytesPerValue;
+    if( io.ptr.c >= io.buffer.end.c )
+      io.ptr = io.buffer.begin;
+    __sync_sub_and_fetch( &io.bytesAvail, count * bytesPerValue );
+    valueCount -= count;
+  }
+}
+
+void
+VpcmAudioEngine::devReset()
+{
+  for( int i = 0; i < mProperties.streams; ++i )
+    for( size_t j = 0; j < sizeof(mStreams[i].io)/sizeof(*mStreams[i].io); ++j )
+      mStreams[i].io[j].bytesAvail = -1;
+}
+
+void
+VpcmAudioEngine::devWakeup()
+{
+  for( int i = 0; i < mProperties.streams; ++i )
+    for( size_t j = 0; j < sizeof(mStreams[i].io)/sizeof(*mStreams[i].io); ++j )
+    {
+      ::selwakeup( &mStreams[i].io[j].sel );
+      mStreams[i].io[j].wait.Wakeup();
+    }
+}
+
 bool
 VpcmAudioEngine::terminate( IOOptionBits options )
 {
-  if( mIOState & FMASK )
+  for( int i = 0; i < mProperties.streams; ++i )
   {
-    const int timeout = 5000, sleep = 5; // ms
-    int time = 0;
-    while( time < timeout && !__sync_bool_compare_and_swap( &mIOState, CLOSING, TERMINATING ) )
+    Stream& s = mStreams[i];
+    if( s.ioState & FMASK )
     {
-      mIOState |= EOF;
-      ::selwakeup( &mDevIOSel );
-      mDevIOWait.Wakeup();
-      ::IOSleep( sleep );
-      time += sleep;
+      const int timeout = 5000, sleep = 5; // ms
+      int time = 0;
+      while( time < timeout && !__sync_bool_compare_and_swap( &s.ioState, IO_CLOSING, IO_TERMINATING ) )
+      {
+        s.ioState |= IO_EOF;
+        devWakeup();
+        ::IOSleep( sleep );
+        time += sleep;
+      }
+      if( time > timeout )
+        return false;
     }
-    if( time > timeout )
-      return false;
   }
+  for( int i = 1; i < mProperties.streams; ++i )
+    if( mStreams[i].pNode && mStreams[i].pNode->devDestroy() != 0 )
+      return false;
   if( devDestroy() != 0 )
     return false;
+  if( mpClockGroup )
+  {
+    mpClockGroup->leave( this );
+    mpClockGroup = 0;
+  }
   return IOAudioEngine::terminate( options );
 }
 
 void
 VpcmAudioEngine::stopEngineAtPosition( IOAudioEnginePosition* endingPosition )
 {
-  if( mProperties.eofOnIdle && mIOState && this->numActiveUserClients == 0 )
+  if( mProperties.eofOnIdle && this->numActiveUserClients == 0 )
   {
-    mIOState |= EOF;
-    ::selwakeup( &mDevIOSel );
-    mDevIOWait.Wakeup();
+    for( int i = 0; i < mProperties.streams; ++i )
+      if( mStreams[i].ioState )
+        mStreams[i].ioState |= IO_EOF;
+    devWakeup();
   }
   IOAudioEngine::stopEngineAtPosition( endingPosition );
 }
@@ -277,50 +996,148 @@ IOReturn
 VpcmAudioEngine::performAudioEngineStart()
 {
   Time now;
-  clock_get_uptime( &now.t );
+  if( mpClockGroup )
+    mpClockGroup->start( this, &now.a );
+  else
+    clock_get_uptime( &now.t );
   this->takeTimeStamp( false, &now.a );
-  mNextTime.t = now.t + mBufferDuration.t;
-  mpTimer->wakeAtTime( mNextTime.a );
-  mDevIOBytesAvail = -1;
+  if( !mpClockGroup )
+    startWallClock( now.t );
+  devReset();
   mWritePosition = 0;
+  mReaderWraps = 0;
   return kIOReturnSuccess;
 }
 
 IOReturn
 VpcmAudioEngine::performAudioEngineStop()
 {
-  mpTimer->cancelTimeout();
+  if( mpClockGroup )
+    mpClockGroup->stop( this );
+  else
+    mpTimer->cancelTimeout();
   return kIOReturnSuccess;
 }
 
 IOReturn
 VpcmAudioEngine::stopAudioEngine()
 {
-  mDevIOBytesAvail = -1;
+  devReset();
   return IOAudioEngine::stopAudioEngine();
 }
 
+// With --clock=reader, engine time advances as the device node reader drains the buffer
+// rather than with wall time. The reader counts buffer wraps and triggers the timer, which
+// then takes one time stamp per wrap. The reader cannot take them itself: it holds the ring's
+// mutex, and reconfigure() waits for that mutex on the work loop, so entering the work loop
+// from the reader could deadlock. Without a reader, the engine falls back to wall time.
+// With --streams, the reader of the first stream drives the clock.
+bool
+VpcmAudioEngine::isReaderClock() const
+{
+  return mProperties.clock == VpcmProperties::ReaderClock && ( mStreams[0].ioState & FREAD );
+}
+
+// CoreAudio mixes at the rate that the wrap time stamps show, and stays the sample offset ahead of
+// the engine. Half a buffer lets a reader that keeps up wrap half a buffer early, so the clock may
+// double its speed with each buffer, rather than gain a single I/O cycle per buffer.
+void
+VpcmAudioEngine::setReaderClockOffset()
+{
+  if( mProperties.clock == VpcmProperties::ReaderClock )
+    setSampleOffset( mProperties.bufferFrames / 2 );
+}
+
 void
 VpcmAudioEngine::onBufferTimer( IOTimerEventSource* )
 {
   Time now;
   clock_get_uptime( &now.t );
+  if( isReaderClock() )
+  { // wraps counted since the last time stamp are spread evenly up to now
+    const int wraps = __sync_fetch_and_and( &mReaderWraps, 0 );
+    const uint64_t last = min( mWrapTime.t, now.t );
+    for( int i = 1; i <= wraps; ++i )
+    {
+      mWrapTime.t = last + ( ( now.t - last ) * i ) / wraps;
+      takeTimeStamp( true, &mWrapTime.a );
+    }
+    return;
+  }
+  // Ticks that have been missed are skipped, as are wraps beyond the first. The time stamp is
+  // the nominal time of the wrap, so that the timer's latency does not show as jitter.
+  bool wrapped = false;
   while( mNextTime.t <= now.t )
-    mNextTime.t += mBufferDuration.t;
-  takeTimeStamp( true, &now.a );
+  {
+    mClockFrame = nextClockFrame();
+    if( mClockFrame >= mProperties.bufferFrames )
+    {
+      mWrapTime.t += mBufferDuration.t;
+      mClockFrame = 0;
+      wrapped = true;
+    }
+    scheduleClockTick();
+  }
+  if( wrapped )
+    takeTimeStamp( true, &mWrapTime.a );
+  mpTimer->wakeAtTime( mNextTime.a );
+}
+
+// Restarts the wall clock with a wrap at the given time.
+void
+VpcmAudioEngine::startWallClock( uint64_t now )
+{
+  mWrapTime.t = now;
+  mClockFrame = 0;
+  scheduleClockTick();
   mpTimer->wakeAtTime( mNextTime.a );
 }
 
+int
+VpcmAudioEngine::nextClockFrame() const
+{
+  if( mProperties.timestampIntervalFrames < 1 )
+    return mProperties.bufferFrames;
+  return min( mClockFrame + mProperties.timestampIntervalFrames, mProperties.bufferFrames );
+}
+
+// Sets mNextTime to the next tick after mClockFrame. Tick times are computed from the wrap time
+// rather than accumulated, so sub-buffer ticks do not drift, and the last tick of a buffer
+// falls exactly on the next wrap.
+void
+VpcmAudioEngine::scheduleClockTick()
+{
+  int frame = nextClockFrame();
+  if( frame >= mProperties.bufferFrames )
+  {
+    mNextTime.t = mWrapTime.t + mBufferDuration.t;
+    return;
+  }
+  Time offset;
+  ::nanoseconds_to_absolutetime( ( frame * INT64_1E9 ) / mProperties.rate, &offset.t );
+  mNextTime.t = mWrapTime.t + offset.t;
+}
+
+void
+VpcmAudioEngine::takeClockGroupTimeStamp( AbsoluteTime* pTime )
+{
+  takeTimeStamp( true, pTime );
+}
+
+// With --timestamp-interval-frames, the position of the clock, to sub-buffer accuracy.
+// Otherwise, the position up to which the engine has clipped playback data.
 UInt32
 VpcmAudioEngine::getCurrentSampleFrame()
 {
+  if( mProperties.timestampIntervalFrames > 0 )
+    return mClockFrame;
   return mWritePosition;
 }
 
 void
-VpcmAudioEngine::resetClipPosition( IOAudioStream*, UInt32 )
+VpcmAudioEngine::resetClipPosition( IOAudioStream* pStream, UInt32 )
 {
-  mDevIOBytesAvail = -1;
+  mStreams[streamIndex( pStream )].io[pStream->getDirection()].bytesAvail = -1;
 }
 
 IOReturn
@@ -329,184 +1146,393 @@ VpcmAudioEngine::eraseOutputSamples( const void* mixBuf, void*, UInt32 firstSamp
   return IOAudioEngine::eraseOutputSamples( mixBuf, 0, firstSampleFrame, numSampleFrames, streamFormat, audioStream );
 }
 
+// Moves the gains of a stream's ring towards the levels of the volume controls, in 0.5 dB steps.
+// Each channel's gain combines the engine-wide level with the channel's own level and mute,
+// so all of them are applied in a single pass. Changes are ramped over a few milliseconds.
+// While the engine-wide mute is on, gains are zero, so unmuting fades in.
+void
+VpcmAudioEngine::updateGains( int stream, int direction )
+{
+  bool output = ( direction == Output );
+  int offset = stream * mProperties.channels,
+      level = output ? mVolume : mGain,
+      muted = output ? mMuteOutput : mMuteInput;
+  const int* pLevels = ( output ? mpChannelVolume : mpChannelGain ) + offset,
+           * pMutes = ( output ? mpChannelMuteOutput : mpChannelMuteInput ) + offset;
+  FloatEmu::Gain* pGains = mStreams[stream].io[direction].pGains;
+  for( int c = 0; c < mProperties.channels; ++c )
+  {
+    FloatEmu::Gain& gain = pGains[c];
+    unsigned int target = pMutes[c] ? 0 : FloatEmu::AttenuationToGain( -( level + pLevels[c] ) );
+    if( muted )
+    {
+      gain.value = 0;
+      gain.target = 0;
+    }
+    else if( target != gain.target )
+      FloatEmu::SetGainTarget( gain, target, ( mProperties.rate * cGainRampMsec ) / 1000 );
+  }
+}
+
+// With --squelch, decides whether a block of playback data is dropped from the device node.
+// Once data has been silent for the hold time, and the reader has consumed everything before,
+// the ring is reset as if the device node had just been opened, so the stream resumes at the
+// next audible block, whose first packet is a discontinuity. Otherwise, silent data is passed on
+// as usual. Only frames that an open reader misses are counted as squelched.
+bool
+VpcmAudioEngine::squelch( Stream& s, const float* mix, int valueCount, int frames )
+{
+  DevIO& io = s.io[Output];
+  if( !mProperties.squelchLevel )
+  {
+    io.silentFrames = 0;
+    return false;
+  }
+  unsigned int threshold = FloatEmu::AttenuationToGain( -2 * mProperties.squelchLevel ) >> 6; // Q30 -> Q24
+  if( FloatEmu::Peak( mix, valueCount ) >= threshold )
+  {
+    io.silentFrames = 0;
+    return false;
+  }
+  int holdFrames = int( ( (int64_t)mProperties.rate * mProperties.squelchMsec ) / 1000 );
+  if( io.silentFrames <= holdFrames )
+    io.silentFrames += frames;
+  if( io.silentFrames <= holdFrames )
+    return false;
+  if( io.bytesAvail >= 0 && !__sync_bool_compare_and_swap( &io.bytesAvail, 0, -1 ) )
+    return false; // the reader has yet to catch up
+  if( s.ioState & FREAD )
+    __sync_fetch_and_add( &io.squelchedFrames, frames );
+  return true;
+}
+
 IOReturn
-VpcmAudioEngine::clipOutputSamples( const void* inpSrc, void*, UInt32 inFrameOffset, UInt32 inFrameCount, const IOAudioStreamFormat*, IOAudioStream* )
+VpcmAudioEngine::clipOutputSamples( const void* inpSrc, void*, UInt32 inFrameOffset, UInt32 inFrameCount, const IOAudioStreamFormat*, IOAudioStream* audioStream )
 {
+  int stream = streamIndex( audioStream );
+  DevIO& io = mStreams[stream].io[Output];
   int channels = mProperties.channels,
-      valueOffset = channels * inFrameOffset,
       valueCount = channels * inFrameCount,
-      bytesPerValue = mProperties.byteWidth;
+      frameBytes = mProperties.frameBytes;
 
-  DataPtr src = { const_cast<void*>( inpSrc ) }, dest = mBuffer.begin;
-  src.f += valueOffset;
-  dest.c += valueOffset * bytesPerValue;
+  DataPtr src = { const_cast<void*>( inpSrc ) }, dest = io.buffer.begin;
+  src.f += channels * inFrameOffset;
+  dest.c += io.segment + inFrameOffset * frameBytes;
+  if( io.bytesAvail < 0 && io.buffer.pAdpcm )
+    for( int i = 0; i < channels; ++i )
+      io.buffer.pAdpcm[i].reset(); // the reader starts decoding here
+  // Muted data is encoded rather than cleared, so codecs see silence and keep their state.
+  updateGains( stream, Output );
+  FillFunc fill = mpFill;
   if( mMuteOutput )
-    ::bzero( dest.c, valueCount * bytesPerValue );
-  else
   {
-    if( !mProperties.raw )
+    ::bzero( src.f, valueCount * sizeof(float) );
+    fill = mpFillRaw;
+  }
+  if( io.buffer.pBlockAdpcm )
+  { // encoded block by block, recording the encoder state at the start of each
+    int frame = int( dest.c - io.buffer.begin.c ) / frameBytes;
+    for( int done = 0; done < int( inFrameCount ); )
     {
-      FloatEmu::Scale( src.f, valueCount, mVolume );
-      FloatEmu::Clip( src.f, valueCount );
+      if( frame % cAdpcmBlockFrames == 0 )
+        ::memcpy( io.buffer.pBlockAdpcm + frame / cAdpcmBlockFrames * channels, io.buffer.pAdpcm,
+                  channels * sizeof(Codecs::AdpcmState) );
+      int n = min( int( inFrameCount ) - done, cAdpcmBlockFrames - frame % cAdpcmBlockFrames );
+      fill( io.buffer, dest.c + done * frameBytes, src.f + done * channels, n * channels, io.pGains, io.pLevels );
+      done += n;
+      frame += n;
     }
-    switch( mProperties.format )
-    {
-      case VpcmProperties::Int16:
-        FloatEmu::FloatToInt16Copy( dest.s, src.f, valueCount );
-        break;
-      case VpcmProperties::Float32:
-        ::memcpy( dest.c, src.c, valueCount * bytesPerValue );
-        break;
+  }
+  else
+    fill( io.buffer, dest.v, src.f, valueCount, io.pGains, io.pLevels );
+  if( mProperties.framing == VpcmProperties::Packets )
+  { // CoreAudio mixes ahead in bursts, so a frame is played no earlier than the previous anchor
+    // puts it, which keeps the times of packets from going backwards
+    uint64_t now, time;
+    ::clock_get_uptime( &now );
+    ::absolutetime_to_nanoseconds( now, &time );
+    uint64_t extrapolated = io.anchorTime + ( ( io.writeFrame - io.anchorFrame ) * INT64_1E9 ) / mProperties.rate;
+    time = max( time, extrapolated );
+    __sync_add_and_fetch( &io.anchorSeq, 1 );
+    io.anchorFrame = io.writeFrame;
+    io.anchorTime = time;
+    __sync_add_and_fetch( &io.anchorSeq, 1 );
+  }
+  if( !squelch( mStreams[stream], src.f, valueCount, inFrameCount ) )
+  {
+    if( io.bytesAvail < 0 )
+    { // counted before the data is made available, so that the reader sees a discontinuity
+      io.ptr = dest;
+      io.startFrame = io.writeFrame;
+      __sync_add_and_fetch( &io.restarts, 1 );
+      io.bytesAvail = 0;
     }
+    if( __sync_add_and_fetch( &io.bytesAvail, inFrameCount * frameBytes ) > 0 )
+      ::selwakeup( &io.sel );
+    io.wait.Wakeup();
   }
-  if( mDevIOBytesAvail < 0 )
+  if( mpRouteTarget )
   {
-    mDevIOPtr = dest;
-    mDevIOBytesAvail = 0;
+    Synchronization::Lock lock( mRouteMutex );
+    if( mpRouteTarget )
+      routeOutputSamples( stream, dest, src.f, valueCount );
   }
-  if( __sync_add_and_fetch( &mDevIOBytesAvail, valueCount * bytesPerValue ) > 0 )
-    ::selwakeup( &mDevIOSel );
-  mDevIOWait.Wakeup();
+  io.writeFrame += inFrameCount;
+  advanceSegment( io, inFrameOffset + inFrameCount );
   mWritePosition = ( inFrameOffset + inFrameCount ) % numSampleFramesPerBuffer;
   return kIOReturnSuccess;
 }
 
 IOReturn
-VpcmAudioEngine::convertInputSamples( const void*, void* inpDest, UInt32 inFrameOffset, UInt32 inFrameCount, const IOAudioStreamFormat*, IOAudioStream* )
+VpcmAudioEngine::convertInputSamples( const void*, void* inpDest, UInt32 inFrameOffset, UInt32 inFrameCount, const IOAudioStreamFormat*, IOAudioStream* audioStream )
 {
+  int stream = streamIndex( audioStream );
+  DevIO& io = mStreams[stream].io[Input];
   int channels = mProperties.channels,
-      valueOffset = channels * inFrameOffset,
-      valueCount = channels * inFrameCount,
-      bytesPerValue = mProperties.byteWidth;
+      frameCount = inFrameCount,
+      frameBytes = mProperties.frameBytes;
   
-  DataPtr src = mBuffer.begin, dest = { inpDest };
-  src.c += valueOffset * bytesPerValue;
+  DataPtr src = io.buffer.begin, dest = { inpDest };
+  src.c += io.segment + inFrameOffset * frameBytes;
+  // Frames that the writer has yet to provide are read as silence. They count as consumed all
+  // the same, so the writer skips them, and its data stays aligned with the engine's position.
+  int valid = 0;
+  if( io.bytesAvail >= 0 )
+    valid = max( 0, min( frameCount, ( io.buffer.bytes() - io.bytesAvail ) / frameBytes ) );
+  // Muted data is decoded anyway, so codecs keep their state. Levels are measured after muting,
+  // as for playback.
+  updateGains( stream, Input );
   if( mMuteInput )
-    ::bzero( dest.f, valueCount * sizeof(float) );
-  else
   {
-    int invalid = 0;
-    if( mDevIOBytesAvail < 0 )
-      invalid = valueCount;
-    else
-    {
-      int valid = ( mBuffer.bytes() - mDevIOBytesAvail ) / bytesPerValue;
-      invalid = max( 0, valueCount - valid );
-    }
-    ::bzero( dest.f, invalid * sizeof(float) );
-    dest.f += invalid;
-    src.c += invalid * bytesPerValue;
-    valueCount -= invalid;
-    switch( mProperties.format )
-    {
-      case VpcmProperties::Int16:
-        FloatEmu::Int16ToFloatCopy( dest.f, src.s, valueCount );
-        break;
-      case VpcmProperties::Float32:
-        ::memcpy( dest.c, src.c, valueCount * bytesPerValue );
-        break;
-    }
-    if( !mProperties.raw )
-    {
-      FloatEmu::Scale( dest.f, valueCount, mGain );
-      FloatEmu::Clip( dest.f, valueCount );
-    }
+    mpDrainRaw( io.buffer, dest.f, src.v, valid * channels, io.pGains, 0 );
+    ::bzero( dest.f, valid * channels * sizeof(float) );
+    if( io.pLevels )
+      FloatEmu::MeasureLevels( dest.f, valid * channels, channels, io.pLevels, LevelReaders );
   }
-  if( mDevIOBytesAvail < 0 )
+  else
+    mpDrain( io.buffer, dest.f, src.v, valid * channels, io.pGains, io.pLevels );
+  ::bzero( dest.f + valid * channels, ( frameCount - valid ) * channels * sizeof(float) );
+  int consumed = frameCount * frameBytes;
+  if( io.bytesAvail < 0 )
   {
-    src.c += valueCount * bytesPerValue;
-    if( src.c >= mBuffer.end.c )
-       src = mBuffer.begin;
-    mDevIOPtr = src;
-    mDevIOBytesAvail = mBuffer.bytes();
+    src.c += consumed;
+    if( src.c >= io.buffer.end.c )
+       src = io.buffer.begin;
+    io.ptr = src;
+    io.bytesAvail = io.buffer.bytes();
+    consumed = 0;
+    for( int i = 0; io.buffer.pAdpcm && i < channels; ++i )
+      io.buffer.pAdpcm[i].reset(); // the writer starts encoding here
   }
-  if( __sync_add_and_fetch( &mDevIOBytesAvail, valueCount * bytesPerValue ) > 0 )
-    ::selwakeup( &mDevIOSel );
-  mDevIOWait.Wakeup();
+  if( __sync_add_and_fetch( &io.bytesAvail, consumed ) > 0 )
+    ::selwakeup( &io.sel );
+  io.wait.Wakeup();
+  advanceSegment( io, inFrameOffset + inFrameCount );
   return kIOReturnSuccess;
 }
 
+// Moves the ring pointer past data that is lost to an overflow or underrun, so transfers
+// resume at the oldest data that is still valid.
+void
+VpcmAudioEngine::skipRingBytes( DevIO& io, int bytes )
+{
+  io.ptr.c = io.buffer.begin.c + ( io.ptr.c - io.buffer.begin.c + bytes ) % io.buffer.bytes();
+}
+
+// After an overflow, moves the read pointer of an IMA ADPCM ring on to the start of the next
+// block, as far as data is available, and takes the decoder state from the block once there.
+// Returns the number of bytes skipped.
+int
+VpcmAudioEngine::skipToAdpcmBlock( DevIO& io, int avail )
+{
+  const int channels = mProperties.channels, blockBytes = cAdpcmBlockFrames * mProperties.frameBytes;
+  int offset = int( io.ptr.c - io.buffer.begin.c ), skip = 0;
+  if( offset % blockBytes )
+    skip = min( min( blockBytes - offset % blockBytes, io.buffer.bytes() - offset ), avail );
+  skipRingBytes( io, skip );
+  offset = int( io.ptr.c - io.buffer.begin.c );
+  if( offset % blockBytes == 0 )
+  {
+    ::memcpy( io.buffer.pReadAdpcm, io.buffer.pBlockAdpcm + offset / blockBytes * channels,
+              channels * sizeof(Codecs::AdpcmState) );
+    io.adpcmResync = false;
+  }
+  return skip;
+}
+
+// The engine passes data in blocks that never cross the end of its buffer. Once a block ends
+// there, the engine's next pass goes into the next segment of the ring.
+void
+VpcmAudioEngine::advanceSegment( DevIO& io, UInt32 endFrame )
+{
+  if( endFrame < numSampleFramesPerBuffer )
+    return;
+  io.segment += numSampleFramesPerBuffer * mProperties.frameBytes;
+  if( io.segment >= io.buffer.bytes() )
+    io.segment = 0;
+}
+
 #if TARGET_OS_OSX && TARGET_CPU_ARM64
+// High resolution sample intervals are only worth it when the clock ticks more often than
+// once per buffer; with wrap time stamps alone, they just add noise.
 bool VpcmAudioEngine::driverDesiresHiResSampleIntervals() {
-    return false;
+    return mProperties.timestampIntervalFrames > 0;
 }
 #endif
 
 int
-VpcmAudioEngine::getIOFlags() const
+VpcmAudioEngine::getIOFlags( int stream ) const
 {
-  return mIOState & FMASK;
+  return mStreams[stream].ioState & FMASK;
+}
+
+const char*
+VpcmAudioEngine::getStreamNodeName( int stream ) const
+{
+  if( stream == 0 )
+    return devName();
+  return mStreams[stream].pNode ? mStreams[stream].pNode->devName() : 0;
+}
+
+bool
+VpcmAudioEngine::getRingState( int stream, int direction, RingState* pState ) const
+{
+  if( stream < 0 || stream >= mProperties.streams || direction < Output || direction > Input )
+    return false;
+  const DevIO& io = mStreams[stream].io[direction];
+  if( !io.buffer.pDesc )
+    return false;
+  pState->bytes = io.buffer.bytes();
+  pState->offset = int( io.ptr.c - io.buffer.begin.c );
+  pState->bytesAvail = io.bytesAvail;
+  pState->segment = io.segment;
+  return true;
 }
 
 int
 VpcmAudioEngine::devOpen( int flags )
+{
+  return devOpen( mStreams[0], flags );
+}
+
+int
+VpcmAudioEngine::devOpen( Stream& s, int flags )
 {
   int err = 0;
   if( mProperties.mode == VpcmProperties::Playback && (flags & FWRITE) )
     err = ENOTSUP;
   else if( mProperties.mode == VpcmProperties::Record && (flags & FREAD) )
     err = ENOTSUP;
-  else if( (flags & FREAD) && (flags & FWRITE) )
-    err = ENOTSUP;
-  else if( !__sync_bool_compare_and_swap( &mIOState, 0, flags ) )
+  else if( !__sync_bool_compare_and_swap( &s.ioState, 0, flags ) )
     err = EACCES;
   else
     err = workLoop->runAction(
       OSMemberFunctionCast( IOWorkLoop::Action, this, &VpcmAudioEngine::onDevOpen ),
-      this
+      this, &s
     );
+  if( !err ) // an open node keeps the engine, which may be terminated meanwhile
+    retain();
   return err;
 }
 
 int
-VpcmAudioEngine::onDevOpen()
+VpcmAudioEngine::onDevOpen( Stream* pStream )
 {
-  mDevIOBytesAvail = -1;
-  ::memset( mBuffer.begin.c, 0, mBuffer.bytes() );
+  if( ( pStream->ioState & FWRITE ) && mpRouteSource )
+  {
+    pStream->ioState = 0;
+    return EBUSY;
+  }
+  for( size_t i = 0; i < sizeof(pStream->io)/sizeof(*pStream->io); ++i )
+  {
+    DevIO& io = pStream->io[i];
+    io.bytesAvail = -1;
+    if( io.buffer.begin.c )
+      ::memset( io.buffer.begin.c, silenceByte( mProperties.format ), io.buffer.bytes() );
+  }
   return 0;
 }
 
 int
 VpcmAudioEngine::devClose()
 {
-  mIOState = CLOSING;
-  ::selthreadclear( &mDevIOSel );
-  return workLoop->runAction(
+  return devClose( mStreams[0] );
+}
+
+int
+VpcmAudioEngine::devClose( Stream& s )
+{
+  s.ioState = IO_CLOSING;
+  for( size_t i = 0; i < sizeof(s.io)/sizeof(*s.io); ++i )
+    ::selthreadclear( &s.io[i].sel );
+  int err = workLoop->runAction(
     OSMemberFunctionCast( IOWorkLoop::Action, this, &VpcmAudioEngine::onDevClose ),
-    this
+    this, &s
   );
+  release();
+  return err;
 }
 
 int
-VpcmAudioEngine::onDevClose()
+VpcmAudioEngine::onDevClose( Stream* pStream )
 {
-  mIOState &= ~CLOSING;
+  pStream->ioState &= ~IO_CLOSING;
+  if( pStream == mStreams && mProperties.clock == VpcmProperties::ReaderClock
+      && getState() == kIOAudioEngineRunning )
+  { // resume wall clock time stamps
+    Time now;
+    clock_get_uptime( &now.t );
+    startWallClock( now.t );
+  }
   return 0;
 }
 
 int
 VpcmAudioEngine::devIoctl( u_long cmd, caddr_t data )
 {
-  int err = 0, arg = *(int*)data;
+  return devIoctl( mStreams[0], cmd, data );
+}
+
+int
+VpcmAudioEngine::devIoctl( Stream& s, u_long cmd, caddr_t data )
+{
+  int err = 0;
   int64_t result = 0;
+  const DevIO& r = s.io[( mProperties.mode & VpcmProperties::Playback ) ? Output : Input],
+              & w = s.io[( mProperties.mode & VpcmProperties::Record ) ? Input : Output];
   switch( cmd )
   {
     case FIONBIO:
+    {
+      int arg = *(int*)data;
       if( arg )
-        __sync_or_and_fetch( &mIOState, FNONBLOCK );
+        __sync_or_and_fetch( &s.ioState, FNONBLOCK );
       else
-        __sync_and_and_fetch( &mIOState, ~FNONBLOCK );
+        __sync_and_and_fetch( &s.ioState, ~FNONBLOCK );
       result = arg;
       break;
+    }
     case FIONREAD:
-      result = mDevIOBytesAvail < 0 ? 0 : min( mDevIOBytesAvail, mBuffer.bytes() );
+      result = r.bytesAvail < 0 ? 0 : min( r.bytesAvail, r.buffer.bytes() );
       break;
     case FIONWRITE:
-      result = mDevIOBytesAvail < 0 ? 0 : mBuffer.bytes() - min( mDevIOBytesAvail, mBuffer.bytes() );
+      result = w.bytesAvail < 0 ? 0 : w.buffer.bytes() - min( w.bytesAvail, w.buffer.bytes() );
       break;
     case FIONSPACE:
-      result = mDevIOBytesAvail < 0 ? 0 : min( mDevIOBytesAvail, mBuffer.bytes() );
+      result = w.bytesAvail < 0 ? 0 : max( 0, min( w.bytesAvail, w.buffer.bytes() ) - devReservedBytes( s, UIO_WRITE ) );
       break;
+    case VPCMIOCGLEVELS:
+      return takeLevels( int( &s - mStreams ), LevelsIoctl, reinterpret_cast<vpcm_levels*>( data ) );
+    case VPCMIOCGSQUELCH:
+    {
+      if( !( mProperties.mode & VpcmProperties::Playback ) )
+        return ENOTTY;
+      vpcm_squelch* pSquelch = reinterpret_cast<vpcm_squelch*>( data );
+      const DevIO& io = s.io[Output];
+      pSquelch->frames = io.squelchedFrames;
+      pSquelch->squelched = ( mProperties.squelchLevel && io.silentFrames > 0 && io.bytesAvail < 0 );
+      return 0;
+    }
     default:
       err = ENOTTY;
   }
@@ -515,90 +1541,321 @@ VpcmAudioEngine::devIoctl( u_long cmd, caddr_t data )
   return err;
 }
 
+// With --framing=packet, playback data is read as a sequence of packets, each consisting of a
+// vpcm_packet header and whole frames of payload. A read returns as many packets as fit.
+// Packets end at discontinuities, at the end of the ring, and at the end of the read buffer.
+// IMA ADPCM headers carry the decoder state at the read pointer, which follows the data read.
+int
+VpcmAudioEngine::devTransferPackets( Stream& s, struct uio* uio )
+{
+  DevIO& io = s.io[Output];
+  const int frameBytes = mProperties.frameBytes, bufferBytes = io.buffer.bytes();
+  Codecs::AdpcmState* pAdpcm = io.buffer.pReadAdpcm;
+  if( io.readRestarts != io.restarts )
+  {
+    io.readRestarts = io.restarts;
+    io.readFrame = io.startFrame;
+    io.discontinuity = true;
+    for( int i = 0; pAdpcm && i < mProperties.channels; ++i )
+      pAdpcm[i].reset(); // the engine restarted encoding at the read pointer
+    io.adpcmResync = false;
+  }
+  int avail = io.bytesAvail;
+  if( avail > bufferBytes && mProperties.overflow == VpcmProperties::Discard )
+  {
+    int skip = avail - bufferBytes;
+    skipRingBytes( io, skip );
+    avail = __sync_sub_and_fetch( &io.bytesAvail, skip );
+    io.readFrame += skip / frameBytes;
+    io.discontinuity = true;
+    io.adpcmResync = ( pAdpcm != 0 );
+  }
+  uint32_t fill[256];
+  ::memset( fill, silenceByte( mProperties.format ), sizeof(fill) );
+  const int headerBytes = int( sizeof(vpcm_packet) ) + ( pAdpcm ? mProperties.channels * int( sizeof(vpcm_adpcm_state) ) : 0 );
+  int transferred = 0, skipped = 0, err = 0;
+  user_ssize_t resid = ::uio_resid( uio );
+  while( avail > 0 && resid >= headerBytes + frameBytes && !err )
+  {
+    bool isFill = ( avail > bufferBytes );
+    if( !isFill && io.adpcmResync )
+    {
+      int skip = skipToAdpcmBlock( io, avail );
+      if( skip )
+      {
+        avail = __sync_sub_and_fetch( &io.bytesAvail, skip );
+        io.readFrame += skip / frameBytes;
+        io.discontinuity = true;
+        skipped += skip;
+      }
+      continue;
+    }
+    int64_t bytes = isFill ? avail - bufferBytes : min( avail, io.buffer.end.c - io.ptr.c );
+    bytes = min( bytes, resid - headerBytes );
+    bytes -= bytes % frameBytes;
+    if( bytes < 1 )
+      break;
+
+    vpcm_packet header = vpcm_packet();
+    header.magic = VPCM_PACKET_MAGIC;
+    header.headerBytes = uint16_t( headerBytes );
+    header.flags = ( io.discontinuity ? VPCM_PACKET_DISCONTINUITY : 0 ) | ( isFill ? VPCM_PACKET_FILL : 0 );
+    header.payloadBytes = uint32_t( bytes );
+    header.rate = mProperties.rate;
+    header.frame = io.readFrame;
+    header.channels = mProperties.channels;
+    header.format = mProperties.format;
+    int seq = 0;
+    do
+    {
+      seq = io.anchorSeq;
+      __sync_synchronize();
+      header.hostTime = io.anchorTime + ( (int64_t)( io.readFrame - io.anchorFrame ) * INT64_1E9 ) / mProperties.rate;
+      __sync_synchronize();
+    } while( ( seq & 1 ) || seq != io.anchorSeq );
+    err = ::uiomove( reinterpret_cast<char*>( &header ), sizeof(header), uio );
+    for( int c = 0; pAdpcm && c < mProperties.channels && !err; )
+    {
+      vpcm_adpcm_state states[32] = {};
+      int n = min( mProperties.channels - c, int( sizeof(states)/sizeof(*states) ) );
+      for( int i = 0; i < n; ++i, ++c )
+      {
+        states[i].predictor = int16_t( pAdpcm[c].predictor );
+        states[i].index = uint8_t( pAdpcm[c].index );
+      }
+      err = ::uiomove( reinterpret_cast<char*>( states ), n * int( sizeof(*states) ), uio );
+    }
+    io.discontinuity = false;
+    if( isFill && pAdpcm )
+      io.adpcmResync = true;
+
+    for( int64_t left = bytes; left > 0 && !err; )
+    {
+      int n = 0;
+      if( isFill )
+      {
+        if( mProperties.overflow == VpcmProperties::Noise )
+          for( size_t i = 0; i < sizeof(fill)/sizeof(*fill); ++i )
+            fill[i] = ::random();
+        n = int( min( left, int64_t( sizeof(fill) ) ) );
+        err = ::uiomove( reinterpret_cast<char*>( fill ), n, uio );
+        skipRingBytes( io, n );
+      }
+      else
+      {
+        n = int( left );
+        err = ::uiomove( io.ptr.c, n, uio );
+        if( pAdpcm )
+          advanceAdpcm( pAdpcm, io.ptr.c, n, mProperties.channels );
+        io.ptr.c += n;
+        if( io.ptr.c >= io.buffer.end.c )
+        {
+          io.ptr = io.buffer.begin;
+          if( &s == mStreams && isReaderClock() )
+          {
+            __sync_add_and_fetch( &mReaderWraps, 1 );
+            mpTimer->setTimeoutUS( 1 ); // the time stamp is taken on the work loop, see isReaderClock()
+          }
+        }
+      }
+      left -= n;
+    }
+    avail -= int( bytes );
+    transferred += int( bytes );
+    io.readFrame += bytes / frameBytes;
+    resid = ::uio_resid( uio );
+  }
+  __sync_sub_and_fetch( &io.bytesAvail, transferred );
+  if( !transferred && !err )
+    err = skipped ? -1 : EINVAL; // -1 if data was skipped up to a block that has yet to arrive
+  return err;
+}
+
 int
-VpcmAudioEngine::devSelect( int, void* wql, struct proc* p )
+VpcmAudioEngine::takeLevels( int stream, int reader, vpcm_levels* pLevels )
 {
-  if( mDevIOBytesAvail > 0 )
+  int direction = -1;
+  switch( pLevels->direction )
+  {
+    case VPCM_METER_DEFAULT:
+      direction = ( mProperties.mode & VpcmProperties::Playback ) ? Output : Input;
+      break;
+    case VPCM_METER_PLAYBACK:
+      if( mProperties.mode & VpcmProperties::Playback )
+        direction = Output;
+      break;
+    case VPCM_METER_RECORD:
+      if( mProperties.mode & VpcmProperties::Record )
+        direction = Input;
+      break;
+  }
+  if( direction < 0 || stream < 0 || stream >= mProperties.streams || reader < 0 || reader >= LevelReaders )
+    return EINVAL;
+  FloatEmu::Levels* pAccumulators = mStreams[stream].io[direction].pLevels;
+  if( !pAccumulators )
+    return ENXIO;
+  pAccumulators += reader * mProperties.channels;
+  pLevels->channels = min( mProperties.channels, VPCM_MAX_METER_CHANNELS );
+  for( int c = 0; c < pLevels->channels; ++c )
+    FloatEmu::TakeLevels( pAccumulators[c], pLevels->peak + c, pLevels->rms + c );
+  return 0;
+}
+
+int
+VpcmAudioEngine::devSelect( int which, void* wql, struct proc* p )
+{
+  return devSelect( mStreams[0], which, wql, p );
+}
+
+int
+VpcmAudioEngine::devSelect( Stream& s, int which, void* wql, struct proc* p )
+{
+  int rw = which == FWRITE ? UIO_WRITE : UIO_READ;
+  DevIO& io = s.io[rw == UIO_READ ? Output : Input];
+  if( io.bytesAvail - devReservedBytes( s, rw ) > 0 )
     return 1;
-  ::selrecord( p, &mDevIOSel, wql );
+  ::selrecord( p, &io.sel, wql );
   return 0;
 }
 
 int
 VpcmAudioEngine::devRead( struct uio* uio )
 {
-  return devReadWrite( uio );
+  return devReadWrite( mStreams[0], uio );
 }
 
 int
 VpcmAudioEngine::devWrite( struct uio* uio )
 {
-  return devReadWrite( uio );
+  return devReadWrite( mStreams[0], uio );
 }
 
 int
-VpcmAudioEngine::devReadWrite( struct uio* uio )
+VpcmAudioEngine::devReadWrite( Stream& s, struct uio* uio )
 {
   user_ssize_t resid = ::uio_resid( uio );
   int rw = ::uio_rw( uio );
   if( resid < 1 )
     return 0;
-  
-  while( mDevIOBytesAvail < 1 )
-  {
-    if( mProperties.posixPipe && numActiveUserClients < 1 )
-      return EPIPE;
-    if( mIOState & EOF )
-      return rw == UIO_READ ? 0 : EPIPE;
-    if( mIOState & FNONBLOCK )
-      return EWOULDBLOCK;
-    if( mIOState & TERMINATING )
-      return EDEVERR;
-    int err = mDevIOWait.Sleep();
-    if( err )
-      return err;
+
+  DevIO& io = s.io[rw == UIO_READ ? Output : Input];
+  for( ;; )
+  {
+    unsigned ticket = io.wait.Ticket();
+    while( io.bytesAvail - devReservedBytes( s, rw ) < 1 )
+    {
+      int err = 0;
+      if( devWaitEnds( s, rw, &err ) )
+        return err;
+      if( s.ioState & FNONBLOCK )
+        return EWOULDBLOCK;
+      err = io.wait.Sleep( ticket );
+      if( err )
+        return err;
+      ticket = io.wait.Ticket();
+    }
+    Synchronization::Lock lock( io.mutex );
+    if( io.bytesAvail - devReservedBytes( s, rw ) > 0 )
+    {
+      int err = ( rw == UIO_READ && mProperties.framing == VpcmProperties::Packets ) ?
+        devTransferPackets( s, uio ) : devTransfer( s, uio );
+      if( err >= 0 )
+        return err;
+      continue; // all data available was skipped
+    }
+    // The buffer has been reconfigured while we were waiting for the lock.
   }
+}
+
+// Returns true if a read or write that waits for data must return instead, with the result in
+// *pErr: 0 at the end of file of a read, or an error.
+bool
+VpcmAudioEngine::devWaitEnds( const Stream& s, int rw, int* pErr ) const
+{
+  if( mProperties.posixPipe && numActiveUserClients < 1 )
+    *pErr = EPIPE;
+  else if( s.ioState & IO_EOF )
+    *pErr = rw == UIO_READ ? 0 : EPIPE;
+  else if( s.ioState & IO_TERMINATING )
+    *pErr = EDEVERR;
+  else
+    return false;
+  return true;
+}
 
-  if( mDevIOBytesAvail > mBuffer.bytes() && mProperties.overflow == VpcmProperties::Discard )
-    mDevIOBytesAvail = mBuffer.bytes();
+// With --write-lead-frames, a writer may only stay that many frames ahead of the engine's
+// read position. The remainder of the buffer is held back, so the writer blocks until
+// convertInputSamples() has consumed data.
+int
+VpcmAudioEngine::devReservedBytes( const Stream& s, int rw ) const
+{
+  if( rw != UIO_WRITE || mProperties.writeLeadFrames < 1 )
+    return 0;
+  return s.io[Input].buffer.bytes() - mProperties.writeLeadFrames * mProperties.frameBytes;
+}
+
+int
+VpcmAudioEngine::devTransfer( Stream& s, struct uio* uio )
+{
+  user_ssize_t resid = ::uio_resid( uio );
+  int rw = ::uio_rw( uio );
+  DevIO& io = s.io[rw == UIO_READ ? Output : Input];
 
-  int avail = mDevIOBytesAvail,
+  if( io.bytesAvail > io.buffer.bytes() && mProperties.overflow == VpcmProperties::Discard )
+  {
+    int skip = io.bytesAvail - io.buffer.bytes();
+    skipRingBytes( io, skip );
+    __sync_sub_and_fetch( &io.bytesAvail, skip );
+  }
+
+  int avail = io.bytesAvail,
+      reserved = devReservedBytes( s, rw ),
       transferred = 0,
       err = 0;
-  if( avail > mBuffer.bytes() )
+  if( avail > io.buffer.bytes() )
   {
     uint32_t fill[256] = { 0 };
-    while( avail > mBuffer.bytes() && resid > 0 && !err )
+    if( silenceByte( mProperties.format ) )
+      ::memset( fill, silenceByte( mProperties.format ), sizeof(fill) );
+    while( avail > io.buffer.bytes() && resid > 0 && !err )
     {
       if( rw == UIO_READ && mProperties.overflow == VpcmProperties::Noise )
         for( size_t i = 0; i < sizeof(fill)/sizeof(*fill); ++i )
           fill[i] = ::random();
-      int64_t bytes = min( avail - mBuffer.bytes(), sizeof(fill) );
+      int64_t bytes = min( avail - io.buffer.bytes(), int( sizeof(fill) ) );
       err = ::uiomove( reinterpret_cast<char*>( fill ), (int)bytes, uio );
       user_ssize_t newResid = ::uio_resid( uio );
       int bytesTransferred = int( resid - newResid );
+      skipRingBytes( io, bytesTransferred );
       avail -= bytesTransferred;
       transferred += bytesTransferred;
       resid = newResid;
     }
   }
-  while( avail > 0 && resid > 0 && !err )
+  while( avail > reserved && resid > 0 && !err )
   {
-    int64_t bytes = min( avail, mBuffer.end.c - mDevIOPtr.c );
-    err = ::uiomove( mDevIOPtr.c, (int)bytes, uio );
+    int64_t bytes = min( avail - reserved, io.buffer.end.c - io.ptr.c );
+    err = ::uiomove( io.ptr.c, (int)bytes, uio );
     user_ssize_t newResid = ::uio_resid( uio );
     int bytesTransferred = int( resid - newResid );
-    DataPtr p = { mDevIOPtr.c + bytesTransferred };
-    if( p.c > mBuffer.end.c )
+    DataPtr p = { io.ptr.c + bytesTransferred };
+    if( p.c > io.buffer.end.c )
       return EDEVERR;
-    if( p.c == mBuffer.end.c )
-      p = mBuffer.begin;
-    mDevIOPtr = p;
+    if( p.c == io.buffer.end.c )
+    {
+      p = io.buffer.begin;
+      if( rw == UIO_READ && &s == mStreams && isReaderClock() )
+      {
+        __sync_add_and_fetch( &mReaderWraps, 1 );
+        mpTimer->setTimeoutUS( 1 ); // the time stamp is taken on the work loop, see isReaderClock()
+      }
+    }
+    io.ptr = p;
     avail -= bytesTransferred;
     transferred += bytesTransferred;
     resid = newResid;
   }
-  __sync_sub_and_fetch( &mDevIOBytesAvail, transferred );
+  __sync_sub_and_fetch( &io.bytesAvail, transferred );
   return err;
 }
 
@@ -5,16 +5,36 @@
 #include "DevfsDeviceNode.h"
 #include "Synchronization.h"
 #include "VpcmProperties.h"
+#include "Codecs.h"
+#include "FloatEmu.h"
+
+class VpcmClockGroup;
 
 extern "C" struct selinfo { char data[128]; }; // no actual declaration available, size guessed
 
 class VpcmAudioEngine : public IOAudioEngine, public DevfsDeviceNode
 {
     OSDeclareDefaultStructors( VpcmAudioEngine )
+    friend class VpcmAggregateNode;
     
 public:
     const VpcmProperties* getProperties() const { return &mProperties; }
-    int getIOFlags() const;
+    // With --streams, stream 0 is served by the engine's own device node.
+    int getIOFlags( int stream = 0 ) const;
+    const char* getStreamNodeName( int stream ) const;
+    // Takes the levels of a stream accumulated since the reader's last call, see VpcmIoctl.h.
+    // Each reader has its own accumulators.
+    enum { LevelsIoctl, LevelsMeter, LevelReaders };
+    int takeLevels( int stream, int reader, struct vpcm_levels* );
+    int reconfigure( const VpcmProperties* );
+    // Routes playback data into the record ring of another engine, or removes the route if 0.
+    int route( VpcmAudioEngine* );
+    const VpcmAudioEngine* getRouteTarget() const { return mpRouteTarget; }
+    void takeClockGroupTimeStamp( AbsoluteTime* );
+    // The state of one of a stream's rings, indexed by IOAudioStreamDirection, for tests.
+    // Returns false if the ring does not exist.
+    struct RingState { int bytes, offset, bytesAvail, segment; };
+    bool getRingState( int stream, int direction, RingState* ) const;
   
 // IOAudioEngine
     virtual bool init( const VpcmProperties* );
@@ -40,23 +60,45 @@ public:
     
 private:
     void onBufferTimer( IOTimerEventSource* );
+    void startWallClock( uint64_t );
+    void scheduleClockTick();
+    int nextClockFrame() const;
+    bool isReaderClock() const;
+    void setReaderClockOffset();
     IOReturn onControlChanged( IOAudioControl*, SInt32, SInt32 );
-    int onDevOpen();
-    int onDevClose();
+    bool setFormat( IOAudioStream* );
+    void setBufferDuration();
+    class StreamNode;
+    struct Stream;
+    int streamIndex( IOAudioStream* ) const;
+    int onDevOpen( Stream* );
+    int onDevClose( Stream* );
   
 private:
     int mGain, mVolume, mMuteInput, mMuteOutput;
+    // Per-channel controls, indexed by engine channel, i.e. across streams.
+    int* mpChannelGain, *mpChannelVolume, *mpChannelMuteInput, *mpChannelMuteOutput;
     static const struct ControlDef
-    { IOAudioControl* (*create)( int, int, int );
+    { IOAudioControl* (*create)( int, int, int, int );
       int usage;
       int initialValue;
       int VpcmAudioEngine::* pValue;
+      int* VpcmAudioEngine::* pChannelValues;
     } sAudioControls[];
 
     union Time { AbsoluteTime a; uint64_t t; int64_t s; };
     Time mNextTime, mBufferDuration;
+    // The wall clock ticks every --timestamp-interval-frames, or once per buffer.
+    // mWrapTime is the time stamp of the most recent wrap, nominal on the wall clock, and
+    // mClockFrame the frame within the buffer at which the clock stands.
+    Time mWrapTime;
+    int mClockFrame;
     IOTimerEventSource*	mpTimer;
-    int mWritePosition;
+    VpcmClockGroup* mpClockGroup;
+    int mWritePosition, mReaderWraps;
+
+    VpcmAudioEngine* mpRouteTarget, *mpRouteSource;
+    Synchronization::Mutex mRouteMutex;
   
 // DevfsDeviceNode
 protected:
@@ -68,24 +110,94 @@ protected:
     virtual int devSelect( int, void*, struct proc* );
 
 private:
-    int devReadWrite( struct uio* );
+    struct DevIO;
+    int devOpen( Stream&, int );
+    int devClose( Stream& );
+    int devIoctl( Stream&, u_long, caddr_t );
+    int devSelect( Stream&, int, void*, struct proc* );
+    int devReadWrite( Stream&, struct uio* );
+    int devTransfer( Stream&, struct uio* );
+    int devTransferPackets( Stream&, struct uio* );
+    int devReservedBytes( const Stream&, int ) const;
+    bool devWaitEnds( const Stream&, int, int* ) const;
+    void devReset();
+    void devWakeup();
+    void updateGains( int, int );
+    bool squelch( Stream&, const float*, int, int );
+    void advanceSegment( DevIO&, UInt32 );
+    void skipRingBytes( DevIO&, int );
+    int skipToAdpcmBlock( DevIO&, int );
 
     VpcmProperties mProperties;
     union DataPtr { void* v; char* c; short* s; float* f; };
+    void routeOutputSamples( int, DataPtr, const float*, int );
+    // A sample buffer, and the codec and dither state of the data it holds, if any.
+    // IMA ADPCM rings also keep the encoder state at the start of each block of cAdpcmBlockFrames,
+    // and the decoder state at the read pointer, one per channel each, for packet headers.
     struct Buffer
     {
       IOBufferMemoryDescriptor* pDesc;
       DataPtr begin, end;
-      Buffer() : pDesc( 0 ) { begin.c = 0; end.c = 0; }
-      bool init( int );
+      Codecs::AdpcmState *pAdpcm, *pReadAdpcm, *pBlockAdpcm;
+      FloatEmu::DitherState dither;
+      int channels;
+      Buffer() : pDesc( 0 ), pAdpcm( 0 ), pReadAdpcm( 0 ), pBlockAdpcm( 0 ), channels( 0 ) { begin.c = 0; end.c = 0; dither.pError = 0; }
+      bool init( int, const VpcmProperties& );
       void free();
-      int bytes() { return int( end.c - begin.c ); }
-    } mBuffer;
-    DataPtr mDevIOPtr;
-    int mDevIOBytesAvail;
-    struct selinfo mDevIOSel;
-    Synchronization::Mutex mDevIOWait;
-    int mIOState;
+      int bytes() const { return int( end.c - begin.c ); }
+    };
+    // Data path kernels, specialized at compile time for each format, dither mode, and raw flag.
+    // A fill kernel scales and clips mix data in place unless raw, and encodes it into a ring.
+    // A drain kernel decodes data from a ring, and scales and clips it unless raw.
+    // Both measure the levels of the data passed to CoreAudio, unless given no level accumulators.
+    typedef void (*FillFunc)( Buffer&, void*, float*, int, FloatEmu::Gain*, FloatEmu::Levels* );
+    typedef void (*DrainFunc)( Buffer&, float*, const void*, int, FloatEmu::Gain*, FloatEmu::Levels* );
+    template<int Format, int Dither, bool Raw> static void fill( Buffer&, void*, float*, int, FloatEmu::Gain*, FloatEmu::Levels* );
+    template<int Format, bool Raw> static void drain( Buffer&, float*, const void*, int, FloatEmu::Gain*, FloatEmu::Levels* );
+    static const struct KernelDef
+    { FillFunc fill[2][3]; // indexed by raw flag and dither mode
+      DrainFunc drain[2];  // indexed by raw flag
+    } sKernels[];          // indexed by format
+    // Selected whenever properties change. The raw kernels are also used while muted.
+    void selectKernels();
+    FillFunc mpFill, mpFillRaw;
+    DrainFunc mpDrain, mpDrainRaw;
+    // One ring per direction, indexed by IOAudioStreamDirection.
+    // Playback data is read from the Output ring, record data is written into the Input ring.
+    enum { Output = kIOAudioStreamDirectionOutput, Input = kIOAudioStreamDirectionInput };
+    struct DevIO
+    {
+      Buffer buffer;
+      DataPtr ptr;
+      int bytesAvail;
+      // With --fifo-frames, the ring holds several engine buffers. This is the byte offset of the
+      // engine's current buffer within the ring; it advances whenever the engine wraps.
+      int segment;
+      FloatEmu::Gain* pGains; // one per channel
+      FloatEmu::Levels* pLevels; // one per channel and reader
+      int silentFrames;
+      unsigned long long squelchedFrames;
+      // Stream position for --framing=packet. The writer counts frames, and records the frame at
+      // the read pointer whenever the stream restarts. Timestamps are extrapolated from an anchor,
+      // which is updated under a sequence count.
+      unsigned long long writeFrame, startFrame, readFrame, anchorFrame, anchorTime;
+      int restarts, readRestarts, anchorSeq;
+      bool discontinuity;
+      // After an overflow, IMA ADPCM packets resume at the next block, whose decoder state is known.
+      bool adpcmResync;
+      struct selinfo sel;
+      // Blocking reads sleep on the output ring's queue, blocking writes on the input ring's.
+      Synchronization::WaitQueue wait;
+      Synchronization::Mutex mutex;
+    };
+    // Each stream of the engine has its own rings and device node. Streams beyond the first
+    // are served by StreamNode objects, which forward to the engine.
+    struct Stream
+    {
+      DevIO io[2];
+      int ioState;
+      StreamNode* pNode;
+    } mStreams[MAX_STREAMS];
 };
 
 
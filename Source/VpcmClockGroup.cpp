@@ -0,0 +1,169 @@
+#include "VpcmClockGroup.h"
+#include "VpcmAudioEngine.h"
+
+#define INT64_1E9  1000000000LL
+
+VpcmClockGroup* VpcmClockGroup::sGroups = 0;
+Synchronization::Mutex VpcmClockGroup::sGroupsMutex;
+
+OSDefineMetaClassAndStructors( VpcmClockGroup, OSObject )
+
+VpcmClockGroup*
+VpcmClockGroup::join( int id, VpcmAudioEngine* pEngine, IOWorkLoop* pWorkLoop )
+{
+  const VpcmProperties* p = pEngine->getProperties();
+  Synchronization::Lock lock( sGroupsMutex );
+  VpcmClockGroup* pGroup = sGroups;
+  while( pGroup && pGroup->mId != id )
+    pGroup = pGroup->mpNext;
+  if( !pGroup )
+  {
+    pGroup = new VpcmClockGroup;
+    if( !pGroup )
+      return 0;
+    if( !pGroup->init( id, p->rate, p->bufferFrames, pWorkLoop ) )
+    {
+      pGroup->release();
+      return 0;
+    }
+    pGroup->mpNext = sGroups;
+    sGroups = pGroup;
+  }
+  if( !pGroup->isCompatible( p->rate, p->bufferFrames ) || pGroup->mpWorkLoop != pWorkLoop )
+    return 0;
+  if( pGroup->mNumMembers >= sMaxMembers )
+    return 0;
+  int i = pGroup->indexOf( 0 );
+  pGroup->mMembers[i] = pEngine;
+  pGroup->mRunning[i] = false;
+  ++pGroup->mNumMembers;
+  return pGroup;
+}
+
+void
+VpcmClockGroup::leave( VpcmAudioEngine* pEngine )
+{
+  Synchronization::Lock lock( sGroupsMutex );
+  int i = indexOf( pEngine );
+  if( i < 0 )
+    return;
+  if( mRunning[i] )
+    stop( pEngine );
+  mMembers[i] = 0;
+  if( --mNumMembers == 0 )
+  {
+    VpcmClockGroup** p = &sGroups;
+    while( *p && *p != this )
+      p = &( *p )->mpNext;
+    if( *p )
+      *p = mpNext;
+    lock.Unlock(); // unlisted, so no other engine can reach the group
+    release();
+  }
+}
+
+bool
+VpcmClockGroup::init( int id, int rate, int bufferFrames, IOWorkLoop* pWorkLoop )
+{
+  if( !OSObject::init() )
+    return false;
+  mId = id;
+  mRate = rate;
+  mBufferFrames = bufferFrames;
+  mNextTime.t = 0;
+  mLastTime.t = 0;
+  mpNext = 0;
+  mNumMembers = 0;
+  mNumRunning = 0;
+  for( int i = 0; i < sMaxMembers; ++i )
+  {
+    mMembers[i] = 0;
+    mRunning[i] = false;
+  }
+  if( rate < 1 )
+    return false;
+  ::nanoseconds_to_absolutetime( ( bufferFrames * INT64_1E9 ) / rate, &mBufferDuration.t );
+
+  mpWorkLoop = pWorkLoop;
+  IOTimerEventSource::Action action = OSMemberFunctionCast(
+    IOTimerEventSource::Action, this,
+    &VpcmClockGroup::onTimer
+  );
+  mpTimer = IOTimerEventSource::timerEventSource( this, action );
+  if( !mpTimer || !mpWorkLoop )
+    return false;
+  mpWorkLoop->addEventSource( mpTimer );
+  return true;
+}
+
+void
+VpcmClockGroup::free()
+{
+  if( mpTimer )
+  {
+    mpTimer->cancelTimeout();
+    if( mpWorkLoop )
+      mpWorkLoop->removeEventSource( mpTimer );
+    mpTimer->release();
+    mpTimer = 0;
+  }
+  OSObject::free();
+}
+
+bool
+VpcmClockGroup::isCompatible( int rate, int bufferFrames ) const
+{
+  return rate == mRate && bufferFrames == mBufferFrames;
+}
+
+int
+VpcmClockGroup::indexOf( const VpcmAudioEngine* pEngine ) const
+{
+  for( int i = 0; i < sMaxMembers; ++i )
+    if( mMembers[i] == pEngine )
+      return i;
+  return -1;
+}
+
+void
+VpcmClockGroup::start( VpcmAudioEngine* pEngine, AbsoluteTime* pTime )
+{
+  int i = indexOf( pEngine );
+  if( i >= 0 && !mRunning[i] )
+  {
+    mRunning[i] = true;
+    if( mNumRunning++ == 0 )
+    {
+      clock_get_uptime( &mLastTime.t );
+      mNextTime.t = mLastTime.t + mBufferDuration.t;
+      mpTimer->wakeAtTime( mNextTime.a );
+    }
+  }
+  *pTime = mLastTime.a;
+}
+
+void
+VpcmClockGroup::stop( VpcmAudioEngine* pEngine )
+{
+  int i = indexOf( pEngine );
+  if( i >= 0 && mRunning[i] )
+  {
+    mRunning[i] = false;
+    if( --mNumRunning == 0 )
+      mpTimer->cancelTimeout();
+  }
+}
+
+void
+VpcmClockGroup::onTimer( IOTimerEventSource* )
+{
+  Time now;
+  clock_get_uptime( &now.t );
+  while( mNextTime.t <= now.t )
+    mNextTime.t += mBufferDuration.t;
+  mLastTime = now;
+  for( int i = 0; i < sMaxMembers; ++i )
+    if( mRunning[i] )
+      mMembers[i]->takeClockGroupTimeStamp( &now.a );
+  mpTimer->wakeAtTime( mNextTime.a );
+}
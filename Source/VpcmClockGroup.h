@@ -0,0 +1,56 @@
+#ifndef VPCM_CLOCK_GROUP_H
+#define VPCM_CLOCK_GROUP_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOTimerEventSource.h>
+#include "DevfsDeviceNode.h"
+#include "Synchronization.h"
+
+class VpcmAudioEngine;
+
+// A clock group drives all of its running engines from a single timer,
+// so that they take identical wrap time stamps and stay sample-aligned.
+// All members must have the same sampling rate, buffer size, and work loop, which owns the
+// timer and on which member functions must be called. join() and leave() also lock the list of
+// groups, which engines of other groups, on other work loops, may change concurrently.
+class VpcmClockGroup : public OSObject
+{
+    OSDeclareDefaultStructors( VpcmClockGroup )
+
+public:
+    // Returns the group with the given id, creating it if necessary,
+    // or 0 if the engine is not compatible with the group.
+    static VpcmClockGroup* join( int id, VpcmAudioEngine*, IOWorkLoop* );
+    void leave( VpcmAudioEngine* );
+
+    int id() const { return mId; }
+    bool isCompatible( int rate, int bufferFrames ) const;
+
+    // Starts the group's clock if necessary, and returns the time of its most recent wrap,
+    // which the engine must use as its start time stamp.
+    void start( VpcmAudioEngine*, AbsoluteTime* );
+    void stop( VpcmAudioEngine* );
+
+private:
+    virtual bool init( int, int, int, IOWorkLoop* );
+    virtual void free();
+    void onTimer( IOTimerEventSource* );
+    int indexOf( const VpcmAudioEngine* ) const;
+
+    union Time { AbsoluteTime a; uint64_t t; int64_t s; };
+    int mId, mRate, mBufferFrames;
+    Time mNextTime, mLastTime, mBufferDuration;
+    IOTimerEventSource* mpTimer;
+    IOWorkLoop* mpWorkLoop;
+
+    static const int sMaxMembers = MAX_INSTANCES;
+    VpcmAudioEngine* mMembers[sMaxMembers];
+    bool mRunning[sMaxMembers];
+    int mNumMembers, mNumRunning;
+
+    VpcmClockGroup* mpNext;
+    static VpcmClockGroup* sGroups;
+    static Synchronization::Mutex sGroupsMutex; // guards sGroups and membership
+};
+
+#endif // VPCM_CLOCK_GROUP_H
@@ -0,0 +1,107 @@
+#ifndef VPCM_IOCTL_H
+#define VPCM_IOCTL_H
+
+// Interface of vpcm device nodes: ioctls in addition to FIONBIO, FIONREAD, FIONWRITE, and FIONSPACE,
+// and the packet format used with --framing=packet.
+// This header may be included by applications.
+
+#include <sys/types.h>
+#ifdef __linux__
+# include <sys/ioctl.h>
+#else
+# include <sys/ioccom.h>
+#endif
+
+#ifndef FIONWRITE
+# define FIONWRITE	_IOR('f', 119, int)
+#endif
+#ifndef FIONSPACE
+# define FIONSPACE	_IOR('f', 118, int)
+#endif
+
+#define VPCM_MAX_METER_CHANNELS 64
+
+#define VPCM_METER_DEFAULT 0
+#define VPCM_METER_PLAYBACK 1
+#define VPCM_METER_RECORD 2
+
+// Peak and RMS levels of each channel of the device node's stream, accumulated since the
+// previous request, in Q24 such that 1<<24 is full scale. The caller sets direction to select
+// playback or record data; the default is playback data if the device has a playback direction.
+// The meter command of vpcmctl keeps separate accumulators. The RMS covers at most 2^31 frames,
+// the first ones since the previous request.
+// Playback levels are measured after volume scaling, on the data written into the device's buffer.
+// Record levels are measured after volume scaling, on the data passed to CoreAudio.
+struct vpcm_levels
+{
+  int direction;
+  int channels;
+  unsigned int peak[VPCM_MAX_METER_CHANNELS];
+  unsigned int rms[VPCM_MAX_METER_CHANNELS];
+};
+
+#define VPCMIOCGLEVELS _IOWR( 'V', 1, struct vpcm_levels )
+
+// With --squelch, the number of playback frames of the device node's stream that have been
+// dropped while the node was open since the device was created, and whether data is currently
+// being dropped.
+struct vpcm_squelch
+{
+  unsigned long long frames;
+  int squelched;
+};
+
+#define VPCMIOCGSQUELCH _IOR( 'V', 2, struct vpcm_squelch )
+
+// Formats as given by --format.
+#define VPCM_FORMAT_S16LE 0
+#define VPCM_FORMAT_FLOAT32LE 1
+#define VPCM_FORMAT_S16BE 2
+#define VPCM_FORMAT_S24_3LE 3
+#define VPCM_FORMAT_S24_3BE 4
+#define VPCM_FORMAT_S32LE 5
+#define VPCM_FORMAT_S32BE 6
+#define VPCM_FORMAT_FLOAT32BE 7
+#define VPCM_FORMAT_FLOAT64LE 8
+#define VPCM_FORMAT_FLOAT64BE 9
+#define VPCM_FORMAT_ULAW 10
+#define VPCM_FORMAT_ALAW 11
+#define VPCM_FORMAT_IMA_ADPCM 12
+
+#define VPCM_PACKET_MAGIC 0x6d637076 // "vpcm" in little-endian byte order
+// The packet does not continue the data of the previous packet, e.g. after the device node has
+// been opened, after data has been discarded or squelched, or after the device has been reconfigured.
+#define VPCM_PACKET_DISCONTINUITY 0x0001
+// The payload is fill data, as chosen by --overflow, because the reader has not kept up.
+#define VPCM_PACKET_FILL 0x0002
+
+// With --framing=packet, reading playback data from a device node returns whole packets,
+// as many as fit into the read buffer. Each packet consists of this header, followed by
+// payloadBytes of data in the given format. The payload always consists of whole frames.
+// With VPCM_FORMAT_IMA_ADPCM, the header is followed by a vpcm_adpcm_state per channel, and
+// headerBytes includes them. Fields are in host byte order.
+struct vpcm_packet
+{
+  uint32_t magic;
+  uint16_t headerBytes;    // offset of the payload, may grow in later versions
+  uint16_t flags;          // VPCM_PACKET_*
+  uint32_t payloadBytes;
+  uint32_t rate;
+  uint64_t frame;          // number of the first frame since the device was created
+  uint64_t hostTime;       // system uptime in nanoseconds at which the first frame was played
+  uint16_t channels;
+  uint8_t format;          // VPCM_FORMAT_*
+  uint8_t reserved[5];
+};
+
+// The IMA ADPCM decoder state of a channel at a packet's first frame. A decoder loads it after
+// a discontinuity or a fill packet, and may load it from any packet, so that it can decode each
+// packet on its own.
+struct vpcm_adpcm_state
+{
+  int16_t predictor;
+  uint8_t index;
+  uint8_t reserved;
+};
+
+#endif // VPCM_IOCTL_H
@@ -4,6 +4,9 @@
 namespace
 {
 
+// Ring sizes are kept in ints, and ring positions must not overflow when advanced by a buffer.
+const int cMaxBufferBytes = 1 << 30;
+
 bool parseOpt( char* string, char** name, char** value )
 {
   char* p = string;
@@ -30,15 +33,33 @@ VpcmProperties::parse( int argc, char** argv )
   mode = Playback;
   rate = 44100;
   channels = 2;
+  streams = 1;
   format = Float32;
+  dither = None;
   byteWidth = 4;
+  frameBytes = channels * byteWidth;
   raw = false;
   bufferFrames = 16384;
+  fifoFrames = 0;
+  timestampIntervalFrames = 0;
   eofOnIdle = true;
   posixPipe = false;
   overflow = Zeros;
+  clock = WallClock;
+  clockGroup = 0;
+  framing = Unframed;
+  latencyFrames = 0;
+  writeLeadFrames = 0;
+  squelchLevel = 0;
+  squelchMsec = 0;
+  return update( argc, argv );
+}
 
+int
+VpcmProperties::update( int argc, char** argv )
+{
   int latencyMs = 0;
+  bool haveLatency = false;
   for( char** arg = argv + 1; arg < argv + argc; ++arg )
   {
     char* option, *strvalue;
@@ -54,10 +75,21 @@ VpcmProperties::parse( int argc, char** argv )
         rate = decvalue;
       else if( !::strcmp( option, "channels" ) )
         channels = decvalue;
+      else if( !::strcmp( option, "streams" ) )
+        streams = decvalue;
       else if( !::strcmp( option, "latency-msec" ) )
+      {
         latencyMs = decvalue;
+        haveLatency = true;
+      }
       else if( !::strcmp( option, "buffer-frames" ) )
         bufferFrames = decvalue;
+      else if( !::strcmp( option, "timestamp-interval-frames" ) )
+        timestampIntervalFrames = decvalue;
+      else if( !::strcmp( option, "fifo-frames" ) )
+        fifoFrames = decvalue;
+      else if( !::strcmp( option, "write-lead-frames" ) )
+        writeLeadFrames = decvalue;
       else if( !::strcmp( option, "format" ) )
       {
         if( !::strcmp( strvalue, "s16" )
@@ -68,6 +100,45 @@ VpcmProperties::parse( int argc, char** argv )
          || !::strcmp( strvalue, "float32le" )
          || !::strcmp( strvalue, "float32ne" ) )
             format = Float32;
+        else if( !::strcmp( strvalue, "s16be" ) )
+            format = Int16BE;
+        else if( !::strcmp( strvalue, "s24_3" )
+         || !::strcmp( strvalue, "s24_3le" )
+         || !::strcmp( strvalue, "s24_3ne" ) )
+            format = Int24;
+        else if( !::strcmp( strvalue, "s24_3be" ) )
+            format = Int24BE;
+        else if( !::strcmp( strvalue, "s32" )
+         || !::strcmp( strvalue, "s32le" )
+         || !::strcmp( strvalue, "s32ne" ) )
+            format = Int32;
+        else if( !::strcmp( strvalue, "s32be" ) )
+            format = Int32BE;
+        else if( !::strcmp( strvalue, "float32be" ) )
+            format = Float32BE;
+        else if( !::strcmp( strvalue, "float64" )
+         || !::strcmp( strvalue, "float64le" )
+         || !::strcmp( strvalue, "float64ne" ) )
+            format = Float64;
+        else if( !::strcmp( strvalue, "float64be" ) )
+            format = Float64BE;
+        else if( !::strcmp( strvalue, "ulaw" ) )
+            format = ULaw;
+        else if( !::strcmp( strvalue, "alaw" ) )
+            format = ALaw;
+        else if( !::strcmp( strvalue, "ima-adpcm" ) )
+            format = ImaAdpcm;
+        else
+          return EINVAL;
+      }
+      else if( !::strcmp( option, "dither" ) )
+      {
+        if( !::strcmp( strvalue, "none" ) )
+          dither = None;
+        else if( !::strcmp( strvalue, "tpdf" ) )
+          dither = TriangularDither;
+        else if( !::strcmp( strvalue, "shaped" ) )
+          dither = ShapedDither;
         else
           return EINVAL;
       }
@@ -82,6 +153,32 @@ VpcmProperties::parse( int argc, char** argv )
         else
           return EINVAL;
       }
+      else if( !::strcmp( option, "clock" ) )
+      {
+        if( !::strcmp( strvalue, "wall" ) )
+          clock = WallClock;
+        else if( !::strcmp( strvalue, "reader" ) )
+          clock = ReaderClock;
+        else
+          return EINVAL;
+      }
+      else if( !::strcmp( option, "squelch" ) )
+      {
+        squelchMsec = 1000;
+        if( ::sscanf( strvalue, "%d,%d", &squelchLevel, &squelchMsec ) < 1 )
+          return EINVAL;
+      }
+      else if( !::strcmp( option, "framing" ) )
+      {
+        if( !::strcmp( strvalue, "none" ) )
+          framing = Unframed;
+        else if( !::strcmp( strvalue, "packet" ) )
+          framing = Packets;
+        else
+          return EINVAL;
+      }
+      else if( !::strcmp( option, "clock-group" ) )
+        clockGroup = decvalue;
       else if( !::strcmp( option, "raw" ) )
         raw = decvalue;
       else if( !::strcmp( option, "eof-on-idle" ) )
@@ -95,14 +192,22 @@ VpcmProperties::parse( int argc, char** argv )
         mode = Playback;
       else if( !::strcmp( option, "record" ) )
         mode = Record;
+      else if( !::strcmp( option, "duplex" ) )
+        mode = Duplex;
       else if( !::strcmp( option, "raw" ) )
         raw = true;
+      else if( !::strcmp( option, "no-raw" ) )
+        raw = false;
       else if( !::strcmp( option, "eof-on-idle" ) )
         eofOnIdle = true;
       else if( !::strcmp( option, "no-eof-on-idle" ) )
         eofOnIdle = false;
       else if( !::strcmp( option, "posix-pipe" ) )
         posixPipe = true;
+      else if( !::strcmp( option, "no-posix-pipe" ) )
+        posixPipe = false;
+      else if( !::strcmp( option, "no-squelch" ) )
+        squelchLevel = 0;
       else
         return EINVAL;
     }
@@ -113,22 +218,92 @@ VpcmProperties::parse( int argc, char** argv )
     return EINVAL;
   if( channels < 1 )
     return EINVAL;
+  if( streams < 1 || streams > MAX_STREAMS )
+    return EINVAL;
   switch( format )
   {
     case Float32:
+    case Float32BE:
+    case Int32:
+    case Int32BE:
       byteWidth = 4;
       break;
     case Int16:
+    case Int16BE:
       byteWidth = 2;
       break;
+    case Int24:
+    case Int24BE:
+      byteWidth = 3;
+      break;
+    case Float64:
+    case Float64BE:
+      byteWidth = 8;
+      break;
+    case ULaw:
+    case ALaw:
+      byteWidth = 1;
+      break;
+    case ImaAdpcm:
+      byteWidth = 0;
+      break;
     default:
       return EDEVERR;
   }
-  if( bufferFrames < 2 )
+  if( format == ImaAdpcm )
+  { // two samples per byte, so frames must consist of whole bytes
+    if( channels % 2 )
+      return EINVAL;
+    frameBytes = channels / 2;
+  }
+  else
+    frameBytes = channels * byteWidth;
+  if( bufferFrames < 2 || bufferFrames > cMaxBufferBytes / frameBytes )
+    return EINVAL;
+  if( fifoFrames < 0 || fifoFrames > cMaxBufferBytes / frameBytes )
+    return EINVAL;
+  if( fifoFrames > 0 )
+  { // rings hold whole engine buffers, so no block of engine data wraps around a ring's end
+    fifoFrames = ( ( fifoFrames + bufferFrames - 1 ) / bufferFrames ) * bufferFrames;
+    if( fifoFrames > cMaxBufferBytes / frameBytes )
+      return EINVAL;
+    if( clock == ReaderClock ) // the reader clock ticks once per ring
+      return EINVAL;
+  }
+  if( timestampIntervalFrames < 0 || timestampIntervalFrames > bufferFrames )
+    return EINVAL;
+  if( timestampIntervalFrames > 0 )
+  { // ticks of less than a millisecond would only load the timer
+    if( (int64_t)timestampIntervalFrames * 1000 < rate )
+      return EINVAL;
+    if( clock != WallClock || clockGroup > 0 )
+      return EINVAL;
+  }
+  if( writeLeadFrames < 0 || writeLeadFrames > ringFrames() )
     return EINVAL;
-  latencyFrames = ( latencyMs * rate + 1 ) / 1000;
+  if( writeLeadFrames > 0 && !( mode & Record ) )
+    return EINVAL;
+  if( haveLatency )
+    latencyFrames = ( latencyMs * rate + 1 ) / 1000;
   if( latencyFrames < 0 )
     return EINVAL;
+  if( clock == ReaderClock && !( mode & Playback ) )
+    return EINVAL;
+  if( clockGroup < 0 || ( clockGroup > 0 && clock != WallClock ) )
+    return EINVAL;
+  if( framing == Packets && !( mode & Playback ) )
+    return EINVAL;
+  // Plain ADPCM playback data would desynchronize the reader's decoder at each overflow, while
+  // packets carry the decoder state.
+  if( format == ImaAdpcm && ( mode & Playback ) && framing != Packets )
+    return EINVAL;
+  if( squelchLevel )
+  { // a squelched stream restarts from scratch, which ADPCM decoders cannot follow
+    if( squelchLevel < -120 || squelchLevel > -1 || squelchMsec < 0 )
+      return EINVAL;
+    if( !( mode & Playback ) || clock == ReaderClock || format == ImaAdpcm )
+      return EINVAL;
+  }
   if( posixPipe )
     eofOnIdle = true;
   return 0;
@@ -149,6 +324,9 @@ VpcmProperties::print( char* buf, int len, const char* sep ) const
     case Record:
       pMode = "record";
       break;
+    case Duplex:
+      pMode = "duplex";
+      break;
   }
   const char* pFormat = "?";
   switch( format )
@@ -159,6 +337,39 @@ VpcmProperties::print( char* buf, int len, const char* sep ) const
     case Float32:
       pFormat = "float32le";
       break;
+    case Int16BE:
+      pFormat = "s16be";
+      break;
+    case Int24:
+      pFormat = "s24_3le";
+      break;
+    case Int24BE:
+      pFormat = "s24_3be";
+      break;
+    case Int32:
+      pFormat = "s32le";
+      break;
+    case Int32BE:
+      pFormat = "s32be";
+      break;
+    case Float32BE:
+      pFormat = "float32be";
+      break;
+    case Float64:
+      pFormat = "float64le";
+      break;
+    case Float64BE:
+      pFormat = "float64be";
+      break;
+    case ULaw:
+      pFormat = "ulaw";
+      break;
+    case ALaw:
+      pFormat = "alaw";
+      break;
+    case ImaAdpcm:
+      pFormat = "ima-adpcm";
+      break;
   }
   const char* pOverflow = "?";
   switch( overflow )
@@ -190,6 +401,26 @@ VpcmProperties::print( char* buf, int len, const char* sep ) const
     sep, pFormat,
     sep, pOverflow
   );
+  if( dither == TriangularDither )
+    pos += ::snprintf( buf + pos, len - pos, "%s%s", sep, "dither=tpdf" );
+  else if( dither == ShapedDither )
+    pos += ::snprintf( buf + pos, len - pos, "%s%s", sep, "dither=shaped" );
+  if( streams > 1 )
+    pos += ::snprintf( buf + pos, len - pos, "%sstreams=%d", sep, streams );
+  if( timestampIntervalFrames > 0 )
+    pos += ::snprintf( buf + pos, len - pos, "%stimestamp-interval-frames=%d", sep, timestampIntervalFrames );
+  if( fifoFrames > bufferFrames )
+    pos += ::snprintf( buf + pos, len - pos, "%sfifo-frames=%d", sep, fifoFrames );
+  if( writeLeadFrames > 0 )
+    pos += ::snprintf( buf + pos, len - pos, "%swrite-lead-frames=%d", sep, writeLeadFrames );
+  if( clockGroup > 0 )
+    pos += ::snprintf( buf + pos, len - pos, "%sclock-group=%d", sep, clockGroup );
+  if( framing == Packets )
+    pos += ::snprintf( buf + pos, len - pos, "%s%s", sep, "framing=packet" );
+  if( squelchLevel )
+    pos += ::snprintf( buf + pos, len - pos, "%ssquelch=%d,%d", sep, squelchLevel, squelchMsec );
+  if( clock == ReaderClock )
+    pos += ::snprintf( buf + pos, len - pos, "%s%s", sep, "clock=reader" );
   if( raw )
     pos += ::snprintf( buf + pos, len - pos, "%s%s", sep, "raw" );
   if( posixPipe )
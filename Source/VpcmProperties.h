@@ -3,22 +3,40 @@
 
 #include <IOKit/audio/IOAudioEngine.h>
 
+#define MAX_STREAMS 16
+
 struct VpcmProperties
 {
   int parse( int, char** );
+  // Applies options on top of the current values, without resetting to defaults.
+  int update( int, char** );
   int print( char*, int, const char* = 0 ) const;
+  // Size of the rings between the engine and the device node, in frames.
+  int ringFrames() const { return fifoFrames > 0 ? fifoFrames : bufferFrames; }
 
   enum
   {
     None = 0,
-    Playback = 1, Record = 2,
-    Int16 = 0, Float32 = 1,
+    Playback = 1, Record = 2, Duplex = Playback | Record,
+    Int16 = 0, Float32 = 1, Int16BE, Int24, Int24BE, Int32, Int32BE, Float32BE, Float64, Float64BE,
+    ULaw, ALaw, ImaAdpcm, NumFormats,
+    TriangularDither = 1, ShapedDither = 2,
     Zeros = 0, Discard = 1, Noise = 2,
+    WallClock = 0, ReaderClock = 1,
+    Unframed = 0, Packets = 1,
   };
   char* name;
-  int mode, overflow, format, byteWidth;
+  int mode, overflow, format, dither, clock, clockGroup, framing;
+  // byteWidth is 0 for formats with less than a byte per sample; use frameBytes for buffer sizes.
+  int byteWidth, frameBytes;
   bool raw, eofOnIdle, posixPipe;
-  int bufferFrames, latencyFrames, channels, rate;
+  int bufferFrames, latencyFrames, writeLeadFrames, channels, rate, streams;
+  // With --fifo-frames, rings hold several engine buffers; 0 means one. Always a multiple of bufferFrames.
+  int fifoFrames;
+  // With --timestamp-interval-frames, the wall clock ticks at this interval rather than once per buffer.
+  int timestampIntervalFrames;
+  // Playback data below squelchLevel dBFS for longer than squelchMsec is dropped from the device node; 0 disables.
+  int squelchLevel, squelchMsec;
 };
 
 
@@ -0,0 +1,1409 @@
+// floatemubench: checks the accuracy and measures the throughput of the data path kernels in
+// FloatEmu and Codecs on the host.
+//
+// Each kernel is first checked against a reference computed in double or long double precision,
+// or against an independent implementation of the codec, on edge cases and random data. The
+// bounds are those promised in FloatEmu.h and Codecs.h:
+//  - ApplyGain: relative error below 2^-23 against x * gain / 2^30, with the gain sequence of
+//    a linear ramp per channel; results below 2^-126 may be flushed to zero. Ramps reach their
+//    targets within twice the given number of frames.
+//  - Clip: exact, NaNs become -1 or 1 by their sign bit.
+//  - FloatToInt16Copy, FloatToIntCopy with 2 and 3 bytes: exact, i.e. round(x * 2^(bits-1)),
+//    ties away from zero, clamped. With 4 bytes, less than 1 LSB, since magnitudes below 2^-8
+//    are truncated.
+//  - Int16ToFloatCopy, IntToFloatCopy with 2 and 3 bytes: exact. With 4 bytes, at most half a
+//    unit in the last place of the result.
+//  - FloatToDoubleCopy: exact, denormals flushed to zero. DoubleToFloatCopy: at most half a unit
+//    in the last place; results below 2^-126 are flushed to zero, results of 2^128 and above
+//    become infinite.
+//  - SwapCopy32: exact.
+//  - G.711: decoding matches the formulas of the reference implementation exactly, and encoding
+//    picks one of the two codes nearest to the input, or the extreme code beyond them.
+//  - IMA ADPCM: decoding matches an independent decoder exactly for any data, the encoder's
+//    state tracks that decoder exactly, and a -6 dBFS 1 kHz sine at 48 kHz is coded with an
+//    SNR of at least 20 dB.
+//  - Round trips through each format of the device node, from the format to floats and back,
+//    and from floats to the format and back, as described at checkRoundTrips.
+//  - FloatToInt16DitherCopy: within 1.5 LSB of x * 32768 with triangular dither, and within
+//    3.5 LSB with noise shaping, except where clamped. The error has a mean below 0.01 LSB
+//    and the expected RMS, is uncorrelated between channels, and has half of its energy below
+//    fs/4 with triangular dither, but less than a quarter with noise shaping.
+//  - Peak, TakeLevels: peak within 1 LSB of max(|x|) * 2^24, RMS within 2^-14 of full scale,
+//    for each of two sets of accumulators, and still at full scale after 2^31 frames.
+//  - LevelToDecibels: within 0.1 dB of 20 * log10(level / 2^24).
+//
+// Then each kernel's throughput is measured on buffers from 64 frames to 1M samples, across
+// channel counts where the kernel depends on them, and reported in ns per sample and in GB/s
+// of input and output data. In-place kernels are timed on a fresh copy of their input, net of
+// the copy. With --baseline, kernels that are slower than in the baseline file by more than the
+// tolerance fail. The exit status is 1 if any check or baseline comparison fails.
+//
+// Build, from the repository root:
+//   c++ -std=c++11 -O2 -Wall -Wextra -ISource -o floatemubench Tools/floatemubench/floatemubench.cpp
+//     Source/FloatEmu.cpp Source/Codecs.cpp
+
+#include "FloatEmu.h"
+#include "Codecs.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+const char* cUsage =
+  "usage: floatemubench [options]\n"
+  "  --check-only           only check accuracy, do not measure throughput\n"
+  "  --quick                fewer buffer sizes and shorter measurements\n"
+  "  --filter=<text>        only measure kernels whose name contains the text\n"
+  "  --baseline=<file>      fail kernels that are slower than in the file\n"
+  "  --tolerance=<percent>  slowdown allowed against the baseline (50)\n"
+  "  --save-baseline=<file> write the measurements as a baseline\n";
+
+const unsigned cMaxSamples = 1 << 20;
+
+struct Options
+{
+  bool checkOnly, quick;
+  const char* filter, *baseline, *saveBaseline;
+  double tolerance;
+};
+
+bool
+parseOptions( int argc, char** argv, Options& o )
+{
+  o.checkOnly = false;
+  o.quick = false;
+  o.filter = "";
+  o.baseline = 0;
+  o.saveBaseline = 0;
+  o.tolerance = 50;
+  for( int i = 1; i < argc; ++i )
+  {
+    const char* arg = argv[i];
+    const char* value = ::strchr( arg, '=' );
+    value = value ? value + 1 : "";
+    if( !::strcmp( arg, "--check-only" ) )
+      o.checkOnly = true;
+    else if( !::strcmp( arg, "--quick" ) )
+      o.quick = true;
+    else if( !::strncmp( arg, "--filter=", 9 ) )
+      o.filter = value;
+    else if( !::strncmp( arg, "--baseline=", 11 ) )
+      o.baseline = value;
+    else if( !::strncmp( arg, "--tolerance=", 12 ) )
+      o.tolerance = ::atof( value );
+    else if( !::strncmp( arg, "--save-baseline=", 16 ) )
+      o.saveBaseline = value;
+    else
+      return false;
+  }
+  return o.tolerance >= 0;
+}
+
+double
+wallTime()
+{
+  timespec t;
+  ::clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// xorshift64*, as in vpcmsim, so runs do not depend on the host's random().
+class Random
+{
+public:
+  explicit Random( unsigned long long seed ) : mState( seed * 2 + 1 ) {}
+  unsigned long long next()
+  {
+    mState ^= mState >> 12;
+    mState ^= mState << 25;
+    mState ^= mState >> 27;
+    return mState * 2685821657736338717ULL;
+  }
+  // Uniform in [0, 1).
+  double uniform() { return ( next() >> 11 ) * ( 1.0 / 9007199254740992.0 ); }
+  // Unit-range values, half uniform, and half with magnitudes spread evenly over the octaves
+  // down to 2^-octaves.
+  float unitRange( int octaves = 40 )
+  {
+    double sign = ( next() & 1 ) ? -1 : 1;
+    if( next() & 2 )
+      return float( sign * uniform() );
+    return float( sign * std::ldexp( 1 + uniform(), -1 - int( uniform() * octaves ) ) );
+  }
+private:
+  unsigned long long mState;
+};
+
+unsigned
+floatBits( float f )
+{
+  unsigned i;
+  ::memcpy( &i, &f, sizeof(i) );
+  return i;
+}
+
+float
+bitsFloat( unsigned i )
+{
+  float f;
+  ::memcpy( &f, &i, sizeof(f) );
+  return f;
+}
+
+// Unit-range edge cases: zeros, full scale, rounding ties of all integer formats, the smallest
+// normals, and denormals.
+std::vector<float>
+edgeCases()
+{
+  std::vector<float> v;
+  const float special[] = { 0.0f, 1.0f, 0.5f, 1 - std::ldexp( 1.0f, -24 ), std::ldexp( 1.0f, -15 ),
+    std::ldexp( 1.0f, -23 ), std::ldexp( 1.0f, -31 ), std::ldexp( 1.0f, -32 ), std::ldexp( 1.0f, -126 ),
+    std::ldexp( 1.0f, -130 ), 32767.0f / 32768, 32767.5f / 32768, 8388607.0f / 8388608 };
+  for( unsigned i = 0; i < sizeof(special)/sizeof(*special); ++i )
+  {
+    v.push_back( special[i] );
+    v.push_back( -special[i] );
+  }
+  for( int bits = 16; bits <= 24; bits += 8 )
+    for( int n = 0; n < 8; ++n )
+    {
+      float tie = std::ldexp( float( n ) + 0.5f, 1 - bits );
+      v.push_back( tie );
+      v.push_back( -tie );
+      v.push_back( bitsFloat( floatBits( tie ) + 1 ) );
+      v.push_back( bitsFloat( floatBits( tie ) - 1 ) );
+    }
+  return v;
+}
+
+// Counts the values checked by one check, and reports the first few failures.
+class Check
+{
+public:
+  explicit Check( const char* name ) : mName( name ), mValues( 0 ), mFailures( 0 ) {}
+  // Records a value, and a failure unless ok. The description is only formatted on failure.
+  bool expect( bool ok, const char* format = 0, ... )
+  {
+    ++mValues;
+    if( ok )
+      return true;
+    if( ++mFailures <= 5 && format )
+    {
+      ::printf( "  %s: ", mName );
+      va_list args;
+      va_start( args, format );
+      ::vprintf( format, args );
+      va_end( args );
+      ::printf( "\n" );
+    }
+    return false;
+  }
+  ~Check()
+  {
+    ::printf( "check %-36s %10llu values  %s\n", mName, mValues, mFailures ? "FAILED" : "ok" );
+    if( mFailures )
+      ++sFailures;
+  }
+  static int sFailures;
+private:
+  const char* mName;
+  unsigned long long mValues, mFailures;
+};
+
+int Check::sFailures = 0;
+
+// Accuracy checks
+
+// Checks values against x * gain / 2^30 for the given gain per sample.
+void
+expectGain( Check& check, const float* in, const float* out, const unsigned* gains, size_t count )
+{
+  for( size_t i = 0; i < count; ++i )
+  {
+    long double ref = (long double)in[i] * gains[i] / ( 1 << 30 ), err = std::fabs( out[i] - ref );
+    bool ok = err <= std::fabs( ref ) * std::ldexp( 1.0L, -23 )
+           || ( out[i] == 0 && std::fabs( ref ) < std::ldexp( 1.0L, -126 ) );
+    check.expect( ok, "gain %u: %.9g -> %.9g, expected %.9Lg", gains[i], in[i], out[i], ref );
+  }
+}
+
+void
+checkGain( const std::vector<float>& input )
+{
+  Check check( "ApplyGain constant" );
+  const unsigned halfDecibels[] = { 0, 1, 3, 12, 40, 100, 255 };
+  std::vector<unsigned> gains;
+  for( unsigned h = 0; h <= sizeof(halfDecibels)/sizeof(*halfDecibels); ++h )
+  {
+    unsigned gain = h < sizeof(halfDecibels)/sizeof(*halfDecibels)
+                  ? FloatEmu::AttenuationToGain( halfDecibels[h] ) : 4 * FloatEmu::UnityGain - 1;
+    for( unsigned channels = 1; channels <= 8; channels *= 2 )
+    { // odd channels have other gains, one of them unity
+      std::vector<float> v( input.begin(), input.begin() + input.size() / channels * channels );
+      FloatEmu::Gain g[8];
+      for( unsigned c = 0; c < channels; ++c )
+      {
+        g[c].value = g[c].target = c % 2 == 0 ? gain : c % 4 == 1 ? FloatEmu::AttenuationToGain( 7 ) : FloatEmu::UnityGain;
+        g[c].step = 0;
+      }
+      FloatEmu::ApplyGain( &v[0], unsigned( v.size() ), channels, g );
+      gains.resize( v.size() );
+      for( size_t i = 0; i < v.size(); ++i )
+        gains[i] = g[i % channels].value;
+      expectGain( check, &input[0], &v[0], &gains[0], v.size() );
+    }
+  }
+}
+
+// Ramps each channel from one gain to another in blocks, and checks each sample against the
+// gain of its frame, which changes by the ramp's step until it reaches the target.
+void
+checkRamp( Check& check, Random& random, unsigned channels, const unsigned* from, const unsigned* to, unsigned frames )
+{
+  std::vector<FloatEmu::Gain> g( channels );
+  std::vector<unsigned> value( channels ), steps( channels ), reached( channels, ~0u );
+  for( unsigned c = 0; c < channels; ++c )
+  {
+    g[c].value = from[c];
+    FloatEmu::SetGainTarget( g[c], to[c], frames );
+    value[c] = from[c];
+    steps[c] = g[c].step;
+  }
+  unsigned total = 3 * frames + 64;
+  std::vector<float> in( total * channels ), out;
+  std::vector<unsigned> gains( in.size() );
+  for( size_t i = 0; i < in.size(); ++i )
+    in[i] = random.unitRange( 20 );
+  for( unsigned f = 0; f < total; ++f )
+    for( unsigned c = 0; c < channels; ++c )
+    {
+      if( value[c] < to[c] )
+        value[c] += std::min( steps[c], to[c] - value[c] );
+      else if( value[c] > to[c] )
+        value[c] -= std::min( steps[c], value[c] - to[c] );
+      if( value[c] == to[c] && reached[c] == ~0u )
+        reached[c] = f + 1;
+      gains[f * channels + c] = value[c];
+    }
+  out = in;
+  for( unsigned f = 0; f < total; )
+  {
+    unsigned n = std::min( total - f, 1 + unsigned( random.next() % 97 ) );
+    FloatEmu::ApplyGain( &out[f * channels], n * channels, channels, &g[0] );
+    f += n;
+  }
+  expectGain( check, &in[0], &out[0], &gains[0], in.size() );
+  for( unsigned c = 0; c < channels; ++c )
+    check.expect( reached[c] <= 2 * frames && g[c].value == to[c],
+      "ramp from %u to %u over %u frames took %u frames", from[c], to[c], frames, reached[c] );
+}
+
+void
+checkGainRamps()
+{
+  Check check( "ApplyGain ramps" );
+  Random random( 3 );
+  const unsigned unity = FloatEmu::UnityGain, half = unity / 2;
+  const unsigned quiet = FloatEmu::AttenuationToGain( 80 );
+  unsigned a[] = { half, unity, unity, quiet }, b[] = { unity, half, quiet, unity };
+  for( unsigned i = 0; i < 4; ++i )
+  {
+    checkRamp( check, random, 1, a + i, b + i, 512 );
+    checkRamp( check, random, 1, a + i, b + i, 7 );
+  }
+  checkRamp( check, random, 4, a, b, 1000 );
+  checkRamp( check, random, 3, b + 1, a + 1, 333 );
+  // from and to mute, and through the smallest gains, where the product has no bits to round
+  unsigned c[] = { 0, 1, 2, 1, unity, 0, 100 }, d[] = { unity, 100, 1, 0, 0, 1, 2 };
+  for( unsigned i = 0; i < 7; ++i )
+  {
+    checkRamp( check, random, 1, c + i, d + i, 512 );
+    checkRamp( check, random, 1, c + i, d + i, 3 );
+  }
+  checkRamp( check, random, 7, c, d, 64 );
+}
+
+void
+checkClip( Random& random, const std::vector<float>& input )
+{
+  Check check( "Clip" );
+  std::vector<float> in( input );
+  const float special[] = { 1.0f, 1.0000001f, 2.0f, 1e30f, INFINITY, NAN };
+  for( unsigned i = 0; i < sizeof(special)/sizeof(*special); ++i )
+  {
+    in.push_back( special[i] );
+    in.push_back( -special[i] );
+  }
+  for( int i = 0; i < 100000; ++i )
+    in.push_back( float( ( random.uniform() * 2 - 1 ) * 4 ) );
+  std::vector<float> v( in );
+  FloatEmu::Clip( &v[0], unsigned( v.size() ) );
+  for( size_t i = 0; i < v.size(); ++i )
+  {
+    float ref = in[i];
+    if( std::isnan( ref ) || std::fabs( ref ) > 1 )
+      ref = std::signbit( ref ) ? -1.0f : 1.0f;
+    check.expect( floatBits( v[i] ) == floatBits( ref ), "%.9g -> %.9g", in[i], v[i] );
+  }
+}
+
+// round(x * 2^(bits-1)), ties away from zero, clamped; NaNs clamp by their sign bit.
+long long
+referenceInt( float x, int bits )
+{
+  long long maxPos = ( 1LL << ( bits - 1 ) ) - 1;
+  if( std::isnan( x ) )
+    return std::signbit( x ) ? -maxPos - 1 : maxPos;
+  long double v = std::round( (long double)x * ( 1LL << ( bits - 1 ) ) );
+  return (long long)std::max<long double>( -maxPos - 1, std::min<long double>( maxPos, v ) );
+}
+
+long long
+loadInt( const unsigned char* p, int bytes, bool bigEndian )
+{
+  unsigned long long v = 0;
+  for( int i = 0; i < bytes; ++i )
+    v |= (unsigned long long)p[bigEndian ? bytes - 1 - i : i] << ( 8 * i );
+  return (long long)( v << ( 64 - 8 * bytes ) ) >> ( 64 - 8 * bytes );
+}
+
+void
+storeInt( unsigned char* p, long long v, int bytes, bool bigEndian )
+{
+  for( int i = 0; i < bytes; ++i )
+    p[bigEndian ? bytes - 1 - i : i] = (unsigned char)( v >> ( 8 * i ) );
+}
+
+// Returns whether a result is within half a unit in the last place of a reference value.
+bool
+withinHalfUlp( float result, long double ref )
+{
+  if( std::isinf( result ) || ref == 0 )
+    return result == ref;
+  int exp = 0;
+  std::frexp( result, &exp );
+  return std::fabs( result - ref ) <= std::ldexp( 1.0L, exp - 25 );
+}
+
+void
+checkIntConversions( Random& random, const std::vector<float>& input )
+{
+  std::vector<float> in( input );
+  const float special[] = { 1.5f, 1e30f, INFINITY, NAN };
+  for( unsigned i = 0; i < sizeof(special)/sizeof(*special); ++i )
+  {
+    in.push_back( special[i] );
+    in.push_back( -special[i] );
+  }
+  {
+    Check check( "FloatToInt16Copy" );
+    std::vector<short> s( in.size() );
+    FloatEmu::FloatToInt16Copy( &s[0], &in[0], unsigned( in.size() ) );
+    for( size_t i = 0; i < in.size(); ++i )
+      check.expect( s[i] == referenceInt( in[i], 16 ), "%.9g -> %d, expected %lld", in[i], s[i], referenceInt( in[i], 16 ) );
+  }
+  {
+    Check check( "Int16ToFloatCopy" );
+    std::vector<short> s( 65536 );
+    std::vector<float> f( s.size() );
+    for( int i = 0; i < 65536; ++i )
+      s[i] = short( i - 32768 );
+    FloatEmu::Int16ToFloatCopy( &f[0], &s[0], unsigned( s.size() ) );
+    for( int i = 0; i < 65536; ++i )
+      check.expect( f[i] == s[i] / 32768.0f, "%d -> %.9g", s[i], f[i] );
+  }
+  for( int bytes = 2; bytes <= 4; ++bytes )
+    for( int bigEndian = 0; bigEndian < 2; ++bigEndian )
+    {
+      static char name[2][64];
+      ::snprintf( name[0], sizeof(name[0]), "FloatToIntCopy %d bytes %s", bytes, bigEndian ? "BE" : "LE" );
+      ::snprintf( name[1], sizeof(name[1]), "IntToFloatCopy %d bytes %s", bytes, bigEndian ? "BE" : "LE" );
+      int bits = 8 * bytes;
+      {
+        Check check( name[0] );
+        std::vector<unsigned char> q( in.size() * bytes );
+        FloatEmu::FloatToIntCopy( &q[0], &in[0], unsigned( in.size() ), bytes, bigEndian );
+        for( size_t i = 0; i < in.size(); ++i )
+        {
+          long long v = loadInt( &q[i * bytes], bytes, bigEndian ), ref = referenceInt( in[i], bits );
+          check.expect( bytes < 4 ? v == ref : std::llabs( v - ref ) <= 1, "%.9g -> %lld, expected %lld", in[i], v, ref );
+        }
+      }
+      {
+        Check check( name[1] );
+        // All values of 2 and 3 bytes, and random values and edge cases of 4 bytes.
+        std::vector<long long> values;
+        if( bytes < 4 )
+          for( long long v = -( 1LL << ( bits - 1 ) ); v < ( 1LL << ( bits - 1 ) ); ++v )
+            values.push_back( v );
+        else
+        {
+          const long long edges[] = { 0, 1, -1, 0x7fffffff, -0x7fffffffLL - 1, 0x1000001, 0x1000003, 0x7fffff80, 0x7fffffc0 };
+          for( unsigned i = 0; i < sizeof(edges)/sizeof(*edges); ++i )
+          {
+            values.push_back( edges[i] );
+            values.push_back( -edges[i] > 0x7fffffff ? edges[i] : -edges[i] );
+          }
+          for( int i = 0; i < 1000000; ++i )
+            values.push_back( (int)(unsigned)random.next() >> ( random.next() % 32 ) );
+        }
+        std::vector<unsigned char> p( values.size() * bytes );
+        for( size_t i = 0; i < values.size(); ++i )
+          storeInt( &p[i * bytes], values[i], bytes, bigEndian );
+        std::vector<float> f( values.size() );
+        FloatEmu::IntToFloatCopy( &f[0], &p[0], unsigned( values.size() ), bytes, bigEndian );
+        for( size_t i = 0; i < values.size(); ++i )
+        {
+          long double ref = std::ldexp( (long double)values[i], 1 - bits );
+          check.expect( bytes < 4 ? f[i] == ref : withinHalfUlp( f[i], ref ), "%lld -> %.9g", values[i], f[i] );
+        }
+      }
+    }
+}
+
+void
+checkDouble( Random& random, const std::vector<float>& input )
+{
+  for( int bigEndian = 0; bigEndian < 2; ++bigEndian )
+  {
+    {
+      Check check( bigEndian ? "FloatToDoubleCopy BE" : "FloatToDoubleCopy LE" );
+      std::vector<float> in( input );
+      in.push_back( INFINITY );
+      in.push_back( -INFINITY );
+      in.push_back( NAN );
+      std::vector<unsigned char> q( in.size() * 8 );
+      FloatEmu::FloatToDoubleCopy( &q[0], &in[0], unsigned( in.size() ), bigEndian );
+      for( size_t i = 0; i < in.size(); ++i )
+      {
+        unsigned long long bits = (unsigned long long)loadInt( &q[i * 8], 8, bigEndian );
+        double d;
+        ::memcpy( &d, &bits, sizeof(d) );
+        double ref = std::fpclassify( in[i] ) == FP_SUBNORMAL ? std::copysign( 0.0, in[i] ) : in[i];
+        bool ok = std::isnan( ref ) ? std::isnan( d ) : ( d == ref && std::signbit( d ) == std::signbit( ref ) );
+        check.expect( ok, "%.9g -> %.17g", in[i], d );
+      }
+    }
+    {
+      Check check( bigEndian ? "DoubleToFloatCopy BE" : "DoubleToFloatCopy LE" );
+      std::vector<double> in;
+      const double special[] = { 0, 1, 1e-40, std::ldexp( 1.0, -126 ), std::ldexp( 1.0, 128 ),
+        std::ldexp( 1.0, 128 ) * ( 1 - std::ldexp( 1.0, -30 ) ), 1e300, INFINITY, NAN };
+      for( unsigned i = 0; i < sizeof(special)/sizeof(*special); ++i )
+      {
+        in.push_back( special[i] );
+        in.push_back( -special[i] );
+      }
+      for( int i = 0; i < 1000000; ++i )
+        in.push_back( std::ldexp( random.uniform() * 2 - 1, 60 - int( random.next() % 120 ) ) );
+      std::vector<unsigned char> p( in.size() * 8 );
+      for( size_t i = 0; i < in.size(); ++i )
+      {
+        unsigned long long bits;
+        ::memcpy( &bits, &in[i], sizeof(bits) );
+        storeInt( &p[i * 8], (long long)bits, 8, bigEndian );
+      }
+      std::vector<float> f( in.size() );
+      FloatEmu::DoubleToFloatCopy( &f[0], &p[0], unsigned( in.size() ), bigEndian );
+      for( size_t i = 0; i < in.size(); ++i )
+      {
+        double ref = in[i];
+        bool ok = false;
+        if( std::isnan( ref ) )
+          ok = std::isnan( f[i] );
+        else if( std::fabs( ref ) < std::ldexp( 1.0, -126 ) )
+          ok = f[i] == 0 || withinHalfUlp( f[i], ref );
+        else if( std::fabs( ref ) >= std::ldexp( 1.0, 128 ) )
+          ok = std::isinf( f[i] );
+        else
+          ok = withinHalfUlp( f[i], ref ) || ( std::isinf( f[i] ) && std::fabs( ref ) > FLT_MAX );
+        check.expect( ok && std::signbit( f[i] ) == std::signbit( ref ), "%.17g -> %.9g", ref, f[i] );
+      }
+    }
+  }
+  Check check( "SwapCopy32" );
+  std::vector<unsigned> in( 4097 ), out( in.size() );
+  for( size_t i = 0; i < in.size(); ++i )
+    in[i] = unsigned( random.next() );
+  FloatEmu::SwapCopy32( &out[0], &in[0], unsigned( in.size() ) );
+  for( size_t i = 0; i < in.size(); ++i )
+    check.expect( out[i] == __builtin_bswap32( in[i] ), "%08x -> %08x", in[i], out[i] );
+}
+
+// G.711 decoders, after the reference implementation (Sun Microsystems' g711.c).
+int
+referenceULaw( unsigned char b )
+{
+  int u = ~b & 0xff, t = ( ( ( u & 0x0f ) << 3 ) + 0x84 ) << ( ( u & 0x70 ) >> 4 );
+  return ( u & 0x80 ) ? 0x84 - t : t - 0x84;
+}
+
+int
+referenceALaw( unsigned char b )
+{
+  int a = b ^ 0x55, t = ( a & 0x0f ) << 4, seg = ( a & 0x70 ) >> 4;
+  if( seg == 0 )
+    t += 8;
+  else
+    t = ( t + 0x108 ) << ( seg - 1 );
+  return ( a & 0x80 ) ? t : -t;
+}
+
+void
+checkG711( bool aLaw )
+{
+  Check check( aLaw ? "G.711 A-law" : "G.711 mu-law" );
+  unsigned char codes[256];
+  short decoded[256];
+  for( int i = 0; i < 256; ++i )
+    codes[i] = (unsigned char)i;
+  ( aLaw ? Codecs::ALawToInt16Copy : Codecs::ULawToInt16Copy )( decoded, codes, 256 );
+  std::vector<int> levels;
+  for( int i = 0; i < 256; ++i )
+  {
+    int ref = aLaw ? referenceALaw( codes[i] ) : referenceULaw( codes[i] );
+    check.expect( decoded[i] == ref, "code %02x -> %d, expected %d", i, decoded[i], ref );
+    levels.push_back( ref );
+  }
+  std::sort( levels.begin(), levels.end() );
+  std::vector<short> in( 65536 ), out( in.size() );
+  std::vector<unsigned char> q( in.size() );
+  for( int i = 0; i < 65536; ++i )
+    in[i] = short( i - 32768 );
+  ( aLaw ? Codecs::Int16ToALawCopy : Codecs::Int16ToULawCopy )( &q[0], &in[0], unsigned( in.size() ) );
+  ( aLaw ? Codecs::ALawToInt16Copy : Codecs::ULawToInt16Copy )( &out[0], &q[0], unsigned( q.size() ) );
+  for( size_t i = 0; i < in.size(); ++i )
+  {
+    // the decoded levels next to the input
+    std::vector<int>::const_iterator above = std::lower_bound( levels.begin(), levels.end(), int( in[i] ) );
+    int hi = above == levels.end() ? levels.back() : *above,
+        lo = above == levels.begin() || hi == in[i] ? hi : *( above - 1 );
+    check.expect( out[i] == lo || out[i] == hi, "%d -> %d, between %d and %d", in[i], out[i], lo, hi );
+  }
+}
+
+// An IMA ADPCM decoder after the IMA recommendation, independent of Codecs.cpp.
+struct ReferenceAdpcm
+{
+  int predictor, index;
+  ReferenceAdpcm() : predictor( 0 ), index( 0 ) {}
+  int decode( int nibble )
+  {
+    static const int indexTable[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+    int step = stepTable( index );
+    int diff = step >> 3;
+    if( nibble & 4 ) diff += step;
+    if( nibble & 2 ) diff += step >> 1;
+    if( nibble & 1 ) diff += step >> 2;
+    predictor += ( nibble & 8 ) ? -diff : diff;
+    predictor = std::max( -32768, std::min( 32767, predictor ) );
+    index = std::max( 0, std::min( 88, index + indexTable[nibble & 7] ) );
+    return predictor;
+  }
+  static int stepTable( int i )
+  {
+    static const int steps[89] =
+    {
+      7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66,
+      73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449,
+      494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272,
+      2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493,
+      10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+    };
+    return steps[i];
+  }
+};
+
+void
+checkAdpcm( Random& random )
+{
+  Check check( "IMA ADPCM" );
+  for( int channels = 1; channels <= 3; ++channels )
+  {
+    // Decoding arbitrary data, in blocks that start at any channel.
+    std::vector<unsigned char> data( 4096 );
+    for( size_t i = 0; i < data.size(); ++i )
+      data[i] = (unsigned char)random.next();
+    std::vector<short> out( 2 * data.size() );
+    std::vector<Codecs::AdpcmState> state( channels );
+    for( int c = 0; c < channels; ++c )
+      state[c].reset();
+    for( size_t i = 0; i < data.size(); )
+    {
+      size_t n = std::min( data.size() - i, size_t( 1 + random.next() % 37 ) );
+      Codecs::ImaAdpcmToInt16Copy( &out[2 * i], &data[i], unsigned( 2 * n ), &state[0], channels, int( 2 * i % channels ) );
+      i += n;
+    }
+    std::vector<ReferenceAdpcm> ref( channels );
+    for( size_t i = 0; i < out.size(); ++i )
+    {
+      int nibble = ( data[i / 2] >> ( 4 * ( i % 2 ) ) ) & 0x0f, r = ref[i % channels].decode( nibble );
+      check.expect( out[i] == r, "%d channels: sample %zu decoded as %d, expected %d", channels, i, out[i], r );
+    }
+    // Encoding a sine, whose reconstruction the encoder's state must follow.
+    const int frames = 48000;
+    std::vector<short> in( frames * channels );
+    for( int f = 0; f < frames; ++f )
+      for( int c = 0; c < channels; ++c )
+        in[f * channels + c] = short( std::lround( 16384 * std::sin( 2 * M_PI * 1000 * f / 48000 + c ) ) );
+    std::vector<unsigned char> coded( in.size() / 2 );
+    for( int c = 0; c < channels; ++c )
+      state[c].reset();
+    for( size_t i = 0; i < coded.size(); )
+    {
+      size_t n = std::min( coded.size() - i, size_t( 1 + random.next() % 37 ) );
+      Codecs::Int16ToImaAdpcmCopy( &coded[i], &in[2 * i], unsigned( 2 * n ), &state[0], channels, int( 2 * i % channels ) );
+      i += n;
+    }
+    std::vector<ReferenceAdpcm> decoder( channels );
+    double signal = 0, noise = 0;
+    for( size_t i = 0; i < 2 * coded.size(); ++i )
+    {
+      int r = decoder[i % channels].decode( ( coded[i / 2] >> ( 4 * ( i % 2 ) ) ) & 0x0f );
+      if( i >= 480 * size_t( channels ) ) // after the encoder has settled
+      {
+        signal += double( in[i] ) * in[i];
+        noise += double( r - in[i] ) * ( r - in[i] );
+      }
+    }
+    for( int c = 0; c < channels; ++c )
+      check.expect( state[c].predictor == decoder[c].predictor && state[c].index == decoder[c].index,
+        "%d channels: encoder state of channel %d differs from the decoder's", channels, c );
+    double snr = 10 * std::log10( signal / std::max( noise, 1.0 ) );
+    check.expect( snr >= 20, "%d channels: SNR %.1f dB", channels, snr );
+  }
+}
+
+// The device node's sample formats, encoded and decoded as by the engine's encodeSamples and
+// decodeSamples, for round trips through each of them. IMA ADPCM is mono, from a reset state.
+typedef void (*EncodeFunc)( void*, const float*, unsigned count );
+typedef void (*DecodeFunc)( float*, const void*, unsigned count );
+
+void encodeS16( void* d, const float* s, unsigned n ) { FloatEmu::FloatToInt16Copy( static_cast<short*>( d ), s, n ); }
+void decodeS16( float* d, const void* s, unsigned n ) { FloatEmu::Int16ToFloatCopy( d, static_cast<const short*>( s ), n ); }
+template<int Bytes, bool BigEndian>
+void encodeInt( void* d, const float* s, unsigned n ) { FloatEmu::FloatToIntCopy( d, s, n, Bytes, BigEndian ); }
+template<int Bytes, bool BigEndian>
+void decodeInt( float* d, const void* s, unsigned n ) { FloatEmu::IntToFloatCopy( d, s, n, Bytes, BigEndian ); }
+void encodeF32( void* d, const float* s, unsigned n ) { ::memcpy( d, s, n * sizeof(float) ); }
+void decodeF32( float* d, const void* s, unsigned n ) { ::memcpy( d, s, n * sizeof(float) ); }
+void encodeF32BE( void* d, const float* s, unsigned n ) { FloatEmu::SwapCopy32( d, s, n ); }
+void decodeF32BE( float* d, const void* s, unsigned n ) { FloatEmu::SwapCopy32( d, s, n ); }
+template<bool BigEndian>
+void encodeF64( void* d, const float* s, unsigned n ) { FloatEmu::FloatToDoubleCopy( d, s, n, BigEndian ); }
+template<bool BigEndian>
+void decodeF64( float* d, const void* s, unsigned n ) { FloatEmu::DoubleToFloatCopy( d, s, n, BigEndian ); }
+
+template<int Codec>
+void
+encodeCodec( void* d, const float* s, unsigned n )
+{
+  std::vector<short> buf( n );
+  FloatEmu::FloatToInt16Copy( &buf[0], s, n );
+  unsigned char* q = static_cast<unsigned char*>( d );
+  Codecs::AdpcmState state;
+  state.reset();
+  if( Codec == 0 )
+    Codecs::Int16ToULawCopy( q, &buf[0], n );
+  else if( Codec == 1 )
+    Codecs::Int16ToALawCopy( q, &buf[0], n );
+  else
+    Codecs::Int16ToImaAdpcmCopy( q, &buf[0], n, &state, 1, 0 );
+}
+
+template<int Codec>
+void
+decodeCodec( float* d, const void* s, unsigned n )
+{
+  std::vector<short> buf( n );
+  const unsigned char* p = static_cast<const unsigned char*>( s );
+  Codecs::AdpcmState state;
+  state.reset();
+  if( Codec == 0 )
+    Codecs::ULawToInt16Copy( &buf[0], p, n );
+  else if( Codec == 1 )
+    Codecs::ALawToInt16Copy( &buf[0], p, n );
+  else
+    Codecs::ImaAdpcmToInt16Copy( &buf[0], p, n, &state, 1, 0 );
+  FloatEmu::Int16ToFloatCopy( d, &buf[0], n );
+}
+
+enum FormatKind { Linear, Float32Kind, Float64Kind, G711, Adpcm };
+
+struct Format
+{
+  const char* name;
+  FormatKind kind;
+  int bits; // per sample
+  EncodeFunc encode;
+  DecodeFunc decode;
+};
+
+const Format cFormats[] =
+{
+  { "s16le", Linear, 16, encodeS16, decodeS16 },
+  { "s16be", Linear, 16, encodeInt<2, true>, decodeInt<2, true> },
+  { "s24_3le", Linear, 24, encodeInt<3, false>, decodeInt<3, false> },
+  { "s24_3be", Linear, 24, encodeInt<3, true>, decodeInt<3, true> },
+  { "s32le", Linear, 32, encodeInt<4, false>, decodeInt<4, false> },
+  { "s32be", Linear, 32, encodeInt<4, true>, decodeInt<4, true> },
+  { "float32le", Float32Kind, 32, encodeF32, decodeF32 },
+  { "float32be", Float32Kind, 32, encodeF32BE, decodeF32BE },
+  { "float64le", Float64Kind, 64, encodeF64<false>, decodeF64<false> },
+  { "float64be", Float64Kind, 64, encodeF64<true>, decodeF64<true> },
+  { "ulaw", G711, 8, encodeCodec<0>, decodeCodec<0> },
+  { "alaw", G711, 8, encodeCodec<1>, decodeCodec<1> },
+  { "ima-adpcm", Adpcm, 4, encodeCodec<2>, decodeCodec<2> },
+};
+
+// Round trips through each format, in both directions:
+//  - From the format to floats and back. Linear formats of up to 24 bits, and IMA ADPCM data that
+//    does not saturate the decoder, return the same data; s32 returns each value rounded to the
+//    24 bits of a float's mantissa, and G.711 codes that decode alike (the two zeros of u-law).
+//    Float formats return the same data for floats and doubles that are normal floats.
+//  - From floats to the format and back. Linear formats return x rounded to the nearest LSB,
+//    ties away from zero, and clamped to the format's range; s32 within 2 LSB and half a unit
+//    in the last place. Float formats return x, except that float64 flushes denormals. G.711
+//    returns a value within |x| / 16 + 2^-12 + 2^-16 of x, or the extreme value beyond it, that
+//    survives a second round trip unchanged. IMA ADPCM has an SNR of at least 20 dB on a sine.
+// Edge cases are zero, one LSB and half an LSB of each format either side of zero, and values
+// at and beyond full scale.
+void
+checkRoundTrips( Random& random, const std::vector<float>& input )
+{
+  for( size_t k = 0; k < sizeof(cFormats)/sizeof(*cFormats); ++k )
+  {
+    const Format& format = cFormats[k];
+    size_t bytes = std::max( format.bits / 8, 1 );
+    static char name[2][64];
+    ::snprintf( name[0], sizeof(name[0]), "round trip %s to float", format.name );
+    ::snprintf( name[1], sizeof(name[1]), "round trip float to %s", format.name );
+    {
+      Check check( name[0] );
+      std::vector<unsigned char> wire;
+      if( format.kind == Linear && format.bits <= 24 )
+        for( long long v = -( 1LL << ( format.bits - 1 ) ); v < ( 1LL << ( format.bits - 1 ) ); ++v )
+        {
+          wire.resize( wire.size() + bytes );
+          storeInt( &wire[wire.size() - bytes], v, int( bytes ), ::strstr( format.name, "be" ) != 0 );
+        }
+      else if( format.kind == G711 )
+        for( int c = 0; c < 256; ++c )
+          wire.push_back( (unsigned char)c );
+      else if( format.kind == Linear )
+        for( int i = 0; i < 1 << 20; ++i )
+          wire.push_back( (unsigned char)random.next() );
+      else if( format.kind == Adpcm )
+      { // the coded noise of -12 dBFS, since arbitrary data saturates the decoder
+        std::vector<float> f( 1 << 20 );
+        for( size_t i = 0; i < f.size(); ++i )
+          f[i] = float( random.uniform() / 2 - 0.25 );
+        wire.resize( f.size() / 2 );
+        format.encode( &wire[0], &f[0], unsigned( f.size() ) );
+      }
+      else
+      {
+        std::vector<float> f( input );
+        for( size_t i = 0; i < f.size(); ++i )
+          if( std::fabs( f[i] ) < FLT_MIN )
+            f[i] = 0;
+        f.push_back( INFINITY );
+        f.push_back( -INFINITY );
+        wire.resize( f.size() * bytes );
+        format.encode( &wire[0], &f[0], unsigned( f.size() ) );
+      }
+      unsigned count = unsigned( wire.size() * 8 / format.bits );
+      std::vector<float> f( count );
+      std::vector<unsigned char> back( wire.size() );
+      format.decode( &f[0], &wire[0], count );
+      format.encode( &back[0], &f[0], count );
+      if( format.kind == Linear && format.bits == 32 )
+        for( unsigned i = 0; i < count; ++i )
+        {
+          bool bigEndian = ::strstr( format.name, "be" ) != 0;
+          long long v = loadInt( &wire[4 * i], 4, bigEndian ), w = loadInt( &back[4 * i], 4, bigEndian );
+          check.expect( std::llabs( w - v ) <= std::llabs( v ) / ( 1 << 24 ) + 1, "%lld -> %.9g -> %lld", v, f[i], w );
+        }
+      else if( format.kind == G711 )
+      {
+        std::vector<float> g( count );
+        format.decode( &g[0], &back[0], count );
+        for( unsigned i = 0; i < count; ++i )
+          check.expect( g[i] == f[i], "sample %u: %.9g decodes as %.9g after the round trip", i, f[i], g[i] );
+      }
+      else
+        for( size_t i = 0; i < wire.size(); i += bytes )
+          check.expect( !::memcmp( &wire[i], &back[i], bytes ), "sample %zu differs after the round trip", i / bytes );
+    }
+    {
+      Check check( name[1] );
+      if( format.kind == Adpcm )
+      {
+        const unsigned frames = 48000;
+        std::vector<float> in( frames ), out( frames );
+        std::vector<unsigned char> wire( frames / 2 );
+        for( unsigned f = 0; f < frames; ++f )
+          in[f] = float( 0.5 * std::sin( 2 * M_PI * 1000 * f / 48000 ) );
+        format.encode( &wire[0], &in[0], frames );
+        format.decode( &out[0], &wire[0], frames );
+        double signal = 0, noise = 0;
+        for( unsigned f = 480; f < frames; ++f )
+        {
+          signal += double( in[f] ) * in[f];
+          noise += double( out[f] - in[f] ) * ( out[f] - in[f] );
+        }
+        double snr = 10 * std::log10( signal / std::max( noise, 1e-30 ) );
+        check.expect( snr >= 20, "SNR %.1f dB", snr );
+        continue;
+      }
+      std::vector<float> in( input );
+      long double lsb = std::ldexp( 1.0L, 1 - ( format.kind == Linear ? format.bits : 16 ) );
+      const long double edges[] = { 0, lsb, lsb / 2, lsb / 2 * ( 1 - std::ldexp( 1.0L, -20 ) ), 3 * lsb / 2, 1 - lsb,
+        1 - lsb / 2, 1, 1 + lsb, 1.5, 1e30, INFINITY };
+      for( size_t i = 0; i < sizeof(edges)/sizeof(*edges); ++i )
+      {
+        in.push_back( float( edges[i] ) );
+        in.push_back( -float( edges[i] ) );
+      }
+      unsigned count = unsigned( in.size() );
+      std::vector<unsigned char> wire( count * bytes ), again( count * bytes );
+      std::vector<float> out( count );
+      format.encode( &wire[0], &in[0], count );
+      format.decode( &out[0], &wire[0], count );
+      std::vector<float> twice( count );
+      float extreme = 0; // the largest G.711 value
+      if( format.kind == G711 )
+      {
+        format.encode( &again[0], &out[0], count );
+        format.decode( &twice[0], &again[0], count );
+        unsigned char codes[256];
+        float values[256];
+        for( int c = 0; c < 256; ++c )
+          codes[c] = (unsigned char)c;
+        format.decode( values, codes, 256 );
+        extreme = *std::max_element( values, values + 256 );
+      }
+      for( unsigned i = 0; i < count; ++i )
+      {
+        long double x = in[i], clamped = std::max( -1.0L, std::min( 1.0L, x ) );
+        bool ok = false;
+        switch( format.kind )
+        {
+          case Linear:
+          {
+            long double ref = referenceInt( in[i], format.bits ) * lsb;
+            ok = format.bits < 32 ? out[i] == ref
+               : std::fabs( out[i] - ref ) <= 2 * lsb + std::fabs( ref ) * std::ldexp( 1.0L, -24 );
+            break;
+          }
+          case Float32Kind:
+            ok = floatBits( out[i] ) == floatBits( in[i] );
+            break;
+          case Float64Kind:
+            ok = out[i] == in[i] || ( std::fabs( in[i] ) < FLT_MIN && out[i] == 0 );
+            break;
+          case G711:
+            ok = ( std::fabs( x ) >= 1 ? std::fabs( out[i] ) == extreme
+                 : std::fabs( out[i] - clamped ) <= std::fabs( clamped ) / 16 + std::ldexp( 1.0L, -12 ) + lsb / 2 )
+              && twice[i] == out[i];
+            break;
+          case Adpcm:
+            break;
+        }
+        check.expect( ok, "%.9g -> %.9g", in[i], out[i] );
+      }
+    }
+  }
+}
+
+void
+checkDither( Random& random, const std::vector<float>& input )
+{
+  for( int shaped = 0; shaped < 2; ++shaped )
+    for( int bigEndian = 0; bigEndian < 2; ++bigEndian )
+    {
+      static char name[64];
+      ::snprintf( name, sizeof(name), "FloatToInt16DitherCopy %s %s", shaped ? "shaped" : "TPDF", bigEndian ? "BE" : "LE" );
+      Check check( name );
+      const double bound = shaped ? 3.5 : 1.5;
+      for( int channels = 1; channels <= 3; ++channels )
+      {
+        std::vector<float> in( input.begin(), input.begin() + input.size() / channels * channels );
+        std::vector<unsigned char> q( 2 * in.size() );
+        std::vector<int> error( channels, 0 );
+        FloatEmu::DitherState state = { 12345, &error[0], channels };
+        for( size_t i = 0; i < in.size(); )
+        {
+          size_t n = std::min( in.size() - i, channels * size_t( 1 + random.next() % 50 ) );
+          FloatEmu::FloatToInt16DitherCopy( &q[2 * i], &in[i], unsigned( n ), bigEndian, shaped, state );
+          i += n;
+        }
+        for( size_t i = 0; i < in.size(); ++i )
+        {
+          long long y = loadInt( &q[2 * i], 2, bigEndian );
+          double x = in[i] * 32768.0;
+          bool clamped = ( y == 32767 && x > 32767 - bound ) || ( y == -32768 && x < -32768 + bound );
+          check.expect( clamped || std::fabs( y - x ) <= bound, "%.9g -> %lld", in[i], y );
+        }
+      }
+    }
+}
+
+// Checks the statistics of the dither error y - x * 32768 on a 997 Hz sine at -12 dBFS: its
+// mean and RMS, its correlation between channels, and the share of its energy below a quarter
+// of the sample rate, from DFTs of 256-sample blocks. Triangular dither gives white noise with
+// an RMS of 1/2 LSB and half of the energy in the lower band; noise shaping, which filters the
+// error with 1 - z^-1, gives an RMS of 1/sqrt(2) LSB and 18% of the energy in the lower band.
+void
+checkDitherNoise()
+{
+  const int frames = 1 << 16, block = 256;
+  std::vector<double> cosines( block ), sines( block );
+  for( int i = 0; i < block; ++i )
+  {
+    cosines[i] = std::cos( 2 * M_PI * i / block );
+    sines[i] = std::sin( 2 * M_PI * i / block );
+  }
+  for( int shaped = 0; shaped < 2; ++shaped )
+  {
+    static char name[64];
+    ::snprintf( name, sizeof(name), "FloatToInt16DitherCopy %s noise", shaped ? "shaped" : "TPDF" );
+    Check check( name );
+    const double rmsExpected = shaped ? M_SQRT1_2 : 0.5,
+                 lowMin = shaped ? 0.14 : 0.46, lowMax = shaped ? 0.22 : 0.54;
+    for( int channels = 1; channels <= 3; ++channels )
+    {
+      std::vector<float> in( frames * channels );
+      for( int f = 0; f < frames; ++f )
+        for( int c = 0; c < channels; ++c )
+          in[f * channels + c] = float( 0.25 * std::sin( 2 * M_PI * 997 * f / 48000 + c ) );
+      std::vector<short> q( in.size() );
+      std::vector<int> error( channels, 0 );
+      FloatEmu::DitherState state = { 777, &error[0], channels };
+      FloatEmu::FloatToInt16DitherCopy( &q[0], &in[0], unsigned( in.size() ), false, shaped, state );
+      std::vector<double> e( in.size() );
+      for( size_t i = 0; i < in.size(); ++i )
+        e[i] = q[i] - in[i] * 32768.0;
+      for( int c = 0; c < channels; ++c )
+      {
+        double sum = 0, squares = 0, low = 0, total = 0;
+        for( int f = 0; f < frames; ++f )
+        {
+          sum += e[f * channels + c];
+          squares += e[f * channels + c] * e[f * channels + c];
+        }
+        for( int b = 0; b < frames; b += block )
+          for( int k = 1; k < block / 2; ++k )
+          {
+            double re = 0, im = 0;
+            for( int i = 0; i < block; ++i )
+            {
+              re += e[( b + i ) * channels + c] * cosines[i * k % block];
+              im += e[( b + i ) * channels + c] * sines[i * k % block];
+            }
+            total += re * re + im * im;
+            low += k < block / 4 ? re * re + im * im : 0;
+          }
+        double mean = sum / frames, rms = std::sqrt( squares / frames );
+        check.expect( std::fabs( mean ) < 0.01, "channel %d of %d: mean error %.4f LSB", c, channels, mean );
+        check.expect( std::fabs( rms - rmsExpected ) < 0.02, "channel %d of %d: rms error %.4f LSB, expected %.4f",
+          c, channels, rms, rmsExpected );
+        check.expect( low / total >= lowMin && low / total <= lowMax,
+          "channel %d of %d: %.3f of the error energy below fs/4", c, channels, low / total );
+        if( c > 0 )
+        {
+          double cross = 0;
+          for( int f = 0; f < frames; ++f )
+            cross += e[f * channels + c] * e[f * channels];
+          cross /= frames * rmsExpected * rmsExpected;
+          check.expect( std::fabs( cross ) < 0.02, "channels 0 and %d of %d: correlation %.4f", c, channels, cross );
+        }
+      }
+    }
+  }
+}
+
+void
+checkLevels( Random& random )
+{
+  Check check( "MeasureLevels, TakeLevels, Peak" );
+  for( int channels = 1; channels <= 4; ++channels )
+    for( int signal = 0; signal < 3; ++signal )
+    {
+      const int frames = 48000;
+      std::vector<float> in( frames * channels );
+      for( int f = 0; f < frames; ++f )
+        for( int c = 0; c < channels; ++c )
+        {
+          double amplitude = std::pow( 0.1, c );
+          double x = signal == 0 ? amplitude * std::sin( 2 * M_PI * 997 * f / 48000 )
+                   : signal == 1 ? amplitude * ( random.uniform() * 2 - 1 ) : random.unitRange( 30 );
+          in[f * channels + c] = float( x );
+        }
+      std::vector<FloatEmu::Levels> levels( 2 * channels ); // two sets, taken independently
+      ::memset( &levels[0], 0, levels.size() * sizeof(levels[0]) );
+      for( int f = 0; f < frames; )
+      {
+        int n = std::min( frames - f, 1 + int( random.next() % 1000 ) );
+        FloatEmu::MeasureLevels( &in[f * channels], n * channels, channels, &levels[0], 2 );
+        f += n;
+      }
+      for( int c = 0; c < channels; ++c )
+      {
+        double peak = 0, sum = 0;
+        for( int f = 0; f < frames; ++f )
+        {
+          double x = std::fabs( in[f * channels + c] );
+          peak = std::max( peak, x );
+          sum += x * x;
+        }
+        unsigned gotPeak = 0, gotRms = 0;
+        FloatEmu::TakeLevels( levels[c], &gotPeak, &gotRms );
+        double rms = std::sqrt( sum / frames );
+        check.expect( std::fabs( gotPeak - peak * ( 1 << 24 ) ) <= 1, "peak %u, expected %.1f", gotPeak, peak * ( 1 << 24 ) );
+        check.expect( std::fabs( gotRms - rms * ( 1 << 24 ) ) <= ( 1 << 10 ), "rms %u, expected %.1f", gotRms, rms * ( 1 << 24 ) );
+        std::vector<float> channel( frames );
+        for( int f = 0; f < frames; ++f )
+          channel[f] = in[f * channels + c];
+        unsigned p = FloatEmu::Peak( &channel[0], frames );
+        check.expect( std::fabs( p - peak * ( 1 << 24 ) ) <= 1, "Peak() %u, expected %.1f", p, peak * ( 1 << 24 ) );
+        unsigned again = 1;
+        FloatEmu::TakeLevels( levels[c], &again, &again );
+        check.expect( again == 0, "levels not reset" );
+        unsigned otherPeak = 0, otherRms = 0;
+        FloatEmu::TakeLevels( levels[channels + c], &otherPeak, &otherRms );
+        check.expect( otherPeak == gotPeak && otherRms == gotRms, "second set %u %u, expected %u %u",
+          otherPeak, otherRms, gotPeak, gotRms );
+      }
+    }
+  // Full scale, starting just below the frame limit: the sums stop growing before they overflow.
+  std::vector<float> ones( 1000, 1.0f );
+  FloatEmu::Levels l = { 0, 0, FloatEmu::Levels::cMaxFrames - 100 };
+  l.sumSquares = l.frames * 0xffffull * 0xffff;
+  for( int i = 0; i < 10; ++i )
+    FloatEmu::MeasureLevels( &ones[0], unsigned( ones.size() ), 1, &l, 1 );
+  check.expect( l.frames <= FloatEmu::Levels::cMaxFrames + ones.size(), "%u frames accumulated", l.frames );
+  unsigned peak = 0, rms = 0;
+  FloatEmu::TakeLevels( l, &peak, &rms );
+  check.expect( peak == ( 1 << 24 ) - 1 && std::abs( int( rms - ( 1 << 24 ) ) ) <= ( 1 << 10 ), "saturated levels %u %u", peak, rms );
+}
+
+void
+checkDecibels()
+{
+  Check check( "LevelToDecibels" );
+  check.expect( FloatEmu::LevelToDecibels( 0 ) == -0x7fffffff - 1, "level 0" );
+  for( double level = 1; level < double( 1u << 31 ); level *= 1.0137 )
+  {
+    unsigned l = unsigned( level );
+    int tenths = FloatEmu::LevelToDecibels( l );
+    double ref = 200 * std::log10( l / double( 1 << 24 ) );
+    check.expect( std::fabs( tenths - ref ) <= 1, "level %u -> %d tenths of a dB, expected %.2f", l, tenths, ref );
+  }
+}
+
+// Throughput measurement
+
+// Input and output buffers of the largest size, and kernel state.
+struct Data
+{
+  std::vector<float> floats, work;
+  std::vector<short> shorts;
+  std::vector<unsigned char> out, ulaw, alaw, adpcm, s24, s32;
+  std::vector<double> doubles;
+  FloatEmu::Gain gains[8];
+  Codecs::AdpcmState adpcmStates[8];
+  int errors[8];
+  FloatEmu::DitherState dither;
+  FloatEmu::Levels levels[8];
+};
+
+typedef void (*RunFunc)( Data&, unsigned count, unsigned channels );
+
+struct Kernel
+{
+  const char* name;
+  int inBytes, outBytes; // per sample
+  bool perChannel;       // throughput depends on the number of channels
+  bool inPlace;          // modifies the work buffer, which is refreshed before each run
+  RunFunc run;
+};
+
+void runCopy( Data& d, unsigned n, unsigned ) { ::memcpy( &d.work[0], &d.floats[0], n * sizeof(float) ); }
+void runClip( Data& d, unsigned n, unsigned ) { FloatEmu::Clip( &d.work[0], n ); }
+
+void
+runGain( Data& d, unsigned n, unsigned channels )
+{
+  for( unsigned c = 0; c < channels; ++c )
+  {
+    d.gains[c].value = d.gains[c].target = FloatEmu::AttenuationToGain( 12 + c );
+    d.gains[c].step = 0;
+  }
+  FloatEmu::ApplyGain( &d.work[0], n, channels, d.gains );
+}
+
+void
+runGainRamp( Data& d, unsigned n, unsigned channels )
+{
+  for( unsigned c = 0; c < channels; ++c )
+  {
+    d.gains[c].value = FloatEmu::UnityGain;
+    FloatEmu::SetGainTarget( d.gains[c], FloatEmu::UnityGain / 4, cMaxSamples );
+  }
+  FloatEmu::ApplyGain( &d.work[0], n, channels, d.gains );
+}
+
+void runToS16( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToInt16Copy( reinterpret_cast<short*>( &d.out[0] ), &d.floats[0], n ); }
+void runFromS16( Data& d, unsigned n, unsigned ) { FloatEmu::Int16ToFloatCopy( &d.work[0], &d.shorts[0], n ); }
+void runToS16BE( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToIntCopy( &d.out[0], &d.floats[0], n, 2, true ); }
+void runFromS16BE( Data& d, unsigned n, unsigned ) { FloatEmu::IntToFloatCopy( &d.work[0], &d.shorts[0], n, 2, true ); }
+void runToS24( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToIntCopy( &d.out[0], &d.floats[0], n, 3, false ); }
+void runFromS24( Data& d, unsigned n, unsigned ) { FloatEmu::IntToFloatCopy( &d.work[0], &d.s24[0], n, 3, false ); }
+void runToS24BE( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToIntCopy( &d.out[0], &d.floats[0], n, 3, true ); }
+void runFromS24BE( Data& d, unsigned n, unsigned ) { FloatEmu::IntToFloatCopy( &d.work[0], &d.s24[0], n, 3, true ); }
+void runToS32( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToIntCopy( &d.out[0], &d.floats[0], n, 4, false ); }
+void runFromS32( Data& d, unsigned n, unsigned ) { FloatEmu::IntToFloatCopy( &d.work[0], &d.s32[0], n, 4, false ); }
+void runToS32BE( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToIntCopy( &d.out[0], &d.floats[0], n, 4, true ); }
+void runFromS32BE( Data& d, unsigned n, unsigned ) { FloatEmu::IntToFloatCopy( &d.work[0], &d.s32[0], n, 4, true ); }
+void runSwap( Data& d, unsigned n, unsigned ) { FloatEmu::SwapCopy32( &d.out[0], &d.floats[0], n ); }
+void runToF64( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToDoubleCopy( &d.out[0], &d.floats[0], n, false ); }
+void runFromF64( Data& d, unsigned n, unsigned ) { FloatEmu::DoubleToFloatCopy( &d.work[0], &d.doubles[0], n, false ); }
+void runToF64BE( Data& d, unsigned n, unsigned ) { FloatEmu::FloatToDoubleCopy( &d.out[0], &d.floats[0], n, true ); }
+void runFromF64BE( Data& d, unsigned n, unsigned ) { FloatEmu::DoubleToFloatCopy( &d.work[0], &d.doubles[0], n, true ); }
+void runToULaw( Data& d, unsigned n, unsigned ) { Codecs::Int16ToULawCopy( &d.out[0], &d.shorts[0], n ); }
+void runFromULaw( Data& d, unsigned n, unsigned ) { Codecs::ULawToInt16Copy( reinterpret_cast<short*>( &d.out[0] ), &d.ulaw[0], n ); }
+void runToALaw( Data& d, unsigned n, unsigned ) { Codecs::Int16ToALawCopy( &d.out[0], &d.shorts[0], n ); }
+void runFromALaw( Data& d, unsigned n, unsigned ) { Codecs::ALawToInt16Copy( reinterpret_cast<short*>( &d.out[0] ), &d.alaw[0], n ); }
+
+void
+runToAdpcm( Data& d, unsigned n, unsigned channels )
+{
+  Codecs::Int16ToImaAdpcmCopy( &d.out[0], &d.shorts[0], n, d.adpcmStates, channels, 0 );
+}
+
+void
+runFromAdpcm( Data& d, unsigned n, unsigned channels )
+{
+  Codecs::ImaAdpcmToInt16Copy( reinterpret_cast<short*>( &d.out[0] ), &d.adpcm[0], n, d.adpcmStates, channels, 0 );
+}
+
+void
+runDither( Data& d, unsigned n, unsigned channels, bool shaped )
+{
+  d.dither.channels = channels;
+  FloatEmu::FloatToInt16DitherCopy( &d.out[0], &d.floats[0], n, false, shaped, d.dither );
+}
+
+void runTpdf( Data& d, unsigned n, unsigned channels ) { runDither( d, n, channels, false ); }
+void runShaped( Data& d, unsigned n, unsigned channels ) { runDither( d, n, channels, true ); }
+void runLevels( Data& d, unsigned n, unsigned channels ) { FloatEmu::MeasureLevels( &d.floats[0], n, channels, d.levels, 1 ); }
+
+const Kernel sKernels[] =
+{
+  { "ApplyGain constant",   4, 4, true,  true,  runGain },
+  { "ApplyGain ramp",       4, 4, true,  true,  runGainRamp },
+  { "Clip",                 4, 4, false, true,  runClip },
+  { "float->s16",           4, 2, false, false, runToS16 },
+  { "s16->float",           2, 4, false, false, runFromS16 },
+  { "float->s16be",         4, 2, false, false, runToS16BE },
+  { "s16be->float",         2, 4, false, false, runFromS16BE },
+  { "float->s24_3le",       4, 3, false, false, runToS24 },
+  { "s24_3le->float",       3, 4, false, false, runFromS24 },
+  { "float->s24_3be",       4, 3, false, false, runToS24BE },
+  { "s24_3be->float",       3, 4, false, false, runFromS24BE },
+  { "float->s32",           4, 4, false, false, runToS32 },
+  { "s32->float",           4, 4, false, false, runFromS32 },
+  { "float->s32be",         4, 4, false, false, runToS32BE },
+  { "s32be->float",         4, 4, false, false, runFromS32BE },
+  { "float->float32be",     4, 4, false, false, runSwap },
+  { "float->float64",       4, 8, false, false, runToF64 },
+  { "float64->float",       8, 4, false, false, runFromF64 },
+  { "float->float64be",     4, 8, false, false, runToF64BE },
+  { "float64be->float",     8, 4, false, false, runFromF64BE },
+  { "s16->ulaw",            2, 1, false, false, runToULaw },
+  { "ulaw->s16",            1, 2, false, false, runFromULaw },
+  { "s16->alaw",            2, 1, false, false, runToALaw },
+  { "alaw->s16",            1, 2, false, false, runFromALaw },
+  { "s16->ima-adpcm",       2, 0, true,  false, runToAdpcm },
+  { "ima-adpcm->s16",       0, 2, true,  false, runFromAdpcm },
+  { "float->s16 tpdf",      4, 2, true,  false, runTpdf },
+  { "float->s16 shaped",    4, 2, true,  false, runShaped },
+  { "MeasureLevels",        4, 0, true,  false, runLevels },
+};
+
+// Returns the time of a single run in ns, as the fastest of several trials of repeated runs.
+double
+measure( Data& d, RunFunc run, RunFunc refresh, unsigned count, unsigned channels, bool quick )
+{
+  unsigned repeats = std::max( 1u, ( quick ? 1u << 19 : 1u << 21 ) / count );
+  double best = 1e30;
+  for( int trial = 0; trial < ( quick ? 3 : 7 ); ++trial )
+  {
+    double start = wallTime();
+    for( unsigned r = 0; r < repeats; ++r )
+    {
+      if( refresh )
+        refresh( d, count, channels );
+      run( d, count, channels );
+    }
+    best = std::min( best, ( wallTime() - start ) * 1e9 / repeats );
+  }
+  return best;
+}
+
+bool
+loadBaseline( const char* path, std::map<std::string, double>& baseline )
+{
+  FILE* f = ::fopen( path, "r" );
+  if( !f )
+    return false;
+  char line[256];
+  while( ::fgets( line, sizeof(line), f ) )
+  {
+    char* tab = ::strrchr( line, '\t' );
+    if( line[0] == '#' || !tab )
+      continue;
+    *tab = 0;
+    baseline[line] = ::atof( tab + 1 );
+  }
+  ::fclose( f );
+  return true;
+}
+
+bool
+benchmark( const Options& o )
+{
+  std::map<std::string, double> baseline;
+  if( o.baseline && !loadBaseline( o.baseline, baseline ) )
+  {
+    ::fprintf( stderr, "floatemubench: cannot read %s\n", o.baseline );
+    return false;
+  }
+  FILE* save = 0;
+  if( o.saveBaseline && !( save = ::fopen( o.saveBaseline, "w" ) ) )
+  {
+    ::fprintf( stderr, "floatemubench: cannot write %s\n", o.saveBaseline );
+    return false;
+  }
+  if( save )
+    ::fprintf( save, "# floatemubench baseline: kernel, frames, channels <tab> ns per sample\n" );
+
+  Data d;
+  Random random( 7 );
+  d.floats.resize( cMaxSamples );
+  d.work.resize( cMaxSamples );
+  d.shorts.resize( cMaxSamples );
+  d.out.resize( 8 * cMaxSamples );
+  d.ulaw.resize( cMaxSamples );
+  d.alaw.resize( cMaxSamples );
+  d.adpcm.resize( cMaxSamples / 2 );
+  d.s24.resize( 3 * cMaxSamples );
+  d.s32.resize( 4 * cMaxSamples );
+  d.doubles.resize( cMaxSamples );
+  for( unsigned i = 0; i < cMaxSamples; ++i )
+    d.floats[i] = random.unitRange( 16 );
+  FloatEmu::FloatToInt16Copy( &d.shorts[0], &d.floats[0], cMaxSamples );
+  FloatEmu::FloatToIntCopy( &d.s24[0], &d.floats[0], cMaxSamples, 3, false );
+  FloatEmu::FloatToIntCopy( &d.s32[0], &d.floats[0], cMaxSamples, 4, false );
+  FloatEmu::FloatToDoubleCopy( &d.doubles[0], &d.floats[0], cMaxSamples, false );
+  Codecs::Int16ToULawCopy( &d.ulaw[0], &d.shorts[0], cMaxSamples );
+  Codecs::Int16ToALawCopy( &d.alaw[0], &d.shorts[0], cMaxSamples );
+  for( int c = 0; c < 8; ++c )
+    d.adpcmStates[c].reset();
+  Codecs::Int16ToImaAdpcmCopy( &d.adpcm[0], &d.shorts[0], cMaxSamples, d.adpcmStates, 1, 0 );
+  ::memset( d.errors, 0, sizeof(d.errors) );
+  d.dither.seed = 1;
+  d.dither.pError = d.errors;
+  ::memset( d.levels, 0, sizeof(d.levels) );
+
+  // Buffer sizes as frames and channels; kernels that do not depend on the channel count
+  // only run on mono buffers.
+  struct Size { unsigned frames, channels; };
+  const Size perChannelSizes[] = { { 64, 1 }, { 64, 2 }, { 64, 8 }, { 512, 1 }, { 512, 2 }, { 512, 8 },
+    { 4096, 1 }, { 4096, 2 }, { 4096, 8 }, { cMaxSamples / 2, 2 } };
+  const Size monoSizes[] = { { 64, 1 }, { 512, 1 }, { 4096, 1 }, { 32768, 1 }, { cMaxSamples, 1 } };
+  const Size quickSizes[] = { { 512, 2 }, { cMaxSamples / 2, 2 } };
+
+  ::printf( "\n%-20s %8s %3s %10s %8s\n", "kernel", "frames", "ch", "ns/sample", "GB/s" );
+  bool ok = true;
+  for( unsigned k = 0; k < sizeof(sKernels)/sizeof(*sKernels); ++k )
+  {
+    const Kernel& kernel = sKernels[k];
+    if( !::strstr( kernel.name, o.filter ) )
+      continue;
+    const Size* sizes = o.quick ? quickSizes : kernel.perChannel ? perChannelSizes : monoSizes;
+    unsigned n = o.quick ? sizeof(quickSizes)/sizeof(*quickSizes)
+               : kernel.perChannel ? sizeof(perChannelSizes)/sizeof(*perChannelSizes) : sizeof(monoSizes)/sizeof(*monoSizes);
+    for( unsigned i = 0; i < n; ++i )
+    {
+      unsigned count = sizes[i].frames * sizes[i].channels;
+      double ns = measure( d, kernel.run, kernel.inPlace ? runCopy : 0, count, sizes[i].channels, o.quick );
+      if( kernel.inPlace )
+        ns = std::max( 0.0, ns - measure( d, runCopy, 0, count, sizes[i].channels, o.quick ) );
+      double perSample = ns / count,
+             gbps = perSample > 0 ? ( kernel.inBytes + kernel.outBytes ) / perSample : 0;
+      char key[128];
+      ::snprintf( key, sizeof(key), "%s, %u, %u", kernel.name, sizes[i].frames, sizes[i].channels );
+      ::printf( "%-20s %8u %3u %10.3f %8.2f", kernel.name, sizes[i].frames, sizes[i].channels, perSample, gbps );
+      std::map<std::string, double>::const_iterator b = baseline.find( key );
+      if( b != baseline.end() && perSample > b->second * ( 1 + o.tolerance / 100 ) )
+      {
+        ::printf( "  SLOWER than the baseline of %.3f", b->second );
+        ok = false;
+      }
+      ::printf( "\n" );
+      if( save )
+        ::fprintf( save, "%s\t%.3f\n", key, perSample );
+    }
+  }
+  if( save )
+    ::fclose( save );
+  return ok;
+}
+
+} // namespace
+
+int
+main( int argc, char** argv )
+{
+  Options options;
+  if( !parseOptions( argc, argv, options ) )
+  {
+    ::fprintf( stderr, "%s", cUsage );
+    return 2;
+  }
+  Random random( 1 );
+  std::vector<float> input = edgeCases();
+  for( int i = 0; i < 1000000; ++i )
+    input.push_back( random.unitRange() );
+
+  checkGain( input );
+  checkGainRamps();
+  checkClip( random, input );
+  checkIntConversions( random, input );
+  checkDouble( random, input );
+  checkG711( false );
+  checkG711( true );
+  checkAdpcm( random );
+  checkRoundTrips( random, input );
+  checkDither( random, input );
+  checkDitherNoise();
+  checkLevels( random );
+  checkDecibels();
+  bool ok = Check::sFailures == 0;
+  if( !options.checkOnly )
+    ok = benchmark( options ) && ok;
+  ::printf( "%s\n", ok ? "all passed" : "FAILED" );
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,477 @@
+// syncbench: checks the POSIX backend of Synchronization.h, and measures it under contention
+// with the engine's blocking I/O pattern in userspace threads.
+//
+// The checks cover what Synchronization.h promises:
+//  - Sleep() returns 0 at once for a ticket taken before a Wakeup().
+//  - A timed Sleep() returns EWOULDBLOCK, no earlier than its timeout.
+//  - Wakeup() wakes every thread that sleeps on the queue.
+//  - A sleep returns EINTR once its thread's interrupt flag is set and InterruptSleepers() is
+//    called.
+//  - Destroying a queue ends its sleeps with EDEVERR, and returns only after the sleepers have
+//    left it.
+//  - Locks exclude each other, and a Lock that is moved releases its mutex once.
+//  - No wakeup is lost: threads hand a token back and forth through two queues many times,
+//    with a timeout that only expires if a wakeup went missing.
+// Built with -fsanitize=thread, ThreadSanitizer checks the same runs for data races.
+//
+// Then it measures, with 1 to 8 threads:
+//  - mutex: threads take one mutex in turn, in ns per acquisition.
+//  - wakeup: Wakeup() on a queue that nobody sleeps on, in ns per call.
+//  - ping-pong: two threads hand a token back and forth, in us per round trip.
+//  - ring: writers put chunks into a ring of 8 chunks and readers take them, each side
+//    sleeping on its own queue while the ring is full or empty, as the engine's device node
+//    readers and writers do. Reported in ns per chunk, with the readers' sleeps per chunk.
+// The exit status is 1 if any check fails.
+//
+// Build, from the repository root:
+//   c++ -std=c++11 -O2 -Wall -Wextra -pthread -DSYNCHRONIZATION_POSIX -IHost/include -ISource
+//     -o syncbench Tools/syncbench/syncbench.cpp Host/PosixSynchronization.cpp
+
+#include "Synchronization.h"
+#include "KernelShim.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+const char* cUsage =
+  "usage: syncbench [options]\n"
+  "  --check-only           only run the checks, do not measure\n"
+  "  --quick                shorter checks and measurements\n";
+
+struct Options
+{
+  bool checkOnly, quick;
+};
+
+bool
+parseOptions( int argc, char** argv, Options& o )
+{
+  o.checkOnly = false;
+  o.quick = false;
+  for( int i = 1; i < argc; ++i )
+  {
+    if( !::strcmp( argv[i], "--check-only" ) )
+      o.checkOnly = true;
+    else if( !::strcmp( argv[i], "--quick" ) )
+      o.quick = true;
+    else
+      return false;
+  }
+  return true;
+}
+
+double
+wallTime()
+{
+  timespec t;
+  ::clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void
+sleepMs( int ms )
+{
+  timespec t = { ms / 1000, ( ms % 1000 ) * 1000 * 1000 };
+  ::nanosleep( &t, 0 );
+}
+
+int sFailures = 0;
+
+// Reports a check and counts its failure.
+void
+report( const char* name, bool ok, const char* detail = "" )
+{
+  ::printf( "check %-56s %s%s\n", name, ok ? "ok" : "FAILED", ok ? "" : detail );
+  if( !ok )
+    ++sFailures;
+}
+
+// Waits on a queue until *pValue reaches a value, with the ticket protocol of the engine.
+// Returns the first error other than a wakeup.
+int
+waitFor( Synchronization::WaitQueue& q, const volatile int* pValue, int value, int timeoutMs )
+{
+  for( ;; )
+  {
+    unsigned ticket = q.Ticket();
+    if( __atomic_load_n( pValue, __ATOMIC_SEQ_CST ) >= value )
+      return 0;
+    int err = q.Sleep( ticket, timeoutMs );
+    if( err )
+      return err;
+  }
+}
+
+// Checks
+
+void
+checkStaleTicket()
+{
+  Synchronization::WaitQueue q;
+  unsigned ticket = q.Ticket();
+  q.Wakeup();
+  double t = wallTime();
+  int err = q.Sleep( ticket, 1000 );
+  report( "Sleep() returns at once for a stale ticket", err == 0 && wallTime() - t < 0.1 );
+}
+
+void
+checkTimeout()
+{
+  Synchronization::WaitQueue q;
+  double t = wallTime();
+  int err = q.Sleep( q.Ticket(), 50 );
+  t = wallTime() - t;
+  char detail[64];
+  ::snprintf( detail, sizeof(detail), ": error %d after %.1f ms", err, t * 1e3 );
+  report( "timed Sleep() returns EWOULDBLOCK after its timeout", err == EWOULDBLOCK && t >= 0.05, detail );
+}
+
+void
+checkWakeup()
+{
+  const int cThreads = 4;
+  Synchronization::WaitQueue q;
+  volatile int ready = 0, woken = 0;
+  int errors[cThreads];
+  std::vector<std::thread> threads;
+  for( int i = 0; i < cThreads; ++i )
+    threads.push_back( std::thread( [&, i]()
+    {
+      unsigned ticket = q.Ticket();
+      __atomic_add_fetch( &ready, 1, __ATOMIC_SEQ_CST );
+      errors[i] = q.Sleep( ticket, 5000 );
+      __atomic_add_fetch( &woken, 1, __ATOMIC_SEQ_CST );
+    } ) );
+  while( __atomic_load_n( &ready, __ATOMIC_SEQ_CST ) < cThreads )
+    sleepMs( 1 );
+  sleepMs( 20 );
+  q.Wakeup();
+  bool ok = true;
+  for( int i = 0; i < cThreads; ++i )
+  {
+    threads[i].join();
+    ok = ok && errors[i] == 0;
+  }
+  report( "Wakeup() wakes all sleepers", ok && woken == cThreads );
+}
+
+void
+checkInterrupt()
+{
+  Synchronization::WaitQueue q;
+  volatile bool interrupted = false;
+  volatile int ready = 0;
+  int err = 0;
+  std::thread thread( [&]()
+  {
+    Synchronization::SetInterruptFlag( &interrupted );
+    unsigned ticket = q.Ticket();
+    __atomic_store_n( &ready, 1, __ATOMIC_SEQ_CST );
+    err = q.Sleep( ticket, 5000 );
+    Synchronization::SetInterruptFlag( 0 );
+  } );
+  while( !__atomic_load_n( &ready, __ATOMIC_SEQ_CST ) )
+    sleepMs( 1 );
+  sleepMs( 20 );
+  double t = wallTime();
+  __atomic_store_n( &interrupted, true, __ATOMIC_SEQ_CST );
+  Synchronization::InterruptSleepers();
+  thread.join();
+  report( "an interrupted Sleep() returns EINTR", err == EINTR && wallTime() - t < 1 );
+}
+
+void
+checkDestroy()
+{
+  const int cThreads = 4;
+  Synchronization::WaitQueue* pQueue = new Synchronization::WaitQueue;
+  volatile int ready = 0, left = 0;
+  int errors[cThreads];
+  std::vector<std::thread> threads;
+  for( int i = 0; i < cThreads; ++i )
+    threads.push_back( std::thread( [&, i]()
+    {
+      unsigned ticket = pQueue->Ticket();
+      __atomic_add_fetch( &ready, 1, __ATOMIC_SEQ_CST );
+      errors[i] = pQueue->Sleep( ticket, 5000 );
+      __atomic_add_fetch( &left, 1, __ATOMIC_SEQ_CST );
+    } ) );
+  while( __atomic_load_n( &ready, __ATOMIC_SEQ_CST ) < cThreads )
+    sleepMs( 1 );
+  sleepMs( 20 );
+  delete pQueue; // returns once the sleepers have left, so ASan and TSan see no late access
+  bool ok = true;
+  for( int i = 0; i < cThreads; ++i )
+  {
+    threads[i].join();
+    ok = ok && errors[i] == EDEVERR;
+  }
+  report( "destroying a queue ends its sleeps with EDEVERR", ok && left == cThreads );
+}
+
+void
+checkLocks( bool quick )
+{
+  const int cThreads = 4, cCount = quick ? 10000 : 100000;
+  Synchronization::Mutex mutex;
+  long counter = 0;
+  std::vector<std::thread> threads;
+  for( int i = 0; i < cThreads; ++i )
+    threads.push_back( std::thread( [&]()
+    {
+      for( int j = 0; j < cCount; ++j )
+      {
+        Synchronization::Lock lock( mutex );
+        Synchronization::Lock moved( static_cast<Synchronization::Lock&&>( lock ) );
+        lock.Unlock(); // no longer holds the mutex, so does nothing
+        ++counter;
+        if( j % 2 )
+        {
+          Synchronization::Lock assigned;
+          assigned = static_cast<Synchronization::Lock&&>( moved );
+        }
+      }
+    } ) );
+  for( size_t i = 0; i < threads.size(); ++i )
+    threads[i].join();
+  report( "Locks exclude each other, and moved Locks unlock once", counter == long( cThreads ) * cCount );
+}
+
+// Hands a token back and forth, and returns the number of sleeps that timed out.
+int
+pingPong( int rounds, int timeoutMs )
+{
+  Synchronization::WaitQueue pings, pongs;
+  volatile int ping = 0, pong = 0;
+  int timeouts = 0;
+  std::thread thread( [&]()
+  {
+    for( int i = 1; i <= rounds; ++i )
+    {
+      if( waitFor( pings, &ping, i, timeoutMs ) == EWOULDBLOCK )
+        __atomic_add_fetch( &timeouts, 1, __ATOMIC_SEQ_CST );
+      __atomic_store_n( &pong, i, __ATOMIC_SEQ_CST );
+      pongs.Wakeup();
+    }
+  } );
+  for( int i = 1; i <= rounds; ++i )
+  {
+    __atomic_store_n( &ping, i, __ATOMIC_SEQ_CST );
+    pings.Wakeup();
+    if( waitFor( pongs, &pong, i, timeoutMs ) == EWOULDBLOCK )
+      __atomic_add_fetch( &timeouts, 1, __ATOMIC_SEQ_CST );
+  }
+  thread.join();
+  return timeouts;
+}
+
+void
+checkLostWakeups( bool quick )
+{
+  int rounds = quick ? 20000 : 200000, timeouts = pingPong( rounds, 2000 );
+  char detail[64];
+  ::snprintf( detail, sizeof(detail), ": %d of %d round trips timed out", timeouts, rounds );
+  report( "no wakeups are lost", timeouts == 0, detail );
+}
+
+// A ring of chunks between writers and readers, as between a device node's writers and
+// readers and the engine.
+class Ring
+{
+public:
+  explicit Ring( int capacity ) : mAvail( 0 ), mCapacity( capacity ), mWriters( 0 ), mTaken( 0 ), mSleeps( 0 ) {}
+  // Puts a chunk, sleeping while the ring is full.
+  void put()
+  {
+    for( ;; )
+    {
+      unsigned ticket = mWritable.Ticket();
+      {
+        Synchronization::Lock lock( mMutex );
+        if( mAvail < mCapacity )
+        {
+          ++mAvail;
+          break;
+        }
+      }
+      mWritable.Sleep( ticket );
+    }
+    mReadable.Wakeup();
+  }
+  // Takes a chunk, sleeping while the ring is empty. Returns false once the ring is empty and
+  // no writers are left.
+  bool take()
+  {
+    for( ;; )
+    {
+      unsigned ticket = mReadable.Ticket();
+      {
+        Synchronization::Lock lock( mMutex );
+        if( mAvail > 0 )
+        {
+          --mAvail;
+          ++mTaken;
+          break;
+        }
+        if( mWriters == 0 )
+          return false;
+        ++mSleeps;
+      }
+      mReadable.Sleep( ticket );
+    }
+    mWritable.Wakeup();
+    return true;
+  }
+  void addWriter()
+  {
+    Synchronization::Lock lock( mMutex );
+    ++mWriters;
+  }
+  void removeWriter()
+  {
+    {
+      Synchronization::Lock lock( mMutex );
+      --mWriters;
+    }
+    mReadable.Wakeup();
+  }
+  long taken() const { return mTaken; }
+  long sleeps() const { return mSleeps; }
+private:
+  Synchronization::Mutex mMutex;
+  Synchronization::WaitQueue mReadable, mWritable;
+  int mAvail, mCapacity, mWriters;
+  long mTaken, mSleeps;
+};
+
+// Runs writers and readers on a ring, and returns the elapsed time.
+double
+runRing( Ring& ring, int writers, int readers, long chunks )
+{
+  std::vector<std::thread> threads;
+  for( int i = 0; i < writers; ++i )
+    ring.addWriter();
+  double t = wallTime();
+  for( int i = 0; i < writers; ++i )
+    threads.push_back( std::thread( [&ring, writers, chunks, i]()
+    {
+      for( long j = i; j < chunks; j += writers )
+        ring.put();
+      ring.removeWriter();
+    } ) );
+  for( int i = 0; i < readers; ++i )
+    threads.push_back( std::thread( [&ring]() { while( ring.take() ) {} } ) );
+  for( size_t i = 0; i < threads.size(); ++i )
+    threads[i].join();
+  return wallTime() - t;
+}
+
+void
+checkRing( bool quick )
+{
+  const long cChunks = quick ? 20000 : 200000;
+  Ring ring( 8 );
+  runRing( ring, 3, 5, cChunks );
+  report( "readers of a ring take every chunk once", ring.taken() == cChunks );
+}
+
+// Measurements
+
+void
+benchmark( bool quick )
+{
+  const int threadCounts[] = { 1, 2, 4, 8 };
+  const int cThreadCounts = sizeof(threadCounts)/sizeof(*threadCounts);
+  const long scale = quick ? 1 : 10;
+
+  ::printf( "\n%-24s %8s %12s %14s\n", "", "threads", "ns", "sleeps/chunk" );
+  for( int t = 0; t < cThreadCounts; ++t )
+  {
+    const int n = threadCounts[t];
+    const long count = 100000 * scale / n;
+    Synchronization::Mutex mutex;
+    long counter = 0;
+    std::vector<std::thread> threads;
+    double time = wallTime();
+    for( int i = 0; i < n; ++i )
+      threads.push_back( std::thread( [&]()
+      {
+        for( long j = 0; j < count; ++j )
+        {
+          Synchronization::Lock lock( mutex );
+          ++counter;
+        }
+      } ) );
+    for( int i = 0; i < n; ++i )
+      threads[i].join();
+    ::printf( "%-24s %8d %12.1f\n", "mutex", n, ( wallTime() - time ) * 1e9 / counter );
+  }
+  for( int t = 0; t < cThreadCounts; ++t )
+  {
+    const int n = threadCounts[t];
+    const long count = 1000000 * scale / n;
+    Synchronization::WaitQueue q;
+    std::vector<std::thread> threads;
+    double time = wallTime();
+    for( int i = 0; i < n; ++i )
+      threads.push_back( std::thread( [&]()
+      {
+        for( long j = 0; j < count; ++j )
+          q.Wakeup();
+      } ) );
+    for( int i = 0; i < n; ++i )
+      threads[i].join();
+    ::printf( "%-24s %8d %12.1f\n", "wakeup, no sleepers", n, ( wallTime() - time ) * 1e9 / ( count * n ) );
+  }
+  {
+    const int rounds = int( 10000 * scale );
+    double time = wallTime();
+    pingPong( rounds, -1 );
+    ::printf( "%-24s %8d %12.1f\n", "ping-pong round trip", 2, ( wallTime() - time ) * 1e9 / rounds );
+  }
+  for( int t = 0; t < cThreadCounts; ++t )
+  {
+    const int n = threadCounts[t];
+    const long chunks = 20000 * scale;
+    for( int writers = 1; writers <= n; writers += n > 1 ? n - 1 : 1 )
+    {
+      Ring ring( 8 );
+      double time = runRing( ring, writers, n, chunks );
+      char name[32];
+      ::snprintf( name, sizeof(name), "ring, %d writer%s", writers, writers > 1 ? "s" : "" );
+      ::printf( "%-24s %8d %12.1f %14.2f\n", name, n, time * 1e9 / chunks, double( ring.sleeps() ) / chunks );
+    }
+  }
+}
+
+} // namespace
+
+int
+main( int argc, char** argv )
+{
+  Options options;
+  if( !parseOptions( argc, argv, options ) )
+  {
+    ::fprintf( stderr, "%s", cUsage );
+    return 2;
+  }
+  checkStaleTicket();
+  checkTimeout();
+  checkWakeup();
+  checkInterrupt();
+  checkDestroy();
+  checkLocks( options.quick );
+  checkLostWakeups( options.quick );
+  checkRing( options.quick );
+  if( !options.checkOnly )
+    benchmark( options.quick );
+  bool ok = sFailures == 0;
+  ::printf( "%s\n", ok ? "all passed" : "FAILED" );
+  return ok ? 0 : 1;
+}
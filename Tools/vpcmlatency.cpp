@@ -0,0 +1,445 @@
+// vpcmlatency: measures the round-trip latency of vpcm devices.
+//
+// Writes a test signal into one device node (usually a record device's node) and detects it in
+// the data read from another (usually a playback device's node), while some CoreAudio client
+// passes the record device's input on to the playback device. Latency is measured from the
+// write call that submits the signal to the read call that returns it, so it includes the
+// device buffers as seen by a device node client.
+//
+// Optionally, the devices are reconfigured through /dev/vpcmctl for each combination of a
+// list of buffer sizes and latencies, and one line of statistics is printed per combination.
+//
+// Build: c++ -O2 -Wall -Wextra -o vpcmlatency vpcmlatency.cpp
+
+#include <algorithm>
+#include <vector>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace
+{
+
+const char* cUsage =
+  "usage: vpcmlatency [options] <node to write> <node to read>\n"
+  "  --rate=<rate>                 sampling rate of both devices (48000)\n"
+  "  --channels=<channels>         channels of both devices (2); the signal is on the first\n"
+  "  --format=<float32|s16>        sample format of both devices (float32)\n"
+  "  --signal=<impulse|mls>        test signal (impulse)\n"
+  "  --trials=<count>              measurements per configuration (20)\n"
+  "  --interval-msec=<msec>        time between measurements (250)\n"
+  "  --timeout-msec=<msec>         time after which a signal counts as lost (2000)\n"
+  "  --period-frames=<frames>      frames per write and read (64)\n"
+  "  --devices=<name>[,<name>...]  GUI names of devices to reconfigure for each configuration\n"
+  "  --buffer-frames=<n>[,<n>...]  buffer sizes to measure, requires --devices\n"
+  "  --latency-msec=<n>[,<n>...]   nominal latencies to measure, requires --devices\n"
+  "  --control=<path>              control node (/dev/vpcmctl)\n"
+  "  --fail-above-msec=<msec>      exit with status 1 if any 95th percentile exceeds this\n";
+
+const int cMlsOrder = 10, cMlsLength = ( 1 << cMlsOrder ) - 1;
+const float cImpulseThreshold = 0.5f, cMlsAmplitude = 0.5f;
+
+struct Options
+{
+  const char* writeNode, *readNode, *control;
+  int rate, channels, trials, intervalMsec, timeoutMsec, periodFrames;
+  bool s16, mls;
+  std::vector<const char*> devices;
+  std::vector<int> bufferFrames, latencyMsec;
+  double failAboveMsec;
+};
+
+double
+now()
+{
+  timespec t;
+  ::clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+bool
+parseList( const char* s, std::vector<int>& list )
+{
+  list.clear();
+  while( *s )
+  {
+    char* end = 0;
+    long value = ::strtol( s, &end, 10 );
+    if( end == s || value < 0 || ( *end && *end != ',' ) )
+      return false;
+    list.push_back( int( value ) );
+    s = *end ? end + 1 : end;
+  }
+  return !list.empty();
+}
+
+bool
+parseOptions( int argc, char** argv, Options& o )
+{
+  o.writeNode = 0;
+  o.readNode = 0;
+  o.control = "/dev/vpcmctl";
+  o.rate = 48000;
+  o.channels = 2;
+  o.trials = 20;
+  o.intervalMsec = 250;
+  o.timeoutMsec = 2000;
+  o.periodFrames = 64;
+  o.s16 = false;
+  o.mls = false;
+  o.failAboveMsec = 0;
+  for( int i = 1; i < argc; ++i )
+  {
+    char* arg = argv[i];
+    if( ::strncmp( arg, "--", 2 ) )
+    {
+      if( !o.writeNode )
+        o.writeNode = arg;
+      else if( !o.readNode )
+        o.readNode = arg;
+      else
+        return false;
+      continue;
+    }
+    char* value = ::strchr( arg, '=' );
+    if( !value )
+      return false;
+    *value++ = 0;
+    const char* name = arg + 2;
+    if( !::strcmp( name, "rate" ) )
+      o.rate = ::atoi( value );
+    else if( !::strcmp( name, "channels" ) )
+      o.channels = ::atoi( value );
+    else if( !::strcmp( name, "trials" ) )
+      o.trials = ::atoi( value );
+    else if( !::strcmp( name, "interval-msec" ) )
+      o.intervalMsec = ::atoi( value );
+    else if( !::strcmp( name, "timeout-msec" ) )
+      o.timeoutMsec = ::atoi( value );
+    else if( !::strcmp( name, "period-frames" ) )
+      o.periodFrames = ::atoi( value );
+    else if( !::strcmp( name, "control" ) )
+      o.control = value;
+    else if( !::strcmp( name, "fail-above-msec" ) )
+      o.failAboveMsec = ::atof( value );
+    else if( !::strcmp( name, "format" ) )
+    {
+      if( !::strcmp( value, "s16" ) || !::strcmp( value, "s16le" ) )
+        o.s16 = true;
+      else if( ::strcmp( value, "float32" ) && ::strcmp( value, "float32le" ) )
+        return false;
+    }
+    else if( !::strcmp( name, "signal" ) )
+    {
+      if( !::strcmp( value, "mls" ) )
+        o.mls = true;
+      else if( ::strcmp( value, "impulse" ) )
+        return false;
+    }
+    else if( !::strcmp( name, "devices" ) )
+    {
+      for( char* p = ::strtok( value, "," ); p; p = ::strtok( 0, "," ) )
+        o.devices.push_back( p );
+    }
+    else if( !::strcmp( name, "buffer-frames" ) )
+    {
+      if( !parseList( value, o.bufferFrames ) )
+        return false;
+    }
+    else if( !::strcmp( name, "latency-msec" ) )
+    {
+      if( !parseList( value, o.latencyMsec ) )
+        return false;
+    }
+    else
+      return false;
+  }
+  if( !o.readNode || o.rate < 1 || o.channels < 1 || o.trials < 1 || o.periodFrames < 1
+      || o.intervalMsec < 1 || o.timeoutMsec < 1 )
+    return false;
+  if( ( !o.bufferFrames.empty() || !o.latencyMsec.empty() ) && o.devices.empty() )
+    return false;
+  return true;
+}
+
+// A maximum length sequence of +1 and -1, from a Fibonacci LFSR with taps 10 and 7.
+std::vector<float>
+makeMls()
+{
+  std::vector<float> mls( cMlsLength );
+  unsigned int state = 1;
+  for( int i = 0; i < cMlsLength; ++i )
+  {
+    mls[i] = ( state & 1 ) ? 1.f : -1.f;
+    unsigned int bit = ( ( state >> 0 ) ^ ( state >> 3 ) ) & 1;
+    state = ( state >> 1 ) | ( bit << ( cMlsOrder - 1 ) );
+  }
+  return mls;
+}
+
+// Finds the signal in the samples captured since it was sent. Returns the index of its
+// first sample, or -1. For an MLS, lags are correlated as soon as a full sequence is available;
+// the first lag from which the correlation keeps falling is the peak.
+int
+detect( const Options& o, const std::vector<float>& mls, const std::vector<float>& captured, int& searched )
+{
+  int size = int( captured.size() );
+  if( !o.mls )
+  {
+    for( ; searched < size; ++searched )
+      if( ::fabs( captured[searched] ) > cImpulseThreshold )
+        return searched;
+    return -1;
+  }
+  const float threshold = 0.5f * cMlsAmplitude * cMlsLength;
+  for( ; searched + cMlsLength + 1 <= size; ++searched )
+  {
+    float corr = 0, next = 0;
+    for( int i = 0; i < cMlsLength; ++i )
+    {
+      corr += captured[searched + i] * mls[i];
+      next += captured[searched + 1 + i] * mls[i];
+    }
+    if( corr > threshold && corr >= next )
+      return searched;
+  }
+  return -1;
+}
+
+int
+openNode( const char* path, int flags )
+{
+  int fd = ::open( path, flags | O_NONBLOCK );
+  if( fd < 0 )
+    ::fprintf( stderr, "vpcmlatency: %s: %s\n", path, ::strerror( errno ) );
+  return fd;
+}
+
+bool
+reconfigure( const Options& o, int bufferFrames, int latencyMsec )
+{
+  for( size_t i = 0; i < o.devices.size(); ++i )
+  {
+    char command[512];
+    int len = ::snprintf( command, sizeof(command), "reconfigure %s", o.devices[i] );
+    if( bufferFrames > 0 )
+      len += ::snprintf( command + len, sizeof(command) - len, " --buffer-frames=%d", bufferFrames );
+    if( latencyMsec >= 0 )
+      len += ::snprintf( command + len, sizeof(command) - len, " --latency-msec=%d", latencyMsec );
+    len += ::snprintf( command + len, sizeof(command) - len, "\n" );
+    int fd = ::open( o.control, O_WRONLY );
+    if( fd < 0 || ::write( fd, command, len ) != len )
+    {
+      ::fprintf( stderr, "vpcmlatency: %s: %s", o.control, command );
+      ::fprintf( stderr, "vpcmlatency: %s\n", ::strerror( errno ) );
+      if( fd >= 0 )
+        ::close( fd );
+      return false;
+    }
+    ::close( fd );
+  }
+  return true;
+}
+
+// Runs the trials of one configuration, and returns latencies in seconds.
+// Lost signals are not included.
+bool
+measure( const Options& o, const std::vector<float>& mls, std::vector<double>& latencies )
+{
+  int readFd = openNode( o.readNode, O_RDONLY ), writeFd = readFd < 0 ? -1 : openNode( o.writeNode, O_WRONLY );
+  if( writeFd < 0 )
+  {
+    if( readFd >= 0 )
+      ::close( readFd );
+    return false;
+  }
+  const int sampleBytes = o.s16 ? 2 : 4, frameBytes = sampleBytes * o.channels;
+  const int signalFrames = o.mls ? cMlsLength : 1;
+  std::vector<char> out( o.periodFrames * frameBytes ), in( o.periodFrames * frameBytes );
+  size_t outPos = out.size();
+  int signalPos = -1; // frames of the signal written so far, -1 when not sending
+  std::vector<float> captured;
+  std::vector<double> times;
+  int searched = 0, trials = 0;
+  bool inFlight = false, startPending = false;
+  double sentTime = 0, nextTrial = now() + o.intervalMsec * 1e-3;
+  bool ok = true;
+
+  while( trials < o.trials && ok )
+  {
+    pollfd fds[2] = { { writeFd, POLLOUT, 0 }, { readFd, POLLIN, 0 } };
+    if( ::poll( fds, 2, 10 ) < 0 && errno != EINTR )
+      ok = false;
+    double t = now();
+    if( inFlight && t - sentTime > o.timeoutMsec * 1e-3 )
+    {
+      ::fprintf( stderr, "vpcmlatency: signal lost\n" );
+      inFlight = false;
+      ++trials;
+      nextTrial = t + o.intervalMsec * 1e-3;
+    }
+    if( fds[0].revents & POLLOUT )
+    {
+      if( outPos == out.size() )
+      { // next period: silence, or the next part of the signal
+        ::memset( &out[0], 0, out.size() );
+        if( !inFlight && signalPos < 0 && t >= nextTrial )
+        {
+          signalPos = 0;
+          startPending = true;
+        }
+        for( int i = 0; signalPos >= 0 && i < o.periodFrames; ++i, ++signalPos )
+        {
+          if( signalPos >= signalFrames )
+          {
+            signalPos = -1;
+            break;
+          }
+          float value = o.mls ? cMlsAmplitude * mls[signalPos] : 1.f;
+          char* p = &out[i * frameBytes];
+          if( o.s16 )
+          {
+            short s = short( value >= 1.f ? 32767 : value * 32768.f );
+            ::memcpy( p, &s, sizeof(s) );
+          }
+          else
+            ::memcpy( p, &value, sizeof(value) );
+        }
+        outPos = 0;
+      }
+      ssize_t n = ::write( writeFd, &out[outPos], out.size() - outPos );
+      if( n > 0 )
+      { // the signal counts as sent once the first byte of its period has been accepted
+        if( startPending )
+        {
+          startPending = false;
+          inFlight = true;
+          sentTime = t;
+          captured.clear();
+          times.clear();
+          searched = 0;
+        }
+        outPos += n;
+      }
+      else if( n < 0 && errno != EAGAIN && errno != EINTR )
+        ok = false;
+    }
+    if( fds[1].revents & ( POLLIN | POLLHUP ) )
+    {
+      ssize_t n = ::read( readFd, &in[0], in.size() );
+      double readTime = now();
+      int frames = n > 0 ? int( n / frameBytes ) : 0;
+      for( int i = 0; inFlight && i < frames; ++i )
+      {
+        const char* p = &in[i * frameBytes];
+        float value = 0;
+        if( o.s16 )
+        {
+          short s;
+          ::memcpy( &s, p, sizeof(s) );
+          value = s / 32768.f;
+        }
+        else
+          ::memcpy( &value, p, sizeof(value) );
+        captured.push_back( value );
+        // the last frame returned is taken to have arrived at the time of the read
+        times.push_back( readTime - double( frames - 1 - i ) / o.rate );
+      }
+      if( n == 0 || ( n < 0 && errno != EAGAIN && errno != EINTR ) )
+        ok = false;
+      int found = inFlight ? detect( o, mls, captured, searched ) : -1;
+      if( found >= 0 )
+      {
+        latencies.push_back( times[found] - sentTime );
+        inFlight = false;
+        ++trials;
+        nextTrial = readTime + o.intervalMsec * 1e-3;
+      }
+    }
+  }
+  if( !ok )
+    ::fprintf( stderr, "vpcmlatency: I/O error: %s\n", ::strerror( errno ) );
+  ::close( writeFd );
+  ::close( readFd );
+  return ok;
+}
+
+double
+percentile( const std::vector<double>& sorted, double p )
+{
+  size_t i = size_t( p * ( sorted.size() - 1 ) + 0.5 );
+  return sorted[std::min( i, sorted.size() - 1 )];
+}
+
+// Prints one line of statistics, and returns the 95th percentile in milliseconds.
+double
+report( const Options& o, int bufferFrames, int latencyMsec, std::vector<double> latencies )
+{
+  char buffer[16] = "-", latency[16] = "-";
+  if( bufferFrames > 0 )
+    ::snprintf( buffer, sizeof(buffer), "%d", bufferFrames );
+  if( latencyMsec >= 0 )
+    ::snprintf( latency, sizeof(latency), "%d", latencyMsec );
+  int lost = o.trials - int( latencies.size() );
+  if( latencies.empty() )
+  {
+    ::printf( "%13s %12s %6d %5d\n", buffer, latency, o.trials, lost );
+    return HUGE_VAL;
+  }
+  std::sort( latencies.begin(), latencies.end() );
+  double sum = 0, sumSquares = 0;
+  for( size_t i = 0; i < latencies.size(); ++i )
+  {
+    sum += latencies[i];
+    sumSquares += latencies[i] * latencies[i];
+  }
+  double mean = sum / latencies.size(),
+         stddev = ::sqrt( std::max( 0., sumSquares / latencies.size() - mean * mean ) );
+  ::printf( "%13s %12s %6d %5d %8.2f %8.2f %8.2f %8.2f %8.3f\n", buffer, latency, o.trials, lost,
+    latencies.front() * 1e3, percentile( latencies, 0.5 ) * 1e3, percentile( latencies, 0.95 ) * 1e3,
+    latencies.back() * 1e3, stddev * 1e3 );
+  ::fflush( stdout );
+  return percentile( latencies, 0.95 ) * 1e3;
+}
+
+} // namespace
+
+int
+main( int argc, char** argv )
+{
+  Options o;
+  if( !parseOptions( argc, argv, o ) )
+  {
+    ::fputs( cUsage, stderr );
+    return 2;
+  }
+  std::vector<float> mls = makeMls();
+  std::vector<int> bufferFrames = o.bufferFrames, latencyMsec = o.latencyMsec;
+  if( bufferFrames.empty() )
+    bufferFrames.push_back( 0 );
+  if( latencyMsec.empty() )
+    latencyMsec.push_back( -1 );
+
+  ::printf( "%13s %12s %6s %5s %8s %8s %8s %8s %8s\n", "buffer-frames", "latency-msec", "trials", "lost",
+    "min ms", "median", "p95", "max", "stddev" );
+  int status = 0;
+  for( size_t i = 0; i < bufferFrames.size(); ++i )
+    for( size_t j = 0; j < latencyMsec.size(); ++j )
+    {
+      if( !o.devices.empty() && !reconfigure( o, bufferFrames[i], latencyMsec[j] ) )
+        return 1;
+      std::vector<double> latencies;
+      if( !measure( o, mls, latencies ) )
+        return 1;
+      double p95 = report( o, bufferFrames[i], latencyMsec[j], latencies );
+      if( o.failAboveMsec > 0 && p95 > o.failAboveMsec )
+        status = 1;
+    }
+  return status;
+}
@@ -0,0 +1,311 @@
+// vpcmsim's runtime, see SimRuntime.h.
+
+#include "SimRuntime.h"
+#include "DevfsDeviceNode.h"
+#include <map>
+#include <string>
+
+namespace
+{
+
+std::vector<IOTimerEventSource*> sTimers;
+
+} // namespace
+
+namespace KernelShim
+{
+
+uint64_t sNow = 0;
+
+uint64_t
+now()
+{
+  return sNow;
+}
+
+bool
+fireTimer()
+{
+  IOTimerEventSource* pDue = 0;
+  for( size_t i = 0; i < sTimers.size(); ++i )
+    if( sTimers[i]->armed() && sTimers[i]->deadline() <= sNow
+        && ( !pDue || sTimers[i]->deadline() < pDue->deadline() ) )
+      pDue = sTimers[i];
+  if( pDue && pDue->takeIfDue( sNow ) )
+    pDue->fire();
+  return pDue != 0;
+}
+
+uint64_t
+nextDeadline()
+{
+  uint64_t deadline = ~0ULL;
+  for( size_t i = 0; i < sTimers.size(); ++i )
+    if( sTimers[i]->armed() )
+      deadline = min( deadline, sTimers[i]->deadline() );
+  return deadline;
+}
+
+} // namespace KernelShim
+
+void
+IOSleep( unsigned ms )
+{
+  KernelShim::sNow += ms * 1000000ULL;
+}
+
+// With a single thread, the work loop's gate is always open to it.
+IOWorkLoop::IOWorkLoop() : mpGate( 0 ) {}
+void IOWorkLoop::free() { OSObject::free(); }
+void IOWorkLoop::closeGate() {}
+void IOWorkLoop::openGate() {}
+
+// Timers
+IOTimerEventSource*
+IOTimerEventSource::timerEventSource( OSObject* pOwner, Action action )
+{
+  IOTimerEventSource* p = new IOTimerEventSource;
+  p->mpOwner = pOwner;
+  p->mAction = action;
+  p->mDeadline = 0;
+  p->mArmed = false;
+  sTimers.push_back( p );
+  return p;
+}
+
+IOReturn
+IOTimerEventSource::wakeAtTime( AbsoluteTime t )
+{
+  mDeadline = t;
+  mArmed = true;
+  return kIOReturnSuccess;
+}
+
+void
+IOTimerEventSource::cancelTimeout()
+{
+  mArmed = false;
+}
+
+void
+IOTimerEventSource::free()
+{
+  for( size_t i = 0; i < sTimers.size(); ++i )
+    if( sTimers[i] == this )
+    {
+      sTimers.erase( sTimers.begin() + i );
+      break;
+    }
+  IOEventSource::free();
+}
+
+// Locks. With a single thread, a lock that is already held can never be released.
+struct lck_mtx { bool locked; };
+
+lck_grp_attr_t* lck_grp_attr_alloc_init() { return reinterpret_cast<lck_grp_attr_t*>( 1 ); }
+void lck_grp_attr_setstat( lck_grp_attr_t* ) {}
+lck_grp_t* lck_grp_alloc_init( const char*, lck_grp_attr_t* ) { return reinterpret_cast<lck_grp_t*>( 1 ); }
+lck_attr_t* lck_attr_alloc_init() { return reinterpret_cast<lck_attr_t*>( 1 ); }
+lck_mtx_t* lck_mtx_alloc_init( lck_grp_t*, lck_attr_t* ) { lck_mtx_t* p = new lck_mtx_t; p->locked = false; return p; }
+void lck_mtx_free( lck_mtx_t* p, lck_grp_t* ) { delete p; }
+void lck_attr_free( lck_attr_t* ) {}
+void lck_grp_free( lck_grp_t* ) {}
+void lck_grp_attr_free( lck_grp_attr_t* ) {}
+
+void
+lck_mtx_lock( lck_mtx_t* p )
+{
+  if( p->locked )
+    panic( "vpcmsim: deadlock: mutex locked twice" );
+  p->locked = true;
+}
+
+void
+lck_mtx_unlock( lck_mtx_t* p )
+{
+  if( !p->locked )
+    panic( "vpcmsim: mutex unlocked while not locked" );
+  p->locked = false;
+}
+
+int
+msleep( void*, lck_mtx_t* pMtx, int flags, const char*, struct timespec* )
+{
+  if( flags & PDROP )
+    lck_mtx_unlock( pMtx );
+  return EWOULDBLOCK;
+}
+
+void wakeup( void* ) {}
+void selwakeup( void* ) {}
+void selrecord( struct proc*, void*, void* ) {}
+void selthreadclear( void* ) {}
+
+// DevfsDeviceNode, without a devfs. Nodes are registered with a device switch by minor number,
+// and found by name.
+struct cdevsw
+{
+  int (*d_open)( dev_t, int, int, struct proc* );
+  int (*d_close)( dev_t, int, int, struct proc* );
+  int (*d_read)( dev_t, struct uio*, int );
+  int (*d_write)( dev_t, struct uio*, int );
+  int (*d_ioctl)( dev_t, u_long, caddr_t, int, struct proc* );
+  int (*d_select)( dev_t, int, void*, struct proc* );
+};
+
+namespace
+{
+
+const struct cdevsw* spCdevsw = 0;
+std::map<std::string, dev_t> sNodeNames;
+
+} // namespace
+
+namespace KernelShim
+{
+
+int
+findNode( const char* name, dev_t* pDev )
+{
+  std::map<std::string, dev_t>::const_iterator i = sNodeNames.find( name ? name : "" );
+  if( i == sNodeNames.end() )
+    return ENOENT;
+  *pDev = i->second;
+  return 0;
+}
+
+int nodeOpen( dev_t dev, int flags ) { return spCdevsw ? spCdevsw->d_open( dev, flags, 0, 0 ) : ENXIO; }
+int nodeClose( dev_t dev ) { return spCdevsw ? spCdevsw->d_close( dev, 0, 0, 0 ) : ENXIO; }
+int nodeRead( dev_t dev, struct uio* uio ) { return spCdevsw ? spCdevsw->d_read( dev, uio, 0 ) : ENXIO; }
+int nodeWrite( dev_t dev, struct uio* uio ) { return spCdevsw ? spCdevsw->d_write( dev, uio, 0 ) : ENXIO; }
+int nodeIoctl( dev_t dev, u_long cmd, caddr_t data ) { return spCdevsw ? spCdevsw->d_ioctl( dev, cmd, data, 0, 0 ) : ENXIO; }
+
+} // namespace KernelShim
+
+struct cdevsw DevfsDeviceNode::sCdevsw;
+int DevfsDeviceNode::sMajor = 0;
+int DevfsDeviceNode::sInstanceCount = 0;
+DevfsDeviceNode* DevfsDeviceNode::sInstances[] = { 0 };
+
+void
+DevfsDeviceNode::classInit()
+{
+  sCdevsw.d_open = open;
+  sCdevsw.d_close = close;
+  sCdevsw.d_read = read;
+  sCdevsw.d_write = write;
+  sCdevsw.d_ioctl = ioctl;
+  sCdevsw.d_select = select;
+  spCdevsw = &sCdevsw;
+}
+
+void
+DevfsDeviceNode::classFree()
+{
+  spCdevsw = 0;
+}
+
+DevfsDeviceNode::DevfsDeviceNode()
+: mpName( 0 ), mNode( 0 ), mDev( 0 ), mUid( 0 ), mGid( 0 ), mMode( 0 )
+{
+  if( sInstanceCount++ == 0 )
+    classInit();
+}
+
+DevfsDeviceNode::~DevfsDeviceNode()
+{
+  devDestroy();
+  if( --sInstanceCount == 0 )
+    classFree();
+}
+
+int
+DevfsDeviceNode::devCreate( const char* name, int mode, int, int )
+{
+  if( !name )
+    return EINVAL;
+  int minor = 0;
+  while( minor < sMaxInstances && sInstances[minor] )
+    ++minor;
+  if( minor >= sMaxInstances )
+    return ENOMEM;
+  sInstances[minor] = this;
+  mDev = dev_t( ( sMajor << 24 ) | minor );
+  mMode = mode;
+  mpName = new char[64];
+  ::snprintf( mpName, 64, name, minor );
+  sNodeNames[mpName] = mDev;
+  return 0;
+}
+
+int
+DevfsDeviceNode::devDestroy()
+{
+  if( mpName )
+  {
+    sNodeNames.erase( mpName );
+    if( sInstances[::minor( mDev )] == this )
+      sInstances[::minor( mDev )] = 0;
+  }
+  delete[] mpName;
+  mpName = 0;
+  return 0;
+}
+
+int DevfsDeviceNode::devAccess( mode_t ) const { return 0; }
+int DevfsDeviceNode::devRead( struct uio* ) { return ENODEV; }
+int DevfsDeviceNode::devWrite( struct uio* ) { return ENODEV; }
+int DevfsDeviceNode::devIoctl( u_long, caddr_t ) { return ENOTTY; }
+int DevfsDeviceNode::devSelect( int, void*, struct proc* ) { return 0; }
+
+DevfsDeviceNode*
+DevfsDeviceNode::getInstance( dev_t dev )
+{
+  if( ::major( dev ) != sMajor )
+    return 0;
+  if( ::minor( dev ) < sMaxInstances )
+    return sInstances[::minor( dev )];
+  return 0;
+}
+
+int
+DevfsDeviceNode::open( dev_t dev, int flags, int, struct proc* )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devOpen( flags ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::close( dev_t dev, int, int, struct proc* )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devClose() : ENXIO;
+}
+
+int
+DevfsDeviceNode::read( dev_t dev, struct uio* uio, int )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devRead( uio ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::write( dev_t dev, struct uio* uio, int )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devWrite( uio ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::ioctl( dev_t dev, u_long cmd, caddr_t pData, int, struct proc* )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devIoctl( cmd, pData ) : ENXIO;
+}
+
+int
+DevfsDeviceNode::select( dev_t dev, int rw, void* wql, struct proc* proc )
+{
+  DevfsDeviceNode* p = getInstance( dev );
+  return p ? p->devSelect( rw, wql, proc ) : ENXIO;
+}
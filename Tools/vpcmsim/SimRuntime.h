@@ -0,0 +1,27 @@
+#ifndef SIM_RUNTIME_H
+#define SIM_RUNTIME_H
+
+// vpcmsim's runtime for the stand-ins in Host/include. Time is simulated, and there is a single
+// thread, so nothing ever blocks: sleeping returns EWOULDBLOCK, and timers only fire when the
+// simulation calls fireTimer().
+
+#include "KernelShim.h"
+
+namespace KernelShim
+{
+  // Simulated time, as returned by now().
+  extern uint64_t sNow;
+  // Fires the earliest due timer, if any, and returns whether one was due.
+  bool fireTimer();
+  // Returns the earliest deadline of an armed timer, or ~0.
+  uint64_t nextDeadline();
+  // Device nodes, as clients see them through the device switch that DevfsDeviceNode registers.
+  int findNode( const char* name, dev_t* );
+  int nodeOpen( dev_t, int flags );
+  int nodeClose( dev_t );
+  int nodeRead( dev_t, struct uio* );
+  int nodeWrite( dev_t, struct uio* );
+  int nodeIoctl( dev_t, u_long, caddr_t );
+}
+
+#endif // SIM_RUNTIME_H
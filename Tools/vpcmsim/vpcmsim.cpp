@@ -0,0 +1,1085 @@
+// vpcmsim: runs the engine's data path on the host, in simulated time.
+//
+// The engine sources are compiled against the stand-ins in Host/include, which replace IOKit,
+// the IOAudioFamily and the device node interface, with the simulated runtime in SimRuntime.cpp. The simulation plays the part of CoreAudio,
+// which writes a test pattern into the playback streams and reads the record streams once per
+// I/O cycle, and of device node clients, which open, read and write the nodes through the device
+// switch without blocking, and encode and decode samples themselves. Time
+// advances from one event to the next, so a run is deterministic for a given seed, and usually
+// thousands of times faster than realtime. Under --clock=reader, CoreAudio follows the engine's
+// time stamps and sample offset, up to --mix-speed, and a steady reader reads as soon as CoreAudio
+// has mixed, so the audio mixed per simulated second measures an offline render's speed.
+//
+// Unless --steady is given, clients use random transfer sizes and timings, and random events
+// stall them, close nodes for a while, reset clip positions, restart the engine, change buffer
+// sizes, and make CoreAudio mix silence for a while.
+// Data passing through the engine is checked throughout, and the first failure ends the run
+// with exit status 1:
+//  - Every frame is either silence or a pattern frame, and pattern frames arrive in order.
+//    Frames may be lost, but never repeated or reordered. The order is only checked with
+//    two or more channels.
+//  - With --framing=packet, headers are well formed, frame numbers are contiguous except at
+//    discontinuities, and each payload frame is the one its header claims. With ima-adpcm, the
+//    decoder state in each header matches the client's decoder, except after discontinuities
+//    and fill packets, where the client takes it over.
+//  - Rings are not overrun, ring positions stay within bounds, and time stamps are monotonic.
+//  - With --squelch, no frames are counted as squelched while a node is closed.
+// Values are only checked for linear formats without dither, and playback values not with
+// --overflow=noise, since the others do not reproduce the pattern exactly.
+//
+// Build, from the repository root:
+//   c++ -std=c++11 -O2 -Wall -Wextra -IHost/include -ISource -o vpcmsim Tools/vpcmsim/*.cpp Host/Shim.cpp
+//     Source/VpcmAudioEngine.cpp Source/VpcmClockGroup.cpp Source/VpcmProperties.cpp
+//     Source/FloatEmu.cpp Source/Codecs.cpp Source/Synchronization.cpp
+
+#include "SimRuntime.h"
+#include "VpcmAudioEngine.h"
+#include "VpcmIoctl.h"
+#include "Codecs.h"
+#include "FloatEmu.h"
+#include <cstdarg>
+#include <ctime>
+
+namespace
+{
+
+const char* cUsage =
+  "usage: vpcmsim [options] [-- <device options>]\n"
+  "  --seed=<n>             seed of the random sequence (1)\n"
+  "  --seconds=<n>          simulated time to run (60)\n"
+  "  --cycle-frames=<n>     frames per CoreAudio I/O cycle (512)\n"
+  "  --event-msec=<n>       mean time between random events (500)\n"
+  "  --mix-speed=<n>        how much faster than real time CoreAudio can mix, for --clock=reader (50)\n"
+  "  --steady               fixed transfer sizes and timings, and no events, for benchmarks\n"
+  "  --no-check             only check invariants, not the data, to benchmark the engine\n"
+  "  --verbose              print events as they happen\n"
+  "Device options are those given to vpcmctl, e.g. -- --format=s16 --buffer-frames=4096\n";
+
+const int cPatternPeriod = 32767;
+const uint64_t cNever = ~0ULL;
+
+struct Options
+{
+  unsigned long seed;
+  int seconds, cycleFrames, eventMsec, mixSpeed;
+  bool steady, check, verbose;
+  int deviceArgc;
+  char** deviceArgv;
+};
+
+bool
+parseOptions( int argc, char** argv, Options& o )
+{
+  o.seed = 1;
+  o.seconds = 60;
+  o.cycleFrames = 512;
+  o.eventMsec = 500;
+  o.mixSpeed = 50;
+  o.steady = false;
+  o.check = true;
+  o.verbose = false;
+  o.deviceArgc = 1;
+  o.deviceArgv = argv; // update() skips the first argument
+  for( int i = 1; i < argc; ++i )
+  {
+    const char* arg = argv[i];
+    if( !::strcmp( arg, "--" ) )
+    {
+      o.deviceArgc = argc - i;
+      o.deviceArgv = argv + i;
+      break;
+    }
+    const char* value = ::strchr( arg, '=' );
+    value = value ? value + 1 : "";
+    if( !::strncmp( arg, "--seed=", 7 ) )
+      o.seed = ::strtoul( value, 0, 10 );
+    else if( !::strncmp( arg, "--seconds=", 10 ) )
+      o.seconds = ::atoi( value );
+    else if( !::strncmp( arg, "--cycle-frames=", 15 ) )
+      o.cycleFrames = ::atoi( value );
+    else if( !::strncmp( arg, "--event-msec=", 13 ) )
+      o.eventMsec = ::atoi( value );
+    else if( !::strncmp( arg, "--mix-speed=", 12 ) )
+      o.mixSpeed = ::atoi( value );
+    else if( !::strcmp( arg, "--steady" ) )
+      o.steady = true;
+    else if( !::strcmp( arg, "--no-check" ) )
+      o.check = false;
+    else if( !::strcmp( arg, "--verbose" ) )
+      o.verbose = true;
+    else
+      return false;
+  }
+  return o.seconds > 0 && o.cycleFrames > 0 && o.eventMsec > 0 && o.mixSpeed > 0;
+}
+
+double
+wallTime()
+{
+  timespec t;
+  ::clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// xorshift64*, so runs do not depend on the host's random().
+class Random
+{
+public:
+  explicit Random( uint64_t seed ) : mState( seed * 2 + 1 ) {}
+  uint64_t next()
+  {
+    mState ^= mState >> 12;
+    mState ^= mState << 25;
+    mState ^= mState >> 27;
+    return mState * 2685821657736338717ULL;
+  }
+  // Uniform in [0, n).
+  int below( int n ) { return n > 1 ? int( next() % n ) : 0; }
+  // Uniform in [lo, hi].
+  int between( int lo, int hi ) { return lo + below( hi - lo + 1 ); }
+private:
+  uint64_t mState;
+};
+
+// Frame n of the pattern holds n modulo the pattern period in the first channel, and n divided
+// by the period in the second, so a frame identifies itself. Other channels repeat these.
+// Values are multiples of 1/32768, which all linear formats represent exactly.
+void
+makePattern( float* dest, uint64_t n, int frames, int channels )
+{
+  int k[2] = { int( n % cPatternPeriod ), int( ( n / cPatternPeriod ) % cPatternPeriod ) };
+  for( int f = 0; f < frames; ++f )
+  {
+    float value[2] = { float( 1 + k[0] ) / 32768, float( 1 + k[1] ) / 32768 };
+    for( int ch = 0; ch < channels; ++ch )
+      *dest++ = value[ch % 2];
+    if( ++k[0] == cPatternPeriod )
+    {
+      k[0] = 0;
+      if( ++k[1] == cPatternPeriod )
+        k[1] = 0;
+    }
+  }
+}
+
+// Converts floats into samples of a format, as a client of the device node would.
+void
+encode( int format, void* dest, const float* src, int count, Codecs::AdpcmState* pAdpcm, int channels )
+{
+  std::vector<short> linear( format >= VpcmProperties::ULaw ? count : 0 );
+  unsigned char* q = static_cast<unsigned char*>( dest );
+  switch( format )
+  {
+    case VpcmProperties::ULaw:
+      FloatEmu::FloatToInt16Copy( &linear[0], src, count );
+      Codecs::Int16ToULawCopy( q, &linear[0], count );
+      break;
+    case VpcmProperties::ALaw:
+      FloatEmu::FloatToInt16Copy( &linear[0], src, count );
+      Codecs::Int16ToALawCopy( q, &linear[0], count );
+      break;
+    case VpcmProperties::ImaAdpcm:
+      FloatEmu::FloatToInt16Copy( &linear[0], src, count );
+      Codecs::Int16ToImaAdpcmCopy( q, &linear[0], count, pAdpcm, channels, 0 );
+      break;
+    case VpcmProperties::Int16:
+      FloatEmu::FloatToInt16Copy( static_cast<short*>( dest ), src, count );
+      break;
+    case VpcmProperties::Int16BE:
+      FloatEmu::FloatToIntCopy( dest, src, count, 2, true );
+      break;
+    case VpcmProperties::Int24:
+    case VpcmProperties::Int24BE:
+      FloatEmu::FloatToIntCopy( dest, src, count, 3, format == VpcmProperties::Int24BE );
+      break;
+    case VpcmProperties::Int32:
+    case VpcmProperties::Int32BE:
+      FloatEmu::FloatToIntCopy( dest, src, count, 4, format == VpcmProperties::Int32BE );
+      break;
+    case VpcmProperties::Float32:
+      ::memcpy( dest, src, count * sizeof(float) );
+      break;
+    case VpcmProperties::Float32BE:
+      FloatEmu::SwapCopy32( dest, src, count );
+      break;
+    case VpcmProperties::Float64:
+    case VpcmProperties::Float64BE:
+      FloatEmu::FloatToDoubleCopy( dest, src, count, format == VpcmProperties::Float64BE );
+      break;
+  }
+}
+
+// Converts samples of a format into floats, as a client of the device node would.
+void
+decode( int format, float* dest, const void* src, int count, Codecs::AdpcmState* pAdpcm, int channels )
+{
+  std::vector<short> linear( format >= VpcmProperties::ULaw ? count : 0 );
+  const unsigned char* p = static_cast<const unsigned char*>( src );
+  switch( format )
+  {
+    case VpcmProperties::ULaw:
+      Codecs::ULawToInt16Copy( &linear[0], p, count );
+      FloatEmu::Int16ToFloatCopy( dest, &linear[0], count );
+      break;
+    case VpcmProperties::ALaw:
+      Codecs::ALawToInt16Copy( &linear[0], p, count );
+      FloatEmu::Int16ToFloatCopy( dest, &linear[0], count );
+      break;
+    case VpcmProperties::ImaAdpcm:
+      Codecs::ImaAdpcmToInt16Copy( &linear[0], p, count, pAdpcm, channels, 0 );
+      FloatEmu::Int16ToFloatCopy( dest, &linear[0], count );
+      break;
+    case VpcmProperties::Int16:
+      FloatEmu::Int16ToFloatCopy( dest, static_cast<const short*>( src ), count );
+      break;
+    case VpcmProperties::Int16BE:
+      FloatEmu::IntToFloatCopy( dest, src, count, 2, true );
+      break;
+    case VpcmProperties::Int24:
+    case VpcmProperties::Int24BE:
+      FloatEmu::IntToFloatCopy( dest, src, count, 3, format == VpcmProperties::Int24BE );
+      break;
+    case VpcmProperties::Int32:
+    case VpcmProperties::Int32BE:
+      FloatEmu::IntToFloatCopy( dest, src, count, 4, format == VpcmProperties::Int32BE );
+      break;
+    case VpcmProperties::Float32:
+      ::memcpy( dest, src, count * sizeof(float) );
+      break;
+    case VpcmProperties::Float32BE:
+      FloatEmu::SwapCopy32( dest, src, count );
+      break;
+    case VpcmProperties::Float64:
+    case VpcmProperties::Float64BE:
+      FloatEmu::DoubleToFloatCopy( dest, src, count, format == VpcmProperties::Float64BE );
+      break;
+  }
+}
+
+} // namespace
+
+class VpcmSimulator
+{
+public:
+  VpcmSimulator( const Options&, VpcmAudioEngine* );
+  bool run();
+  void report( double wallSeconds ) const;
+
+private:
+  // Frames seen in one direction of a stream, in the order they arrived.
+  struct Sequence
+  {
+    bool started;
+    uint64_t last, frames, silent, lost;
+    Sequence() : started( false ), last( 0 ), frames( 0 ), silent( 0 ), lost( 0 ) {}
+  };
+  // A stream as seen by CoreAudio and by the device node client.
+  struct Client
+  {
+    IOAudioStream* pOutput, *pInput;
+    dev_t dev;
+    bool open;
+    uint64_t nextRead, nextWrite, readStall, writeStall, reopenTime;
+    unsigned long long closedSquelched; // squelched frames when the node was last closed
+    // CoreAudio's side
+    uint64_t playFrame, silentUntil;
+    std::vector<float> mix, input;
+    Sequence recorded;
+    // The device node client's side
+    uint64_t recordFrame;
+    std::vector<char> readData, pending;
+    std::vector<float> decoded;
+    Sequence played;
+    bool haveNextPacketFrame;
+    uint64_t nextPacketFrame, lastHostTime, packets, fillFrames, discontinuities;
+    // ADPCM states of the client's encoder and decoder, one per channel
+    std::vector<Codecs::AdpcmState> encoder, decoder;
+    bool adpcmSynced; // the decoder follows the packet headers
+  };
+
+  const VpcmProperties& properties() const { return *mpEngine->getProperties(); }
+  // The engine's clock follows the reader while the first stream's node is open for playback.
+  bool isReaderClock() const
+  { return properties().clock == VpcmProperties::ReaderClock && ( openFlags() & FREAD ) && mClients[0].open; }
+  uint64_t framesToNs( uint64_t frames ) const { return ( frames * 1000000000ULL ) / properties().rate; }
+  int openFlags() const;
+  bool openNode( int );
+  unsigned long long squelchedFrames( int ) const;
+  bool fail( const char*, ... );
+  void log( const char*, ... ) const;
+
+  void resetCodecs();
+  void ioCycle();
+  bool identify( const float*, uint64_t& ) const;
+  bool checkFrames( Sequence&, const float*, int, const char*, int );
+  bool checkPackets( Client&, const char*, int, int );
+  bool checkInvariants();
+  void read( int );
+  void write( int );
+  void event();
+  void resync();
+  uint64_t readerCycleTime() const;
+
+  const Options& mOptions;
+  VpcmAudioEngine* mpEngine;
+  Random mRandom;
+  Client mClients[MAX_STREAMS];
+  int mStreams;
+  bool mCheckPlayback, mCheckRecord, mFailed;
+  char mError[256];
+  // CoreAudio's position within the engine's buffer, and its pacing under --clock=reader,
+  // where it estimates the time per frame from the engine's time stamps.
+  int mPosition;
+  uint64_t mNextCycle, mLastCycle, mCycles, mLoopBase, mFramesSinceBase, mMixedFrames;
+  double mFrameNs;
+  uint64_t mRestartTime, mNextEvent, mEnd;
+  UInt32 mLastLoopCount;
+  AbsoluteTime mLastLoopTime;
+  int mInitialBufferFrames;
+  uint64_t mEvents[6];
+  // Wall time spent in the engine's data path, and frames passed through it.
+  double mEngineTime;
+  uint64_t mEngineFrames;
+};
+
+VpcmSimulator::VpcmSimulator( const Options& options, VpcmAudioEngine* pEngine )
+: mOptions( options ), mpEngine( pEngine ), mRandom( options.seed ), mStreams( 0 ),
+  mCheckPlayback( false ), mCheckRecord( false ), mFailed( false ),
+  mPosition( 0 ), mNextCycle( 0 ), mLastCycle( 0 ), mCycles( 0 ), mLoopBase( 0 ), mFramesSinceBase( 0 ),
+  mMixedFrames( 0 ), mFrameNs( 0 ),
+  mRestartTime( cNever ), mNextEvent( cNever ), mEnd( 0 ), mLastLoopCount( 0 ), mLastLoopTime( 0 ),
+  mInitialBufferFrames( 0 ), mEngineTime( 0 ), mEngineFrames( 0 )
+{
+  mError[0] = 0;
+  ::bzero( mEvents, sizeof(mEvents) );
+  const VpcmProperties& p = properties();
+  mStreams = p.streams;
+  mInitialBufferFrames = p.bufferFrames;
+  mFrameNs = 1e9 / p.rate;
+  bool linear = ( p.format != VpcmProperties::ULaw && p.format != VpcmProperties::ALaw
+                  && p.format != VpcmProperties::ImaAdpcm && p.dither == VpcmProperties::None );
+  mCheckRecord = linear && options.check;
+  mCheckPlayback = linear && options.check && p.overflow != VpcmProperties::Noise;
+  for( int i = 0; i < mStreams; ++i )
+  {
+    Client& c = mClients[i];
+    c.pOutput = 0;
+    c.pInput = 0;
+    c.dev = 0;
+    c.open = false;
+    c.nextRead = 0;
+    c.nextWrite = 0;
+    c.readStall = 0;
+    c.writeStall = 0;
+    c.reopenTime = 0;
+    c.closedSquelched = 0;
+    c.playFrame = 0;
+    c.silentUntil = 0;
+    c.recordFrame = 0;
+    c.haveNextPacketFrame = false;
+    c.adpcmSynced = false;
+    c.nextPacketFrame = 0;
+    c.lastHostTime = 0;
+    c.packets = 0;
+    c.fillFrames = 0;
+    c.discontinuities = 0;
+  }
+  OSSet* sets[] = { mpEngine->outputStreams, mpEngine->inputStreams };
+  for( int i = 0; i < 2; ++i )
+  {
+    IOAudioStream* pStream = 0;
+    for( int j = 0; ( pStream = OSDynamicCast( IOAudioStream, sets[i]->getObject( j ) ) ); ++j )
+    {
+      int idx = int( pStream->getStartingChannelID() - 1 ) / p.channels;
+      Client& c = mClients[max( 0, min( idx, mStreams - 1 ) )];
+      ( i == 0 ? c.pOutput : c.pInput ) = pStream;
+    }
+  }
+  resetCodecs();
+}
+
+int
+VpcmSimulator::openFlags() const
+{
+  int flags = FNONBLOCK;
+  if( properties().mode & VpcmProperties::Playback )
+    flags |= FREAD;
+  if( properties().mode & VpcmProperties::Record )
+    flags |= FWRITE;
+  return flags;
+}
+
+// Opens a stream's node by name, as a client would.
+bool
+VpcmSimulator::openNode( int i )
+{
+  Client& c = mClients[i];
+  c.open = ( KernelShim::findNode( mpEngine->getStreamNodeName( i ), &c.dev ) == 0
+             && KernelShim::nodeOpen( c.dev, openFlags() ) == 0 );
+  return c.open;
+}
+
+// Returns the number of frames squelched on a stream's node, which must be open.
+unsigned long long
+VpcmSimulator::squelchedFrames( int i ) const
+{
+  vpcm_squelch squelch = vpcm_squelch();
+  KernelShim::nodeIoctl( mClients[i].dev, VPCMIOCGSQUELCH, reinterpret_cast<caddr_t>( &squelch ) );
+  return squelch.frames;
+}
+
+bool
+VpcmSimulator::fail( const char* format, ... )
+{
+  if( mFailed )
+    return false;
+  mFailed = true;
+  int n = ::snprintf( mError, sizeof(mError), "at %.6f s: ", KernelShim::sNow * 1e-9 );
+  va_list args;
+  va_start( args, format );
+  ::vsnprintf( mError + n, sizeof(mError) - n, format, args );
+  va_end( args );
+  return false;
+}
+
+void
+VpcmSimulator::log( const char* format, ... ) const
+{
+  if( !mOptions.verbose )
+    return;
+  ::printf( "%10.6f ", KernelShim::sNow * 1e-9 );
+  va_list args;
+  va_start( args, format );
+  ::vprintf( format, args );
+  va_end( args );
+  ::printf( "\n" );
+}
+
+void
+VpcmSimulator::resetCodecs()
+{
+  for( int i = 0; i < mStreams; ++i )
+  {
+    Client& c = mClients[i];
+    c.encoder.resize( properties().channels );
+    c.decoder.resize( properties().channels );
+    for( int ch = 0; ch < properties().channels; ++ch )
+    {
+      c.encoder[ch].reset();
+      c.decoder[ch].reset();
+    }
+  }
+}
+
+// CoreAudio's I/O cycle. Blocks never cross the end of the engine's buffer.
+void
+VpcmSimulator::ioCycle()
+{
+  const VpcmProperties& p = properties();
+  int frames = mOptions.cycleFrames;
+  if( isReaderClock() )
+  { // mixes a cycle and the sample offset ahead of where the time stamps put the engine, but
+    // not beyond the buffer
+    uint64_t loops = mpEngine->currentLoopCount - mLoopBase;
+    uint64_t predicted = loops * p.bufferFrames
+                       + uint64_t( ( KernelShim::sNow - mpEngine->lastLoopTime ) / mFrameNs + 0.5 );
+    uint64_t allowed = min( ( loops + 1 ) * p.bufferFrames, predicted + mpEngine->sampleOffset + frames );
+    frames = int( min( uint64_t( frames ), allowed > mFramesSinceBase ? allowed - mFramesSinceBase : 0 ) );
+  }
+  else
+    resync();
+  while( frames > 0 && !mFailed )
+  {
+    int n = min( frames, p.bufferFrames - mPosition );
+    for( int i = 0; i < mStreams; ++i )
+    {
+      Client& c = mClients[i];
+      if( c.pOutput )
+      {
+        if( KernelShim::sNow < c.silentUntil )
+          ::bzero( &c.mix[mPosition * p.channels], n * p.channels * sizeof(float) );
+        else
+          makePattern( &c.mix[mPosition * p.channels], c.playFrame, n, p.channels );
+        c.playFrame += n;
+        double start = wallTime();
+        mpEngine->clipOutputSamples( &c.mix[0], c.pOutput->getSampleBuffer(), mPosition, n,
+          c.pOutput->getFormat(), c.pOutput );
+        mEngineTime += wallTime() - start;
+        mEngineFrames += n;
+      }
+      if( c.pInput )
+      {
+        double start = wallTime();
+        mpEngine->convertInputSamples( c.pInput->getSampleBuffer(), &c.input[0], mPosition, n,
+          c.pInput->getFormat(), c.pInput );
+        mEngineTime += wallTime() - start;
+        mEngineFrames += n;
+        checkFrames( c.recorded, &c.input[0], n, "record", i );
+      }
+    }
+    mPosition = ( mPosition + n ) % p.bufferFrames;
+    mFramesSinceBase += n;
+    mMixedFrames += n;
+    frames -= n;
+  }
+  ++mCycles;
+}
+
+// Under --clock=reader, CoreAudio wakes when the time stamps put the engine the sample offset
+// before where its next cycle starts, but no sooner than its mixing speed allows.
+uint64_t
+VpcmSimulator::readerCycleTime() const
+{
+  const VpcmProperties& p = properties();
+  uint64_t start = mpEngine->lastLoopTime,
+           wrapFrames = ( mpEngine->currentLoopCount - mLoopBase ) * p.bufferFrames + mpEngine->sampleOffset;
+  if( mFramesSinceBase > wrapFrames )
+    start += uint64_t( ( mFramesSinceBase - wrapFrames ) * mFrameNs );
+  return max( start, mLastCycle + framesToNs( mOptions.cycleFrames ) / mOptions.mixSpeed );
+}
+
+// Restarts CoreAudio's pacing from the engine's current loop.
+void
+VpcmSimulator::resync()
+{
+  mLoopBase = mpEngine->currentLoopCount;
+  mFramesSinceBase = mPosition;
+  mFrameNs = 1e9 / properties().rate;
+}
+
+// Returns whether a frame is a pattern frame, and its number if so.
+bool
+VpcmSimulator::identify( const float* frame, uint64_t& n ) const
+{
+  int channels = properties().channels;
+  uint64_t k[2] = { 0, 0 };
+  for( int ch = 0; ch < channels; ++ch )
+  {
+    if( ch >= 2 )
+    {
+      if( frame[ch] != frame[ch % 2] )
+        return false;
+      continue;
+    }
+    float scaled = frame[ch] * 32768;
+    int value = int( scaled );
+    if( float( value ) != scaled || value < 1 || value > cPatternPeriod )
+      return false;
+    k[ch] = value - 1;
+  }
+  n = k[0] + k[1] * cPatternPeriod;
+  return true;
+}
+
+bool
+VpcmSimulator::checkFrames( Sequence& seq, const float* data, int frames, const char* what, int stream )
+{
+  int channels = properties().channels;
+  bool check = ( &seq == &mClients[stream].recorded ) ? mCheckRecord : mCheckPlayback;
+  uint64_t period = channels > 1 ? uint64_t( cPatternPeriod ) * cPatternPeriod : cPatternPeriod;
+  for( int f = 0; f < frames && check; ++f, data += channels )
+  {
+    bool silent = true;
+    for( int ch = 0; ch < channels; ++ch )
+      silent = silent && data[ch] == 0;
+    if( silent )
+    {
+      ++seq.silent;
+      continue;
+    }
+    uint64_t n = 0;
+    if( !identify( data, n ) )
+      return fail( "stream %d %s: frame %llu is neither silence nor pattern (%g, %g)", stream, what,
+        (unsigned long long)( seq.frames + f ), data[0], channels > 1 ? data[1] : 0.0 );
+    if( seq.started && channels < 2 )
+      seq.last = n; // a single channel repeats too often to tell the order of frames
+    else if( seq.started )
+    {
+      uint64_t delta = ( n + period - seq.last % period ) % period;
+      if( delta == 0 || delta > period / 2 )
+        return fail( "stream %d %s: pattern frame %llu follows frame %llu", stream, what,
+          (unsigned long long)n, (unsigned long long)( seq.last % period ) );
+      seq.lost += delta - 1;
+      seq.last += delta;
+    }
+    else
+      seq.last = n;
+    seq.started = true;
+  }
+  seq.frames += frames;
+  return true;
+}
+
+// A read with --framing=packet returns whole packets.
+bool
+VpcmSimulator::checkPackets( Client& c, const char* data, int bytes, int stream )
+{
+  const VpcmProperties& p = properties();
+  bool adpcm = ( p.format == VpcmProperties::ImaAdpcm );
+  int headerBytes = int( sizeof(vpcm_packet) ) + ( adpcm ? p.channels * int( sizeof(vpcm_adpcm_state) ) : 0 );
+  while( bytes > 0 )
+  {
+    vpcm_packet header;
+    if( bytes < headerBytes )
+      return fail( "stream %d: %d bytes left after the last packet", stream, bytes );
+    ::memcpy( &header, data, sizeof(header) );
+    if( header.magic != VPCM_PACKET_MAGIC || header.headerBytes != headerBytes )
+      return fail( "stream %d: bad packet header", stream );
+    if( header.rate != uint32_t( p.rate ) || header.channels != p.channels || header.format != p.format )
+      return fail( "stream %d: packet header does not match the device", stream );
+    if( header.payloadBytes == 0 || header.payloadBytes % p.frameBytes
+        || int( headerBytes + header.payloadBytes ) > bytes )
+      return fail( "stream %d: bad payload size %u", stream, header.payloadBytes );
+    bool discontinuity = ( header.flags & VPCM_PACKET_DISCONTINUITY );
+    if( adpcm && !( header.flags & VPCM_PACKET_FILL ) )
+    {
+      if( discontinuity )
+        c.adpcmSynced = false;
+      for( int ch = 0; ch < p.channels; ++ch )
+      {
+        vpcm_adpcm_state state;
+        ::memcpy( &state, data + sizeof(header) + ch * sizeof(state), sizeof(state) );
+        if( !c.adpcmSynced )
+        {
+          c.decoder[ch].predictor = state.predictor;
+          c.decoder[ch].index = state.index;
+        }
+        else if( c.decoder[ch].predictor != state.predictor || c.decoder[ch].index != state.index )
+          return fail( "stream %d: packet at frame %llu has ADPCM state %d/%d on channel %d, the decoder %d/%d",
+            stream, (unsigned long long)header.frame, state.predictor, state.index, ch,
+            c.decoder[ch].predictor, c.decoder[ch].index );
+      }
+      c.adpcmSynced = true;
+    }
+    if( !discontinuity && c.haveNextPacketFrame && header.frame != c.nextPacketFrame )
+      return fail( "stream %d: packet starts at frame %llu rather than %llu without a discontinuity", stream,
+        (unsigned long long)header.frame, (unsigned long long)c.nextPacketFrame );
+    if( !discontinuity && c.haveNextPacketFrame && header.hostTime < c.lastHostTime )
+      return fail( "stream %d: packet time goes backwards", stream );
+    if( discontinuity )
+      ++c.discontinuities;
+    data += headerBytes;
+    bytes -= headerBytes;
+    int frames = header.payloadBytes / p.frameBytes;
+    if( header.flags & VPCM_PACKET_FILL )
+    {
+      c.adpcmSynced = false;
+      c.fillFrames += frames;
+      for( uint32_t i = 0; i < header.payloadBytes && mCheckPlayback; ++i )
+          if( data[i] )
+            return fail( "stream %d: fill packet holds data", stream );
+      c.played.frames += frames;
+      c.played.silent += frames;
+    }
+    else if( !mCheckPlayback )
+    {
+      c.played.frames += frames;
+      c.decoded.resize( frames * p.channels );
+      if( adpcm )
+        decode( p.format, &c.decoded[0], data, frames * p.channels, &c.decoder[0], p.channels );
+    }
+    else
+    {
+      c.decoded.resize( frames * p.channels );
+      decode( p.format, &c.decoded[0], data, frames * p.channels, &c.decoder[0], p.channels );
+      if( !checkFrames( c.played, &c.decoded[0], frames, "packet", stream ) )
+        return false;
+      // A pattern frame's number is the number of frames that CoreAudio played before it.
+      uint64_t period = p.channels > 1 ? uint64_t( cPatternPeriod ) * cPatternPeriod : cPatternPeriod;
+      for( int f = 0; f < frames; ++f )
+      {
+        uint64_t n = 0;
+        if( identify( &c.decoded[f * p.channels], n ) && n != ( header.frame + f ) % period )
+          return fail( "stream %d: packet frame %llu holds pattern frame %llu", stream,
+            (unsigned long long)( header.frame + f ), (unsigned long long)n );
+      }
+    }
+    ++c.packets;
+    c.haveNextPacketFrame = true;
+    c.nextPacketFrame = header.frame + frames;
+    c.lastHostTime = header.hostTime;
+    data += header.payloadBytes;
+    bytes -= header.payloadBytes;
+  }
+  return true;
+}
+
+void
+VpcmSimulator::read( int i )
+{
+  Client& c = mClients[i];
+  const VpcmProperties& p = properties();
+  int ringBytes = p.ringFrames() * p.frameBytes, size = 0;
+  bool packets = ( p.framing == VpcmProperties::Packets );
+  if( mOptions.steady )
+    size = packets ? 2 * ringBytes : ringBytes;
+  else if( packets )
+  {
+    int headerBytes = int( sizeof(vpcm_packet) )
+                    + ( p.format == VpcmProperties::ImaAdpcm ? p.channels * int( sizeof(vpcm_adpcm_state) ) : 0 );
+    size = mRandom.between( headerBytes + p.frameBytes, 2 * ringBytes );
+  }
+  else
+    size = mRandom.between( 1, p.ringFrames() ) * p.frameBytes;
+  c.readData.resize( size );
+  struct uio uio = { &c.readData[0], size, UIO_READ };
+  double start = wallTime();
+  int err = KernelShim::nodeRead( c.dev, &uio );
+  mEngineTime += wallTime() - start;
+  if( err == EWOULDBLOCK )
+    return;
+  if( err )
+  {
+    fail( "stream %d: read returned %d", i, err );
+    return;
+  }
+  int bytes = int( size - uio.resid );
+  mEngineFrames += bytes / p.frameBytes;
+  if( packets )
+    checkPackets( c, &c.readData[0], bytes, i );
+  else if( bytes % p.frameBytes )
+    fail( "stream %d: read returned %d bytes, not whole frames", i, bytes );
+  else if( bytes > 0 && !mCheckPlayback )
+    c.played.frames += bytes / p.frameBytes;
+  else if( bytes > 0 )
+  {
+    int frames = bytes / p.frameBytes;
+    c.decoded.resize( frames * p.channels );
+    decode( p.format, &c.decoded[0], &c.readData[0], frames * p.channels, &c.decoder[0], p.channels );
+    checkFrames( c.played, &c.decoded[0], frames, "playback", i );
+  }
+}
+
+void
+VpcmSimulator::write( int i )
+{
+  Client& c = mClients[i];
+  const VpcmProperties& p = properties();
+  if( c.pending.empty() )
+  {
+    int frames = mOptions.steady ? p.ringFrames() : mRandom.between( 1, p.ringFrames() );
+    std::vector<float> values( frames * p.channels );
+    makePattern( &values[0], c.recordFrame, frames, p.channels );
+    c.recordFrame += frames;
+    c.pending.resize( frames * p.frameBytes );
+    encode( p.format, &c.pending[0], &values[0], frames * p.channels, &c.encoder[0], p.channels );
+  }
+  struct uio uio = { &c.pending[0], user_ssize_t( c.pending.size() ), UIO_WRITE };
+  double start = wallTime();
+  int err = KernelShim::nodeWrite( c.dev, &uio );
+  mEngineTime += wallTime() - start;
+  if( err == EWOULDBLOCK )
+    return;
+  if( err )
+  {
+    fail( "stream %d: write returned %d", i, err );
+    return;
+  }
+  mEngineFrames += ( c.pending.size() - uio.resid ) / p.frameBytes;
+  c.pending.erase( c.pending.begin(), c.pending.begin() + ( c.pending.size() - uio.resid ) );
+}
+
+void
+VpcmSimulator::event()
+{
+  const VpcmProperties& p = properties();
+  uint64_t ringTime = framesToNs( p.ringFrames() );
+  int i = mRandom.below( mStreams ), kind = mRandom.below( 6 );
+  Client& c = mClients[i];
+  ++mEvents[kind];
+  switch( kind )
+  {
+    case 0:
+    {
+      uint64_t until = KernelShim::sNow + ( ringTime * mRandom.between( 0, 300 ) ) / 100;
+      ( mRandom.below( 2 ) ? c.readStall : c.writeStall ) = until;
+      log( "stream %d: client stalls for %.3f s", i, ( until - KernelShim::sNow ) * 1e-9 );
+      break;
+    }
+    case 1:
+    {
+      IOAudioStream* pStream = mRandom.below( 2 ) ? c.pOutput : c.pInput;
+      if( !pStream )
+        pStream = c.pOutput ? c.pOutput : c.pInput;
+      log( "stream %d: CoreAudio resets the clip position", i );
+      mpEngine->resetClipPosition( pStream, mPosition );
+      break;
+    }
+    case 2:
+      if( !c.open )
+        break;
+      c.reopenTime = KernelShim::sNow + ( ringTime * mRandom.between( 0, 300 ) ) / 100;
+      log( "stream %d: client closes the node for %.3f s", i, ( c.reopenTime - KernelShim::sNow ) * 1e-9 );
+      c.closedSquelched = squelchedFrames( i );
+      KernelShim::nodeClose( c.dev );
+      c.open = false;
+      c.pending.clear();
+      c.haveNextPacketFrame = false;
+      c.adpcmSynced = false;
+      break;
+    case 3:
+      if( mRestartTime != cNever )
+        break;
+      log( "engine stops" );
+      mpEngine->stopAudioEngine();
+      mRestartTime = KernelShim::sNow + mRandom.between( 0, int( ringTime / 1000 ) ) * 1000ULL;
+      break;
+    case 4:
+    {
+      const int sizes[] = { mInitialBufferFrames / 2, mInitialBufferFrames, 2 * mInitialBufferFrames };
+      int bufferFrames = sizes[mRandom.below( 3 )],
+          fifoFrames = mRandom.below( 2 ) ? 0 : 2 * bufferFrames;
+      char arg0[] = "vpcmsim", buffer[64], fifo[64];
+      ::snprintf( buffer, sizeof(buffer), "--buffer-frames=%d", bufferFrames );
+      ::snprintf( fifo, sizeof(fifo), "--fifo-frames=%d", fifoFrames );
+      char* argv[] = { arg0, buffer, fifo };
+      VpcmProperties newProperties = p;
+      if( newProperties.update( 3, argv ) )
+        break;
+      // A new ring restarts the engine at the start of its buffer.
+      bool resize = ( newProperties.bufferFrames != p.bufferFrames || newProperties.fifoFrames != p.fifoFrames );
+      int err = mpEngine->reconfigure( &newProperties );
+      log( "engine reconfigured to %d buffer frames, %d FIFO frames: %d", bufferFrames, fifoFrames, err );
+      if( err && err != ENOTSUP )
+        fail( "reconfiguring returned %d", err );
+      else if( !err && resize )
+      {
+        mPosition = 0;
+        resync();
+        for( int j = 0; j < mStreams; ++j )
+        {
+          mClients[j].mix.resize( properties().bufferFrames * properties().channels );
+          mClients[j].input.resize( properties().bufferFrames * properties().channels );
+        }
+      }
+      break;
+    }
+    case 5:
+    { // long enough to be squelched about half the time
+      uint64_t hold = 1000000ULL * ( p.squelchLevel ? p.squelchMsec : 0 );
+      c.silentUntil = KernelShim::sNow + ( ( hold + ringTime ) * mRandom.between( 0, 200 ) ) / 100;
+      log( "stream %d: CoreAudio mixes silence for %.3f s", i, ( c.silentUntil - KernelShim::sNow ) * 1e-9 );
+      break;
+    }
+  }
+  mNextEvent = KernelShim::sNow + 1000000ULL * mRandom.between( 1, 2 * mOptions.eventMsec );
+}
+
+bool
+VpcmSimulator::checkInvariants()
+{
+  if( !KernelShim::buffersIntact() )
+    return fail( "ring overrun" );
+  const VpcmProperties& p = properties();
+  for( int i = 0; i < mStreams; ++i )
+    for( int j = 0; j < 2; ++j )
+    {
+      VpcmAudioEngine::RingState ring;
+      if( !mpEngine->getRingState( i, j, &ring ) )
+        continue;
+      if( ring.bytesAvail < -1 )
+        return fail( "stream %d: bytesAvail is %d", i, ring.bytesAvail );
+      if( ring.bytesAvail >= 0 && ( ring.offset < 0 || ring.offset >= ring.bytes ) )
+        return fail( "stream %d: ring pointer out of bounds", i );
+      if( ring.segment < 0 || ring.segment >= ring.bytes || ring.segment % ( p.bufferFrames * p.frameBytes ) )
+        return fail( "stream %d: bad ring segment %d", i, ring.segment );
+    }
+  if( mRestartTime == cNever && mpEngine->getCurrentSampleFrame() >= UInt32( p.bufferFrames ) )
+    return fail( "sample frame %u beyond the buffer", mpEngine->getCurrentSampleFrame() );
+  if( mpEngine->currentLoopCount != mLastLoopCount || mpEngine->lastLoopTime != mLastLoopTime )
+  {
+    if( mpEngine->lastLoopTime < mLastLoopTime || mpEngine->lastLoopTime > KernelShim::sNow )
+      return fail( "time stamp %.6f s out of order", mpEngine->lastLoopTime * 1e-9 );
+    // CoreAudio derives the engine's rate from the time between wraps, up to its mixing speed.
+    if( isReaderClock() && mpEngine->currentLoopCount == mLastLoopCount + 1 && mLastLoopTime )
+      mFrameNs = max( double( mpEngine->lastLoopTime - mLastLoopTime ) / p.bufferFrames,
+                      1e9 / ( double( p.rate ) * mOptions.mixSpeed ) );
+    mLastLoopCount = mpEngine->currentLoopCount;
+    mLastLoopTime = mpEngine->lastLoopTime;
+  }
+  return true;
+}
+
+bool
+VpcmSimulator::run()
+{
+  const VpcmProperties& p = properties();
+  ::srandom( (unsigned int)mOptions.seed ); // for --overflow=noise
+  for( int i = 0; i < mStreams; ++i )
+  {
+    Client& c = mClients[i];
+    c.mix.resize( p.bufferFrames * p.channels );
+    c.input.resize( p.bufferFrames * p.channels );
+    if( !openNode( i ) )
+      return fail( "stream %d: opening the node failed", i );
+    // Clients run half a cycle out of phase with CoreAudio.
+    c.nextRead = c.nextWrite = framesToNs( mOptions.cycleFrames ) / 2;
+  }
+  mEnd = KernelShim::sNow + mOptions.seconds * 1000000000ULL;
+  mNextCycle = KernelShim::sNow;
+  if( !mOptions.steady )
+    mNextEvent = KernelShim::sNow + 1000000ULL * mRandom.between( 1, 2 * mOptions.eventMsec );
+  while( !mFailed )
+  {
+    bool running = ( mRestartTime == cNever );
+    if( running && isReaderClock() )
+      mNextCycle = readerCycleTime();
+    uint64_t t = min( mEnd, min( KernelShim::nextDeadline(), min( mNextEvent, mRestartTime ) ) );
+    if( running )
+      t = min( t, mNextCycle );
+    for( int i = 0; i < mStreams; ++i )
+    {
+      if( !mClients[i].open )
+        t = min( t, mClients[i].reopenTime );
+      else if( mClients[i].pOutput )
+        t = min( t, max( mClients[i].nextRead, mClients[i].readStall ) );
+      if( mClients[i].open && mClients[i].pInput )
+        t = min( t, max( mClients[i].nextWrite, mClients[i].writeStall ) );
+    }
+    if( t >= mEnd )
+      break;
+    KernelShim::sNow = max( KernelShim::sNow, t );
+    const uint64_t now = KernelShim::sNow;
+    while( KernelShim::fireTimer() && checkInvariants() )
+      ;
+    if( now >= mRestartTime )
+    {
+      log( "engine starts" );
+      mRestartTime = cNever;
+      mpEngine->startAudioEngine();
+      mPosition = 0;
+      resync();
+      mNextCycle = now;
+    }
+    if( running && now >= mNextCycle )
+    {
+      ioCycle();
+      mLastCycle = now;
+      if( !isReaderClock() )
+        mNextCycle += framesToNs( mOptions.cycleFrames );
+      else if( mOptions.steady )
+        for( int i = 0; i < mStreams; ++i )
+          mClients[i].nextRead = now; // reads as soon as CoreAudio has mixed
+    }
+    uint64_t period = framesToNs( mOptions.cycleFrames );
+    for( int i = 0; i < mStreams && !mFailed; ++i )
+    {
+      Client& c = mClients[i];
+      if( !c.open && now >= c.reopenTime )
+      {
+        log( "stream %d: client reopens the node", i );
+        if( !openNode( i ) )
+          fail( "stream %d: reopening the node failed", i );
+        else if( ( p.mode & VpcmProperties::Playback ) && squelchedFrames( i ) != c.closedSquelched )
+          fail( "stream %d: %llu frames squelched while the node was closed", i,
+            squelchedFrames( i ) - c.closedSquelched );
+        continue;
+      }
+      if( !c.open )
+        continue;
+      if( c.pOutput && now >= c.nextRead && now >= c.readStall )
+      {
+        read( i );
+        c.nextRead = now + ( mOptions.steady ? period : mRandom.between( 0, int( 2 * period / 1000 ) ) * 1000ULL );
+      }
+      if( c.pInput && now >= c.nextWrite && now >= c.writeStall )
+      {
+        write( i );
+        c.nextWrite = now + ( mOptions.steady ? period : mRandom.between( 0, int( 2 * period / 1000 ) ) * 1000ULL );
+      }
+    }
+    if( now >= mNextEvent && !mFailed )
+      event();
+    checkInvariants();
+  }
+  for( int i = 0; i < mStreams; ++i )
+    if( mClients[i].open )
+    {
+      if( p.mode & VpcmProperties::Playback )
+        mClients[i].closedSquelched = squelchedFrames( i );
+      KernelShim::nodeClose( mClients[i].dev );
+    }
+  if( mFailed )
+    ::fprintf( stderr, "vpcmsim: %s\n", mError );
+  return !mFailed;
+}
+
+void
+VpcmSimulator::report( double wallSeconds ) const
+{
+  double seconds = KernelShim::sNow * 1e-9;
+  ::printf( "%.1f s simulated in %.3f s, %.0fx realtime, %llu I/O cycles\n",
+    seconds, wallSeconds, seconds / max( wallSeconds, 1e-9 ), (unsigned long long)mCycles );
+  // Frames are counted once on each side of the engine, as CoreAudio and the client pass them.
+  ::printf( "engine: %.3f s in the data path, %.1f ns per frame passed\n",
+    mEngineTime, mEngineFrames ? mEngineTime * 1e9 / mEngineFrames : 0.0 );
+  double audio = double( mMixedFrames ) / properties().rate;
+  ::printf( "CoreAudio: %.1f s of audio mixed, %.1fx the simulated time\n", audio, audio / max( seconds, 1e-9 ) );
+  for( int i = 0; i < mStreams; ++i )
+  {
+    const Client& c = mClients[i];
+    if( c.pOutput )
+      ::printf( "stream %d playback: %llu frames read, %llu silent, %llu lost%s\n", i,
+        (unsigned long long)c.played.frames, (unsigned long long)c.played.silent,
+        (unsigned long long)c.played.lost, mCheckPlayback ? "" : ", values unchecked" );
+    if( c.pOutput && properties().squelchLevel )
+      ::printf( "stream %d squelch: %llu frames dropped\n", i, c.closedSquelched );
+    if( c.packets )
+      ::printf( "stream %d packets: %llu, %llu fill frames, %llu discontinuities\n", i,
+        (unsigned long long)c.packets, (unsigned long long)c.fillFrames, (unsigned long long)c.discontinuities );
+    if( c.pInput )
+      ::printf( "stream %d record: %llu frames converted, %llu silent, %llu lost%s\n", i,
+        (unsigned long long)c.recorded.frames, (unsigned long long)c.recorded.silent,
+        (unsigned long long)c.recorded.lost, mCheckRecord ? "" : ", values unchecked" );
+  }
+  if( !mOptions.steady )
+    ::printf( "events: %llu stalls, %llu clip position resets, %llu reopens, %llu restarts, %llu reconfigurations, "
+      "%llu silent periods\n",
+      (unsigned long long)mEvents[0], (unsigned long long)mEvents[1], (unsigned long long)mEvents[2],
+      (unsigned long long)mEvents[3], (unsigned long long)mEvents[4], (unsigned long long)mEvents[5] );
+}
+
+int
+main( int argc, char** argv )
+{
+  Options options;
+  if( !parseOptions( argc, argv, options ) )
+  {
+    ::fprintf( stderr, "%s", cUsage );
+    return 2;
+  }
+  // The device is named after the simulator, unless the device options name it.
+  std::vector<char*> deviceArgs( options.deviceArgv, options.deviceArgv + options.deviceArgc );
+  char name[] = "vpcmsim";
+  deviceArgs.insert( deviceArgs.begin() + 1, name );
+  VpcmProperties properties;
+  properties.name = 0;
+  int err = properties.parse( int( deviceArgs.size() ), &deviceArgs[0] );
+  if( err )
+  {
+    ::fprintf( stderr, "vpcmsim: bad device options: %s\n", ::strerror( err ) );
+    return 2;
+  }
+  char description[256];
+  properties.print( description, sizeof(description) );
+  ::printf( "%s, seed %lu\n", description, options.seed );
+
+  VpcmAudioEngine* pEngine = new VpcmAudioEngine;
+  if( !pEngine->init( &properties ) || !pEngine->initHardware( 0 ) )
+  {
+    ::fprintf( stderr, "vpcmsim: could not create the engine\n" );
+    return 2;
+  }
+  pEngine->startAudioEngine();
+  bool ok = false;
+  {
+    VpcmSimulator simulator( options, pEngine );
+    double start = wallTime();
+    ok = simulator.run();
+    simulator.report( wallTime() - start );
+  }
+  pEngine->stopAudioEngine();
+  pEngine->terminate( 0 );
+  pEngine->release();
+  return ok ? 0 : 1;
+}